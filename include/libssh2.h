@@ -246,6 +246,16 @@ typedef struct _LIBSSH2_USERAUTH_KBDINT_RESPONSE
                                               const void *buffer, size_t length,\
                                               int flags, void **abstract)
 
+/* Session lock callback, LOCK is 1 to acquire and 0 to release. It has to
+   be a recursive lock */
+#define LIBSSH2_LOCK_FUNC(name)  void name(LIBSSH2_SESSION *session, \
+                                           int lock, void **abstract)
+
+/* Completion callback of the *_async() functions, RC is what the call
+   returned and DATA what was passed along with the request */
+#define LIBSSH2_COMPLETE_FUNC(name) void name(LIBSSH2_SESSION *session, \
+                                              ssize_t rc, void *data)
+
 /* libssh2_session_callback_set() constants */
 #define LIBSSH2_CALLBACK_IGNORE             0
 #define LIBSSH2_CALLBACK_DEBUG              1
@@ -254,6 +264,7 @@ typedef struct _LIBSSH2_USERAUTH_KBDINT_RESPONSE
 #define LIBSSH2_CALLBACK_X11                4
 #define LIBSSH2_CALLBACK_SEND               5
 #define LIBSSH2_CALLBACK_RECV               6
+#define LIBSSH2_CALLBACK_LOCK               7
 
 /* libssh2_session_method_pref() constants */
 #define LIBSSH2_METHOD_KEX          0
@@ -270,12 +281,14 @@ typedef struct _LIBSSH2_USERAUTH_KBDINT_RESPONSE
 /* flags */
 #define LIBSSH2_FLAG_SIGPIPE        1
 #define LIBSSH2_FLAG_COMPRESS       2
+#define LIBSSH2_FLAG_ZEROCOPY       4
 
 typedef struct _LIBSSH2_SESSION                     LIBSSH2_SESSION;
 typedef struct _LIBSSH2_CHANNEL                     LIBSSH2_CHANNEL;
 typedef struct _LIBSSH2_LISTENER                    LIBSSH2_LISTENER;
 typedef struct _LIBSSH2_KNOWNHOSTS                  LIBSSH2_KNOWNHOSTS;
 typedef struct _LIBSSH2_AGENT                       LIBSSH2_AGENT;
+typedef struct _LIBSSH2_POLLER                      LIBSSH2_POLLER;
 
 typedef struct _LIBSSH2_POLLFD {
     unsigned char type; /* LIBSSH2_POLLFD_* below */
@@ -285,6 +298,8 @@ typedef struct _LIBSSH2_POLLFD {
         LIBSSH2_CHANNEL *channel; /* Examined by checking internal state */
         LIBSSH2_LISTENER *listener; /* Read polls only -- are inbound
                                        connections waiting to be accepted? */
+        LIBSSH2_SESSION *session; /* Pollers only -- can the call that
+                                     returned EAGAIN make progress? */
     } fd;
 
     unsigned long events; /* Requested Events */
@@ -295,6 +310,7 @@ typedef struct _LIBSSH2_POLLFD {
 #define LIBSSH2_POLLFD_SOCKET       1
 #define LIBSSH2_POLLFD_CHANNEL      2
 #define LIBSSH2_POLLFD_LISTENER     3
+#define LIBSSH2_POLLFD_SESSION      4
 
 /* Note: Win32 Doesn't actually have a poll() implementation, so some of these
    values are faked with select() data */
@@ -324,6 +340,29 @@ typedef struct _LIBSSH2_POLLFD {
 #define LIBSSH2_SESSION_BLOCK_INBOUND                  0x0001
 #define LIBSSH2_SESSION_BLOCK_OUTBOUND                 0x0002
 
+/* Socket I/O backend, see libssh2_session_io_backend(3). A session has at
+   most one receive and one send in flight. RECV and SEND start them, and
+   COMPLETE returns the result of the one in DIRECTION (one of the
+   LIBSSH2_SESSION_BLOCK_* values above) like recv() and send() would, or
+   -EAGAIN while it is still in flight. BUFFER tells where the session
+   receives into, or NULL when the backend is detached. */
+struct libssh2_iovec {
+    const void *base;
+    size_t length;
+};
+
+typedef struct _LIBSSH2_IO_BACKEND {
+    int (*recv)(LIBSSH2_SESSION *session, libssh2_socket_t socket,
+                void *buffer, size_t length, void **abstract);
+    int (*send)(LIBSSH2_SESSION *session, libssh2_socket_t socket,
+                const struct libssh2_iovec *iov, int iovcnt,
+                void **abstract);
+    ssize_t (*complete)(LIBSSH2_SESSION *session, libssh2_socket_t socket,
+                        int direction, void **abstract);
+    void (*buffer)(LIBSSH2_SESSION *session, void *buffer, size_t length,
+                   void **abstract);
+} LIBSSH2_IO_BACKEND;
+
 /* Hash Types */
 #define LIBSSH2_HOSTKEY_HASH_MD5                            1
 #define LIBSSH2_HOSTKEY_HASH_SHA1                           2
@@ -406,6 +445,7 @@ typedef struct _LIBSSH2_POLLFD {
 #define LIBSSH2_ERROR_ENCRYPT                   -44
 #define LIBSSH2_ERROR_BAD_SOCKET                -45
 #define LIBSSH2_ERROR_KNOWN_HOSTS               -46
+#define LIBSSH2_ERROR_CANCELLED                 -47
 
 /* this is a define to provide the old (<= 1.2.7) name */
 #define LIBSSH2_ERROR_BANNER_NONE LIBSSH2_ERROR_BANNER_RECV
@@ -503,8 +543,49 @@ LIBSSH2_API int libssh2_session_last_error(LIBSSH2_SESSION *session,
 LIBSSH2_API int libssh2_session_last_errno(LIBSSH2_SESSION *session);
 LIBSSH2_API int libssh2_session_block_directions(LIBSSH2_SESSION *session);
 
+/*
+ * libssh2_session_pump()
+ *
+ * Make progress on the requests queued with the *_async() functions without
+ * blocking, calling the completion callback of each request that finishes.
+ * Requests on the same channel or SFTP instance complete in the order they
+ * were queued. Call it whenever the socket is ready in the direction(s)
+ * returned by libssh2_session_block_directions().
+ *
+ * Returns the number of requests still queued, or a negative value for
+ * error.
+ */
+LIBSSH2_API int libssh2_session_pump(LIBSSH2_SESSION *session);
+
 LIBSSH2_API int libssh2_session_flag(LIBSSH2_SESSION *session, int flag,
                                      int value);
+
+/*
+ * libssh2_session_recv_buffer()
+ *
+ * Set the size of the buffer the session receives network data into. Every
+ * call of the recv callback asks for as much as fits, so a large buffer
+ * takes in many packets per system call on busy sessions, and a small one
+ * saves memory when there are many idle sessions. 0 restores the default,
+ * 16 kB. The smallest size is 1 kB.
+ *
+ * Returns 0 if succeeded, or a negative value for error.
+ */
+LIBSSH2_API int libssh2_session_recv_buffer(LIBSSH2_SESSION *session,
+                                            size_t size);
+
+/*
+ * libssh2_session_io_backend()
+ *
+ * Send and receive through BACKEND, which submits the operations and
+ * completes them later, instead of the send and recv callbacks. ABSTRACT is
+ * passed to the backend's functions. NULL goes back to the callbacks.
+ *
+ * Returns 0 if succeeded, or a negative value for error.
+ */
+LIBSSH2_API int libssh2_session_io_backend(LIBSSH2_SESSION *session,
+                                           const LIBSSH2_IO_BACKEND *backend,
+                                           void *abstract);
 LIBSSH2_API const char *libssh2_session_banner_get(LIBSSH2_SESSION *session);
 
 /* Userauth API */
@@ -592,11 +673,83 @@ libssh2_userauth_keyboard_interactive_ex(LIBSSH2_SESSION* session,
 LIBSSH2_API int libssh2_poll(LIBSSH2_POLLFD *fds, unsigned int nfds,
                              long timeout);
 
+/*
+ * libssh2_transport_read()
+ *
+ * Read everything available on the session's socket without blocking, then
+ * fill in FDS with up to NFDS channels (type LIBSSH2_POLLFD_CHANNEL) that
+ * became readable (POLLIN/POLLEXT), reached EOF (POLLHUP), got closed
+ * (CHANNEL_CLOSED) or had their transfer window opened (POLLOUT) since they
+ * were last reported. Events are only reported once; read a channel until it
+ * returns LIBSSH2_ERROR_EAGAIN before waiting for it again.
+ *
+ * libssh2_transport_write() only reports the POLLOUT events, and does not
+ * read from the socket.
+ *
+ * Returns the number of channels filled in, or a negative value for error.
+ */
+LIBSSH2_API int libssh2_transport_read(LIBSSH2_SESSION *session,
+                                       LIBSSH2_POLLFD *fds,
+                                       unsigned int nfds);
+LIBSSH2_API int libssh2_transport_write(LIBSSH2_SESSION *session,
+                                        LIBSSH2_POLLFD *fds,
+                                        unsigned int nfds);
+
+/*
+ * libssh2_poller_init()
+ *
+ * Create a poller: a persistent set of sockets, channels, listeners and
+ * sessions (possibly of different sessions) to wait for events on. A
+ * session entry is reported once the socket is ready in the direction(s)
+ * given by libssh2_session_block_directions(), so that the non-blocking call
+ * that returned LIBSSH2_ERROR_EAGAIN can be called again. Memory is
+ * allocated using SESSION's allocator, so the poller must be freed with
+ * libssh2_poller_free() before that session is.
+ *
+ * libssh2_poller_add() and libssh2_poller_remove() change the set, using
+ * the type, fd and events members of the given LIBSSH2_POLLFD.
+ *
+ * libssh2_poller_wait() waits up to TIMEOUT milliseconds (-1 for ever) and
+ * fills in up to NFDS entries with what is ready. Channel events, including
+ * data already buffered within the session, are reported once when they
+ * happen, see libssh2_transport_read(). Returns the number of entries filled
+ * in, or a negative value for error.
+ */
+LIBSSH2_API LIBSSH2_POLLER *libssh2_poller_init(LIBSSH2_SESSION *session);
+LIBSSH2_API int libssh2_poller_add(LIBSSH2_POLLER *poller,
+                                   const LIBSSH2_POLLFD *fd);
+LIBSSH2_API int libssh2_poller_remove(LIBSSH2_POLLER *poller,
+                                      const LIBSSH2_POLLFD *fd);
+LIBSSH2_API int libssh2_poller_wait(LIBSSH2_POLLER *poller,
+                                    LIBSSH2_POLLFD *fds, unsigned int nfds,
+                                    long timeout);
+LIBSSH2_API void libssh2_poller_free(LIBSSH2_POLLER *poller);
+
 /* Channel API */
 #define LIBSSH2_CHANNEL_WINDOW_DEFAULT  (256*1024)
 #define LIBSSH2_CHANNEL_PACKET_DEFAULT  32768
 #define LIBSSH2_CHANNEL_MINADJUST       1024
 
+/* Receive window modes for libssh2_channel_window_mode() */
+#define LIBSSH2_CHANNEL_WINDOW_FIXED    0
+#define LIBSSH2_CHANNEL_WINDOW_AUTO     1
+
+/* Default memory ceiling for an auto-tuned receive window */
+#define LIBSSH2_CHANNEL_WINDOW_MAX      (16*1024*1024)
+
+/* Default percentage of the receive window that is consumed before it gets
+   refunded to the peer, see libssh2_channel_window_threshold() */
+#define LIBSSH2_CHANNEL_ADJUST_THRESHOLD 50
+
+/* Outbound scheduling weights for libssh2_channel_priority(). When several
+   channels write on a session that uses priorities, each of them gets to
+   send weight * LIBSSH2_CHANNEL_QUANTUM bytes per round */
+#define LIBSSH2_CHANNEL_PRIORITY_BULK        1
+#define LIBSSH2_CHANNEL_PRIORITY_NORMAL      4
+#define LIBSSH2_CHANNEL_PRIORITY_INTERACTIVE 16
+#define LIBSSH2_CHANNEL_PRIORITY_MAX         64
+#define LIBSSH2_CHANNEL_QUANTUM              4096
+
 /* Extended Data Handling */
 #define LIBSSH2_CHANNEL_EXTENDED_DATA_NORMAL        0
 #define LIBSSH2_CHANNEL_EXTENDED_DATA_IGNORE        1
@@ -618,6 +771,29 @@ libssh2_channel_open_ex(LIBSSH2_SESSION *session, const char *channel_type,
                           LIBSSH2_CHANNEL_WINDOW_DEFAULT, \
                           LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0)
 
+/*
+ * libssh2_channel_open_batch()
+ *
+ * Open COUNT channels of the same type at once. All CHANNEL_OPEN messages
+ * are sent back-to-back and the channels are stored in CHANNELS, at the
+ * index of their request, as the confirmations arrive. Entries the server
+ * refused are left NULL.
+ *
+ * Returns the number of channels opened, or a negative value for error.
+ */
+LIBSSH2_API int
+libssh2_channel_open_batch(LIBSSH2_SESSION *session, const char *channel_type,
+                           unsigned int channel_type_len,
+                           unsigned int window_size, unsigned int packet_size,
+                           const char *message, unsigned int message_len,
+                           LIBSSH2_CHANNEL **channels, unsigned int count);
+
+#define libssh2_channel_open_session_batch(session, channels, count) \
+  libssh2_channel_open_batch((session), "session", sizeof("session") - 1, \
+                             LIBSSH2_CHANNEL_WINDOW_DEFAULT, \
+                             LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0, \
+                             (channels), (count))
+
 LIBSSH2_API LIBSSH2_CHANNEL *
 libssh2_channel_direct_tcpip_ex(LIBSSH2_SESSION *session, const char *host,
                                 int port, const char *shost, int sport);
@@ -635,6 +811,20 @@ LIBSSH2_API int libssh2_channel_forward_cancel(LIBSSH2_LISTENER *listener);
 LIBSSH2_API LIBSSH2_CHANNEL *
 libssh2_channel_forward_accept(LIBSSH2_LISTENER *listener);
 
+/*
+ * libssh2_channel_pipeline()
+ *
+ * With ENABLE set, pty, x11 and environment requests on the channel are sent
+ * without waiting for their replies, which libssh2_channel_process_startup()
+ * then collects together with its own. Passing 0 waits for any outstanding
+ * replies and turns pipelining off again.
+ *
+ * Returns the number of pipelined requests the server denied, or a negative
+ * value for error.
+ */
+LIBSSH2_API int libssh2_channel_pipeline(LIBSSH2_CHANNEL *channel,
+                                         int enable);
+
 LIBSSH2_API int libssh2_channel_setenv_ex(LIBSSH2_CHANNEL *channel,
                                           const char *varname,
                                           unsigned int varname_len,
@@ -721,6 +911,45 @@ libssh2_channel_receive_window_adjust2(LIBSSH2_CHANNEL *channel,
                                        unsigned char force,
                                        unsigned int *storewindow);
 
+/*
+ * libssh2_channel_window_mode()
+ *
+ * Select how the receive window of the channel is maintained. With
+ * LIBSSH2_CHANNEL_WINDOW_AUTO the window is grown and shrunk based on the
+ * measured round-trip time and the rate at which the application drains the
+ * channel, but never beyond MAX_WINDOW bytes (0 means
+ * LIBSSH2_CHANNEL_WINDOW_MAX). LIBSSH2_CHANNEL_WINDOW_FIXED is the default.
+ *
+ * Returns 0 if succeeded, or a negative value for error.
+ */
+LIBSSH2_API int libssh2_channel_window_mode(LIBSSH2_CHANNEL *channel,
+                                            int mode,
+                                            unsigned long max_window);
+
+/*
+ * libssh2_channel_window_threshold()
+ *
+ * Set how many percent of the receive window that has to be consumed before
+ * the consumed bytes are refunded to the peer with a single window adjust.
+ * 0 restores the default, LIBSSH2_CHANNEL_ADJUST_THRESHOLD.
+ *
+ * Returns 0 if succeeded, or a negative value for error.
+ */
+LIBSSH2_API int libssh2_channel_window_threshold(LIBSSH2_CHANNEL *channel,
+                                                 unsigned int percent);
+
+/*
+ * libssh2_channel_priority()
+ *
+ * Set the weight the channel gets when outgoing data from several channels
+ * of the same session compete for the connection. 0 restores the default,
+ * LIBSSH2_CHANNEL_PRIORITY_NORMAL.
+ *
+ * Returns 0 if succeeded, or a negative value for error.
+ */
+LIBSSH2_API int libssh2_channel_priority(LIBSSH2_CHANNEL *channel,
+                                         unsigned int weight);
+
 LIBSSH2_API ssize_t libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel,
                                              int stream_id, const char *buf,
                                              size_t buflen);
@@ -730,6 +959,27 @@ LIBSSH2_API ssize_t libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel,
 #define libssh2_channel_write_stderr(channel, buf, buflen)  \
   libssh2_channel_write_ex((channel), SSH_EXTENDED_DATA_STDERR, (buf), (buflen))
 
+/*
+ * libssh2_channel_read_async() / libssh2_channel_write_async()
+ *
+ * Queue a libssh2_channel_read_ex() or libssh2_channel_write_ex() call to be
+ * run by libssh2_session_pump(). CALLBACK gets what the call returned once
+ * it no longer returns LIBSSH2_ERROR_EAGAIN, or LIBSSH2_ERROR_CANCELLED if
+ * the channel is freed first. BUF must stay valid until then.
+ *
+ * Returns 0 if queued, or a negative value for error.
+ */
+LIBSSH2_API int libssh2_channel_read_async(LIBSSH2_CHANNEL *channel,
+                                           int stream_id, char *buf,
+                                           size_t buflen,
+                                           LIBSSH2_COMPLETE_FUNC((*callback)),
+                                           void *data);
+LIBSSH2_API int libssh2_channel_write_async(LIBSSH2_CHANNEL *channel,
+                                            int stream_id, const char *buf,
+                                            size_t buflen,
+                                            LIBSSH2_COMPLETE_FUNC((*callback)),
+                                            void *data);
+
 LIBSSH2_API unsigned long
 libssh2_channel_window_write_ex(LIBSSH2_CHANNEL *channel,
                                 unsigned long *window_size_initial);
@@ -1166,6 +1416,70 @@ LIBSSH2_API void libssh2_keepalive_config (LIBSSH2_SESSION *session,
 LIBSSH2_API int libssh2_keepalive_send (LIBSSH2_SESSION *session,
                                         int *seconds_to_next);
 
+/* Session pool */
+typedef struct _LIBSSH2_POOL LIBSSH2_POOL;
+
+#define LIBSSH2_POOL_CONNECT_FUNC(name) \
+ LIBSSH2_SESSION *name(const char *host, int port, const char *username, \
+                       void **abstract)
+#define LIBSSH2_POOL_CLOSE_FUNC(name) \
+ void name(LIBSSH2_SESSION *session, const char *host, int port, \
+           const char *username, void **abstract)
+
+/*
+ * libssh2_pool_init()
+ *
+ * Create a pool that keeps authenticated sessions for reuse. CONNECT_CB is
+ * called to connect, handshake and authenticate a new session when the pool
+ * has none for a host, port and user, CLOSE_CB when the pool is done with a
+ * session.
+ */
+LIBSSH2_API LIBSSH2_POOL *
+libssh2_pool_init(LIBSSH2_POOL_CONNECT_FUNC((*connect_cb)),
+                  LIBSSH2_POOL_CLOSE_FUNC((*close_cb)), void *abstract);
+
+/*
+ * libssh2_pool_config()
+ *
+ * MAX_IDLE is the number of seconds an unused session is kept, MAX_CHANNELS
+ * the number of channels handed out on one session at the same time and
+ * KEEPALIVE the keepalive interval of idle sessions. 0 keeps the current
+ * value.
+ */
+LIBSSH2_API void libssh2_pool_config(LIBSSH2_POOL *pool,
+                                     unsigned int max_idle,
+                                     unsigned int max_channels,
+                                     unsigned int keepalive);
+
+/*
+ * libssh2_pool_channel()
+ *
+ * Open a session channel to HOST:PORT as USERNAME on a pooled session, or on
+ * a new one if there is none to reuse.
+ */
+LIBSSH2_API LIBSSH2_CHANNEL *libssh2_pool_channel(LIBSSH2_POOL *pool,
+                                                  const char *host, int port,
+                                                  const char *username);
+
+/*
+ * libssh2_pool_release()
+ *
+ * Free a channel from libssh2_pool_channel() and return its session to the
+ * pool.
+ */
+LIBSSH2_API int libssh2_pool_release(LIBSSH2_POOL *pool,
+                                     LIBSSH2_CHANNEL *channel);
+
+/*
+ * libssh2_pool_sweep()
+ *
+ * Evict idle and dead sessions and send keepalives on the others. Returns
+ * the number of sessions left in the pool.
+ */
+LIBSSH2_API int libssh2_pool_sweep(LIBSSH2_POOL *pool);
+
+LIBSSH2_API void libssh2_pool_free(LIBSSH2_POOL *pool);
+
 /* NOTE NOTE NOTE
    libssh2_trace() has no function in builds that aren't built with debug
    enabled
@@ -58,7 +58,9 @@ extern "C" {
 typedef struct _LIBSSH2_SFTP                LIBSSH2_SFTP;
 typedef struct _LIBSSH2_SFTP_HANDLE         LIBSSH2_SFTP_HANDLE;
 typedef struct _LIBSSH2_SFTP_ATTRIBUTES     LIBSSH2_SFTP_ATTRIBUTES;
+typedef struct _LIBSSH2_SFTP_DIRENT         LIBSSH2_SFTP_DIRENT;
 typedef struct _LIBSSH2_SFTP_STATVFS        LIBSSH2_SFTP_STATVFS;
+typedef struct _LIBSSH2_SFTP_BATCH          LIBSSH2_SFTP_BATCH;
 
 /* Flags for open_ex() */
 #define LIBSSH2_SFTP_OPENFILE           0
@@ -73,6 +75,9 @@ typedef struct _LIBSSH2_SFTP_STATVFS        LIBSSH2_SFTP_STATVFS;
 #define LIBSSH2_SFTP_STAT               0
 #define LIBSSH2_SFTP_LSTAT              1
 #define LIBSSH2_SFTP_SETSTAT            2
+/* OR'ed to STAT or LSTAT to ask the server even when the attribute cache
+   has the answer */
+#define LIBSSH2_SFTP_FRESH              0x100
 
 /* Flags for symlink_ex() */
 #define LIBSSH2_SFTP_SYMLINK            0
@@ -102,6 +107,17 @@ struct _LIBSSH2_SFTP_ATTRIBUTES {
     unsigned long atime, mtime;
 };
 
+/* A directory entry from libssh2_sftp_readdir_batch(). The name and the
+ * long entry are zero terminated and stored in the buffer given to it.
+ */
+struct _LIBSSH2_SFTP_DIRENT {
+    char *name;
+    size_t name_len;
+    char *longentry;
+    size_t longentry_len;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+};
+
 struct _LIBSSH2_SFTP_STATVFS {
     libssh2_uint64_t  f_bsize;    /* file system block size */
     libssh2_uint64_t  f_frsize;   /* fragment size */
@@ -219,6 +235,9 @@ LIBSSH2_API LIBSSH2_SFTP *libssh2_sftp_init(LIBSSH2_SESSION *session);
 LIBSSH2_API int libssh2_sftp_shutdown(LIBSSH2_SFTP *sftp);
 LIBSSH2_API unsigned long libssh2_sftp_last_error(LIBSSH2_SFTP *sftp);
 LIBSSH2_API LIBSSH2_CHANNEL *libssh2_sftp_get_channel(LIBSSH2_SFTP *sftp);
+LIBSSH2_API int libssh2_sftp_cache_config(LIBSSH2_SFTP *sftp,
+                                          unsigned long ttl,
+                                          unsigned int max_entries);
 
 /* File / Directory Ops */
 LIBSSH2_API LIBSSH2_SFTP_HANDLE *libssh2_sftp_open_ex(LIBSSH2_SFTP *sftp,
@@ -233,6 +252,78 @@ LIBSSH2_API LIBSSH2_SFTP_HANDLE *libssh2_sftp_open_ex(LIBSSH2_SFTP *sftp,
     libssh2_sftp_open_ex((sftp), (path), strlen(path), 0, 0, \
                          LIBSSH2_SFTP_OPENDIR)
 
+/* Whole file transfers */
+LIBSSH2_API LIBSSH2_SFTP_HANDLE *libssh2_sftp_send(LIBSSH2_SFTP *sftp,
+                                                   libssh2_uint64_t filesize,
+                                                   const char *remote_path,
+                                                   unsigned int remote_path_len,
+                                                   long mode);
+LIBSSH2_API LIBSSH2_SFTP_HANDLE *libssh2_sftp_recv(LIBSSH2_SFTP *sftp,
+                                                   const char *remote_path,
+                                                   unsigned int remote_path_len,
+                                                   LIBSSH2_SFTP_ATTRIBUTES *attrs);
+
+/* Batches of whole file transfers. The DATA callback gets LENGTH bytes
+   received at OFFSET of a download or fills BUFFER with up to LENGTH bytes
+   from OFFSET for an upload, the DONE callback gets the outcome of each
+   file. FILE_ABSTRACT is what was passed in when the file was added. */
+#define LIBSSH2_SFTP_BATCH_DATA_FUNC(name) \
+    ssize_t name(LIBSSH2_SFTP_BATCH *batch, libssh2_uint64_t offset, \
+                 char *buffer, size_t length, void *file_abstract)
+#define LIBSSH2_SFTP_BATCH_DONE_FUNC(name) \
+    void name(LIBSSH2_SFTP_BATCH *batch, int rc, void *file_abstract)
+
+LIBSSH2_API LIBSSH2_SFTP_BATCH *libssh2_sftp_batch_init(LIBSSH2_SFTP *sftp,
+                                                        unsigned int max_files,
+                                                        size_t max_bytes);
+LIBSSH2_API int libssh2_sftp_batch_get(LIBSSH2_SFTP_BATCH *batch,
+                                       const char *remote_path,
+                                       unsigned int remote_path_len,
+                                       LIBSSH2_SFTP_BATCH_DATA_FUNC((*data)),
+                                       LIBSSH2_SFTP_BATCH_DONE_FUNC((*done)),
+                                       void *file_abstract);
+LIBSSH2_API int libssh2_sftp_batch_put(LIBSSH2_SFTP_BATCH *batch,
+                                       const char *remote_path,
+                                       unsigned int remote_path_len,
+                                       long mode, libssh2_uint64_t filesize,
+                                       LIBSSH2_SFTP_BATCH_DATA_FUNC((*data)),
+                                       LIBSSH2_SFTP_BATCH_DONE_FUNC((*done)),
+                                       void *file_abstract);
+LIBSSH2_API int
+libssh2_sftp_batch_get_range(LIBSSH2_SFTP_BATCH *batch,
+                             const char *remote_path,
+                             unsigned int remote_path_len,
+                             libssh2_uint64_t offset, libssh2_uint64_t length,
+                             LIBSSH2_SFTP_BATCH_DATA_FUNC((*data)),
+                             LIBSSH2_SFTP_BATCH_DONE_FUNC((*done)),
+                             void *file_abstract);
+LIBSSH2_API int
+libssh2_sftp_batch_put_range(LIBSSH2_SFTP_BATCH *batch,
+                             const char *remote_path,
+                             unsigned int remote_path_len, long mode,
+                             libssh2_uint64_t offset, libssh2_uint64_t length,
+                             LIBSSH2_SFTP_BATCH_DATA_FUNC((*data)),
+                             LIBSSH2_SFTP_BATCH_DONE_FUNC((*done)),
+                             void *file_abstract);
+LIBSSH2_API int libssh2_sftp_batch_run(LIBSSH2_SFTP_BATCH *batch);
+LIBSSH2_API void libssh2_sftp_batch_free(LIBSSH2_SFTP_BATCH *batch);
+
+/* Callback of libssh2_sftp_walk(), returning 0 to go on,
+   LIBSSH2_SFTP_WALK_PRUNE to not descend into a directory or a negative
+   value to stop the walk */
+#define LIBSSH2_SFTP_WALK_FUNC(name) \
+    int name(LIBSSH2_SFTP *sftp, const char *path, size_t path_len, \
+             LIBSSH2_SFTP_ATTRIBUTES *attrs, unsigned int depth, \
+             void *abstract)
+#define LIBSSH2_SFTP_WALK_PRUNE 1
+
+LIBSSH2_API int libssh2_sftp_walk(LIBSSH2_SFTP *sftp, const char *path,
+                                  unsigned int path_len,
+                                  unsigned int max_dirs,
+                                  unsigned int max_depth,
+                                  LIBSSH2_SFTP_WALK_FUNC((*callback)),
+                                  void *abstract);
+
 LIBSSH2_API ssize_t libssh2_sftp_read(LIBSSH2_SFTP_HANDLE *handle,
                                       char *buffer, size_t buffer_maxlen);
 
@@ -244,9 +335,29 @@ LIBSSH2_API int libssh2_sftp_readdir_ex(LIBSSH2_SFTP_HANDLE *handle, \
 #define libssh2_sftp_readdir(handle, buffer, buffer_maxlen, attrs)      \
     libssh2_sftp_readdir_ex((handle), (buffer), (buffer_maxlen), NULL, 0, \
                             (attrs))
+LIBSSH2_API int libssh2_sftp_readdir_batch(LIBSSH2_SFTP_HANDLE *handle,
+                                           LIBSSH2_SFTP_DIRENT *entries,
+                                           size_t max_entries,
+                                           char *buffer, size_t buffer_len);
 
 LIBSSH2_API ssize_t libssh2_sftp_write(LIBSSH2_SFTP_HANDLE *handle,
                                        const char *buffer, size_t count);
+
+/*
+ * libssh2_sftp_read_async() / libssh2_sftp_write_async()
+ *
+ * Queue a libssh2_sftp_read() or libssh2_sftp_write() call to be run by
+ * libssh2_session_pump(). CALLBACK gets what the call returned, or
+ * LIBSSH2_ERROR_CANCELLED if the handle is closed first.
+ */
+LIBSSH2_API int libssh2_sftp_read_async(LIBSSH2_SFTP_HANDLE *handle,
+                                        char *buffer, size_t buffer_maxlen,
+                                        LIBSSH2_COMPLETE_FUNC((*callback)),
+                                        void *data);
+LIBSSH2_API int libssh2_sftp_write_async(LIBSSH2_SFTP_HANDLE *handle,
+                                         const char *buffer, size_t count,
+                                         LIBSSH2_COMPLETE_FUNC((*callback)),
+                                         void *data);
 LIBSSH2_API int libssh2_sftp_fsync(LIBSSH2_SFTP_HANDLE *handle);
 
 LIBSSH2_API int libssh2_sftp_close_handle(LIBSSH2_SFTP_HANDLE *handle);
@@ -0,0 +1,220 @@
+/* Copyright (c) 2026 The libssh2 project and its contributors.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+#include "libssh2_priv.h"
+#include "session.h"
+
+/*
+ * Requests queued with the *_async() functions wait in session->requests
+ * until libssh2_session_pump() completes them. A request keeps the
+ * arguments of its call, so the application doesn't have to repeat them
+ * after LIBSSH2_ERROR_EAGAIN, and any number of requests can be queued.
+ *
+ * The state of a non-blocking call lives in the object it works on: the
+ * channel, or the SFTP instance for SFTP calls. Reads and writes keep
+ * separate state, so requests of one kind on the same object run one at a
+ * time in the order they were queued, while reads, writes and requests on
+ * different objects progress side by side. A request whose call has to wait
+ * marks its kind of call on the object for the rest of the pump, so later
+ * requests of that kind are skipped without being tried.
+ *
+ * Cancelling a request whose call had to wait lets its cancel hook put the
+ * object back in its idle state, so the next call doesn't resume the
+ * abandoned one.
+ *
+ * A packet that was only partly sent has to be completed by the same call
+ * before anything else is sent. The request that left it is resumed first
+ * by the next pump, and nothing else is tried while the socket stays full.
+ */
+
+/*
+ * _libssh2_request_submit
+ *
+ * Queue a copy of 'request'.
+ */
+int
+_libssh2_request_submit(LIBSSH2_SESSION *session,
+                        const LIBSSH2_REQUEST *request)
+{
+    LIBSSH2_REQUEST *copy;
+
+    if(!request->callback)
+        return _libssh2_error(session, LIBSSH2_ERROR_BAD_USE,
+                              "A completion callback is required");
+
+    copy = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_REQUEST));
+    if(!copy)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for request");
+    *copy = *request;
+
+    _libssh2_session_lock(session);
+    copy->pass = session->request_pass;
+    _libssh2_list_add(&session->requests, &copy->node);
+    session->request_count++;
+    _libssh2_session_unlock(session);
+
+    return 0;
+}
+
+/*
+ * request_done
+ *
+ * Unqueue the request and hand 'rc' to its callback.
+ */
+static void
+request_done(LIBSSH2_SESSION *session, LIBSSH2_REQUEST *request, ssize_t rc)
+{
+    _libssh2_list_remove(&request->node);
+    session->request_count--;
+    if(session->request_sending == request)
+        session->request_sending = NULL;
+
+    request->callback(session, rc, request->data);
+    LIBSSH2_FREE(session, request);
+}
+
+/*
+ * request_step
+ *
+ * Run the request's call once. Returns 1 if it has to wait.
+ */
+static int
+request_step(LIBSSH2_SESSION *session, LIBSSH2_REQUEST *request)
+{
+    ssize_t rc = request->run(request);
+
+    if(rc != LIBSSH2_ERROR_EAGAIN) {
+        request_done(session, request, rc);
+        return 0;
+    }
+
+    request->waiting = 1;
+    *request->mark = session->request_pass;
+    if(session->packet.olen)
+        session->request_sending = request;
+    else if(session->request_sending == request)
+        session->request_sending = NULL;
+    return 1;
+}
+
+/*
+ * _libssh2_request_cancel
+ *
+ * Complete every request on 'object' with LIBSSH2_ERROR_CANCELLED, or all
+ * requests of the session if 'object' is NULL.
+ */
+void
+_libssh2_request_cancel(LIBSSH2_SESSION *session, void *object)
+{
+    LIBSSH2_REQUEST *request = _libssh2_list_first(&session->requests);
+
+    while(request) {
+        if(object && (request->object != object) &&
+           (request->handle != object)) {
+            request = _libssh2_list_next(&request->node);
+            continue;
+        }
+
+        session->request_cancels++;
+        if(request->waiting && request->cancel)
+            request->cancel(request);
+        request_done(session, request, LIBSSH2_ERROR_CANCELLED);
+
+        /* the callback may have changed the queue */
+        request = _libssh2_list_first(&session->requests);
+    }
+}
+
+/*
+ * libssh2_session_pump
+ *
+ * Make progress on the queued requests without blocking.
+ */
+LIBSSH2_API int
+libssh2_session_pump(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_REQUEST *request;
+    LIBSSH2_REQUEST *next;
+    unsigned long pass;
+    int rc;
+
+    if(!session)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    _libssh2_session_lock(session);
+
+    if(session->request_pumping) {
+        _libssh2_session_unlock(session);
+        return _libssh2_error(session, LIBSSH2_ERROR_BAD_USE,
+                              "libssh2_session_pump() called from a "
+                              "completion callback");
+    }
+    session->request_pumping = 1;
+    pass = ++session->request_pass;
+
+    /* finish the partly sent packet first */
+    request = session->request_sending;
+    if(request && request_step(session, request) && session->packet.olen)
+        goto done;
+
+    for(request = _libssh2_list_first(&session->requests); request;
+        request = next) {
+        unsigned long cancels = session->request_cancels;
+
+        next = _libssh2_list_next(&request->node);
+
+        /* skip requests queued by the callbacks of this pump, and those
+           behind a request on the same object that has to wait */
+        if((request->pass == pass) || (*request->mark == pass))
+            continue;
+
+        if(request_step(session, request) && session->packet.olen)
+            /* the socket is full */
+            break;
+
+        if(session->request_cancels != cancels)
+            /* a callback cancelled requests, 'next' may be gone */
+            next = _libssh2_list_first(&session->requests);
+    }
+
+  done:
+    rc = (int)session->request_count;
+    session->request_pumping = 0;
+    _libssh2_session_unlock(session);
+    return rc;
+}
@@ -120,6 +120,122 @@ _libssh2_channel_locate(LIBSSH2_SESSION *session, uint32_t channel_id)
     return NULL;
 }
 
+/*
+ * _libssh2_channel_ready
+ *
+ * Record 'events' (LIBSSH2_POLLFD_* bits) for the channel so that the
+ * application learns about them from libssh2_transport_read/write().
+ * Channels still waiting in a listener's queue are not reported.
+ */
+void
+_libssh2_channel_ready(LIBSSH2_CHANNEL *channel, unsigned long events)
+{
+    LIBSSH2_SESSION *session = channel->session;
+
+    if(channel->node.head != &session->channels)
+        return;
+
+    if(!channel->ready_events)
+        _libssh2_list_add(&session->ready_channels, &channel->ready_node);
+
+    channel->ready_events |= events;
+
+    if(channel->poller)
+        _libssh2_poller_wake(channel->poller, session);
+}
+
+/*
+ * channel_create
+ *
+ * Allocate a channel with a fresh local id and link it into the session
+ */
+static LIBSSH2_CHANNEL *
+channel_create(LIBSSH2_SESSION *session, const char *channel_type,
+               uint32_t channel_type_len, uint32_t window_size,
+               uint32_t packet_size)
+{
+    LIBSSH2_CHANNEL *channel = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_CHANNEL));
+    if (!channel) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate space for channel data");
+        return NULL;
+    }
+    memset(channel, 0, sizeof(LIBSSH2_CHANNEL));
+
+    channel->channel_type_len = channel_type_len;
+    channel->channel_type = LIBSSH2_ALLOC(session, channel_type_len);
+    if (!channel->channel_type) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Failed allocating memory for channel type name");
+        LIBSSH2_FREE(session, channel);
+        return NULL;
+    }
+    memcpy(channel->channel_type, channel_type, channel_type_len);
+
+    /* REMEMBER: local as in locally sourced */
+    channel->local.id = _libssh2_channel_nextid(session);
+    channel->remote.window_size = window_size;
+    channel->remote.window_size_initial = window_size;
+    channel->window_credit = window_size;
+    channel->remote.packet_size = packet_size;
+    channel->session = session;
+
+    _libssh2_list_add(&session->channels, &channel->node);
+
+    return channel;
+}
+
+/*
+ * channel_confirmed
+ *
+ * Fill in what the server told about the channel in its
+ * SSH_MSG_CHANNEL_OPEN_CONFIRMATION
+ */
+static void
+channel_confirmed(LIBSSH2_CHANNEL *channel, const unsigned char *data)
+{
+    channel->remote.id = _libssh2_ntohu32(data + 5);
+    channel->local.window_size = _libssh2_ntohu32(data + 9);
+    channel->local.window_size_initial = _libssh2_ntohu32(data + 9);
+    channel->local.packet_size = _libssh2_ntohu32(data + 13);
+    _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
+                   "Connection Established - ID: %lu/%lu win: %lu/%lu"
+                   " pack: %lu/%lu",
+                   channel->local.id, channel->remote.id,
+                   channel->local.window_size, channel->remote.window_size,
+                   channel->local.packet_size, channel->remote.packet_size);
+}
+
+/*
+ * channel_discard
+ *
+ * Get rid of a channel the server never confirmed
+ */
+static void
+channel_discard(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    unsigned char channel_id[4];
+    unsigned char *data;
+    size_t data_len;
+
+    LIBSSH2_FREE(session, channel->channel_type);
+
+    _libssh2_list_remove(&channel->node);
+
+    /* Clear out packets meant for this channel */
+    _libssh2_htonu32(channel_id, channel->local.id);
+    while ((_libssh2_packet_ask(session, SSH_MSG_CHANNEL_DATA,
+                                &data, &data_len, 1, channel_id, 4) >= 0)
+           ||
+           (_libssh2_packet_ask(session, SSH_MSG_CHANNEL_EXTENDED_DATA,
+                                &data, &data_len, 1, channel_id, 4) >= 0)) {
+        LIBSSH2_FREE(session, data);
+    }
+
+    LIBSSH2_FREE(session, channel);
+}
+
 /*
  * _libssh2_channel_open
  *
@@ -148,7 +264,6 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
         /* 17 = packet_type(1) + channel_type_len(4) + sender_channel(4) +
          * window_size(4) + packet_size(4) */
         session->open_packet_len = channel_type_len + 17;
-        session->open_local_channel = _libssh2_channel_nextid(session);
 
         /* Zero the whole thing out */
         memset(&session->open_packet_requirev_state, 0,
@@ -158,36 +273,11 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
                        "Opening Channel - win %d pack %d", window_size,
                        packet_size);
         session->open_channel =
-            LIBSSH2_ALLOC(session, sizeof(LIBSSH2_CHANNEL));
-        if (!session->open_channel) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Unable to allocate space for channel data");
+            channel_create(session, channel_type, channel_type_len,
+                           window_size, packet_size);
+        if (!session->open_channel)
             return NULL;
-        }
-        memset(session->open_channel, 0, sizeof(LIBSSH2_CHANNEL));
-
-        session->open_channel->channel_type_len = channel_type_len;
-        session->open_channel->channel_type =
-            LIBSSH2_ALLOC(session, channel_type_len);
-        if (!session->open_channel->channel_type) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Failed allocating memory for channel type name");
-            LIBSSH2_FREE(session, session->open_channel);
-            session->open_channel = NULL;
-            return NULL;
-        }
-        memcpy(session->open_channel->channel_type, channel_type,
-               channel_type_len);
-
-        /* REMEMBER: local as in locally sourced */
-        session->open_channel->local.id = session->open_local_channel;
-        session->open_channel->remote.window_size = window_size;
-        session->open_channel->remote.window_size_initial = window_size;
-        session->open_channel->remote.packet_size = packet_size;
-        session->open_channel->session = session;
-
-        _libssh2_list_add(&session->channels,
-                          &session->open_channel->node);
+        session->open_local_channel = session->open_channel->local.id;
 
         s = session->open_packet =
             LIBSSH2_ALLOC(session, session->open_packet_len);
@@ -241,23 +331,7 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
         }
 
         if (session->open_data[0] == SSH_MSG_CHANNEL_OPEN_CONFIRMATION) {
-            session->open_channel->remote.id =
-                _libssh2_ntohu32(session->open_data + 5);
-            session->open_channel->local.window_size =
-                _libssh2_ntohu32(session->open_data + 9);
-            session->open_channel->local.window_size_initial =
-                _libssh2_ntohu32(session->open_data + 9);
-            session->open_channel->local.packet_size =
-                _libssh2_ntohu32(session->open_data + 13);
-            _libssh2_debug(session, LIBSSH2_TRACE_CONN,
-                           "Connection Established - ID: %lu/%lu win: %lu/%lu"
-                           " pack: %lu/%lu",
-                           session->open_channel->local.id,
-                           session->open_channel->remote.id,
-                           session->open_channel->local.window_size,
-                           session->open_channel->remote.window_size,
-                           session->open_channel->local.packet_size,
-                           session->open_channel->remote.packet_size);
+            channel_confirmed(session->open_channel, session->open_data);
             LIBSSH2_FREE(session, session->open_packet);
             session->open_packet = NULL;
             LIBSSH2_FREE(session, session->open_data);
@@ -284,27 +358,7 @@ _libssh2_channel_open(LIBSSH2_SESSION * session, const char *channel_type,
         session->open_packet = NULL;
     }
     if (session->open_channel) {
-        unsigned char channel_id[4];
-        LIBSSH2_FREE(session, session->open_channel->channel_type);
-
-        _libssh2_list_remove(&session->open_channel->node);
-
-        /* Clear out packets meant for this channel */
-        _libssh2_htonu32(channel_id, session->open_channel->local.id);
-        while ((_libssh2_packet_ask(session, SSH_MSG_CHANNEL_DATA,
-                                    &session->open_data,
-                                    &session->open_data_len, 1,
-                                    channel_id, 4) >= 0)
-               ||
-               (_libssh2_packet_ask(session, SSH_MSG_CHANNEL_EXTENDED_DATA,
-                                    &session->open_data,
-                                    &session->open_data_len, 1,
-                                    channel_id, 4) >= 0)) {
-            LIBSSH2_FREE(session, session->open_data);
-            session->open_data = NULL;
-        }
-
-        LIBSSH2_FREE(session, session->open_channel);
+        channel_discard(session->open_channel);
         session->open_channel = NULL;
     }
 
@@ -336,6 +390,238 @@ libssh2_channel_open_ex(LIBSSH2_SESSION *session, const char *type,
     return ptr;
 }
 
+/*
+ * channel_open_batch
+ *
+ * Send 'count' CHANNEL_OPEN messages back-to-back and collect the replies as
+ * they arrive, so that all channels are opened in a single round trip
+ */
+static int
+channel_open_batch(LIBSSH2_SESSION *session, const char *channel_type,
+                   uint32_t channel_type_len, uint32_t window_size,
+                   uint32_t packet_size, const unsigned char *message,
+                   size_t message_len, LIBSSH2_CHANNEL **channels,
+                   unsigned int count)
+{
+    unsigned char *s;
+    unsigned int i;
+    int rc;
+
+    if (session->openbatch_state == libssh2_NB_state_idle) {
+        if (!count)
+            return 0;
+
+        memset(channels, 0, count * sizeof(LIBSSH2_CHANNEL *));
+
+        _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                       "Opening %u Channels - win %d pack %d", count,
+                       window_size, packet_size);
+
+        session->openbatch_channels =
+            LIBSSH2_ALLOC(session, count * sizeof(LIBSSH2_CHANNEL *));
+        /* 17 = packet_type(1) + channel_type_len(4) + sender_channel(4) +
+         * window_size(4) + packet_size(4) */
+        session->openbatch_packet_len = channel_type_len + 17;
+        s = session->openbatch_packet =
+            LIBSSH2_ALLOC(session, session->openbatch_packet_len);
+        if (!session->openbatch_channels || !session->openbatch_packet) {
+            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                           "Unable to allocate memory for channel-open "
+                           "batch");
+            goto batch_error;
+        }
+
+        *(s++) = SSH_MSG_CHANNEL_OPEN;
+        _libssh2_store_str(&s, channel_type, channel_type_len);
+        _libssh2_store_u32(&s, 0); /* sender channel, set for each send */
+        _libssh2_store_u32(&s, window_size);
+        _libssh2_store_u32(&s, packet_size);
+
+        session->openbatch_count = 0;
+        session->openbatch_first_id = 0;
+        for (i = 0; i < count; i++) {
+            session->openbatch_channels[i] =
+                channel_create(session, channel_type, channel_type_len,
+                               window_size, packet_size);
+            if (!session->openbatch_channels[i])
+                goto batch_error;
+            if (!i)
+                session->openbatch_first_id =
+                    session->openbatch_channels[i]->local.id;
+            session->openbatch_count++;
+        }
+
+        session->openbatch_sent = 0;
+        session->openbatch_pending = count;
+        session->openbatch_opened = 0;
+        session->openbatch_start = 0;
+
+        session->openbatch_state = libssh2_NB_state_created;
+    }
+
+    if (session->openbatch_state == libssh2_NB_state_created) {
+        while (session->openbatch_sent < session->openbatch_count) {
+            LIBSSH2_CHANNEL *channel =
+                session->openbatch_channels[session->openbatch_sent];
+
+            s = session->openbatch_packet + 5 + channel_type_len;
+            _libssh2_store_u32(&s, channel->local.id);
+
+            rc = _libssh2_transport_send(session,
+                                         session->openbatch_packet,
+                                         session->openbatch_packet_len,
+                                         message, message_len);
+            if (rc == LIBSSH2_ERROR_EAGAIN)
+                return _libssh2_error(session, rc,
+                                      "Would block sending channel-open "
+                                      "request");
+            else if (rc) {
+                _libssh2_error(session, rc,
+                               "Unable to send channel-open request");
+                goto batch_error;
+            }
+            session->openbatch_sent++;
+        }
+
+        session->openbatch_state = libssh2_NB_state_sent;
+    }
+
+    if (session->openbatch_state == libssh2_NB_state_sent) {
+        LIBSSH2_PACKET *packet;
+        LIBSSH2_PACKET *next;
+
+        while (session->openbatch_pending) {
+            /* A single pass over the brigade picks up every reply that has
+               arrived. The channels got consecutive ids when they were
+               created, so the id in the reply is the index into the batch */
+            packet = _libssh2_list_first(&session->packets);
+            while (packet && session->openbatch_pending) {
+                LIBSSH2_CHANNEL *channel;
+                uint32_t id;
+
+                next = _libssh2_list_next(&packet->node);
+                if ((packet->data_len < 5) ||
+                    ((packet->data[0] != SSH_MSG_CHANNEL_OPEN_CONFIRMATION) &&
+                     (packet->data[0] != SSH_MSG_CHANNEL_OPEN_FAILURE))) {
+                    packet = next;
+                    continue;
+                }
+
+                id = _libssh2_ntohu32(packet->data + 1);
+                i = id - session->openbatch_first_id;
+                channel = (i < session->openbatch_count)?
+                    session->openbatch_channels[i]:NULL;
+                if (!channel || (channel->local.id != id)) {
+                    packet = next; /* not one of ours, or answered */
+                    continue;
+                }
+
+                _libssh2_list_remove(&packet->node);
+                session->openbatch_channels[i] = NULL;
+                session->openbatch_pending--;
+
+                if ((packet->data[0] == SSH_MSG_CHANNEL_OPEN_CONFIRMATION) &&
+                    (packet->data_len >= 17)) {
+                    channel_confirmed(channel, packet->data);
+                    channels[i] = channel;
+                    session->openbatch_opened++;
+                }
+                else {
+                    channel_discard(channel);
+                    /* that may have taken data packets off the brigade,
+                       'next' among them */
+                    next = _libssh2_list_first(&session->packets);
+                }
+
+                LIBSSH2_FREE(session, packet->data);
+                LIBSSH2_FREE(session, packet);
+                packet = next;
+            }
+
+            if (!session->openbatch_pending)
+                break;
+
+            if (!session->openbatch_start)
+                session->openbatch_start = _libssh2_time_ms();
+
+            rc = _libssh2_transport_read(session);
+            if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN)) {
+                _libssh2_error(session, rc,
+                               "Failed waiting for channel-open replies");
+                goto batch_error;
+            }
+            if (rc <= 0) {
+                if ((_libssh2_time_ms() - session->openbatch_start) >=
+                    LIBSSH2_READ_TIMEOUT * 1000) {
+                    _libssh2_error(session, LIBSSH2_ERROR_TIMEOUT,
+                                   "Timed out waiting for channel-open "
+                                   "replies");
+                    goto batch_error;
+                }
+                if (rc == LIBSSH2_ERROR_EAGAIN)
+                    return _libssh2_error(session, rc, "Would block");
+            }
+        }
+
+        rc = session->openbatch_opened;
+        if (!rc)
+            rc = _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                                "Channel open failure");
+        goto batch_done;
+    }
+
+    _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                   "Invalid channel-open batch state");
+
+  batch_error:
+    rc = session->err_code;
+
+  batch_done:
+    /* channels that never got a reply are dropped. The confirmed ones are
+       in 'channels' already and belong to the caller, also on failure:
+       a non-blocking caller may have started using them */
+    if (session->openbatch_channels) {
+        for (i = 0; i < session->openbatch_count; i++) {
+            if (session->openbatch_channels[i])
+                channel_discard(session->openbatch_channels[i]);
+        }
+        LIBSSH2_FREE(session, session->openbatch_channels);
+        session->openbatch_channels = NULL;
+    }
+    if (session->openbatch_packet) {
+        LIBSSH2_FREE(session, session->openbatch_packet);
+        session->openbatch_packet = NULL;
+    }
+    session->openbatch_count = 0;
+    session->openbatch_state = libssh2_NB_state_idle;
+    return rc;
+}
+
+/*
+ * libssh2_channel_open_batch
+ *
+ * Establish several generic session channels at once
+ */
+LIBSSH2_API int
+libssh2_channel_open_batch(LIBSSH2_SESSION *session, const char *type,
+                           unsigned int type_len,
+                           unsigned int window_size, unsigned int packet_size,
+                           const char *msg, unsigned int msg_len,
+                           LIBSSH2_CHANNEL **channels, unsigned int count)
+{
+    int rc;
+
+    if(!session || (count && !channels))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    BLOCK_ADJUST(rc, session,
+                 channel_open_batch(session, type, type_len,
+                                    window_size, packet_size,
+                                    (unsigned char *)msg, msg_len,
+                                    channels, count));
+    return rc;
+}
+
 /*
  * libssh2_channel_direct_tcpip_ex
  *
@@ -665,13 +951,14 @@ int _libssh2_channel_forward_cancel(LIBSSH2_LISTENER *listener)
     }
     LIBSSH2_FREE(session, listener->host);
 
+    if (listener->poller)
+        _libssh2_poller_forget_listener(listener);
+
     /* remove this entry from the parent's list of listeners */
     _libssh2_list_remove(&listener->node);
 
     LIBSSH2_FREE(session, listener);
 
-    listener->chanFwdCncl_state = libssh2_NB_state_idle;
-
     return 0;
 }
 
@@ -686,13 +973,16 @@ int _libssh2_channel_forward_cancel(LIBSSH2_LISTENER *listener)
 LIBSSH2_API int
 libssh2_channel_forward_cancel(LIBSSH2_LISTENER *listener)
 {
+    LIBSSH2_SESSION *session;
     int rc;
 
     if(!listener)
         return LIBSSH2_ERROR_BAD_USE;
 
-    BLOCK_ADJUST(rc, listener->session,
-                 _libssh2_channel_forward_cancel(listener));
+    /* the listener is gone once this succeeds, don't let BLOCK_ADJUST look
+       at it afterwards */
+    session = listener->session;
+    BLOCK_ADJUST(rc, session, _libssh2_channel_forward_cancel(listener));
     return rc;
 }
 
@@ -753,6 +1043,81 @@ libssh2_channel_forward_accept(LIBSSH2_LISTENER *listener)
 
 }
 
+/*
+ * channel_pipeline_collect
+ *
+ * Pick up the replies to the channel requests that were sent without waiting
+ * for them, see libssh2_channel_pipeline(). Returns 0 once all of them have
+ * arrived.
+ */
+static int
+channel_pipeline_collect(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    static const unsigned char reply_codes[3] =
+        { SSH_MSG_CHANNEL_SUCCESS, SSH_MSG_CHANNEL_FAILURE, 0 };
+    unsigned char local_channel[4];
+    unsigned char *data;
+    size_t data_len;
+    int rc;
+
+    _libssh2_htonu32(local_channel, channel->local.id);
+
+    while (channel->pipeline_pending) {
+        if (_libssh2_packet_askv(session, reply_codes, &data, &data_len,
+                                 1, local_channel, 4)) {
+            if (channel->remote.close)
+                return _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_CLOSED,
+                                      "Channel closed before all requests "
+                                      "were answered");
+
+            rc = _libssh2_transport_read(session);
+            if (rc == LIBSSH2_ERROR_EAGAIN)
+                return rc;
+            else if (rc < 0)
+                return _libssh2_error(session, rc,
+                                      "Failed waiting for channel request "
+                                      "replies");
+            continue;
+        }
+
+        if (data[0] == SSH_MSG_CHANNEL_FAILURE)
+            channel->pipeline_denied++;
+        LIBSSH2_FREE(session, data);
+        channel->pipeline_pending--;
+    }
+
+    return 0;
+}
+
+/*
+ * libssh2_channel_pipeline
+ *
+ * Send the channel requests without waiting for each reply
+ */
+LIBSSH2_API int
+libssh2_channel_pipeline(LIBSSH2_CHANNEL *channel, int enable)
+{
+    int rc;
+
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if(enable) {
+        channel->pipeline = 1;
+        return 0;
+    }
+
+    BLOCK_ADJUST(rc, channel->session, channel_pipeline_collect(channel));
+    if(rc)
+        return rc;
+
+    rc = channel->pipeline_denied;
+    channel->pipeline = 0;
+    channel->pipeline_denied = 0;
+    return rc;
+}
+
 /*
  * channel_setenv
  *
@@ -823,6 +1188,13 @@ static int channel_setenv(LIBSSH2_CHANNEL *channel,
 
         _libssh2_htonu32(channel->setenv_local_channel, channel->local.id);
 
+        if (channel->pipeline) {
+            /* the reply is picked up by channel_pipeline_collect() */
+            channel->pipeline_pending++;
+            channel->setenv_state = libssh2_NB_state_idle;
+            return 0;
+        }
+
         channel->setenv_state = libssh2_NB_state_sent;
     }
 
@@ -942,6 +1314,13 @@ static int channel_request_pty(LIBSSH2_CHANNEL *channel,
         }
         _libssh2_htonu32(channel->reqPTY_local_channel, channel->local.id);
 
+        if (channel->pipeline) {
+            /* the reply is picked up by channel_pipeline_collect() */
+            channel->pipeline_pending++;
+            channel->reqPTY_state = libssh2_NB_state_idle;
+            return 0;
+        }
+
         channel->reqPTY_state = libssh2_NB_state_sent;
     }
 
@@ -1167,6 +1546,13 @@ channel_x11_req(LIBSSH2_CHANNEL *channel, int single_connection,
 
         _libssh2_htonu32(channel->reqX11_local_channel, channel->local.id);
 
+        if (channel->pipeline) {
+            /* the reply is picked up by channel_pipeline_collect() */
+            channel->pipeline_pending++;
+            channel->reqX11_state = libssh2_NB_state_idle;
+            return 0;
+        }
+
         channel->reqX11_state = libssh2_NB_state_sent;
     }
 
@@ -1297,6 +1683,16 @@ _libssh2_channel_process_startup(LIBSSH2_CHANNEL *channel,
         unsigned char *data;
         size_t data_len;
         unsigned char code;
+
+        /* replies arrive in order, so those to pipelined requests first */
+        rc = channel_pipeline_collect(channel);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            channel->process_state = libssh2_NB_state_idle;
+            return rc;
+        }
+
         rc = _libssh2_packet_requirev(session, reply_codes, &data, &data_len,
                                       1, channel->process_local_channel, 4,
                                       &channel->process_packet_requirev_state);
@@ -1397,7 +1793,8 @@ _libssh2_channel_flush(LIBSSH2_CHANNEL *channel, int streamid)
                                    channel->local.id, channel->remote.id);
 
                     /* It's one of the streams we wanted to flush */
-                    channel->flush_refund_bytes += packet->data_len - 13;
+                    _libssh2_channel_window_refund(channel, bytes_to_flush);
+                    channel->flush_refund_bytes += bytes_to_flush;
                     channel->flush_flush_bytes += bytes_to_flush;
 
                     LIBSSH2_FREE(channel->session, packet->data);
@@ -1416,9 +1813,8 @@ _libssh2_channel_flush(LIBSSH2_CHANNEL *channel, int streamid)
     if (channel->flush_refund_bytes) {
         int rc;
 
-        rc = _libssh2_channel_receive_window_adjust(channel,
-                                                    channel->flush_refund_bytes,
-                                                    1, NULL);
+        /* the bytes are queued already, send them if enough are */
+        rc = _libssh2_channel_receive_window_adjust(channel, 0, 0, NULL);
         if (rc == LIBSSH2_ERROR_EAGAIN)
             return rc;
     }
@@ -1526,12 +1922,261 @@ libssh2_channel_get_exit_signal(LIBSSH2_CHANNEL *channel,
     return LIBSSH2_ERROR_NONE;
 }
 
+/* Minimum time, in milliseconds, to measure the drain rate over */
+#define WINDOW_SAMPLE_MS 250
+
+/*
+ * channel_window_floor
+ *
+ * The smallest receive window an auto-tuned channel shrinks to. It always
+ * allows the peer to send at least two full packets.
+ */
+static uint32_t
+channel_window_floor(LIBSSH2_CHANNEL *channel)
+{
+    uint32_t floor = channel->remote.packet_size * 2;
+
+    if(floor < LIBSSH2_CHANNEL_MINADJUST * 2)
+        floor = LIBSSH2_CHANNEL_MINADJUST * 2;
+
+    return (floor > channel->window_max)?channel->window_max:floor;
+}
+
+/*
+ * channel_window_retarget
+ *
+ * Set the target receive window to twice the measured bandwidth-delay
+ * product, within the floor and the memory ceiling.
+ */
+static void
+channel_window_retarget(LIBSSH2_CHANNEL *channel)
+{
+    libssh2_uint64_t target;
+    uint32_t floor = channel_window_floor(channel);
+
+    if(!channel->window_rate || !channel->window_rtt)
+        /* nothing to base the decision on yet */
+        return;
+
+    target = (libssh2_uint64_t)channel->window_rate * channel->window_rtt
+        / 1000 * 2;
+
+    if(target < floor)
+        target = floor;
+    else if(target > channel->window_max)
+        target = channel->window_max;
+
+    if((uint32_t)target != channel->window_target) {
+        _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
+                       "Receive window target %lu -> %lu on channel %lu/%lu "
+                       "(rate %lu bytes/sec, rtt %lu ms)",
+                       channel->window_target, (uint32_t)target,
+                       channel->local.id, channel->remote.id,
+                       channel->window_rate, channel->window_rtt);
+        channel->window_target = (uint32_t)target;
+    }
+}
+
+/*
+ * channel_window_drained
+ *
+ * Account for 'bytes' handed over to the application and update the
+ * smoothed drain rate once a sample period has passed.
+ */
+static void
+channel_window_drained(LIBSSH2_CHANNEL *channel, size_t bytes)
+{
+    libssh2_uint64_t now = _libssh2_time_ms();
+    libssh2_uint64_t elapsed;
+    uint32_t period = WINDOW_SAMPLE_MS;
+    uint32_t rate;
+
+    if(!channel->window_sample_start) {
+        channel->window_sample_start = now;
+        channel->window_sample_bytes = 0;
+    }
+    channel->window_sample_bytes += bytes;
+
+    /* sample over at least one round-trip */
+    if(channel->window_rtt > period)
+        period = channel->window_rtt;
+
+    elapsed = now - channel->window_sample_start;
+    if(elapsed < period)
+        return;
+
+    rate = (uint32_t)((libssh2_uint64_t)channel->window_sample_bytes * 1000 /
+                      elapsed);
+    /* weigh in the new sample with 1/4 */
+    channel->window_rate =
+        channel->window_rate?(channel->window_rate/4*3 + rate/4):rate;
+
+    channel->window_sample_start = now;
+    channel->window_sample_bytes = 0;
+
+    channel_window_retarget(channel);
+}
+
+/*
+ * _libssh2_channel_window_data
+ *
+ * Called when data arrives on an auto-tuned channel. If we are waiting for
+ * the first data after having refilled an exhausted window, the time since
+ * then is a round-trip time sample.
+ */
+void
+_libssh2_channel_window_data(LIBSSH2_CHANNEL *channel)
+{
+    uint32_t rtt;
+
+    if(!channel->window_probe)
+        return;
+
+    rtt = (uint32_t)(_libssh2_time_ms() - channel->window_probe);
+    if(!rtt)
+        rtt = 1;
+
+    /* weigh in the new sample with 1/8, like TCP does */
+    channel->window_rtt =
+        channel->window_rtt?(channel->window_rtt/8*7 + rtt/8):rtt;
+    channel->window_probe = 0;
+
+    _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
+                   "Round-trip sample %lu ms, smoothed %lu ms on "
+                   "channel %lu/%lu", rtt, channel->window_rtt,
+                   channel->local.id, channel->remote.id);
+}
+
+/*
+ * channel_window_autotune
+ *
+ * Figure out the adjustment to send for an auto-tuned channel, based on what
+ * the caller asked for. The window is topped up to the target size but never
+ * grown beyond the memory ceiling. Data that has arrived but is not read yet
+ * counts against both, so a slow reader cannot make the channel buffer more
+ * than the ceiling.
+ */
+static uint32_t
+channel_window_autotune(LIBSSH2_CHANNEL *channel, uint32_t adjustment)
+{
+    libssh2_uint64_t window = channel->window_credit + adjustment;
+
+    if(!channel->remote.window_size) {
+        /* The peer had to stop sending because of us. Make it larger and
+           measure how long it takes until data arrives again. */
+        if(channel->window_target < channel->window_max / 2)
+            channel->window_target *= 2;
+        else
+            channel->window_target = channel->window_max;
+    }
+
+    if(window < channel->window_target)
+        adjustment += channel->window_target - (uint32_t)window;
+    else if(window > channel->window_max) {
+        window -= channel->window_max;
+        adjustment = (window > adjustment)?0:adjustment - (uint32_t)window;
+    }
+
+    return adjustment;
+}
+
+/*
+ * channel_window_nominal
+ *
+ * The receive window size the channel is meant to have when the application
+ * keeps up with the incoming data.
+ */
+static uint32_t
+channel_window_nominal(LIBSSH2_CHANNEL *channel)
+{
+    if(channel->window_mode == LIBSSH2_CHANNEL_WINDOW_AUTO)
+        return channel->window_target;
+
+    return channel->remote.window_size_initial;
+}
+
+/*
+ * channel_adjust_threshold
+ *
+ * The number of consumed bytes to collect before they are refunded to the
+ * peer in a single window adjust.
+ */
+static uint32_t
+channel_adjust_threshold(LIBSSH2_CHANNEL *channel)
+{
+    uint32_t percent = channel->adjust_threshold?
+        channel->adjust_threshold:LIBSSH2_CHANNEL_ADJUST_THRESHOLD;
+    uint32_t threshold = (uint32_t)((libssh2_uint64_t)
+                                    channel_window_nominal(channel) *
+                                    percent / 100);
+
+    return (threshold < LIBSSH2_CHANNEL_MINADJUST)?
+        LIBSSH2_CHANNEL_MINADJUST:threshold;
+}
+
+/*
+ * _libssh2_channel_window_refund
+ *
+ * Queue the refund of 'bytes' of received data that were handed to the
+ * application or thrown away. They are sent with the next window adjust.
+ */
+void
+_libssh2_channel_window_refund(LIBSSH2_CHANNEL *channel, size_t bytes)
+{
+    channel->adjust_queue += (uint32_t)bytes;
+}
+
+/*
+ * _libssh2_channel_window_refill
+ *
+ * Figure out if a window adjust is due before reading up to 'want' bytes.
+ * The credit is brought to the nominal window size, or to 'want' if that is
+ * larger. A credit above that, as when an auto-tuned window shrinks, is
+ * worked off by keeping back queued refunds. Returns 1 if the queued
+ * refunds plus the *grant bytes are worth a window adjust, 0 if not yet.
+ */
+int
+_libssh2_channel_window_refill(LIBSSH2_CHANNEL *channel, size_t want,
+                               uint32_t *grant)
+{
+    libssh2_uint64_t nominal = channel_window_nominal(channel);
+    libssh2_uint64_t refund;
+
+    if(want > nominal)
+        nominal = want;
+
+    if(channel->window_credit > nominal) {
+        /* more is allowed than wanted, let the window shrink */
+        libssh2_uint64_t excess = channel->window_credit - nominal;
+
+        if(excess > channel->adjust_queue)
+            excess = channel->adjust_queue;
+        channel->adjust_queue -= (uint32_t)excess;
+        channel->window_credit -= excess;
+    }
+
+    *grant = (channel->window_credit < nominal)?
+        (uint32_t)(nominal - channel->window_credit):0;
+    refund = (libssh2_uint64_t)channel->adjust_queue + *grant;
+
+    if(!refund)
+        return 0;
+
+    /* with the window shut, any refund is better than waiting for more */
+    return !channel->remote.window_size ||
+        (refund >= channel_adjust_threshold(channel));
+}
+
 /*
  * _libssh2_channel_receive_window_adjust
  *
  * Adjust the receive window for a channel by adjustment bytes. If the amount
- * to be adjusted is less than LIBSSH2_CHANNEL_MINADJUST and force is 0 the
- * adjustment amount will be queued for a later packet.
+ * to be adjusted is less than the channel's adjust threshold (see
+ * libssh2_channel_window_threshold()) and force is 0 the adjustment amount
+ * will be queued for a later packet.
+ *
+ * Channels in LIBSSH2_CHANNEL_WINDOW_AUTO mode adjust by the amount needed
+ * to reach their target window instead, within their memory ceiling.
  *
  * Calls _libssh2_error() !
  */
@@ -1544,14 +2189,18 @@ _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
     int rc;
 
     if (channel->adjust_state == libssh2_NB_state_idle) {
+        if (channel->window_mode == LIBSSH2_CHANNEL_WINDOW_AUTO)
+            adjustment = channel_window_autotune(channel, adjustment);
+
         if (!force
             && (adjustment + channel->adjust_queue <
-                LIBSSH2_CHANNEL_MINADJUST)) {
+                channel_adjust_threshold(channel))) {
             _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
                            "Queueing %lu bytes for receive window adjustment "
                            "for channel %lu/%lu",
                            adjustment, channel->local.id, channel->remote.id);
             channel->adjust_queue += adjustment;
+            channel->window_credit += adjustment;
             if(store)
                 *store = channel->remote.window_size;
             return 0;
@@ -1563,6 +2212,8 @@ _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
             return 0;
         }
 
+        /* a grant beyond the queued refunds allows more data in */
+        channel->window_credit += adjustment;
         adjustment += channel->adjust_queue;
         channel->adjust_queue = 0;
 
@@ -1592,6 +2243,11 @@ _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
                               "packet, deferring");
     }
     else {
+        if ((channel->window_mode == LIBSSH2_CHANNEL_WINDOW_AUTO) &&
+            !channel->remote.window_size)
+            /* the window was exhausted, time the refill */
+            channel->window_probe = _libssh2_time_ms();
+
         channel->remote.window_size += adjustment;
     }
 
@@ -1608,8 +2264,8 @@ _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
  * DEPRECATED
  *
  * Adjust the receive window for a channel by adjustment bytes. If the amount
- * to be adjusted is less than LIBSSH2_CHANNEL_MINADJUST and force is 0 the
- * adjustment amount will be queued for a later packet.
+ * to be adjusted is less than the channel's adjust threshold and force is 0
+ * the adjustment amount will be queued for a later packet.
  *
  * Returns the new size of the receive window (as understood by remote end).
  * Note that it might return EAGAIN too which is highly stupid.
@@ -1639,8 +2295,8 @@ libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL *channel,
  * libssh2_channel_receive_window_adjust2
  *
  * Adjust the receive window for a channel by adjustment bytes. If the amount
- * to be adjusted is less than LIBSSH2_CHANNEL_MINADJUST and force is 0 the
- * adjustment amount will be queued for a later packet.
+ * to be adjusted is less than the channel's adjust threshold and force is 0
+ * the adjustment amount will be queued for a later packet.
  *
  * Stores the new size of the receive window in the data 'window' points to.
  *
@@ -1663,6 +2319,100 @@ libssh2_channel_receive_window_adjust2(LIBSSH2_CHANNEL *channel,
     return rc;
 }
 
+/*
+ * libssh2_channel_window_mode
+ *
+ * Select fixed or auto-tuned receive window for the channel. The auto-tuned
+ * window is kept within max_window bytes, 0 means LIBSSH2_CHANNEL_WINDOW_MAX.
+ */
+LIBSSH2_API int
+libssh2_channel_window_mode(LIBSSH2_CHANNEL *channel, int mode,
+                            unsigned long max_window)
+{
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    switch(mode) {
+    case LIBSSH2_CHANNEL_WINDOW_FIXED:
+        channel->window_probe = 0;
+        break;
+
+    case LIBSSH2_CHANNEL_WINDOW_AUTO:
+        if(!max_window)
+            max_window = LIBSSH2_CHANNEL_WINDOW_MAX;
+        else if(max_window > 0x7fffffff)
+            /* keep well clear of the 32 bit window limit */
+            max_window = 0x7fffffff;
+
+        channel->window_max = max_window;
+        channel->window_target = channel->remote.window_size_initial;
+        if(channel->window_target > channel->window_max)
+            channel->window_target = channel->window_max;
+        else if(channel->window_target < channel_window_floor(channel))
+            channel->window_target = channel_window_floor(channel);
+
+        channel->window_sample_start = 0;
+        channel->window_sample_bytes = 0;
+        channel->window_rate = 0;
+        channel->window_probe = 0;
+        channel->window_rtt = 0;
+        break;
+
+    default:
+        return _libssh2_error(channel->session, LIBSSH2_ERROR_INVAL,
+                              "Unknown receive window mode");
+    }
+
+    channel->window_mode = mode;
+    return 0;
+}
+
+/*
+ * libssh2_channel_window_threshold
+ *
+ * Set how large part of the receive window, in percent, that needs to be
+ * consumed before it is refunded to the peer.
+ */
+LIBSSH2_API int
+libssh2_channel_window_threshold(LIBSSH2_CHANNEL *channel,
+                                 unsigned int percent)
+{
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if(!percent)
+        percent = LIBSSH2_CHANNEL_ADJUST_THRESHOLD;
+    else if(percent > 90)
+        return _libssh2_error(channel->session, LIBSSH2_ERROR_INVAL,
+                              "Window adjust threshold out of range");
+
+    channel->adjust_threshold = percent;
+    return 0;
+}
+
+/*
+ * libssh2_channel_priority
+ *
+ * Set the weight of the channel in the outbound scheduling of the session
+ */
+LIBSSH2_API int
+libssh2_channel_priority(LIBSSH2_CHANNEL *channel, unsigned int weight)
+{
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if(!weight)
+        weight = LIBSSH2_CHANNEL_PRIORITY_NORMAL;
+    else if(weight > LIBSSH2_CHANNEL_PRIORITY_MAX)
+        return _libssh2_error(channel->session, LIBSSH2_ERROR_INVAL,
+                              "Channel priority out of range");
+
+    channel->sched_weight = weight;
+    /* the session only pays for the scheduling once it is asked for */
+    channel->session->sched_enabled = 1;
+    return 0;
+}
+
 int
 _libssh2_channel_extended_data(LIBSSH2_CHANNEL *channel, int ignore_mode)
 {
@@ -1846,6 +2596,9 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
         read_packet = read_next;
     }
 
+    if (bytes_read && (channel->window_mode == LIBSSH2_CHANNEL_WINDOW_AUTO))
+        channel_window_drained(channel, bytes_read);
+
     if (!bytes_read) {
         channel->read_state = libssh2_NB_state_idle;
 
@@ -1889,24 +2642,77 @@ libssh2_channel_read_ex(LIBSSH2_CHANNEL *channel, int stream_id, char *buf,
                         size_t buflen)
 {
     int rc;
-    unsigned long recv_window;
+    uint32_t grant;
 
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
-    recv_window = libssh2_channel_window_read_ex(channel, NULL, NULL);
-
-    if(buflen > recv_window) {
+    if(_libssh2_channel_window_refill(channel, buflen, &grant))
+        /* enough has been handed out, refund it all in one go */
         BLOCK_ADJUST(rc, channel->session,
-                     _libssh2_channel_receive_window_adjust(channel, buflen,
+                     _libssh2_channel_receive_window_adjust(channel, grant,
                                                             1, NULL));
-    }
 
     BLOCK_ADJUST(rc, channel->session,
                  _libssh2_channel_read(channel, stream_id, buf, buflen));
+    if(rc > 0)
+        _libssh2_channel_window_refund(channel, rc);
+    return rc;
+}
+
+/*
+ * channel_read_request
+ *
+ * The call behind libssh2_channel_read_async(), same as
+ * libssh2_channel_read_ex() without blocking.
+ */
+static ssize_t
+channel_read_request(LIBSSH2_REQUEST *request)
+{
+    LIBSSH2_CHANNEL *channel = request->handle;
+    uint32_t grant;
+    ssize_t rc = 0;
+
+    if(_libssh2_channel_window_refill(channel, request->length, &grant))
+        rc = _libssh2_channel_receive_window_adjust(channel, grant, 1, NULL);
+    if(rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+    rc = _libssh2_channel_read(channel, request->stream_id,
+                               request->buffer, request->length);
+    if(rc > 0)
+        _libssh2_channel_window_refund(channel, rc);
     return rc;
 }
 
+/*
+ * libssh2_channel_read_async
+ *
+ * Queue a read from the channel for libssh2_session_pump()
+ */
+LIBSSH2_API int
+libssh2_channel_read_async(LIBSSH2_CHANNEL *channel, int stream_id,
+                           char *buf, size_t buflen,
+                           LIBSSH2_COMPLETE_FUNC((*callback)), void *data)
+{
+    LIBSSH2_REQUEST request;
+
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    memset(&request, 0, sizeof(request));
+    request.object = request.handle = channel;
+    request.mark = &channel->request_read_mark;
+    request.run = channel_read_request;
+    request.stream_id = stream_id;
+    request.buffer = buf;
+    request.length = buflen;
+    request.callback = callback;
+    request.data = data;
+
+    return _libssh2_request_submit(channel->session, &request);
+}
+
 /*
  * _libssh2_channel_packet_data_len
  *
@@ -1957,22 +2763,131 @@ _libssh2_channel_packet_data_len(LIBSSH2_CHANNEL * channel, int stream_id)
     return 0;
 }
 
+/* A channel that has not tried to write for this long no longer competes
+   for the connection */
+#define SCHED_IDLE_MS 100
+
 /*
- * _libssh2_channel_write
+ * channel_sched_quantum
  *
- * Send data to a channel. Note that if this returns EAGAIN, the caller must
- * call this function again with the SAME input arguments.
+ * Number of bytes the channel may send per scheduling round
+ */
+static uint32_t
+channel_sched_quantum(LIBSSH2_CHANNEL *channel)
+{
+    unsigned int weight = channel->sched_weight?
+        channel->sched_weight:LIBSSH2_CHANNEL_PRIORITY_NORMAL;
+
+    return weight * LIBSSH2_CHANNEL_QUANTUM;
+}
+
+/*
+ * channel_sched_leave
  *
- * Returns: number of bytes sent, or if it returns a negative number, that is
- * the error code!
+ * Stop taking part in the outbound scheduling of the session
+ */
+static void
+channel_sched_leave(LIBSSH2_CHANNEL *channel)
+{
+    if(channel->sched_active) {
+        _libssh2_list_remove(&channel->sched_node);
+        channel->sched_active = 0;
+        channel->session->sched_count--;
+    }
+}
+
+/*
+ * channel_sched_budget
+ *
+ * Deficit round robin over the channels that are writing on the session,
+ * once libssh2_channel_priority() has been used on it. Every round each of
+ * them may send its quantum, which is scaled by the weight of the channel.
+ * While other channels are writing, packets are cut down to what is left of
+ * the quantum so that a bulk transfer can't hold the connection for long.
+ * A channel that has used up its quantum starts a new round rather than
+ * waiting: there is nothing on the socket to wait for until another channel
+ * writes.
+ *
+ * The channels are kept in order of their last write, so the ones that went
+ * idle are found at the front of the list and this is O(1) per packet.
+ *
+ * Returns how many of the 'want' bytes that may be sent now.
+ */
+static size_t
+channel_sched_budget(LIBSSH2_CHANNEL *channel, size_t want)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    libssh2_uint64_t now;
+    struct list_node *node;
+
+    if(!session->sched_enabled)
+        return want;
+
+    now = _libssh2_time_ms();
+    if(channel->sched_active)
+        _libssh2_list_remove(&channel->sched_node);
+    else {
+        channel->sched_active = 1;
+        session->sched_count++;
+        /* make sure it gets credited below */
+        channel->sched_round = session->sched_round - 1;
+    }
+    channel->sched_last = now;
+    _libssh2_list_add(&session->sched_channels, &channel->sched_node);
+
+    while((node = _libssh2_list_first(&session->sched_channels))) {
+        LIBSSH2_CHANNEL *other = (LIBSSH2_CHANNEL *)
+            ((char *)node - offsetof(LIBSSH2_CHANNEL, sched_node));
+
+        if(now - other->sched_last <= SCHED_IDLE_MS)
+            break;
+        channel_sched_leave(other);
+    }
+
+    if(session->sched_count < 2)
+        return want;
+
+    if(channel->sched_round != session->sched_round) {
+        channel->sched_round = session->sched_round;
+        channel->sched_deficit = channel_sched_quantum(channel);
+    }
+    else if(!channel->sched_deficit) {
+        /* everybody has had their turn, start a new round */
+        session->sched_round++;
+        channel->sched_round = session->sched_round;
+        channel->sched_deficit = channel_sched_quantum(channel);
+    }
+
+    return (want > channel->sched_deficit)?channel->sched_deficit:want;
+}
+
+/*
+ * _libssh2_channel_write2
+ *
+ * Send data to a channel, gathered from two buffers: 'head' (at most
+ * LIBSSH2_CHANNEL_WRITE_HEAD bytes, may be NULL) followed by 'buf'. The head
+ * is copied next to the channel header while 'buf' is passed on to the
+ * transport layer as-is, so callers can put a small protocol header in front
+ * of a large payload without building both in one buffer first. Note that if
+ * this returns EAGAIN, the caller must call this function again with the
+ * SAME input arguments.
+ *
+ * Returns: number of bytes sent, counting the head first, or if it returns a
+ * negative number, that is the error code!
  */
 ssize_t
-_libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
-                       const unsigned char *buf, size_t buflen)
+_libssh2_channel_write2(LIBSSH2_CHANNEL *channel, int stream_id,
+                        const unsigned char *head, size_t headlen,
+                        const unsigned char *buf, size_t buflen)
 {
     int rc = 0;
     LIBSSH2_SESSION *session = channel->session;
     ssize_t wrote = 0; /* counter for this specific this call */
+    size_t sched;
+
+    if(headlen > LIBSSH2_CHANNEL_WRITE_HEAD)
+        return _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                              "Channel write head too large");
 
     /* In theory we could split larger buffers into several smaller packets
      * but it turns out to be really hard and nasty to do while still offering
@@ -1982,16 +2897,16 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
      * function to call it again with the remainder! 32K is a conservative
      * limit based on the text in RFC4253 section 6.1.
      */
-    if(buflen > 32700)
-        buflen = 32700;
+    if(headlen + buflen > 32700)
+        buflen = 32700 - headlen;
 
     if (channel->write_state == libssh2_NB_state_idle) {
         unsigned char *s = channel->write_packet;
 
         _libssh2_debug(channel->session, LIBSSH2_TRACE_CONN,
                        "Writing %d bytes on channel %lu/%lu, stream #%d",
-                       (int) buflen, channel->local.id, channel->remote.id,
-                       stream_id);
+                       (int) (headlen + buflen), channel->local.id,
+                       channel->remote.id, stream_id);
 
         if (channel->local.close)
             return _libssh2_error(channel->session,
@@ -2016,7 +2931,7 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
             /* there's no room for data so we stop */
             return (rc==LIBSSH2_ERROR_EAGAIN?rc:0);
 
-        channel->write_bufwrite = buflen;
+        channel->write_bufwrite = headlen + buflen;
 
         *(s++) = stream_id ? SSH_MSG_CHANNEL_EXTENDED_DATA :
             SSH_MSG_CHANNEL_DATA;
@@ -2042,9 +2957,26 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
                            channel->remote.id, stream_id);
             channel->write_bufwrite = channel->local.packet_size;
         }
-        /* store the size here only, the buffer is passed in as-is to
-           _libssh2_transport_send() */
+        /* Share the connection with other channels writing on it */
+        sched = channel_sched_budget(channel, channel->write_bufwrite);
+        if (channel->write_bufwrite > sched) {
+            _libssh2_debug(session, LIBSSH2_TRACE_CONN,
+                           "Splitting write block to %lu bytes to share "
+                           "the session on %lu/%lu/%d",
+                           (unsigned long)sched, channel->local.id,
+                           channel->remote.id, stream_id);
+            channel->write_bufwrite = sched;
+        }
+        /* store the size and the head here only, the buffer is passed in
+           as-is to _libssh2_transport_send() */
         _libssh2_store_u32(&s, channel->write_bufwrite);
+        channel->write_headlen = headlen;
+        if(channel->write_headlen > channel->write_bufwrite)
+            channel->write_headlen = channel->write_bufwrite;
+        if(channel->write_headlen) {
+            memcpy(s, head, channel->write_headlen);
+            s += channel->write_headlen;
+        }
         channel->write_packet_len = s - channel->write_packet;
 
         _libssh2_debug(session, LIBSSH2_TRACE_CONN,
@@ -2057,8 +2989,9 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
 
     if (channel->write_state == libssh2_NB_state_created) {
         rc = _libssh2_transport_send(session, channel->write_packet,
-                                     channel->write_packet_len,
-                                     buf, channel->write_bufwrite);
+                                     channel->write_packet_len, buf,
+                                     channel->write_bufwrite -
+                                     channel->write_headlen);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             return _libssh2_error(session, rc,
                                   "Unable to send channel data");
@@ -2071,6 +3004,12 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
         /* Shrink local window size */
         channel->local.window_size -= channel->write_bufwrite;
 
+        /* ... and what is left of this round's quantum */
+        if (channel->sched_deficit > channel->write_bufwrite)
+            channel->sched_deficit -= channel->write_bufwrite;
+        else
+            channel->sched_deficit = 0;
+
         wrote += channel->write_bufwrite;
 
         /* Since _libssh2_transport_write() succeeded, we must return
@@ -2091,6 +3030,53 @@ _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
     return LIBSSH2_ERROR_INVAL; /* reaching this point is really bad */
 }
 
+/*
+ * _libssh2_channel_write
+ *
+ * Send data to a channel. Note that if this returns EAGAIN, the caller must
+ * call this function again with the SAME input arguments.
+ *
+ * Returns: number of bytes sent, or if it returns a negative number, that is
+ * the error code!
+ */
+ssize_t
+_libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
+                       const unsigned char *buf, size_t buflen)
+{
+    return _libssh2_channel_write2(channel, stream_id, NULL, 0, buf, buflen);
+}
+
+/*
+ * _libssh2_channel_write_abandon
+ *
+ * The caller that got EAGAIN from _libssh2_channel_write() won't call it
+ * again. The packet it left in the transport still goes out ahead of the
+ * next one, so count it as sent and let the next write start over.
+ *
+ * Returns the number of bytes of the call that packet carries, counting the
+ * head.
+ */
+size_t
+_libssh2_channel_write_abandon(LIBSSH2_CHANNEL *channel)
+{
+    LIBSSH2_SESSION *session = channel->session;
+    size_t sent = 0;
+
+    if(channel->write_state != libssh2_NB_state_created)
+        return 0;
+
+    /* an EAGAIN from a key exchange leaves no packet of ours behind */
+    if(session->packet.olen &&
+       (session->packet.odata == channel->write_packet)) {
+        _libssh2_transport_orphan(session);
+        channel->local.window_size -= channel->write_bufwrite;
+        sent = channel->write_bufwrite;
+    }
+    channel->write_state = libssh2_NB_state_idle;
+
+    return sent;
+}
+
 /*
  * libssh2_channel_write_ex
  *
@@ -2111,6 +3097,62 @@ libssh2_channel_write_ex(LIBSSH2_CHANNEL *channel, int stream_id,
     return rc;
 }
 
+/*
+ * channel_write_request
+ *
+ * The call behind libssh2_channel_write_async()
+ */
+static ssize_t
+channel_write_request(LIBSSH2_REQUEST *request)
+{
+    return _libssh2_channel_write(request->handle, request->stream_id,
+                                  (unsigned char *)request->buffer,
+                                  request->length);
+}
+
+/*
+ * channel_write_cancel
+ *
+ * Drop the write a cancelled request left half-way
+ */
+static void
+channel_write_cancel(LIBSSH2_REQUEST *request)
+{
+    LIBSSH2_CHANNEL *channel = request->handle;
+
+    if(channel->session->request_sending == request)
+        _libssh2_channel_write_abandon(channel);
+}
+
+/*
+ * libssh2_channel_write_async
+ *
+ * Queue a write to the channel for libssh2_session_pump()
+ */
+LIBSSH2_API int
+libssh2_channel_write_async(LIBSSH2_CHANNEL *channel, int stream_id,
+                            const char *buf, size_t buflen,
+                            LIBSSH2_COMPLETE_FUNC((*callback)), void *data)
+{
+    LIBSSH2_REQUEST request;
+
+    if(!channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    memset(&request, 0, sizeof(request));
+    request.object = request.handle = channel;
+    request.mark = &channel->request_write_mark;
+    request.run = channel_write_request;
+    request.cancel = channel_write_cancel;
+    request.stream_id = stream_id;
+    request.buffer = (char *)buf;
+    request.length = buflen;
+    request.callback = callback;
+    request.data = data;
+
+    return _libssh2_request_submit(channel->session, &request);
+}
+
 /*
  * channel_send_eof
  *
@@ -2168,11 +3210,15 @@ libssh2_channel_eof(LIBSSH2_CHANNEL * channel)
 {
     LIBSSH2_SESSION *session;
     LIBSSH2_PACKET *packet;
+    int rc;
 
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
     session = channel->session;
+    _libssh2_session_lock(session);
+
+    rc = channel->remote.eof;
     packet = _libssh2_list_first(&session->packets);
 
     while (packet) {
@@ -2180,12 +3226,14 @@ libssh2_channel_eof(LIBSSH2_CHANNEL * channel)
              || (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA))
             && (channel->local.id == _libssh2_ntohu32(packet->data + 1))) {
             /* There's data waiting to be read yet, mask the EOF status */
-            return 0;
+            rc = 0;
+            break;
         }
         packet = _libssh2_list_next(&packet->node);
     }
 
-    return channel->remote.eof;
+    _libssh2_session_unlock(session);
+    return rc;
 }
 
 /*
@@ -2465,6 +3513,20 @@ int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
     /* Unlink from channel list */
     _libssh2_list_remove(&channel->node);
 
+    /* ... and from the list of channels with events to report */
+    if (channel->ready_events)
+        _libssh2_list_remove(&channel->ready_node);
+
+    /* ... and from the outbound scheduling */
+    channel_sched_leave(channel);
+
+    if (channel->poller)
+        _libssh2_poller_forget_channel(channel);
+
+    /* ... and its queued requests are dropped */
+    if (session->request_count)
+        _libssh2_request_cancel(session, channel);
+
     /*
      * Make sure all memory used in the state variables are free
      */
@@ -2494,12 +3556,15 @@ int _libssh2_channel_free(LIBSSH2_CHANNEL *channel)
 LIBSSH2_API int
 libssh2_channel_free(LIBSSH2_CHANNEL *channel)
 {
+    LIBSSH2_SESSION *session;
     int rc;
 
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
-    BLOCK_ADJUST(rc, channel->session, _libssh2_channel_free(channel));
+    /* the channel is gone when BLOCK_ADJUST releases the session */
+    session = channel->session;
+    BLOCK_ADJUST(rc, session, _libssh2_channel_free(channel));
     return rc;
 }
 /*
@@ -2525,8 +3590,10 @@ libssh2_channel_window_read_ex(LIBSSH2_CHANNEL *channel,
 
     if (read_avail) {
         size_t bytes_queued = 0;
-        LIBSSH2_PACKET *packet =
-            _libssh2_list_first(&channel->session->packets);
+        LIBSSH2_PACKET *packet;
+
+        _libssh2_session_lock(channel->session);
+        packet = _libssh2_list_first(&channel->session->packets);
 
         while (packet) {
             unsigned char packet_type = packet->data[0];
@@ -2539,6 +3606,7 @@ libssh2_channel_window_read_ex(LIBSSH2_CHANNEL *channel,
 
             packet = _libssh2_list_next(&packet->node);
         }
+        _libssh2_session_unlock(channel->session);
 
         *read_avail = bytes_queued;
     }
@@ -42,8 +42,8 @@
  * _libssh2_channel_receive_window_adjust
  *
  * Adjust the receive window for a channel by adjustment bytes. If the amount
- * to be adjusted is less than LIBSSH2_CHANNEL_MINADJUST and force is 0 the
- * adjustment amount will be queued for a later packet.
+ * to be adjusted is less than the channel's adjust threshold and force is 0
+ * the adjustment amount will be queued for a later packet.
  *
  * Always non-blocking.
  */
@@ -52,6 +52,31 @@ int _libssh2_channel_receive_window_adjust(LIBSSH2_CHANNEL * channel,
                                            unsigned char force,
                                            unsigned int *store);
 
+/*
+ * _libssh2_channel_window_data
+ *
+ * Take a round-trip time sample for an auto-tuned receive window when data
+ * arrives on the channel.
+ */
+void _libssh2_channel_window_data(LIBSSH2_CHANNEL *channel);
+
+/*
+ * _libssh2_channel_window_refill
+ *
+ * Tells if a window adjust is due before reading up to 'want' bytes, with
+ * the bytes to grant on top of the queued refunds in *grant.
+ */
+int _libssh2_channel_window_refill(LIBSSH2_CHANNEL *channel, size_t want,
+                                   uint32_t *grant);
+
+/*
+ * _libssh2_channel_window_refund
+ *
+ * Queue the refund of 'bytes' of received data that were handed out or
+ * thrown away
+ */
+void _libssh2_channel_window_refund(LIBSSH2_CHANNEL *channel, size_t bytes);
+
 /*
  * _libssh2_channel_flush
  *
@@ -82,6 +107,23 @@ ssize_t
 _libssh2_channel_write(LIBSSH2_CHANNEL *channel, int stream_id,
                        const unsigned char *buf, size_t buflen);
 
+/*
+ * _libssh2_channel_write_abandon
+ *
+ * Give up a write that returned EAGAIN
+ */
+size_t _libssh2_channel_write_abandon(LIBSSH2_CHANNEL *channel);
+
+/*
+ * _libssh2_channel_write2
+ *
+ * Send data to a channel, a small 'head' copied in front of 'buf'
+ */
+ssize_t
+_libssh2_channel_write2(LIBSSH2_CHANNEL *channel, int stream_id,
+                        const unsigned char *head, size_t headlen,
+                        const unsigned char *buf, size_t buflen);
+
 /*
  * _libssh2_channel_open
  *
@@ -119,6 +161,13 @@ ssize_t _libssh2_channel_read(LIBSSH2_CHANNEL *channel, int stream_id,
 
 uint32_t _libssh2_channel_nextid(LIBSSH2_SESSION * session);
 
+/*
+ * _libssh2_channel_ready
+ *
+ * Queue events for libssh2_transport_read() and libssh2_transport_write()
+ */
+void _libssh2_channel_ready(LIBSSH2_CHANNEL *channel, unsigned long events);
+
 LIBSSH2_CHANNEL *_libssh2_channel_locate(LIBSSH2_SESSION * session,
                                          uint32_t channel_id);
 
@@ -38,6 +38,7 @@
 
 #include "libssh2_priv.h"
 #include "transport.h" /* _libssh2_transport_write */
+#include "session.h" /* _libssh2_session_lock */
 
 /* Keep-alive stuff. */
 
@@ -53,21 +54,21 @@ libssh2_keepalive_config (LIBSSH2_SESSION *session,
     session->keepalive_want_reply = want_reply ? 1 : 0;
 }
 
-LIBSSH2_API int
-libssh2_keepalive_send (LIBSSH2_SESSION *session,
-                        int *seconds_to_next)
+int
+_libssh2_keepalive_send(LIBSSH2_SESSION *session, long *ms_to_next)
 {
-    time_t now;
+    libssh2_uint64_t now;
+    libssh2_uint64_t interval;
 
     if (!session->keepalive_interval) {
-        if (seconds_to_next)
-            *seconds_to_next = 0;
+        *ms_to_next = 0;
         return 0;
     }
 
-    now = time (NULL);
+    now = _libssh2_time_ms();
+    interval = (libssh2_uint64_t)session->keepalive_interval * 1000;
 
-    if (session->keepalive_last_sent + session->keepalive_interval <= now) {
+    if (session->keepalive_last_sent + interval <= now) {
         /* Format is
            "SSH_MSG_GLOBAL_REQUEST || 4-byte len || str || want-reply". */
         unsigned char keepalive_data[]
@@ -77,7 +78,9 @@ libssh2_keepalive_send (LIBSSH2_SESSION *session,
 
         keepalive_data[len - 1] = session->keepalive_want_reply;
 
+        _libssh2_session_lock(session);
         rc = _libssh2_transport_send(session, keepalive_data, len, NULL, 0);
+        _libssh2_session_unlock(session);
         /* Silently ignore PACKET_EAGAIN here: if the write buffer is
            already full, sending another keepalive is not useful. */
         if (rc && rc != LIBSSH2_ERROR_EAGAIN) {
@@ -87,12 +90,24 @@ libssh2_keepalive_send (LIBSSH2_SESSION *session,
         }
 
         session->keepalive_last_sent = now;
-        if (seconds_to_next)
-            *seconds_to_next = session->keepalive_interval;
-    } else if (seconds_to_next) {
-        *seconds_to_next = (int) session->keepalive_last_sent
-            + session->keepalive_interval - now;
+        *ms_to_next = (long)interval;
+    } else {
+        *ms_to_next = (long)(session->keepalive_last_sent + interval - now);
     }
 
     return 0;
 }
+
+LIBSSH2_API int
+libssh2_keepalive_send (LIBSSH2_SESSION *session,
+                        int *seconds_to_next)
+{
+    long ms_to_next;
+    int rc = _libssh2_keepalive_send(session, &ms_to_next);
+
+    if (!rc && seconds_to_next)
+        /* rounded up, a keepalive that is due in 0 seconds is sent now */
+        *seconds_to_next = (int)((ms_to_next + 999) / 1000);
+
+    return rc;
+}
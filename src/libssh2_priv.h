@@ -92,6 +92,18 @@
 #ifdef HAVE_SYS_IOCTL_H
 # include <sys/ioctl.h>
 #endif
+
+/* Linux can send straight from user memory and tell later, through the
+   socket's error queue, when it is done with it */
+#ifdef HAVE_LINUX_ERRQUEUE_H
+# include <netinet/in.h>
+# include <linux/errqueue.h>
+#endif
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(MSG_ZEROCOPY) && \
+    defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY) && \
+    defined(SO_EE_CODE_ZEROCOPY_COPIED)
+#define LIBSSH2_ZEROCOPY 1
+#endif
 #ifdef HAVE_INTTYPES_H
 #include <inttypes.h>
 #endif
@@ -153,6 +165,10 @@ static inline int writev(int sock, struct iovec *iov, int nvecs)
  */
 #define MAX_SSH_PACKET_LEN 35000
 
+/* Largest head _libssh2_channel_write2() accepts, enough for an SFTP
+   FXP_WRITE header (25 bytes) with a handle of the maximum 256 bytes */
+#define LIBSSH2_CHANNEL_WRITE_HEAD 288
+
 #define LIBSSH2_ALLOC(session, count) \
   session->alloc((count), &(session)->abstract)
 #define LIBSSH2_REALLOC(session, ptr, count) \
@@ -188,10 +204,11 @@ static inline int writev(int sock, struct iovec *iov, int nvecs)
 #define LIBSSH2_RECV_FD(session, fd, buffer, length, flags) \
     session->recv(fd, buffer, length, flags, &session->abstract)
 
+/* the session's own socket goes through its I/O backend, if it has one */
 #define LIBSSH2_SEND(session, buffer, length, flags)  \
-    LIBSSH2_SEND_FD(session, session->socket_fd, buffer, length, flags)
+    _libssh2_io_send(session, buffer, length, flags)
 #define LIBSSH2_RECV(session, buffer, length, flags)                    \
-    LIBSSH2_RECV_FD(session, session->socket_fd, buffer, length, flags)
+    _libssh2_io_recv(session, buffer, length, flags)
 
 typedef struct _LIBSSH2_KEX_METHOD LIBSSH2_KEX_METHOD;
 typedef struct _LIBSSH2_HOSTKEY_METHOD LIBSSH2_HOSTKEY_METHOD;
@@ -199,6 +216,7 @@ typedef struct _LIBSSH2_CRYPT_METHOD LIBSSH2_CRYPT_METHOD;
 typedef struct _LIBSSH2_COMP_METHOD LIBSSH2_COMP_METHOD;
 
 typedef struct _LIBSSH2_PACKET LIBSSH2_PACKET;
+typedef struct _LIBSSH2_REQUEST LIBSSH2_REQUEST;
 
 typedef enum
 {
@@ -223,12 +241,12 @@ typedef enum
 typedef struct packet_require_state_t
 {
     libssh2_nonblocking_states state;
-    time_t start;
+    libssh2_uint64_t start; /* _libssh2_time_ms() */
 } packet_require_state_t;
 
 typedef struct packet_requirev_state_t
 {
-    time_t start;
+    libssh2_uint64_t start; /* _libssh2_time_ms() */
 } packet_requirev_state_t;
 
 typedef struct kmdhgGPsha1kex_state_t
@@ -329,6 +347,33 @@ struct _LIBSSH2_PACKET
     size_t data_head;
 };
 
+/* A call queued with one of the *_async() functions, see async.c */
+struct _LIBSSH2_REQUEST
+{
+    struct list_node node; /* in session->requests */
+
+    /* Requests of the same kind on the same object run one at a time: the
+       object holds the state of the non-blocking call and 'mark' points to
+       the pump mark of that kind of call */
+    void *object;
+    unsigned long *mark;
+    unsigned long pass; /* the pump pass it was submitted in */
+    int waiting; /* its call returned EAGAIN and is to be resumed */
+
+    /* The call and its arguments */
+    ssize_t (*run)(LIBSSH2_REQUEST *request);
+    /* Puts the object back in its idle state when a waiting request is
+       cancelled, may be NULL */
+    void (*cancel)(LIBSSH2_REQUEST *request);
+    void *handle; /* the channel or SFTP handle */
+    int stream_id;
+    char *buffer;
+    size_t length;
+
+    LIBSSH2_COMPLETE_FUNC((*callback));
+    void *data;
+};
+
 typedef struct _libssh2_channel_data
 {
     /* Identifier */
@@ -357,12 +402,35 @@ struct _LIBSSH2_CHANNEL
     libssh2_channel_data local, remote;
     /* Amount of bytes to be refunded to receive window (but not yet sent) */
     uint32_t adjust_queue;
+    /* What the peer has been allowed to send so far that is not yet handed
+       to the application: the open window, the data waiting in the brigade
+       and adjust_queue. Reads only refund what they hand out, so this is
+       what bounds the memory a channel can tie up. */
+    libssh2_uint64_t window_credit;
+    /* Percentage of the window to consume before refunding, 0 for default */
+    uint32_t adjust_threshold;
 
     LIBSSH2_SESSION *session;
 
     void *abstract;
       LIBSSH2_CHANNEL_CLOSE_FUNC((*close_cb));
 
+    /* Events not yet reported by libssh2_transport_read/write(), the channel
+       is linked into session->ready_channels while this is non-zero */
+    unsigned long ready_events;
+    struct list_node ready_node;
+
+    /* The poller the channel is added to, the events it waits for and its
+       entry in the poller + 1 */
+    LIBSSH2_POLLER *poller;
+    unsigned long poller_events;
+    unsigned int poller_index;
+
+    /* Last pump pass a read and a write request on the channel had to wait
+       in */
+    unsigned long request_read_mark;
+    unsigned long request_write_mark;
+
     /* State variables used in libssh2_channel_setenv_ex() */
     libssh2_nonblocking_states setenv_state;
     unsigned char *setenv_packet;
@@ -397,10 +465,35 @@ struct _LIBSSH2_CHANNEL
     size_t flush_refund_bytes;
     size_t flush_flush_bytes;
 
+    /* Requests sent without waiting for the reply, see
+       libssh2_channel_pipeline() */
+    int pipeline;
+    unsigned int pipeline_pending; /* replies not yet picked up */
+    unsigned int pipeline_denied;  /* requests the server refused */
+
     /* State variables used in libssh2_channel_receive_window_adjust() */
     libssh2_nonblocking_states adjust_state;
     unsigned char adjust_adjust[9];     /* packet_type(1) + channel(4) + adjustment(4) */
 
+    /* Receive window tuning, see libssh2_channel_window_mode() */
+    int window_mode;
+    uint32_t window_max;        /* memory ceiling for the receive window */
+    uint32_t window_target;     /* receive window size we aim for */
+    libssh2_uint64_t window_sample_start; /* ms, start of the drain sample */
+    uint32_t window_sample_bytes; /* bytes drained in the current sample */
+    uint32_t window_rate;       /* smoothed drain rate, bytes/second */
+    libssh2_uint64_t window_probe; /* ms, when an exhausted window was
+                                      refilled, 0 when not measuring */
+    uint32_t window_rtt;        /* smoothed round-trip time, ms */
+
+    /* Outbound scheduling, see libssh2_channel_priority() */
+    unsigned int sched_weight;  /* 0 means LIBSSH2_CHANNEL_PRIORITY_NORMAL */
+    uint32_t sched_deficit;     /* bytes left to send in the current round */
+    unsigned long sched_round;  /* round the deficit was credited in */
+    libssh2_uint64_t sched_last; /* ms, last write attempt */
+    struct list_node sched_node; /* in session->sched_channels */
+    int sched_active;           /* non-zero while linked by sched_node */
+
     /* State variables used in libssh2_channel_read_ex() */
     libssh2_nonblocking_states read_state;
 
@@ -408,8 +501,11 @@ struct _LIBSSH2_CHANNEL
 
     /* State variables used in libssh2_channel_write_ex() */
     libssh2_nonblocking_states write_state;
-    unsigned char write_packet[13];
+    /* the channel data header followed by a copy of the head passed to
+       _libssh2_channel_write2() */
+    unsigned char write_packet[13 + LIBSSH2_CHANNEL_WRITE_HEAD];
     size_t write_packet_len;
+    size_t write_headlen; /* part of write_bufwrite kept in write_packet */
     size_t write_bufwrite;
 
     /* State variables used in libssh2_channel_close() */
@@ -445,6 +541,10 @@ struct _LIBSSH2_LISTENER
     int queue_size;
     int queue_maxsize;
 
+    /* The poller the listener is added to and its entry there + 1 */
+    LIBSSH2_POLLER *poller;
+    unsigned int poller_index;
+
     /* State variables used in libssh2_channel_forward_cancel() */
     libssh2_nonblocking_states chanFwdCncl_state;
     unsigned char *chanFwdCncl_data;
@@ -475,12 +575,33 @@ typedef struct _libssh2_endpoint_data
     char *lang_prefs;
 } libssh2_endpoint_data;
 
+/* default and smallest size of the receive buffer, see
+   libssh2_session_recv_buffer() */
 #define PACKETBUFSIZE (1024*16)
+#define PACKETBUFSIZE_MIN 1024
+
+#ifdef LIBSSH2_ZEROCOPY
+/* With LIBSSH2_FLAG_ZEROCOPY large packets are built in a ring of buffers
+   and sent with MSG_ZEROCOPY, a buffer is used again only once the kernel
+   has reported all sends from it as completed */
+#define ZEROCOPY_BUFFERS 8
+#define ZEROCOPY_MIN 16384  /* smaller packets are cheaper to copy */
+
+struct zerocopy_buffer
+{
+    unsigned char *data;
+    uint32_t first;         /* id of the first send from this buffer */
+    uint32_t sends;         /* number of sends from it, ids are sequential */
+    uint32_t pending;       /* sends the kernel hasn't completed yet */
+};
+#endif
 
 struct transportpacket
 {
     /* ------------- for incoming data --------------- */
-    unsigned char buf[PACKETBUFSIZE];
+    unsigned char *buf;     /* network data not yet decrypted, every recv
+                               fills as much of it as possible */
+    size_t bufsize;
     unsigned char init[5];  /* first 5 bytes of the incoming data stream,
                                still encrypted */
     size_t writeidx;        /* at what array index we do the next write into
@@ -504,6 +625,17 @@ struct transportpacket
 
     /* ------------- for outgoing data --------------- */
     unsigned char outbuf[MAX_SSH_PACKET_LEN]; /* area for the outgoing data */
+    unsigned char *obuf;    /* where the packet being sent was built, outbuf
+                               or one of the zerocopy buffers */
+#ifdef LIBSSH2_ZEROCOPY
+    int zerocopy;           /* 0 not tried yet, 1 enabled on the socket, -1
+                               not available */
+    uint32_t zc_next_id;    /* id the kernel gives the next zerocopy send */
+    unsigned int zc_next;   /* ring index of the buffer to use next */
+    unsigned int zc_pending; /* buffers the kernel still holds on to */
+    unsigned int zc_copied; /* zerocopy sends in a row the kernel copied */
+    struct zerocopy_buffer zc[ZEROCOPY_BUFFERS];
+#endif
 
     int ototal_num;         /* size of outbuf in number of bytes */
     const unsigned char *odata; /* original pointer to the data */
@@ -545,6 +677,7 @@ struct _LIBSSH2_PUBLICKEY
 struct flags {
     int sigpipe;  /* LIBSSH2_FLAG_SIGPIPE */
     int compress; /* LIBSSH2_FLAG_COMPRESS */
+    int zerocopy; /* LIBSSH2_FLAG_ZEROCOPY */
 };
 
 struct _LIBSSH2_SESSION
@@ -563,6 +696,20 @@ struct _LIBSSH2_SESSION
       LIBSSH2_X11_OPEN_FUNC((*x11));
       LIBSSH2_SEND_FUNC((*send));
       LIBSSH2_RECV_FUNC((*recv));
+      LIBSSH2_LOCK_FUNC((*lock));
+
+    /* The I/O backend used instead of send and recv, see
+       libssh2_session_io_backend(), and the directions
+       (LIBSSH2_SESSION_BLOCK_*) it has an operation in flight in */
+    const LIBSSH2_IO_BACKEND *io;
+    void *io_abstract;
+    int io_pending;
+
+    /* Times the lock is held by the thread inside the library, see
+       _libssh2_session_lock(), and the threads waiting for the socket in
+       _libssh2_wait_socket() without it */
+    int lock_depth;
+    int lock_waiters;
 
     /* Method preferences -- NULL yields "load order" */
     char *kex_prefs;
@@ -614,6 +761,34 @@ struct _LIBSSH2_SESSION
     /* Active connection channels */
     struct list_head channels;
 
+    /* Channels with events to report from libssh2_transport_read/write() */
+    struct list_head ready_channels;
+
+    /* The poller the session itself is added to and its entry there + 1 */
+    LIBSSH2_POLLER *poller;
+    unsigned int poller_index;
+
+    /* The poller watching the socket, for the session or any of its
+       channels and listeners. Told when the session blocks, see
+       _libssh2_session_block() */
+    LIBSSH2_POLLER *watcher;
+
+    /* Requests waiting for libssh2_session_pump() */
+    struct list_head requests;
+    unsigned int request_count;
+    unsigned long request_pass;     /* bumped by every pump */
+    unsigned long request_cancels;  /* bumped by every cancel */
+    LIBSSH2_REQUEST *request_sending; /* left a packet partly sent */
+    int request_pumping;
+
+    /* Channels that recently wrote data and compete for the connection,
+       oldest writer first. Only used once sched_enabled is set by
+       libssh2_channel_priority() */
+    struct list_head sched_channels;
+    unsigned int sched_count;
+    unsigned long sched_round;
+    int sched_enabled;
+
     uint32_t next_channel;
 
     struct list_head listeners; /* list of LIBSSH2_LISTENER structs */
@@ -732,6 +907,18 @@ struct _LIBSSH2_SESSION
     size_t open_data_len;
     uint32_t open_local_channel;
 
+    /* State variables used in libssh2_channel_open_batch() */
+    libssh2_nonblocking_states openbatch_state;
+    LIBSSH2_CHANNEL **openbatch_channels; /* NULL once answered */
+    unsigned int openbatch_count;
+    uint32_t openbatch_first_id;    /* local id of openbatch_channels[0] */
+    unsigned int openbatch_sent;
+    unsigned int openbatch_pending;
+    unsigned int openbatch_opened;
+    unsigned char *openbatch_packet;
+    size_t openbatch_packet_len;
+    libssh2_uint64_t openbatch_start; /* _libssh2_time_ms() */
+
     /* State variables used in libssh2_channel_direct_tcpip_ex() */
     libssh2_nonblocking_states direct_state;
     unsigned char *direct_message;
@@ -773,8 +960,9 @@ struct _LIBSSH2_SESSION
     libssh2_nonblocking_states sftpInit_state;
     LIBSSH2_SFTP *sftpInit_sftp;
     LIBSSH2_CHANNEL *sftpInit_channel;
-    unsigned char sftpInit_buffer[9];   /* sftp_header(5){excludes request_id}
-                                           + version_id(4) */
+    unsigned char sftpInit_buffer[31];  /* sftp_header(5){excludes request_id}
+                                           + version_id(4), later the
+                                           limits@openssh.com request */
     int sftpInit_sent; /* number of bytes from the buffer that have been
                           sent */
 
@@ -808,7 +996,7 @@ struct _LIBSSH2_SESSION
     /* Keepalive variables used by keepalive.c. */
     int keepalive_interval;
     int keepalive_want_reply;
-    time_t keepalive_last_sent;
+    libssh2_uint64_t keepalive_last_sent; /* _libssh2_time_ms() */
 };
 
 /* session.state bits */
@@ -882,6 +1070,8 @@ struct _LIBSSH2_CRYPT_METHOD
                  const LIBSSH2_CRYPT_METHOD * method, unsigned char *iv,
                  int *free_iv, unsigned char *secret, int *free_secret,
                  int encrypt, void **abstract);
+    /* transforms 'blocksize' bytes in place, which may be any multiple of
+       the cipher's block size so that a whole packet is done in one call */
     int (*crypt) (LIBSSH2_SESSION * session, unsigned char *block,
                   size_t blocksize, void **abstract);
     int (*dtor) (LIBSSH2_SESSION * session, void **abstract);
@@ -1003,6 +1193,10 @@ ssize_t _libssh2_recv(libssh2_socket_t socket, void *buffer,
                       size_t length, int flags, void **abstract);
 ssize_t _libssh2_send(libssh2_socket_t socket, const void *buffer,
                       size_t length, int flags, void **abstract);
+ssize_t _libssh2_io_recv(LIBSSH2_SESSION *session, void *buffer,
+                         size_t length, int flags);
+ssize_t _libssh2_io_send(LIBSSH2_SESSION *session, const void *buffer,
+                         size_t length, int flags);
 
 #define LIBSSH2_READ_TIMEOUT 60 /* generic timeout in seconds used when
                                    waiting for more data to arrive */
@@ -1027,6 +1221,18 @@ int _libssh2_pem_decode_integer(unsigned char **data, unsigned int *datalen,
 /* global.c */
 void _libssh2_init_if_needed (void);
 
+/* poller.c */
+void _libssh2_poller_forget_channel(LIBSSH2_CHANNEL *channel);
+void _libssh2_poller_forget_session(LIBSSH2_SESSION *session);
+void _libssh2_poller_forget_listener(LIBSSH2_LISTENER *listener);
+void _libssh2_poller_wake(LIBSSH2_POLLER *poller, LIBSSH2_SESSION *session);
+void _libssh2_poller_rearm(LIBSSH2_POLLER *poller, LIBSSH2_SESSION *session);
+
+/* async.c */
+int _libssh2_request_submit(LIBSSH2_SESSION *session,
+                            const LIBSSH2_REQUEST *request);
+void _libssh2_request_cancel(LIBSSH2_SESSION *session, void *object);
+
 
 #define ARRAY_SIZE(a) (sizeof ((a)) / sizeof ((a)[0]))
 
@@ -48,6 +48,10 @@
 #include <sys/time.h>
 #endif
 
+#if defined(__APPLE__) && defined(__MACH__)
+#include <mach/mach_time.h>
+#endif
+
 #include <stdio.h>
 #include <errno.h>
 
@@ -146,6 +150,73 @@ _libssh2_send(libssh2_socket_t sock, const void *buffer, size_t length,
     return rc;
 }
 
+/* _libssh2_io_recv
+ *
+ * Receive on the session's socket, through its I/O backend if it has one.
+ * A receive still in flight returns -EAGAIN, and the caller must come back
+ * with the same buffer to collect it.
+ */
+ssize_t
+_libssh2_io_recv(LIBSSH2_SESSION *session, void *buffer, size_t length,
+                 int flags)
+{
+    const LIBSSH2_IO_BACKEND *io = session->io;
+    ssize_t rc;
+
+    if(!io)
+        return session->recv(session->socket_fd, buffer, length, flags,
+                             &session->abstract);
+
+    if(!(session->io_pending & LIBSSH2_SESSION_BLOCK_INBOUND)) {
+        rc = io->recv(session, session->socket_fd, buffer, length,
+                      &session->io_abstract);
+        if(rc < 0)
+            return rc;
+        session->io_pending |= LIBSSH2_SESSION_BLOCK_INBOUND;
+    }
+
+    rc = io->complete(session, session->socket_fd,
+                      LIBSSH2_SESSION_BLOCK_INBOUND, &session->io_abstract);
+    if(rc != -EAGAIN)
+        session->io_pending &= ~LIBSSH2_SESSION_BLOCK_INBOUND;
+    return rc;
+}
+
+/* _libssh2_io_send
+ *
+ * Send on the session's socket, through its I/O backend if it has one.
+ * A send still in flight returns -EAGAIN, and the caller must come back
+ * with the same data to collect it.
+ */
+ssize_t
+_libssh2_io_send(LIBSSH2_SESSION *session, const void *buffer, size_t length,
+                 int flags)
+{
+    const LIBSSH2_IO_BACKEND *io = session->io;
+    struct libssh2_iovec iov;
+    ssize_t rc;
+
+    if(!io)
+        return session->send(session->socket_fd, buffer, length, flags,
+                             &session->abstract);
+
+    if(!(session->io_pending & LIBSSH2_SESSION_BLOCK_OUTBOUND)) {
+        iov.base = buffer;
+        iov.length = length;
+        rc = io->send(session, session->socket_fd, &iov, 1,
+                      &session->io_abstract);
+        if(rc < 0)
+            return rc;
+        session->io_pending |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
+    }
+
+    rc = io->complete(session, session->socket_fd,
+                      LIBSSH2_SESSION_BLOCK_OUTBOUND, &session->io_abstract);
+    if(rc != -EAGAIN)
+        session->io_pending &= ~LIBSSH2_SESSION_BLOCK_OUTBOUND;
+    return rc;
+}
+
 /* libssh2_ntohu32
  */
 unsigned int
@@ -610,3 +681,58 @@ int __cdecl _libssh2_gettimeofday(struct timeval *tp, void *tzp)
 
 
 #endif
+
+/*
+ * _libssh2_time_ms
+ *
+ * Return a time stamp in milliseconds. Only meant for measuring elapsed
+ * time, the starting point is unspecified. A monotonic clock is used so
+ * that timeouts aren't thrown off by the wall clock being set. Only where
+ * none is known the wall clock is used, and then it is never let go back.
+ */
+libssh2_uint64_t _libssh2_time_ms(void)
+{
+#if defined(WIN32)
+    LARGE_INTEGER count;
+    LARGE_INTEGER freq;
+
+    /* never fails on Windows XP and later */
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (libssh2_uint64_t)(count.QuadPart / freq.QuadPart) * 1000 +
+        (libssh2_uint64_t)(count.QuadPart % freq.QuadPart) * 1000 /
+        freq.QuadPart;
+#elif defined(__APPLE__) && defined(__MACH__)
+    static mach_timebase_info_data_t timebase;
+    libssh2_uint64_t ticks = mach_absolute_time();
+
+    if(!timebase.denom)
+        mach_timebase_info(&timebase);
+    /* ticks to nanoseconds in two steps, the product may overflow */
+    return (ticks / timebase.denom * timebase.numer +
+            ticks % timebase.denom * timebase.numer / timebase.denom) /
+        1000000;
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (libssh2_uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    static libssh2_uint64_t last;
+    libssh2_uint64_t now;
+#ifdef HAVE_LIBSSH2_GETTIMEOFDAY
+    struct timeval tv;
+
+    _libssh2_gettimeofday(&tv, NULL);
+    now = (libssh2_uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#else
+    now = (libssh2_uint64_t)time(NULL) * 1000;
+#endif
+    /* the elapsed times computed from it are unsigned, a clock set back
+       must not make them huge */
+    if(now < last)
+        now = last;
+    last = now;
+    return now;
+#endif
+}
@@ -91,4 +91,6 @@ int __cdecl _libssh2_gettimeofday(struct timeval *tp, void *tzp);
 #endif
 #endif
 
+libssh2_uint64_t _libssh2_time_ms(void);
+
 #endif /* _LIBSSH2_MISC_H */
@@ -183,15 +183,13 @@ _libssh2_cipher_crypt(_libssh2_cipher_ctx * ctx,
                       _libssh2_cipher_type(algo),
                       int encrypt, unsigned char *block, size_t blocksize)
 {
-    unsigned char buf[EVP_MAX_BLOCK_LENGTH];
     int ret;
     (void) algo;
     (void) encrypt;
 
-    ret = EVP_Cipher(ctx, buf, block, blocksize);
-    if (ret == 1) {
-        memcpy(block, buf, blocksize);
-    }
+    /* EVP ciphers work in place, so any number of blocks can be done
+       without a bounce buffer */
+    ret = EVP_Cipher(ctx, block, block, blocksize);
     return ret == 1 ? 0 : 1;
 }
 
@@ -268,7 +266,7 @@ aes_ctr_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out,
     size_t i = 0;
     int outlen = 0;
 
-    if (inl != 16) /* libssh2 only ever encrypt one block */
+    if (inl % AES_BLOCK_SIZE) /* libssh2 only ever encrypt whole blocks */
         return 0;
 
     if (c == NULL) {
@@ -282,18 +280,21 @@ aes_ctr_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out,
   the ciphertext block C1.  The counter X is then incremented
 */
 
-    if (EVP_EncryptUpdate(c->aes_ctx, b1, &outlen, c->ctr, AES_BLOCK_SIZE) != 1) {
-        return 0;
-    }
-
-    for (i = 0; i < 16; i++)
-        *out++ = *in++ ^ b1[i];
-
-    i = 15;
-    while (c->ctr[i]++ == 0xFF) {
-        if (i == 0)
-            break;
-        i--;
+    for (; inl; inl -= AES_BLOCK_SIZE) {
+        if (EVP_EncryptUpdate(c->aes_ctx, b1, &outlen, c->ctr,
+                              AES_BLOCK_SIZE) != 1) {
+            return 0;
+        }
+
+        for (i = 0; i < AES_BLOCK_SIZE; i++)
+            *out++ = *in++ ^ b1[i];
+
+        i = AES_BLOCK_SIZE - 1;
+        while (c->ctr[i]++ == 0xFF) {
+            if (i == 0)
+                break;
+            i--;
+        }
     }
 
     return 1;
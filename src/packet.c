@@ -175,6 +175,7 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
                         LIBSSH2_CHANNEL_WINDOW_DEFAULT;
                     channel->remote.window_size =
                         LIBSSH2_CHANNEL_WINDOW_DEFAULT;
+                    channel->window_credit = LIBSSH2_CHANNEL_WINDOW_DEFAULT;
                     channel->remote.packet_size =
                         LIBSSH2_CHANNEL_PACKET_DEFAULT;
 
@@ -221,6 +222,8 @@ packet_queue_listener(LIBSSH2_SESSION * session, unsigned char *data,
                     _libssh2_list_add(&listn->queue,
                                       &listen_state->channel->node);
                     listn->queue_size++;
+                    if(listn->poller)
+                        _libssh2_poller_wake(listn->poller, session);
 
                     listen_state->state = libssh2_NB_state_idle;
                     return 0;
@@ -325,6 +328,7 @@ packet_x11_open(LIBSSH2_SESSION * session, unsigned char *data,
             channel->remote.window_size_initial =
                 LIBSSH2_CHANNEL_WINDOW_DEFAULT;
             channel->remote.window_size = LIBSSH2_CHANNEL_WINDOW_DEFAULT;
+            channel->window_credit = LIBSSH2_CHANNEL_WINDOW_DEFAULT;
             channel->remote.packet_size = LIBSSH2_CHANNEL_PACKET_DEFAULT;
 
             channel->local.id = _libssh2_channel_nextid(session);
@@ -655,13 +659,19 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                (int) (datalen - 13));
                 session->packAdd_channelp = channelp;
 
-                /* Adjust the window based on the block we just freed */
+                /* It used up window all the same. Refund the block we just
+                   freed, queued until enough has been collected to be worth
+                   an adjust packet. */
+                if (channelp->remote.window_size > datalen - 13)
+                    channelp->remote.window_size -= datalen - 13;
+                else
+                    channelp->remote.window_size = 0;
+                _libssh2_channel_window_refund(channelp, datalen - 13);
               libssh2_packet_add_jump_point1:
                 session->packAdd_state = libssh2_NB_state_jump1;
                 rc = _libssh2_channel_receive_window_adjust(session->
                                                             packAdd_channelp,
-                                                            datalen - 13,
-                                                            1, NULL);
+                                                            0, 0, NULL);
                 if (rc == LIBSSH2_ERROR_EAGAIN)
                     return rc;
 
@@ -712,6 +722,16 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                 /* Now that we've received it, shrink our window */
                 channelp->remote.window_size -= datalen - data_head;
 
+            if (channelp->window_mode == LIBSSH2_CHANNEL_WINDOW_AUTO)
+                _libssh2_channel_window_data(channelp);
+
+            if ((msg == SSH_MSG_CHANNEL_DATA) ||
+                (channelp->remote.extended_data_ignore_mode ==
+                 LIBSSH2_CHANNEL_EXTENDED_DATA_MERGE))
+                _libssh2_channel_ready(channelp, LIBSSH2_POLLFD_POLLIN);
+            else
+                _libssh2_channel_ready(channelp, LIBSSH2_POLLFD_POLLEXT);
+
             break;
 
             /*
@@ -734,6 +754,7 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                                channelp->local.id,
                                channelp->remote.id);
                 channelp->remote.eof = 1;
+                _libssh2_channel_ready(channelp, LIBSSH2_POLLFD_POLLHUP);
             }
             LIBSSH2_FREE(session, data);
             session->packAdd_state = libssh2_NB_state_idle;
@@ -852,6 +873,8 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
 
             channelp->remote.close = 1;
             channelp->remote.eof = 1;
+            _libssh2_channel_ready(channelp, LIBSSH2_POLLFD_POLLHUP |
+                                   LIBSSH2_POLLFD_CHANNEL_CLOSED);
 
             LIBSSH2_FREE(session, data);
             session->packAdd_state = libssh2_NB_state_idle;
@@ -918,6 +941,10 @@ _libssh2_packet_add(LIBSSH2_SESSION * session, unsigned char *data,
                     _libssh2_channel_locate(session,
                                             _libssh2_ntohu32(data + 1));
                 if(channelp) {
+                    if(!channelp->local.window_size && bytestoadd)
+                        /* the channel was blocked on the window */
+                        _libssh2_channel_ready(channelp,
+                                               LIBSSH2_POLLFD_POLLOUT);
                     channelp->local.window_size += bytestoadd;
 
                     _libssh2_debug(session, LIBSSH2_TRACE_CONN,
@@ -1038,8 +1065,8 @@ _libssh2_packet_ask(LIBSSH2_SESSION * session, unsigned char packet_type,
 /*
  * libssh2_packet_askv
  *
- * Scan for any of a list of packet types in the brigade, optionally poll the
- * socket for a packet first
+ * Scan for the first packet, in the order they arrived, of any of a list of
+ * packet types in the brigade
  */
 int
 _libssh2_packet_askv(LIBSSH2_SESSION * session,
@@ -1049,14 +1076,26 @@ _libssh2_packet_askv(LIBSSH2_SESSION * session,
                      const unsigned char *match_buf,
                      size_t match_len)
 {
-    int i, packet_types_len = strlen((char *) packet_types);
+    LIBSSH2_PACKET *packet = _libssh2_list_first(&session->packets);
+
+    while (packet) {
+        if (packet->data[0]
+            && strchr((char *) packet_types, packet->data[0])
+            && (packet->data_len >= (match_ofs + match_len))
+            && (!match_buf ||
+                (memcmp(packet->data + match_ofs, match_buf,
+                        match_len) == 0))) {
+            *data = packet->data;
+            *data_len = packet->data_len;
+
+            /* unlink struct from session->packets */
+            _libssh2_list_remove(&packet->node);
+
+            LIBSSH2_FREE(session, packet);
 
-    for(i = 0; i < packet_types_len; i++) {
-        if (0 == _libssh2_packet_ask(session, packet_types[i], data,
-                                     data_len, match_ofs,
-                                     match_buf, match_len)) {
             return 0;
         }
+        packet = _libssh2_list_next(&packet->node);
     }
 
     return -1;
@@ -1087,7 +1126,7 @@ _libssh2_packet_require(LIBSSH2_SESSION * session, unsigned char packet_type,
             return 0;
         }
 
-        state->start = time(NULL);
+        state->start = _libssh2_time_ms();
     }
 
     while (session->socket_state == LIBSSH2_SOCKET_CONNECTED) {
@@ -1106,8 +1145,8 @@ _libssh2_packet_require(LIBSSH2_SESSION * session, unsigned char packet_type,
             return ret;
         } else if (ret == 0) {
             /* nothing available, wait until data arrives or we time out */
-            long left = LIBSSH2_READ_TIMEOUT - (long)(time(NULL) -
-                                                      state->start);
+            long left = LIBSSH2_READ_TIMEOUT * 1000 -
+                (long)(_libssh2_time_ms() - state->start);
 
             if (left <= 0) {
                 state->start = 0;
@@ -1206,7 +1245,7 @@ _libssh2_packet_requirev(LIBSSH2_SESSION *session,
     }
 
     if (state->start == 0) {
-        state->start = time(NULL);
+        state->start = _libssh2_time_ms();
     }
 
     while (session->socket_state != LIBSSH2_SOCKET_DISCONNECTED) {
@@ -1216,8 +1255,8 @@ _libssh2_packet_requirev(LIBSSH2_SESSION *session,
             return ret;
         }
         if (ret <= 0) {
-            long left = LIBSSH2_READ_TIMEOUT -
-                (long)(time(NULL) - state->start);
+            long left = LIBSSH2_READ_TIMEOUT * 1000 -
+                (long)(_libssh2_time_ms() - state->start);
 
             if (left <= 0) {
                 state->start = 0;
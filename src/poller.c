@@ -0,0 +1,1258 @@
+/* Copyright (c) 2026 The libssh2 project and its contributors.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+#include "libssh2_priv.h"
+#include "transport.h"
+#include "channel.h"
+#include "session.h"
+
+#include <errno.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+/*
+ * A poller keeps a persistent set of sockets, channels and listeners to
+ * wait for. Every distinct socket is only watched once, no matter how many
+ * channels and listeners share it, and with epoll the registration with the
+ * kernel is only updated when the set changes.
+ *
+ * Channel readiness is taken from the events that packet_add records for
+ * each channel (see _libssh2_channel_ready), so data that is already
+ * buffered inside a session is reported without touching the socket and
+ * without looking at channels that have nothing to report.
+ *
+ * A session can be added as well, for driving any non-blocking call rather
+ * than channel I/O: it is reported when its socket is ready in the
+ * direction the call last blocked on. Such a socket is not read from by the
+ * poller unless channels or listeners of the session are added too, so the
+ * call finds its data where it expects it, even during the handshake.
+ *
+ * Sockets are found by descriptor through a hash index, and channels,
+ * listeners and sessions know their entry, so adding and removing is O(1).
+ * Two lists of socket indexes keep the rest of the work proportional to
+ * what happens rather than to the size of the set: the ready list holds the
+ * sockets with something to report, filled from what the OS returned and
+ * from the channel and listener events recorded in between, and the rearm
+ * list holds the sockets whose session got blocked in a direction since
+ * the last wait (see _libssh2_session_block). A wanted direction that went
+ * away is noticed when the OS reports it. A poller can thus carry many
+ * thousands of sessions. A poller is not shared between threads: to spread
+ * sessions over several cores, run one poller per thread with its own
+ * partition of the sessions.
+ */
+
+/* the socket index lists */
+#define POLLER_READY 0  /* something to report */
+#define POLLER_REARM 1  /* update the events asked for from the OS */
+
+struct poller_socket {
+    libssh2_socket_t fd;
+    LIBSSH2_SESSION *session;   /* NULL for plain sockets */
+    unsigned long events;       /* LIBSSH2_POLLFD_* wanted for plain sockets */
+    unsigned long watched;      /* LIBSSH2_POLLFD_* asked for from the OS */
+    unsigned long revents;      /* LIBSSH2_POLLFD_* returned by the OS */
+    unsigned int refs;          /* number of entries using this socket */
+    unsigned int next;          /* hash chain: index + 1, 0 ends it */
+    unsigned int pos[2];        /* place in the index lists + 1, 0 if not */
+    unsigned int socket_entry;  /* entry of the plain socket + 1 */
+
+    int session_entry;              /* the session itself is added */
+    unsigned long session_events;   /* events member of that entry */
+    unsigned long session_revents;  /* LIBSSH2_POLLFD_* to report for it */
+};
+
+struct _LIBSSH2_POLLER
+{
+    LIBSSH2_SESSION *session;   /* the session memory is allocated with */
+
+    LIBSSH2_POLLFD *entries;
+    unsigned int num_entries;
+    unsigned int max_entries;
+
+    struct poller_socket *sockets;
+    unsigned int num_sockets;
+    unsigned int max_sockets;
+    unsigned int *hash;         /* max_sockets buckets of index + 1 */
+    unsigned int *list[2];      /* max_sockets socket indexes each */
+    unsigned int list_len[2];
+
+#ifdef HAVE_SYS_EPOLL_H
+    int epfd;
+    struct epoll_event *epevents;
+#elif defined(HAVE_POLL)
+    struct pollfd *pollfds;
+#endif
+};
+
+/* the OS level events of interest */
+#define POLLER_OS_EVENTS (LIBSSH2_POLLFD_POLLIN | LIBSSH2_POLLFD_POLLPRI | \
+                          LIBSSH2_POLLFD_POLLOUT)
+
+/* the events a channel can be waited for */
+#define POLLER_CHANNEL_EVENTS (LIBSSH2_POLLFD_POLLIN | \
+                               LIBSSH2_POLLFD_POLLEXT | \
+                               LIBSSH2_POLLFD_POLLOUT)
+
+/* reported for channels whether asked for or not */
+#define POLLER_CHANNEL_ALWAYS (LIBSSH2_POLLFD_POLLHUP | \
+                               LIBSSH2_POLLFD_CHANNEL_CLOSED)
+
+static LIBSSH2_SESSION *
+entry_session(const LIBSSH2_POLLFD *entry)
+{
+    switch(entry->type) {
+    case LIBSSH2_POLLFD_CHANNEL:
+        return entry->fd.channel->session;
+    case LIBSSH2_POLLFD_LISTENER:
+        return entry->fd.listener->session;
+    case LIBSSH2_POLLFD_SESSION:
+        return entry->fd.session;
+    default:
+        return NULL;
+    }
+}
+
+static libssh2_socket_t
+entry_socket(const LIBSSH2_POLLFD *entry)
+{
+    LIBSSH2_SESSION *session = entry_session(entry);
+
+    return session?session->socket_fd:entry->fd.socket;
+}
+
+#if !defined(HAVE_SYS_EPOLL_H) && !defined(HAVE_POLL) && defined(HAVE_SELECT)
+#define POLLER_SELECT 1
+#endif
+
+/* how poller_watch() should tell the OS */
+#define WATCH_UPDATE  0 /* only if the events changed */
+#define WATCH_ADD     1 /* new socket */
+#define WATCH_REINDEX 2 /* socket moved to another index */
+
+/*
+ * socket_wanted
+ *
+ * The events to wait for on a socket: what was asked for plain sockets, and
+ * for sessions incoming data when channels or listeners are added, plus the
+ * directions the session is blocked on.
+ */
+static unsigned long
+socket_wanted(const struct poller_socket *sock)
+{
+    unsigned long events = sock->events & POLLER_OS_EVENTS;
+
+    if(sock->session) {
+        int dir = sock->session->socket_block_directions;
+
+        if((sock->refs > (unsigned int)sock->session_entry) ||
+           (dir & LIBSSH2_SESSION_BLOCK_INBOUND))
+            events |= LIBSSH2_POLLFD_POLLIN;
+        if(dir & LIBSSH2_SESSION_BLOCK_OUTBOUND)
+            events |= LIBSSH2_POLLFD_POLLOUT;
+    }
+    return events;
+}
+
+/* max_sockets is always a power of two */
+#define POLLER_HASH(poller, fd) \
+    ((unsigned int)(fd) & ((poller)->max_sockets - 1))
+
+/*
+ * poller_socket_find
+ *
+ * Return the index of socket 'fd', or -1 if it isn't watched.
+ */
+static int
+poller_socket_find(LIBSSH2_POLLER *poller, libssh2_socket_t fd)
+{
+    unsigned int i;
+
+    if(!poller->num_sockets)
+        return -1;
+
+    for(i = poller->hash[POLLER_HASH(poller, fd)]; i;
+        i = poller->sockets[i - 1].next) {
+        if(poller->sockets[i - 1].fd == fd)
+            return (int)(i - 1);
+    }
+    return -1;
+}
+
+/*
+ * poller_hash_link / poller_hash_unlink
+ *
+ * Add or remove socket 'index' to or from the hash index.
+ */
+static void
+poller_hash_link(LIBSSH2_POLLER *poller, unsigned int index)
+{
+    unsigned int *bucket =
+        &poller->hash[POLLER_HASH(poller, poller->sockets[index].fd)];
+
+    poller->sockets[index].next = *bucket;
+    *bucket = index + 1;
+}
+
+static void
+poller_hash_unlink(LIBSSH2_POLLER *poller, unsigned int index)
+{
+    unsigned int *link =
+        &poller->hash[POLLER_HASH(poller, poller->sockets[index].fd)];
+
+    while(*link != index + 1)
+        link = &poller->sockets[*link - 1].next;
+    *link = poller->sockets[index].next;
+}
+
+/*
+ * poller_list_add / poller_list_remove
+ *
+ * Add or remove socket 'index' to or from one of the index lists.
+ */
+static void
+poller_list_add(LIBSSH2_POLLER *poller, int which, unsigned int index)
+{
+    struct poller_socket *sock = &poller->sockets[index];
+
+    if(!sock->pos[which]) {
+        poller->list[which][poller->list_len[which]++] = index;
+        sock->pos[which] = poller->list_len[which];
+    }
+}
+
+static void
+poller_list_remove(LIBSSH2_POLLER *poller, int which, unsigned int index)
+{
+    unsigned int pos = poller->sockets[index].pos[which];
+    unsigned int last;
+
+    if(!pos)
+        return;
+    poller->sockets[index].pos[which] = 0;
+
+    /* move the last one into the hole */
+    last = poller->list[which][--poller->list_len[which]];
+    if(last != index) {
+        poller->list[which][pos - 1] = last;
+        poller->sockets[last].pos[which] = pos;
+    }
+}
+
+/*
+ * poller_watch
+ *
+ * Tell the OS which events to wait for on socket 'index'.
+ */
+static int
+poller_watch(LIBSSH2_POLLER *poller, unsigned int index,
+             unsigned long events, int how)
+{
+    struct poller_socket *sock = &poller->sockets[index];
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+
+    if((how == WATCH_UPDATE) && (events == sock->watched))
+        return 0;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((events & LIBSSH2_POLLFD_POLLIN)?EPOLLIN:0) |
+        ((events & LIBSSH2_POLLFD_POLLPRI)?EPOLLPRI:0) |
+        ((events & LIBSSH2_POLLFD_POLLOUT)?EPOLLOUT:0);
+    ev.data.u32 = index;
+
+    if(epoll_ctl(poller->epfd, (how == WATCH_ADD)?EPOLL_CTL_ADD:EPOLL_CTL_MOD,
+                 sock->fd, &ev))
+        return -1;
+#elif defined(HAVE_POLL)
+    poller->pollfds[index].fd = sock->fd;
+    poller->pollfds[index].events =
+        ((events & LIBSSH2_POLLFD_POLLIN)?POLLIN:0) |
+        ((events & LIBSSH2_POLLFD_POLLPRI)?POLLPRI:0) |
+        ((events & LIBSSH2_POLLFD_POLLOUT)?POLLOUT:0);
+    poller->pollfds[index].revents = 0;
+    (void)how;
+#else
+    (void)how;
+#endif
+    sock->watched = events;
+    return 0;
+}
+
+/*
+ * poller_socket_add
+ *
+ * Find or add the socket used by 'entry' and take a reference to it.
+ */
+static int
+poller_socket_add(LIBSSH2_POLLER *poller, const LIBSSH2_POLLFD *entry)
+{
+    LIBSSH2_SESSION *session = entry_session(entry);
+    libssh2_socket_t fd = entry_socket(entry);
+    struct poller_socket *sock;
+    unsigned int i;
+    int index = poller_socket_find(poller, fd);
+
+    if(index >= 0) {
+        sock = &poller->sockets[index];
+        if(session && !sock->session) {
+            sock->session = session;
+            session->watcher = poller;
+        }
+        else if(!session)
+            sock->events |= entry->events;
+        if(entry->type == LIBSSH2_POLLFD_SESSION) {
+            sock->session_entry = 1;
+            sock->session_events = entry->events;
+        }
+        sock->refs++;
+        return poller_watch(poller, index, socket_wanted(sock),
+                            WATCH_UPDATE);
+    }
+
+    if(poller->num_sockets == poller->max_sockets) {
+        unsigned int max = poller->max_sockets?poller->max_sockets * 2:16;
+        void *ptr = LIBSSH2_REALLOC(poller->session, poller->sockets,
+                                    max * sizeof(struct poller_socket));
+        if(!ptr)
+            return -1;
+        poller->sockets = ptr;
+
+        ptr = LIBSSH2_REALLOC(poller->session, poller->hash,
+                              max * sizeof(unsigned int));
+        if(!ptr)
+            return -1;
+        poller->hash = ptr;
+
+        for(i = 0; i < 2; i++) {
+            ptr = LIBSSH2_REALLOC(poller->session, poller->list[i],
+                                  max * sizeof(unsigned int));
+            if(!ptr)
+                return -1;
+            poller->list[i] = ptr;
+        }
+
+#ifdef HAVE_SYS_EPOLL_H
+        ptr = LIBSSH2_REALLOC(poller->session, poller->epevents,
+                              max * sizeof(struct epoll_event));
+        if(!ptr)
+            return -1;
+        poller->epevents = ptr;
+#elif defined(HAVE_POLL)
+        ptr = LIBSSH2_REALLOC(poller->session, poller->pollfds,
+                              max * sizeof(struct pollfd));
+        if(!ptr)
+            return -1;
+        poller->pollfds = ptr;
+#endif
+        poller->max_sockets = max;
+
+        /* the bucket count changed, spread the sockets again */
+        memset(poller->hash, 0, max * sizeof(unsigned int));
+        for(i = 0; i < poller->num_sockets; i++)
+            poller_hash_link(poller, i);
+    }
+
+    sock = &poller->sockets[poller->num_sockets];
+    memset(sock, 0, sizeof(*sock));
+    sock->fd = fd;
+    sock->session = session;
+    sock->events = session?0:entry->events;
+    sock->refs = 1;
+    if(entry->type == LIBSSH2_POLLFD_SESSION) {
+        sock->session_entry = 1;
+        sock->session_events = entry->events;
+    }
+
+    if(poller_watch(poller, poller->num_sockets, socket_wanted(sock),
+                    WATCH_ADD))
+        return -1;
+
+    poller_hash_link(poller, poller->num_sockets);
+    poller->num_sockets++;
+    if(session)
+        session->watcher = poller;
+    return 0;
+}
+
+/*
+ * poller_socket_release
+ *
+ * Drop a reference to the socket used by 'entry', forgetting about the
+ * socket when nothing uses it anymore.
+ */
+static void
+poller_socket_release(LIBSSH2_POLLER *poller, const LIBSSH2_POLLFD *entry)
+{
+    libssh2_socket_t fd = entry_socket(entry);
+    int index = poller_socket_find(poller, fd);
+    unsigned int i;
+    unsigned int last;
+
+    if(index < 0)
+        return;
+    i = (unsigned int)index;
+
+    if(entry->type == LIBSSH2_POLLFD_SESSION) {
+        poller->sockets[i].session_entry = 0;
+        poller->sockets[i].session_revents = 0;
+    }
+
+    if(--poller->sockets[i].refs)
+        return;
+
+    if(poller->sockets[i].session &&
+       (poller->sockets[i].session->watcher == poller))
+        poller->sockets[i].session->watcher = NULL;
+    poller_list_remove(poller, POLLER_READY, i);
+    poller_list_remove(poller, POLLER_REARM, i);
+
+#ifdef HAVE_SYS_EPOLL_H
+    {
+        struct epoll_event ev; /* non-NULL for kernels before 2.6.9 */
+        epoll_ctl(poller->epfd, EPOLL_CTL_DEL, fd, &ev);
+    }
+#endif
+
+    /* move the last one into the hole */
+    poller_hash_unlink(poller, i);
+    last = --poller->num_sockets;
+    if(i != last) {
+        struct poller_socket *sock = &poller->sockets[i];
+
+        poller_hash_unlink(poller, last);
+        *sock = poller->sockets[last];
+        poller_hash_link(poller, i);
+        poller_watch(poller, i, sock->watched, WATCH_REINDEX);
+        if(sock->pos[POLLER_READY])
+            poller->list[POLLER_READY][sock->pos[POLLER_READY] - 1] = i;
+        if(sock->pos[POLLER_REARM])
+            poller->list[POLLER_REARM][sock->pos[POLLER_REARM] - 1] = i;
+    }
+}
+
+/*
+ * libssh2_poller_init
+ *
+ * Create a poller. Memory is allocated with the given session's allocator.
+ */
+LIBSSH2_API LIBSSH2_POLLER *
+libssh2_poller_init(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_POLLER *poller;
+
+    if(!session)
+        return NULL;
+
+    poller = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_POLLER));
+    if(!poller) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for poller");
+        return NULL;
+    }
+    memset(poller, 0, sizeof(LIBSSH2_POLLER));
+    poller->session = session;
+
+#ifdef HAVE_SYS_EPOLL_H
+    poller->epfd = epoll_create(16);
+    if(poller->epfd == -1) {
+        LIBSSH2_FREE(session, poller);
+        _libssh2_error(session, LIBSSH2_ERROR_SOCKET_NONE,
+                       "Unable to create epoll instance");
+        return NULL;
+    }
+#endif
+
+    return poller;
+}
+
+/*
+ * poller_entry_moved
+ *
+ * Tell the channel, listener, session or socket of entry 'i' where it is.
+ */
+static void
+poller_entry_moved(LIBSSH2_POLLER *poller, unsigned int i)
+{
+    LIBSSH2_POLLFD *entry = &poller->entries[i];
+    int index;
+
+    switch(entry->type) {
+    case LIBSSH2_POLLFD_CHANNEL:
+        entry->fd.channel->poller_index = i + 1;
+        break;
+    case LIBSSH2_POLLFD_LISTENER:
+        entry->fd.listener->poller_index = i + 1;
+        break;
+    case LIBSSH2_POLLFD_SESSION:
+        entry->fd.session->poller_index = i + 1;
+        break;
+    case LIBSSH2_POLLFD_SOCKET:
+        index = poller_socket_find(poller, entry->fd.socket);
+        if(index >= 0)
+            poller->sockets[index].socket_entry = i + 1;
+        break;
+    }
+}
+
+/*
+ * libssh2_poller_add
+ *
+ * Add a socket, channel, listener or session to the poller. Channels that
+ * already have something to report will be reported by the next wait.
+ */
+LIBSSH2_API int
+libssh2_poller_add(LIBSSH2_POLLER *poller, const LIBSSH2_POLLFD *fd)
+{
+    LIBSSH2_POLLFD *entry;
+    LIBSSH2_CHANNEL *channel;
+
+    if(!poller || !fd)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    switch(fd->type) {
+    case LIBSSH2_POLLFD_SOCKET:
+        break;
+    case LIBSSH2_POLLFD_CHANNEL:
+        if(fd->fd.channel->poller)
+            return _libssh2_error(poller->session, LIBSSH2_ERROR_BAD_USE,
+                                  "Channel already added to a poller");
+        break;
+    case LIBSSH2_POLLFD_LISTENER:
+        if(fd->fd.listener->poller)
+            return _libssh2_error(poller->session, LIBSSH2_ERROR_BAD_USE,
+                                  "Listener already added to a poller");
+        break;
+    case LIBSSH2_POLLFD_SESSION:
+        if(fd->fd.session->poller)
+            return _libssh2_error(poller->session, LIBSSH2_ERROR_BAD_USE,
+                                  "Session already added to a poller");
+        break;
+    default:
+        return _libssh2_error(poller->session,
+                              LIBSSH2_ERROR_INVALID_POLL_TYPE,
+                              "Invalid descriptor passed to poller");
+    }
+
+    if(poller->num_entries == poller->max_entries) {
+        unsigned int max = poller->max_entries?poller->max_entries * 2:16;
+        void *ptr = LIBSSH2_REALLOC(poller->session, poller->entries,
+                                    max * sizeof(LIBSSH2_POLLFD));
+        if(!ptr)
+            return _libssh2_error(poller->session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for poller");
+        poller->entries = ptr;
+        poller->max_entries = max;
+    }
+
+#ifdef POLLER_SELECT
+    /* an fd_set only has room for FD_SETSIZE sockets */
+    if(poller_socket_find(poller, entry_socket(fd)) < 0) {
+#ifdef WIN32
+        if(poller->num_sockets >= FD_SETSIZE)
+#else
+        if(entry_socket(fd) >= FD_SETSIZE)
+#endif
+            return _libssh2_error(poller->session, LIBSSH2_ERROR_SOCKET_NONE,
+                                  "Socket out of range for select()");
+    }
+#endif
+
+    if(poller_socket_add(poller, fd))
+        return _libssh2_error(poller->session, LIBSSH2_ERROR_SOCKET_NONE,
+                              "Unable to watch socket");
+
+    entry = &poller->entries[poller->num_entries++];
+    *entry = *fd;
+    entry->revents = 0;
+    poller_entry_moved(poller, poller->num_entries - 1);
+
+    switch(fd->type) {
+    case LIBSSH2_POLLFD_CHANNEL:
+        channel = fd->fd.channel;
+        channel->poller = poller;
+        channel->poller_events = fd->events;
+
+        /* report whatever is already known about the channel */
+        if(libssh2_poll_channel_read(channel, 0))
+            _libssh2_channel_ready(channel, LIBSSH2_POLLFD_POLLIN);
+        if(libssh2_poll_channel_read(channel, 1))
+            _libssh2_channel_ready(channel, LIBSSH2_POLLFD_POLLEXT);
+        if(channel->local.window_size)
+            _libssh2_channel_ready(channel, LIBSSH2_POLLFD_POLLOUT);
+        if(channel->remote.eof)
+            _libssh2_channel_ready(channel, LIBSSH2_POLLFD_POLLHUP);
+        if(channel->remote.close)
+            _libssh2_channel_ready(channel, LIBSSH2_POLLFD_CHANNEL_CLOSED);
+        break;
+
+    case LIBSSH2_POLLFD_LISTENER:
+        fd->fd.listener->poller = poller;
+        if(_libssh2_list_first(&fd->fd.listener->queue))
+            _libssh2_poller_wake(poller, fd->fd.listener->session);
+        break;
+
+    case LIBSSH2_POLLFD_SESSION:
+        fd->fd.session->poller = poller;
+        break;
+    }
+
+    return 0;
+}
+
+/*
+ * poller_entry_detach
+ *
+ * Make the channel, listener or session of an entry forget the poller.
+ */
+static void
+poller_entry_detach(LIBSSH2_POLLFD *entry)
+{
+    switch(entry->type) {
+    case LIBSSH2_POLLFD_CHANNEL:
+        entry->fd.channel->poller = NULL;
+        entry->fd.channel->poller_events = 0;
+        entry->fd.channel->poller_index = 0;
+        break;
+    case LIBSSH2_POLLFD_LISTENER:
+        entry->fd.listener->poller = NULL;
+        entry->fd.listener->poller_index = 0;
+        break;
+    case LIBSSH2_POLLFD_SESSION:
+        entry->fd.session->poller = NULL;
+        entry->fd.session->poller_index = 0;
+        break;
+    }
+}
+
+/*
+ * poller_remove_entry
+ *
+ * Drop entry 'i' from the poller.
+ */
+static void
+poller_remove_entry(LIBSSH2_POLLER *poller, unsigned int i)
+{
+    LIBSSH2_POLLFD *entry = &poller->entries[i];
+
+    poller_entry_detach(entry);
+    poller_socket_release(poller, entry);
+
+    /* move the last one into the hole */
+    if(i != --poller->num_entries) {
+        poller->entries[i] = poller->entries[poller->num_entries];
+        poller_entry_moved(poller, i);
+    }
+}
+
+/*
+ * libssh2_poller_remove
+ *
+ * Remove a socket, channel, listener or session from the poller.
+ */
+LIBSSH2_API int
+libssh2_poller_remove(LIBSSH2_POLLER *poller, const LIBSSH2_POLLFD *fd)
+{
+    unsigned int i = 0;
+    int index;
+
+    if(!poller || !fd)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    switch(fd->type) {
+    case LIBSSH2_POLLFD_CHANNEL:
+        if(fd->fd.channel->poller == poller)
+            i = fd->fd.channel->poller_index;
+        break;
+    case LIBSSH2_POLLFD_LISTENER:
+        if(fd->fd.listener->poller == poller)
+            i = fd->fd.listener->poller_index;
+        break;
+    case LIBSSH2_POLLFD_SESSION:
+        if(fd->fd.session->poller == poller)
+            i = fd->fd.session->poller_index;
+        break;
+    case LIBSSH2_POLLFD_SOCKET:
+        index = poller_socket_find(poller, fd->fd.socket);
+        if(index < 0)
+            break;
+        i = poller->sockets[index].socket_entry;
+        if(i && (poller->entries[i - 1].type == LIBSSH2_POLLFD_SOCKET) &&
+           (poller->entries[i - 1].fd.socket == fd->fd.socket))
+            break;
+
+        /* the same socket was added more than once */
+        for(i = poller->num_entries; i; i--) {
+            if((poller->entries[i - 1].type == LIBSSH2_POLLFD_SOCKET) &&
+               (poller->entries[i - 1].fd.socket == fd->fd.socket))
+                break;
+        }
+        break;
+    }
+
+    if(!i)
+        return _libssh2_error(poller->session, LIBSSH2_ERROR_INVAL,
+                              "Descriptor not added to poller");
+
+    poller_remove_entry(poller, i - 1);
+    return 0;
+}
+
+/*
+ * _libssh2_poller_forget_channel
+ *
+ * The channel is being freed, make sure the poller doesn't keep it.
+ */
+void
+_libssh2_poller_forget_channel(LIBSSH2_CHANNEL *channel)
+{
+    poller_remove_entry(channel->poller, channel->poller_index - 1);
+}
+
+/*
+ * _libssh2_poller_forget_session
+ *
+ * The session is being freed, make sure the poller doesn't keep it.
+ */
+void
+_libssh2_poller_forget_session(LIBSSH2_SESSION *session)
+{
+    poller_remove_entry(session->poller, session->poller_index - 1);
+}
+
+/*
+ * _libssh2_poller_forget_listener
+ *
+ * The listener is being freed, make sure the poller doesn't keep it.
+ */
+void
+_libssh2_poller_forget_listener(LIBSSH2_LISTENER *listener)
+{
+    poller_remove_entry(listener->poller, listener->poller_index - 1);
+}
+
+/*
+ * _libssh2_poller_wake
+ *
+ * Something of the session's socket has become ready without the OS being
+ * involved: a channel event was recorded or a listener queued a connection.
+ * Have the next wait look at the socket.
+ */
+void
+_libssh2_poller_wake(LIBSSH2_POLLER *poller, LIBSSH2_SESSION *session)
+{
+    int index = poller_socket_find(poller, session->socket_fd);
+
+    if(index >= 0)
+        poller_list_add(poller, POLLER_READY, (unsigned int)index);
+}
+
+/*
+ * _libssh2_poller_rearm
+ *
+ * The session got blocked in a direction, have the next wait update what
+ * it asks the OS for on the session's socket.
+ */
+void
+_libssh2_poller_rearm(LIBSSH2_POLLER *poller, LIBSSH2_SESSION *session)
+{
+    int index = poller_socket_find(poller, session->socket_fd);
+
+    if(index >= 0)
+        poller_list_add(poller, POLLER_REARM, (unsigned int)index);
+}
+
+/*
+ * poller_collect_session
+ *
+ * Fill in 'fds' with what there is to report for a session's socket: the
+ * session itself, its channels with events queued and its listeners with
+ * pending connections. Sets '*more' if the socket has to be looked at again
+ * by the next wait.
+ */
+static unsigned int
+poller_collect_session(LIBSSH2_POLLER *poller, struct poller_socket *sock,
+                       LIBSSH2_POLLFD *fds, unsigned int nfds, int *more)
+{
+    LIBSSH2_SESSION *session = sock->session;
+    LIBSSH2_LISTENER *listener;
+    struct list_node *node;
+    struct list_node *next;
+    unsigned int count = 0;
+
+    if(sock->session_revents) {
+        fds[count].type = LIBSSH2_POLLFD_SESSION;
+        fds[count].fd.session = session;
+        fds[count].events = sock->session_events;
+        fds[count].revents = sock->session_revents;
+        sock->session_revents = 0;
+        count++;
+    }
+
+    for(node = _libssh2_list_first(&session->ready_channels); node;
+        node = next) {
+        LIBSSH2_CHANNEL *channel = (LIBSSH2_CHANNEL *)
+            ((char *)node - offsetof(LIBSSH2_CHANNEL, ready_node));
+        unsigned long mask;
+
+        next = _libssh2_list_next(node);
+
+        if(channel->poller != poller)
+            /* leave it for libssh2_transport_read() */
+            continue;
+
+        if(count == nfds) {
+            *more = 1;
+            return count;
+        }
+
+        mask = (channel->poller_events & POLLER_CHANNEL_EVENTS) |
+            POLLER_CHANNEL_ALWAYS;
+
+        if(channel->ready_events & mask) {
+            fds[count].type = LIBSSH2_POLLFD_CHANNEL;
+            fds[count].fd.channel = channel;
+            fds[count].events = channel->poller_events;
+            fds[count].revents = channel->ready_events & mask;
+            count++;
+        }
+
+        /* events nobody asked for are dropped too, they would otherwise
+           keep the channel in the list forever */
+        channel->ready_events = 0;
+        _libssh2_list_remove(node);
+    }
+
+    /* listeners are reported for as long as connections are waiting */
+    for(listener = _libssh2_list_first(&session->listeners); listener;
+        listener = _libssh2_list_next(&listener->node)) {
+        if((listener->poller != poller) ||
+           !_libssh2_list_first(&listener->queue))
+            continue;
+
+        *more = 1;
+        if(count == nfds)
+            break;
+        fds[count] = poller->entries[listener->poller_index - 1];
+        fds[count].revents = LIBSSH2_POLLFD_POLLIN;
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * poller_collect
+ *
+ * Fill in 'fds' with the libssh2 level events of the sockets on the ready
+ * list: channel events queued in the sessions, pending listener
+ * connections, and the socket and session events returned by the OS.
+ */
+static unsigned int
+poller_collect(LIBSSH2_POLLER *poller, LIBSSH2_POLLFD *fds,
+               unsigned int nfds)
+{
+    unsigned int count = 0;
+    unsigned int k;
+
+    /* backwards, so that removing the current one only moves sockets that
+       have been looked at already */
+    for(k = poller->list_len[POLLER_READY]; k && (count < nfds); k--) {
+        unsigned int index = poller->list[POLLER_READY][k - 1];
+        struct poller_socket *sock = &poller->sockets[index];
+        int more = 0;
+
+        if(sock->session)
+            count += poller_collect_session(poller, sock, &fds[count],
+                                            nfds - count, &more);
+        else if(sock->revents) {
+            fds[count].type = LIBSSH2_POLLFD_SOCKET;
+            fds[count].fd.socket = sock->fd;
+            fds[count].events = sock->events;
+            fds[count].revents = sock->revents;
+            sock->revents = 0;
+            count++;
+        }
+
+        if(!more)
+            poller_list_remove(poller, POLLER_READY, index);
+    }
+
+    return count;
+}
+
+/*
+ * poller_session_event
+ *
+ * The session's socket is readable or writable: process the incoming data
+ * so that channel events are recorded, and wake up the channels waiting for
+ * the socket to drain. Only the session itself is told when nothing else of
+ * it is added, its pending call will do the reading.
+ *
+ * Returns 1 if the event was only for a direction that is no longer waited
+ * for, which stops the OS from reporting it again.
+ */
+static int
+poller_session_event(LIBSSH2_POLLER *poller, unsigned int index)
+{
+    struct poller_socket *sock = &poller->sockets[index];
+    LIBSSH2_SESSION *session = sock->session;
+    LIBSSH2_CHANNEL *channel;
+    unsigned long events = 0;
+    unsigned long wanted;
+    int dir;
+    int rc = 0;
+
+    /* other threads may be using the session's channels */
+    _libssh2_session_lock(session);
+
+    /* zerocopy completion notices flag the socket with an error */
+    if(_libssh2_transport_zerocopy_reap(session))
+        sock->revents &= ~LIBSSH2_POLLFD_POLLERR;
+
+    wanted = socket_wanted(sock);
+    if(wanted != sock->watched)
+        poller_watch(poller, index, wanted, WATCH_UPDATE);
+
+    if(!(sock->revents & (wanted | LIBSSH2_POLLFD_POLLERR |
+                          LIBSSH2_POLLFD_POLLHUP | LIBSSH2_POLLFD_POLLNVAL))) {
+        sock->revents = 0;
+        _libssh2_session_unlock(session);
+        return 1;
+    }
+
+    dir = session->socket_block_directions;
+    if(sock->session_entry) {
+        unsigned long blocked =
+            ((dir & LIBSSH2_SESSION_BLOCK_INBOUND)?LIBSSH2_POLLFD_POLLIN:0) |
+            ((dir & LIBSSH2_SESSION_BLOCK_OUTBOUND)?LIBSSH2_POLLFD_POLLOUT:0);
+
+        sock->session_revents |= sock->revents &
+            (blocked | LIBSSH2_POLLFD_POLLERR | LIBSSH2_POLLFD_POLLHUP |
+             LIBSSH2_POLLFD_POLLNVAL);
+        if(sock->session_revents)
+            poller_list_add(poller, POLLER_READY, index);
+    }
+
+    if(sock->refs == (unsigned int)sock->session_entry) {
+        sock->revents = 0;
+        _libssh2_session_unlock(session);
+        return 0;
+    }
+
+    if(sock->revents & (LIBSSH2_POLLFD_POLLIN | LIBSSH2_POLLFD_POLLERR |
+                        LIBSSH2_POLLFD_POLLHUP)) {
+        do {
+            rc = _libssh2_transport_read(session);
+        } while(rc > 0);
+    }
+
+    if((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN) && sock->session_entry) {
+        sock->session_revents |= LIBSSH2_POLLFD_SESSION_CLOSED;
+        poller_list_add(poller, POLLER_READY, index);
+    }
+
+    if((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+        /* the session is dead, tell every channel on it */
+        events = LIBSSH2_POLLFD_SESSION_CLOSED;
+    else if((sock->revents & LIBSSH2_POLLFD_POLLOUT) &&
+            (dir & LIBSSH2_SESSION_BLOCK_OUTBOUND))
+        /* the socket had been full, writes may succeed again */
+        events = LIBSSH2_POLLFD_POLLOUT;
+
+    if(events) {
+        for(channel = _libssh2_list_first(&session->channels); channel;
+            channel = _libssh2_list_next(&channel->node)) {
+            if((channel->poller == poller) &&
+               ((events != LIBSSH2_POLLFD_POLLOUT) ||
+                channel->local.window_size))
+                _libssh2_channel_ready(channel, events);
+        }
+    }
+
+    sock->revents = 0;
+    _libssh2_session_unlock(session);
+    return 0;
+}
+
+/*
+ * poller_socket_event
+ *
+ * Handle what the OS returned for socket 'index'. Returns 1 if there was
+ * nothing in it for anybody.
+ */
+static int
+poller_socket_event(LIBSSH2_POLLER *poller, unsigned int index)
+{
+    struct poller_socket *sock = &poller->sockets[index];
+
+    if(!sock->revents)
+        return 1;
+
+    if(sock->session)
+        return poller_session_event(poller, index);
+
+    /* plain sockets only report what was asked for, plus errors */
+    sock->revents &= sock->events | LIBSSH2_POLLFD_POLLERR |
+        LIBSSH2_POLLFD_POLLHUP | LIBSSH2_POLLFD_POLLNVAL;
+    if(!sock->revents)
+        return 1;
+
+    poller_list_add(poller, POLLER_READY, index);
+    return 0;
+}
+
+/*
+ * poller_os_wait
+ *
+ * Wait for OS level socket events. Returns the number of sockets with
+ * events that may be of use, or negative on error. '*stale' is set to the
+ * number of sockets that only had events nobody waits for anymore.
+ */
+static int
+poller_os_wait(LIBSSH2_POLLER *poller, long timeout, int *stale)
+{
+    unsigned int i;
+    int events = 0;
+    int rc;
+
+    *stale = 0;
+
+    /* the sessions that got blocked in a new direction since the last
+       wait */
+    while(poller->list_len[POLLER_REARM]) {
+        unsigned int index = poller->list[POLLER_REARM][0];
+
+        poller_list_remove(poller, POLLER_REARM, index);
+        if(poller_watch(poller, index, socket_wanted(&poller->sockets[index]),
+                        WATCH_UPDATE))
+            return -1;
+    }
+
+    if(!poller->num_sockets && (timeout < 0))
+        /* nothing that could ever wake us up */
+        return 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if(poller->num_sockets)
+        rc = epoll_wait(poller->epfd, poller->epevents,
+                        (int)poller->num_sockets, (int)timeout);
+    else {
+        /* epoll_wait() refuses zero events, this just sleeps */
+        struct epoll_event none;
+        rc = epoll_wait(poller->epfd, &none, 1, (int)timeout);
+    }
+    for(i = 0; (rc > 0) && (i < (unsigned int)rc); i++) {
+        struct epoll_event *ev = &poller->epevents[i];
+        struct poller_socket *sock = &poller->sockets[ev->data.u32];
+
+        sock->revents =
+            ((ev->events & EPOLLIN)?LIBSSH2_POLLFD_POLLIN:0) |
+            ((ev->events & EPOLLPRI)?LIBSSH2_POLLFD_POLLPRI:0) |
+            ((ev->events & EPOLLOUT)?LIBSSH2_POLLFD_POLLOUT:0) |
+            ((ev->events & EPOLLERR)?LIBSSH2_POLLFD_POLLERR:0) |
+            ((ev->events & EPOLLHUP)?LIBSSH2_POLLFD_POLLHUP:0);
+    }
+    /* only look at the sockets that have something */
+    for(i = 0; (rc > 0) && (i < (unsigned int)rc); i++) {
+        if(poller_socket_event(poller, poller->epevents[i].data.u32))
+            (*stale)++;
+        else
+            events++;
+    }
+#elif defined(HAVE_POLL)
+    rc = poll(poller->pollfds, poller->num_sockets, (int)timeout);
+    for(i = 0; (rc > 0) && (i < poller->num_sockets); i++) {
+        short revents = poller->pollfds[i].revents;
+
+        if(!revents)
+            continue;
+        poller->sockets[i].revents =
+            ((revents & POLLIN)?LIBSSH2_POLLFD_POLLIN:0) |
+            ((revents & POLLPRI)?LIBSSH2_POLLFD_POLLPRI:0) |
+            ((revents & POLLOUT)?LIBSSH2_POLLFD_POLLOUT:0) |
+            ((revents & POLLERR)?LIBSSH2_POLLFD_POLLERR:0) |
+            ((revents & POLLHUP)?LIBSSH2_POLLFD_POLLHUP:0) |
+            ((revents & POLLNVAL)?LIBSSH2_POLLFD_POLLNVAL:0);
+        if(poller_socket_event(poller, i))
+            (*stale)++;
+        else
+            events++;
+    }
+#elif defined(HAVE_SELECT)
+    {
+        fd_set rfds, wfds;
+        struct timeval tv;
+        libssh2_socket_t maxfd = 0;
+
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        for(i = 0; i < poller->num_sockets; i++) {
+            struct poller_socket *sock = &poller->sockets[i];
+            if(sock->watched & LIBSSH2_POLLFD_POLLIN)
+                FD_SET(sock->fd, &rfds);
+            if(sock->watched & LIBSSH2_POLLFD_POLLOUT)
+                FD_SET(sock->fd, &wfds);
+            if(sock->fd > maxfd)
+                maxfd = sock->fd;
+        }
+
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        rc = select(maxfd + 1, &rfds, &wfds, NULL,
+                    (timeout < 0)?NULL:&tv);
+        for(i = 0; (rc > 0) && (i < poller->num_sockets); i++) {
+            struct poller_socket *sock = &poller->sockets[i];
+            sock->revents =
+                (FD_ISSET(sock->fd, &rfds)?LIBSSH2_POLLFD_POLLIN:0) |
+                (FD_ISSET(sock->fd, &wfds)?LIBSSH2_POLLFD_POLLOUT:0);
+            if(!sock->revents)
+                continue;
+            if(poller_socket_event(poller, i))
+                (*stale)++;
+            else
+                events++;
+        }
+    }
+#else
+    /* no way to wait, just check what is already known */
+    rc = 0;
+#endif
+
+    if((rc < 0) && (errno == EINTR))
+        /* a signal, report nothing and let the caller decide */
+        return 0;
+
+    return (rc < 0)?rc:events;
+}
+
+/*
+ * libssh2_poller_wait
+ *
+ * Wait up to 'timeout' milliseconds for events on anything added to the
+ * poller, and fill in up to 'nfds' entries in 'fds'. Returns the number of
+ * entries filled in or a negative error code.
+ */
+LIBSSH2_API int
+libssh2_poller_wait(LIBSSH2_POLLER *poller, LIBSSH2_POLLFD *fds,
+                    unsigned int nfds, long timeout)
+{
+    libssh2_uint64_t start = _libssh2_time_ms();
+    unsigned int count;
+    long wait = timeout;
+    int stale;
+    int rc;
+
+    if(!poller || !fds || !nfds)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    for(;;) {
+        /* anything already known makes the wait not block */
+        rc = poller_os_wait(poller, poller->list_len[POLLER_READY]?0:wait,
+                            &stale);
+        if(rc < 0)
+            return _libssh2_error(poller->session, LIBSSH2_ERROR_SOCKET_NONE,
+                                  "Error waiting for sockets");
+
+        count = poller_collect(poller, fds, nfds);
+        if(count || rc || !stale || !wait)
+            break;
+
+        /* the OS only woke us up for directions nobody waits for anymore,
+           which it won't report again */
+        if(timeout > 0) {
+            libssh2_uint64_t spent = _libssh2_time_ms() - start;
+
+            if(spent >= (libssh2_uint64_t)timeout)
+                break;
+            wait = timeout - (long)spent;
+        }
+    }
+
+    return (int)count;
+}
+
+/*
+ * libssh2_poller_free
+ *
+ * Free the poller. The sockets, channels, listeners and sessions are left
+ * untouched.
+ */
+LIBSSH2_API void
+libssh2_poller_free(LIBSSH2_POLLER *poller)
+{
+    LIBSSH2_SESSION *session;
+    unsigned int i;
+
+    if(!poller)
+        return;
+
+    session = poller->session;
+
+    for(i = 0; i < poller->num_entries; i++)
+        poller_entry_detach(&poller->entries[i]);
+    for(i = 0; i < poller->num_sockets; i++) {
+        if(poller->sockets[i].session &&
+           (poller->sockets[i].session->watcher == poller))
+            poller->sockets[i].session->watcher = NULL;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    close(poller->epfd);
+    if(poller->epevents)
+        LIBSSH2_FREE(session, poller->epevents);
+#elif defined(HAVE_POLL)
+    if(poller->pollfds)
+        LIBSSH2_FREE(session, poller->pollfds);
+#endif
+    if(poller->sockets)
+        LIBSSH2_FREE(session, poller->sockets);
+    if(poller->hash)
+        LIBSSH2_FREE(session, poller->hash);
+    for(i = 0; i < 2; i++) {
+        if(poller->list[i])
+            LIBSSH2_FREE(session, poller->list[i]);
+    }
+    if(poller->entries)
+        LIBSSH2_FREE(session, poller->entries);
+    LIBSSH2_FREE(session, poller);
+}
@@ -0,0 +1,484 @@
+/* Copyright (c) 2026 The libssh2 project and its contributors.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+#include "libssh2_priv.h"
+#include "transport.h"
+#include "session.h"
+
+#include <stdlib.h>
+
+/*
+ * A pool keeps authenticated sessions around after their channels are done
+ * so that the next command for the same host, port and user only costs a
+ * channel open. The application makes and tears down the connections in its
+ * callbacks since libssh2 never creates sockets itself.
+ *
+ * The pool outlives the sessions it holds, so its own bookkeeping can't use
+ * their allocators and is done with malloc() and free().
+ */
+
+/* Defaults for libssh2_pool_config() */
+#define POOL_MAX_IDLE      60  /* seconds */
+#define POOL_MAX_CHANNELS  10
+#define POOL_KEEPALIVE     15  /* seconds */
+
+/* libssh2_pool_channel() looks after the pooled sessions at most this
+   often */
+#define POOL_SWEEP_MS      1000
+
+struct pool_session {
+    struct list_node node;      /* in pool->sessions */
+    LIBSSH2_SESSION *session;
+    char *host;
+    int port;
+    char *username;
+    unsigned int channels;      /* handed out and not yet released */
+    int broken;                 /* don't hand out more channels */
+    LIBSSH2_CHANNEL *spare;     /* opened after the caller gave up on it */
+    libssh2_uint64_t spare_since; /* _libssh2_time_ms() of when it opened */
+    LIBSSH2_CHANNEL *closing;   /* spare unused for too long, being freed */
+    libssh2_uint64_t idle_since; /* _libssh2_time_ms() of when the last
+                                    channel was released */
+};
+
+struct _LIBSSH2_POOL
+{
+    struct list_head sessions;
+    LIBSSH2_POOL_CONNECT_FUNC((*connect_cb));
+    LIBSSH2_POOL_CLOSE_FUNC((*close_cb));
+    void *abstract;
+    unsigned int max_idle;      /* seconds an unused session is kept */
+    unsigned int max_channels;  /* channels per session at the same time */
+    unsigned int keepalive;     /* keepalive interval for idle sessions */
+    libssh2_uint64_t last_sweep; /* _libssh2_time_ms() */
+};
+
+/*
+ * pool_strdup
+ */
+static char *
+pool_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = malloc(len);
+
+    if(copy)
+        memcpy(copy, str, len);
+    return copy;
+}
+
+/*
+ * pool_evict
+ *
+ * Drop a session from the pool and hand it back to the application
+ */
+static void
+pool_evict(LIBSSH2_POOL *pool, struct pool_session *entry)
+{
+    _libssh2_list_remove(&entry->node);
+    pool->close_cb(entry->session, entry->host, entry->port,
+                   entry->username, &pool->abstract);
+    free(entry->host);
+    free(entry->username);
+    free(entry);
+}
+
+/*
+ * pool_alive
+ *
+ * Process whatever the server sent to an idle session and keep the
+ * connection from timing out. Returns 0 unless the connection is gone,
+ * other errors may well pass.
+ */
+static int
+pool_alive(LIBSSH2_SESSION *session)
+{
+    int rc;
+
+    _libssh2_session_lock(session);
+    do
+        rc = _libssh2_transport_read(session);
+    while(rc > 0);
+
+    if((rc == LIBSSH2_ERROR_SOCKET_RECV) ||
+       (session->socket_state == LIBSSH2_SOCKET_DISCONNECTED))
+        rc = LIBSSH2_ERROR_SOCKET_DISCONNECT;
+    _libssh2_session_unlock(session);
+
+    if(rc != LIBSSH2_ERROR_SOCKET_DISCONNECT)
+        rc = libssh2_keepalive_send(session, NULL);
+
+    return (rc == LIBSSH2_ERROR_SOCKET_DISCONNECT) ||
+        (rc == LIBSSH2_ERROR_SOCKET_SEND);
+}
+
+/*
+ * pool_close_spare
+ *
+ * Free the spare channel of a session once it has been unused for too long.
+ * Returns 0 unless the session failed.
+ */
+static int
+pool_close_spare(LIBSSH2_POOL *pool, struct pool_session *entry,
+                 libssh2_uint64_t now)
+{
+    int rc;
+
+    if(entry->spare && ((now - entry->spare_since) >=
+                        (libssh2_uint64_t)pool->max_idle * 1000)) {
+        entry->closing = entry->spare;
+        entry->spare = NULL;
+    }
+    if(!entry->closing)
+        return 0;
+
+    rc = libssh2_channel_free(entry->closing);
+    if(rc == LIBSSH2_ERROR_EAGAIN)
+        return 0;
+
+    entry->closing = NULL;
+    return rc;
+}
+
+/*
+ * pool_open
+ *
+ * Get a channel on a pooled session: the spare one if there is one, or
+ * start or resume opening a new one
+ */
+static LIBSSH2_CHANNEL *
+pool_open(struct pool_session *entry)
+{
+    LIBSSH2_CHANNEL *channel = entry->spare;
+
+    if(channel)
+        entry->spare = NULL;
+    else
+        channel = libssh2_channel_open_session(entry->session);
+
+    if(channel)
+        entry->channels++;
+    return channel;
+}
+
+/*
+ * pool_failed
+ *
+ * A session that can't open channels anymore is of no use
+ */
+static void
+pool_failed(LIBSSH2_POOL *pool, struct pool_session *entry)
+{
+    if(!entry->channels)
+        pool_evict(pool, entry);
+    else
+        entry->broken = 1;
+}
+
+/*
+ * pool_find
+ *
+ * Find the pooled session of a channel
+ */
+static struct pool_session *
+pool_find(LIBSSH2_POOL *pool, LIBSSH2_SESSION *session)
+{
+    struct pool_session *entry;
+
+    for(entry = _libssh2_list_first(&pool->sessions); entry;
+        entry = _libssh2_list_next(&entry->node)) {
+        if(entry->session == session)
+            return entry;
+    }
+    return NULL;
+}
+
+/*
+ * libssh2_pool_init
+ *
+ * Create a pool of sessions
+ */
+LIBSSH2_API LIBSSH2_POOL *
+libssh2_pool_init(LIBSSH2_POOL_CONNECT_FUNC((*connect_cb)),
+                  LIBSSH2_POOL_CLOSE_FUNC((*close_cb)), void *abstract)
+{
+    LIBSSH2_POOL *pool;
+
+    if(!connect_cb || !close_cb)
+        return NULL;
+
+    pool = malloc(sizeof(LIBSSH2_POOL));
+    if(!pool)
+        return NULL;
+    memset(pool, 0, sizeof(LIBSSH2_POOL));
+
+    _libssh2_list_init(&pool->sessions);
+    pool->connect_cb = connect_cb;
+    pool->close_cb = close_cb;
+    pool->abstract = abstract;
+    pool->max_idle = POOL_MAX_IDLE;
+    pool->max_channels = POOL_MAX_CHANNELS;
+    pool->keepalive = POOL_KEEPALIVE;
+
+    return pool;
+}
+
+/*
+ * libssh2_pool_config
+ *
+ * Set how long unused sessions are kept, how many channels a session gets
+ * at once and how often idle sessions send keepalives. 0 leaves a setting
+ * unchanged.
+ */
+LIBSSH2_API void
+libssh2_pool_config(LIBSSH2_POOL *pool, unsigned int max_idle,
+                    unsigned int max_channels, unsigned int keepalive)
+{
+    if(!pool)
+        return;
+
+    if(max_idle)
+        pool->max_idle = max_idle;
+    if(max_channels)
+        pool->max_channels = max_channels;
+    if(keepalive)
+        pool->keepalive = keepalive;
+}
+
+/*
+ * libssh2_pool_channel
+ *
+ * Open a session channel to host/port as username, reusing a pooled session
+ * when there is one
+ */
+LIBSSH2_API LIBSSH2_CHANNEL *
+libssh2_pool_channel(LIBSSH2_POOL *pool, const char *host, int port,
+                     const char *username)
+{
+    struct pool_session *entry;
+    struct pool_session *next;
+    LIBSSH2_SESSION *session;
+    LIBSSH2_CHANNEL *channel;
+    int pass;
+
+    if(!pool || !host || !username)
+        return NULL;
+
+    if((_libssh2_time_ms() - pool->last_sweep) >= POOL_SWEEP_MS)
+        libssh2_pool_sweep(pool);
+
+    /* First look for a session with a channel open already underway or
+       done, so that a non-blocking open is resumed rather than started over
+       on another session */
+    for(pass = 0; pass < 2; pass++) {
+        for(entry = _libssh2_list_first(&pool->sessions); entry;
+            entry = next) {
+            next = _libssh2_list_next(&entry->node);
+
+            if(entry->broken || (entry->port != port) ||
+               (entry->channels >= pool->max_channels) ||
+               strcmp(entry->host, host) ||
+               strcmp(entry->username, username))
+                continue;
+
+            if(!pass && !entry->spare &&
+               (entry->session->open_state == libssh2_NB_state_idle))
+                continue;
+
+            channel = pool_open(entry);
+            if(channel)
+                return channel;
+
+            if(libssh2_session_last_errno(entry->session) ==
+               LIBSSH2_ERROR_EAGAIN)
+                return NULL;
+
+            pool_failed(pool, entry);
+        }
+    }
+
+    session = pool->connect_cb(host, port, username, &pool->abstract);
+    if(!session)
+        return NULL;
+
+    entry = malloc(sizeof(struct pool_session));
+    if(entry) {
+        memset(entry, 0, sizeof(struct pool_session));
+        entry->host = pool_strdup(host);
+        entry->username = pool_strdup(username);
+    }
+    if(!entry || !entry->host || !entry->username) {
+        if(entry) {
+            free(entry->host);
+            free(entry->username);
+            free(entry);
+        }
+        pool->close_cb(session, host, port, username, &pool->abstract);
+        return NULL;
+    }
+    entry->session = session;
+    entry->port = port;
+    entry->idle_since = _libssh2_time_ms();
+    _libssh2_list_add(&pool->sessions, &entry->node);
+
+    libssh2_keepalive_config(session, 0, pool->keepalive);
+
+    /* a non-blocking application gets the session's EAGAIN and finds the
+       session in the pool on its next call */
+    channel = libssh2_channel_open_session(session);
+    if(channel)
+        entry->channels++;
+    else if(libssh2_session_last_errno(session) != LIBSSH2_ERROR_EAGAIN)
+        pool_evict(pool, entry);
+
+    return channel;
+}
+
+/*
+ * libssh2_pool_release
+ *
+ * Close and free a channel handed out by libssh2_pool_channel() and make
+ * its session available for reuse
+ */
+LIBSSH2_API int
+libssh2_pool_release(LIBSSH2_POOL *pool, LIBSSH2_CHANNEL *channel)
+{
+    struct pool_session *entry;
+    int rc;
+
+    if(!pool || !channel)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    entry = pool_find(pool, channel->session);
+    if(!entry)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    rc = libssh2_channel_free(channel);
+    if(rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+
+    if(entry->channels && !--entry->channels)
+        entry->idle_since = _libssh2_time_ms();
+
+    if(rc)
+        /* the session is broken, don't hand it out again */
+        entry->broken = 1;
+
+    if(entry->broken && !entry->channels)
+        pool_evict(pool, entry);
+
+    return rc;
+}
+
+/*
+ * libssh2_pool_sweep
+ *
+ * Evict sessions that have been unused for too long or that have died and
+ * keep the others alive
+ */
+LIBSSH2_API int
+libssh2_pool_sweep(LIBSSH2_POOL *pool)
+{
+    struct pool_session *entry;
+    struct pool_session *next;
+    libssh2_uint64_t now = _libssh2_time_ms();
+    int count = 0;
+
+    if(!pool)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    pool->last_sweep = now;
+
+    for(entry = _libssh2_list_first(&pool->sessions); entry; entry = next) {
+        next = _libssh2_list_next(&entry->node);
+
+        /* finish opening a channel the caller may have given up on and keep
+           it for the next caller, the session can't do anything else
+           meanwhile */
+        if(entry->session->open_state != libssh2_NB_state_idle) {
+            entry->spare = libssh2_channel_open_session(entry->session);
+            entry->spare_since = now;
+            if(!entry->spare &&
+               (libssh2_session_last_errno(entry->session) !=
+                LIBSSH2_ERROR_EAGAIN)) {
+                if(entry->channels)
+                    count++;
+                pool_failed(pool, entry);
+                continue;
+            }
+            count++;
+            continue;
+        }
+
+        if(pool_close_spare(pool, entry, now)) {
+            if(entry->channels)
+                count++;
+            pool_failed(pool, entry);
+            continue;
+        }
+
+        if(!entry->channels &&
+           (((now - entry->idle_since) >=
+             (libssh2_uint64_t)pool->max_idle * 1000) ||
+            pool_alive(entry->session))) {
+            pool_evict(pool, entry);
+            continue;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * libssh2_pool_free
+ *
+ * Hand all sessions back to the application and free the pool
+ */
+LIBSSH2_API void
+libssh2_pool_free(LIBSSH2_POOL *pool)
+{
+    struct pool_session *entry;
+
+    if(!pool)
+        return;
+
+    while((entry = _libssh2_list_first(&pool->sessions)))
+        pool_evict(pool, entry);
+
+    free(pool);
+}
@@ -110,13 +110,15 @@ banner_receive(LIBSSH2_SESSION * session)
     while ((banner_len < (int) sizeof(session->banner_TxRx_banner)) &&
            ((banner_len == 0)
             || (session->banner_TxRx_banner[banner_len - 1] != '\n'))) {
-        char c = '\0';
+        char c;
 
         /* no incoming block yet! */
         session->socket_block_directions &= ~LIBSSH2_SESSION_BLOCK_INBOUND;
 
-        ret = LIBSSH2_RECV(session, &c, 1,
-                            LIBSSH2_SOCKET_RECV_FLAGS(session));
+        /* receive straight into the session, an I/O backend may complete
+           the receive after this returns */
+        ret = LIBSSH2_RECV(session, &session->banner_TxRx_banner[banner_len],
+                           1, LIBSSH2_SOCKET_RECV_FLAGS(session));
         if (ret < 0) {
             if(session->api_block_mode || (ret != -EAGAIN))
                 /* ignore EAGAIN when non-blocking */
@@ -129,8 +131,8 @@ banner_receive(LIBSSH2_SESSION * session)
 
         if (ret < 0) {
             if (ret == -EAGAIN) {
-                session->socket_block_directions =
-                    LIBSSH2_SESSION_BLOCK_INBOUND;
+                _libssh2_session_block(session,
+                                       LIBSSH2_SESSION_BLOCK_INBOUND);
                 session->banner_TxRx_total_send = banner_len;
                 return LIBSSH2_ERROR_EAGAIN;
             }
@@ -146,6 +148,7 @@ banner_receive(LIBSSH2_SESSION * session)
             return LIBSSH2_ERROR_SOCKET_DISCONNECT;
         }
 
+        c = session->banner_TxRx_banner[banner_len];
         if (c == '\0') {
             /* NULLs are not allowed in SSH banners */
             session->banner_TxRx_state = libssh2_NB_state_idle;
@@ -153,7 +156,7 @@ banner_receive(LIBSSH2_SESSION * session)
             return LIBSSH2_ERROR_BANNER_RECV;
         }
 
-        session->banner_TxRx_banner[banner_len++] = c;
+        banner_len++;
     }
 
     while (banner_len &&
@@ -244,8 +247,7 @@ banner_send(LIBSSH2_SESSION * session)
     if (ret != (banner_len - session->banner_TxRx_total_send)) {
         if (ret >= 0 || ret == -EAGAIN) {
             /* the whole packet could not be sent, save the what was */
-            session->socket_block_directions =
-                LIBSSH2_SESSION_BLOCK_OUTBOUND;
+            _libssh2_session_block(session, LIBSSH2_SESSION_BLOCK_OUTBOUND);
             if (ret > 0)
                 session->banner_TxRx_total_send += ret;
             return LIBSSH2_ERROR_EAGAIN;
@@ -495,6 +497,12 @@ libssh2_session_init_ex(LIBSSH2_ALLOC_FUNC((*my_alloc)),
         session->abstract = abstract;
         session->api_timeout = 0; /* timeout-free API by default */
         session->api_block_mode = 1; /* blocking API by default */
+        session->packet.bufsize = PACKETBUFSIZE;
+        session->packet.buf = local_alloc(PACKETBUFSIZE, &abstract);
+        if (!session->packet.buf) {
+            local_free(session, &abstract);
+            return NULL;
+        }
         _libssh2_debug(session, LIBSSH2_TRACE_TRANS,
                        "New session resource allocated");
         _libssh2_init_if_needed ();
@@ -552,26 +560,77 @@ libssh2_session_callback_set(LIBSSH2_SESSION * session,
         oldcb = session->recv;
         session->recv = callback;
         return oldcb;
+
+    case LIBSSH2_CALLBACK_LOCK:
+        oldcb = session->lock;
+        session->lock = callback;
+        return oldcb;
     }
     _libssh2_debug(session, LIBSSH2_TRACE_TRANS, "Setting Callback %d", cbtype);
 
     return NULL;
 }
 
+/*
+ * _libssh2_session_lock()
+ *
+ * Take the lock the application set with LIBSSH2_CALLBACK_LOCK, if any. It
+ * is held while the library works on the session and only dropped while a
+ * blocking call sleeps in _libssh2_wait_socket(), so that other threads can
+ * use other channels of the session in the meantime.
+ */
+void
+_libssh2_session_lock(LIBSSH2_SESSION *session)
+{
+    if(session->lock)
+        session->lock(session, 1, &session->abstract);
+    session->lock_depth++;
+}
+
+void
+_libssh2_session_unlock(LIBSSH2_SESSION *session)
+{
+    session->lock_depth--;
+    if(session->lock)
+        session->lock(session, 0, &session->abstract);
+}
+
+/*
+ * _libssh2_session_block()
+ *
+ * Record that the session has to wait for its socket in direction 'dir'
+ * (see libssh2_session_block_directions()), and tell the poller watching
+ * the socket, if any, so that its next wait looks for that too.
+ */
+void
+_libssh2_session_block(LIBSSH2_SESSION *session, int dir)
+{
+    session->socket_block_directions |= dir;
+    if(session->watcher)
+        _libssh2_poller_rearm(session->watcher, session);
+}
+
+/* With a lock set another thread may consume the socket readiness this one
+   waits for and leave the data in the packet brigade, so waits are cut into
+   slices of this many milliseconds after which the caller has another look */
+#define LOCKED_WAIT_MS 50
+
 /*
  * _libssh2_wait_socket()
  *
  * Utility function that waits for action on the socket. Returns 0 when ready
- * to run again or error on timeout.
+ * to run again or error on timeout. 'start_time' is the _libssh2_time_ms()
+ * of when the blocking call started, the session's timeout counts from it.
  */
-int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
+int _libssh2_wait_socket(LIBSSH2_SESSION *session,
+                         libssh2_uint64_t start_time)
 {
     int rc;
-    int seconds_to_next;
     int dir;
     int has_timeout;
     long ms_to_next = 0;
-    long elapsed_ms;
+    int retry;
+    int unlocked = 0;
 
     /* since libssh2 often sets EAGAIN internally before this function is
        called, we can decrease some amount of confusion in user programs by
@@ -579,11 +638,15 @@ int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
        being stored as error when a blocking function has returned */
     session->err_code = LIBSSH2_ERROR_NONE;
 
-    rc = libssh2_keepalive_send (session, &seconds_to_next);
+    rc = _libssh2_keepalive_send(session, &ms_to_next);
     if (rc < 0)
         return rc;
 
-    ms_to_next = seconds_to_next * 1000;
+    /* waking up to send the next keepalive is no reason to give up */
+    retry = (ms_to_next > 0);
+
+    /* zerocopy completion notices would make the wait return at once */
+    _libssh2_transport_zerocopy_reap(session);
 
     /* figure out what to wait for */
     dir = libssh2_session_block_directions(session);
@@ -595,25 +658,40 @@ int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
            wait for, we timeout on 1 second to also avoid busy-looping
            during this condition */
         ms_to_next = 1000;
+        retry = 0;
     }
 
-    if (session->api_timeout > 0 &&
-        (seconds_to_next == 0 ||
-         seconds_to_next > session->api_timeout)) {
-        time_t now = time (NULL);
-        elapsed_ms = (long)(1000*difftime(start_time, now));
-        if (elapsed_ms > session->api_timeout) {
+    if (session->api_timeout > 0) {
+        /* the deadline is counted from the start of the blocking call */
+        long left = session->api_timeout -
+            (long)(_libssh2_time_ms() - start_time);
+
+        if (left <= 0) {
             session->err_code = LIBSSH2_ERROR_TIMEOUT;
             return LIBSSH2_ERROR_TIMEOUT;
         }
-        ms_to_next = (session->api_timeout - elapsed_ms);
-        has_timeout = 1;
+        if (!ms_to_next || (left <= ms_to_next)) {
+            ms_to_next = left;
+            retry = 0;
+        }
     }
-    else if (ms_to_next > 0) {
-        has_timeout = 1;
+
+    has_timeout = (ms_to_next > 0);
+
+    if (session->lock) {
+        if (!has_timeout || (ms_to_next > LOCKED_WAIT_MS)) {
+            ms_to_next = LOCKED_WAIT_MS;
+            has_timeout = 1;
+            retry = 1;
+        }
+
+        /* a nested call can't give the lock away */
+        if (session->lock_depth == 1) {
+            session->lock_waiters++;
+            _libssh2_session_unlock(session);
+            unlocked = 1;
+        }
     }
-    else
-        has_timeout = 0;
 
 #ifdef HAVE_POLL
     {
@@ -658,6 +736,14 @@ int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t start_time)
                     has_timeout ? &tv : NULL);
     }
 #endif
+    if (unlocked) {
+        _libssh2_session_lock(session);
+        session->lock_waiters--;
+    }
+
+    if (!rc && retry)
+        return 0; /* have another look */
+
     if(rc <= 0) {
         /* timeout (or error), bail out with a timeout error */
         session->err_code = LIBSSH2_ERROR_TIMEOUT;
@@ -834,6 +920,20 @@ session_free(LIBSSH2_SESSION *session)
         _libssh2_debug(session, LIBSSH2_TRACE_TRANS, "Freeing session resource",
                        session->remote.banner);
 
+        if (session->poller)
+            _libssh2_poller_forget_session(session);
+
+        /* the listeners are cancelled further down, but a poller must not
+           be left with them if that fails */
+        for (l = _libssh2_list_first(&session->listeners); l;
+             l = _libssh2_list_next(&l->node)) {
+            if (l->poller)
+                _libssh2_poller_forget_listener(l);
+        }
+
+        if (session->request_count)
+            _libssh2_request_cancel(session, NULL);
+
         session->free_state = libssh2_NB_state_created;
     }
 
@@ -858,6 +958,14 @@ session_free(LIBSSH2_SESSION *session)
         session->free_state = libssh2_NB_state_sent1;
     }
 
+    if (session->free_state == libssh2_NB_state_sent1) {
+        rc = _libssh2_transport_zerocopy_free(session);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return rc;
+
+        session->free_state = libssh2_NB_state_sent2;
+    }
+
     if (session->state & LIBSSH2_STATE_NEWKEYS) {
         /* hostkey */
         if (session->hostkey && session->hostkey->dtor) {
@@ -1001,6 +1109,12 @@ session_free(LIBSSH2_SESSION *session)
     if (session->open_data) {
         LIBSSH2_FREE(session, session->open_data);
     }
+    if (session->openbatch_packet) {
+        LIBSSH2_FREE(session, session->openbatch_packet);
+    }
+    if (session->openbatch_channels) {
+        LIBSSH2_FREE(session, session->openbatch_channels);
+    }
     if (session->direct_message) {
         LIBSSH2_FREE(session, session->direct_message);
     }
@@ -1040,6 +1154,10 @@ session_free(LIBSSH2_SESSION *session)
         LIBSSH2_FREE(session, session->server_hostkey);
     }
 
+    if(session->io)
+        /* the backend drops whatever it still has in flight */
+        session->io->buffer(session, NULL, 0, &session->io_abstract);
+    LIBSSH2_FREE(session, session->packet.buf);
     LIBSSH2_FREE(session, session);
 
     return 0;
@@ -1054,9 +1172,18 @@ session_free(LIBSSH2_SESSION *session)
 LIBSSH2_API int
 libssh2_session_free(LIBSSH2_SESSION * session)
 {
+    libssh2_uint64_t entry_time = _libssh2_time_ms();
     int rc;
 
-    BLOCK_ADJUST(rc, session, session_free(session) );
+    /* BLOCK_ADJUST would release the lock of a session that is gone */
+    do {
+        rc = session_free(session);
+        /* the order of the check below is important, the session is freed
+           unless rc is EAGAIN */
+        if ((rc != LIBSSH2_ERROR_EAGAIN) || !session->api_block_mode)
+            break;
+        rc = _libssh2_wait_socket(session, entry_time);
+    } while (!rc);
 
     return rc;
 }
@@ -1283,6 +1410,9 @@ libssh2_session_flag(LIBSSH2_SESSION * session, int flag, int value)
     case LIBSSH2_FLAG_COMPRESS:
         session->flag.compress = value;
         break;
+    case LIBSSH2_FLAG_ZEROCOPY:
+        session->flag.zerocopy = value;
+        break;
     default:
         /* unknown flag */
         return LIBSSH2_ERROR_INVAL;
@@ -1291,6 +1421,92 @@ libssh2_session_flag(LIBSSH2_SESSION * session, int flag, int value)
     return LIBSSH2_ERROR_NONE;
 }
 
+/* libssh2_session_recv_buffer
+ *
+ * Resize the buffer network data is received into, keeping what it holds.
+ */
+LIBSSH2_API int
+libssh2_session_recv_buffer(LIBSSH2_SESSION *session, size_t size)
+{
+    struct transportpacket *p;
+    size_t remain;
+    unsigned char *buf;
+
+    if(!session)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if(!size)
+        size = PACKETBUFSIZE;
+    else if(size < PACKETBUFSIZE_MIN)
+        return _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                              "Receive buffer too small");
+
+    if(session->io_pending & LIBSSH2_SESSION_BLOCK_INBOUND)
+        /* the backend is receiving into the buffer */
+        return _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                              "A receive is in progress");
+
+    p = &session->packet;
+    remain = p->writeidx - p->readidx;
+    if(remain > size)
+        return _libssh2_error(session, LIBSSH2_ERROR_BUFFER_TOO_SMALL,
+                              "Receive buffer holds more data than that");
+
+    /* move the data not yet dealt with to the start */
+    if(remain && p->readidx)
+        memmove(p->buf, &p->buf[p->readidx], remain);
+    p->readidx = 0;
+    p->writeidx = remain;
+
+    buf = LIBSSH2_REALLOC(session, p->buf, size);
+    if(!buf)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate receive buffer");
+    p->buf = buf;
+    p->bufsize = size;
+
+    if(session->io)
+        session->io->buffer(session, p->buf, p->bufsize,
+                            &session->io_abstract);
+
+    return 0;
+}
+
+/* libssh2_session_io_backend
+ *
+ * Switch the session to another I/O backend, or back to the send and recv
+ * callbacks.
+ */
+LIBSSH2_API int
+libssh2_session_io_backend(LIBSSH2_SESSION *session,
+                           const LIBSSH2_IO_BACKEND *backend, void *abstract)
+{
+    if(!session)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    if(backend && (!backend->recv || !backend->send || !backend->complete ||
+                   !backend->buffer))
+        return _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                              "Incomplete I/O backend");
+
+    if(session->io_pending)
+        /* the data in flight belongs to the current backend */
+        return _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                              "I/O is in progress");
+
+    if(session->io)
+        session->io->buffer(session, NULL, 0, &session->io_abstract);
+
+    session->io = backend;
+    session->io_abstract = abstract;
+
+    if(backend)
+        backend->buffer(session, session->packet.buf, session->packet.bufsize,
+                        &session->io_abstract);
+
+    return 0;
+}
+
 /* _libssh2_session_set_blocking
  *
  * Set a session's blocking mode on or off, return the previous status when
@@ -1362,11 +1578,13 @@ libssh2_poll_channel_read(LIBSSH2_CHANNEL *channel, int extended)
 {
     LIBSSH2_SESSION *session;
     LIBSSH2_PACKET *packet;
+    int rc = 0;
 
     if(!channel)
         return LIBSSH2_ERROR_BAD_USE;
 
     session = channel->session;
+    _libssh2_session_lock(session);
     packet = _libssh2_list_first(&session->packets);
 
     while (packet) {
@@ -1374,17 +1592,20 @@ libssh2_poll_channel_read(LIBSSH2_CHANNEL *channel, int extended)
             if ( extended == 1 &&
                  (packet->data[0] == SSH_MSG_CHANNEL_EXTENDED_DATA
                   || packet->data[0] == SSH_MSG_CHANNEL_DATA )) {
-                return 1;
+                rc = 1;
+                break;
             } else if ( extended == 0 &&
                         packet->data[0] == SSH_MSG_CHANNEL_DATA) {
-                return 1;
+                rc = 1;
+                break;
             }
             /* else - no data of any type is ready to be read */
         }
         packet = _libssh2_list_next(&packet->node);
     }
 
-    return 0;
+    _libssh2_session_unlock(session);
+    return rc;
 }
 
 /*
@@ -1720,6 +1941,108 @@ libssh2_poll(LIBSSH2_POLLFD * fds, unsigned int nfds, long timeout)
     return active_fds;
 }
 
+/* the channel events reported by libssh2_transport_read() */
+#define TRANSPORT_READ_EVENTS (LIBSSH2_POLLFD_POLLIN | LIBSSH2_POLLFD_POLLEXT | \
+                               LIBSSH2_POLLFD_POLLOUT | LIBSSH2_POLLFD_POLLHUP | \
+                               LIBSSH2_POLLFD_CHANNEL_CLOSED)
+
+/*
+ * transport_ready
+ *
+ * Fill in 'fds' with up to 'nfds' channels that have any of the 'mask'
+ * events pending, and forget about the events reported. Returns the number
+ * of entries filled in.
+ */
+static int
+transport_ready(LIBSSH2_SESSION *session, LIBSSH2_POLLFD *fds,
+                unsigned int nfds, unsigned long mask)
+{
+    LIBSSH2_CHANNEL *channel;
+    struct list_node *node;
+    struct list_node *next;
+    unsigned int count = 0;
+
+    for(node = _libssh2_list_first(&session->ready_channels);
+        node && (count < nfds); node = next) {
+        next = _libssh2_list_next(node);
+        channel = (LIBSSH2_CHANNEL *)
+            ((char *)node - offsetof(LIBSSH2_CHANNEL, ready_node));
+
+        if(!(channel->ready_events & mask))
+            continue;
+
+        fds[count].type = LIBSSH2_POLLFD_CHANNEL;
+        fds[count].fd.channel = channel;
+        fds[count].events = mask;
+        fds[count].revents = channel->ready_events & mask;
+        count++;
+
+        channel->ready_events &= ~mask;
+        if(!channel->ready_events)
+            _libssh2_list_remove(node);
+    }
+
+    return count;
+}
+
+/*
+ * libssh2_transport_read
+ *
+ * Read and process everything that is available on the session's socket,
+ * then report up to 'nfds' channels that have seen new data, EOF, close or
+ * an opened transfer window since they were last reported. Channels that
+ * don't fit are reported in subsequent calls.
+ *
+ * Returns the number of entries filled in, or a negative error code.
+ */
+LIBSSH2_API int
+libssh2_transport_read(LIBSSH2_SESSION *session, LIBSSH2_POLLFD *fds,
+                       unsigned int nfds)
+{
+    int rc;
+
+    if(!session || (!fds && nfds))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    _libssh2_session_lock(session);
+
+    do {
+        rc = _libssh2_transport_read(session);
+    } while (rc > 0);
+
+    if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+        rc = _libssh2_error(session, rc, "transport read");
+    else
+        rc = transport_ready(session, fds, nfds, TRANSPORT_READ_EVENTS);
+
+    _libssh2_session_unlock(session);
+    return rc;
+}
+
+/*
+ * libssh2_transport_write
+ *
+ * Report up to 'nfds' channels whose transfer window has been opened up by
+ * the remote end since they were last reported, so that writing to them
+ * will no longer block on the window. Does not touch the socket.
+ *
+ * Returns the number of entries filled in, or a negative error code.
+ */
+LIBSSH2_API int
+libssh2_transport_write(LIBSSH2_SESSION *session, LIBSSH2_POLLFD *fds,
+                        unsigned int nfds)
+{
+    int rc;
+
+    if(!session || (!fds && nfds))
+        return LIBSSH2_ERROR_BAD_USE;
+
+    _libssh2_session_lock(session);
+    rc = transport_ready(session, fds, nfds, LIBSSH2_POLLFD_POLLOUT);
+    _libssh2_session_unlock(session);
+    return rc;
+}
+
 /*
  * libssh2_session_block_directions
  *
@@ -53,15 +53,15 @@
 */
 #define BLOCK_ADJUST(rc,sess,x) \
     do { \
-       time_t entry_time = time (NULL); \
+       libssh2_uint64_t entry_time = _libssh2_time_ms(); \
+       _libssh2_session_lock(sess); \
        do { \
           rc = x; \
-          /* the order of the check below is important to properly deal with \
-             the case when the 'sess' is freed */ \
           if((rc != LIBSSH2_ERROR_EAGAIN) || !sess->api_block_mode) \
               break; \
           rc = _libssh2_wait_socket(sess, entry_time);  \
        } while(!rc);   \
+       _libssh2_session_unlock(sess); \
     } while(0)
 
 /*
@@ -72,8 +72,9 @@
  */
 #define BLOCK_ADJUST_ERRNO(ptr,sess,x) \
     do { \
-       time_t entry_time = time (NULL); \
+       libssh2_uint64_t entry_time = _libssh2_time_ms(); \
        int rc; \
+       _libssh2_session_lock(sess); \
        do { \
            ptr = x; \
            if(!sess->api_block_mode || \
@@ -82,10 +83,22 @@
                break; \
            rc = _libssh2_wait_socket(sess, entry_time); \
         } while(!rc); \
+       _libssh2_session_unlock(sess); \
     } while(0)
 
 
-int _libssh2_wait_socket(LIBSSH2_SESSION *session, time_t entry_time);
+int _libssh2_wait_socket(LIBSSH2_SESSION *session,
+                         libssh2_uint64_t entry_time);
+
+/* libssh2_keepalive_send() with the time to the next one in milliseconds */
+int _libssh2_keepalive_send(LIBSSH2_SESSION *session, long *ms_to_next);
+
+/* take and drop the lock set with LIBSSH2_CALLBACK_LOCK */
+void _libssh2_session_lock(LIBSSH2_SESSION *session);
+void _libssh2_session_unlock(LIBSSH2_SESSION *session);
+
+/* add to the directions the session is blocked on */
+void _libssh2_session_block(LIBSSH2_SESSION *session, int dir);
 
 /* this is the lib-internal set blocking function */
 int _libssh2_session_set_blocking(LIBSSH2_SESSION * session, int blocking);
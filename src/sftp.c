@@ -90,14 +90,18 @@
 #define SSH_FXE_STATVFS_ST_NOSUID               0x00000002
 
 /* This is the maximum packet length to accept, as larger than this indicate
-   some kind of server problem. */
-#define LIBSSH2_SFTP_PACKET_MAXLEN  80000
+   some kind of server problem. It is the largest message OpenSSH handles. */
+#define LIBSSH2_SFTP_PACKET_MAXLEN  (256*1024)
 
 static int sftp_close_handle(LIBSSH2_SFTP_HANDLE *handle);
 static int sftp_packet_ask(LIBSSH2_SFTP *sftp, unsigned char packet_type,
                            uint32_t request_id, unsigned char **data,
                            size_t *data_len);
 static void sftp_packet_flush(LIBSSH2_SFTP *sftp);
+static void sftp_walk_free(LIBSSH2_SFTP *sftp, struct sftp_walk *walk,
+                           int zombies);
+static int sftp_fstat(LIBSSH2_SFTP_HANDLE *handle,
+                      LIBSSH2_SFTP_ATTRIBUTES *attrs, int setstat);
 
 /* sftp_attrsize
  * Size that attr with this flagset will occupy when turned into a bin struct
@@ -133,24 +137,144 @@ static void _libssh2_store_u64(unsigned char **ptr, libssh2_uint64_t value)
 }
 
 /*
- * Search list of zombied FXP_READ request IDs.
+ * Request ids are handed out in sequence, so the low bits of an id spread the
+ * entries of an index over its slots as well as any hash would.
+ */
+#define SFTP_INDEX_MIN_SIZE 32
+
+/*
+ * sftp_index_find
  *
- * Returns NULL if ID not in list.
+ * Returns the entry stored for request_id or NULL
  */
-static struct sftp_zombie_requests *
-find_zombie_request(LIBSSH2_SFTP *sftp, uint32_t request_id)
+static void *sftp_index_find(struct sftp_index *index, uint32_t request_id)
 {
-    struct sftp_zombie_requests *zombie =
-        _libssh2_list_first(&sftp->zombie_requests);
+    unsigned int mask = index->size - 1;
+    unsigned int i;
 
-    while(zombie) {
-        if(zombie->request_id == request_id)
+    if(!index->count)
+        return NULL;
+
+    for(i = request_id & mask; index->slots[i].entry; i = (i + 1) & mask) {
+        if(index->slots[i].request_id == request_id)
+            return index->slots[i].entry;
+    }
+    return NULL;
+}
+
+/*
+ * sftp_index_place
+ *
+ * Store an entry in the first free slot from its home slot on
+ */
+static void sftp_index_place(struct sftp_index *index, uint32_t request_id,
+                             void *entry)
+{
+    unsigned int mask = index->size - 1;
+    unsigned int i = request_id & mask;
+
+    while(index->slots[i].entry)
+        i = (i + 1) & mask;
+
+    index->slots[i].request_id = request_id;
+    index->slots[i].entry = entry;
+}
+
+/*
+ * sftp_index_add
+ *
+ * Store the entry for a request id that is not in the index yet. The table
+ * is doubled whenever it would get more than half full.
+ */
+static int sftp_index_add(LIBSSH2_SESSION *session, struct sftp_index *index,
+                          uint32_t request_id, void *entry)
+{
+    if((index->count + 1) * 2 > index->size) {
+        struct sftp_index_slot *old = index->slots;
+        unsigned int old_size = index->size;
+        unsigned int size = old_size ? old_size * 2 : SFTP_INDEX_MIN_SIZE;
+        unsigned int i;
+
+        index->slots = LIBSSH2_ALLOC(session,
+                                     size * sizeof(struct sftp_index_slot));
+        if(!index->slots) {
+            index->slots = old;
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for an SFTP "
+                                  "request index");
+        }
+        memset(index->slots, 0, size * sizeof(struct sftp_index_slot));
+        index->size = size;
+
+        for(i = 0; i < old_size; i++) {
+            if(old[i].entry)
+                sftp_index_place(index, old[i].request_id, old[i].entry);
+        }
+        if(old)
+            LIBSSH2_FREE(session, old);
+    }
+
+    sftp_index_place(index, request_id, entry);
+    index->count++;
+    return 0;
+}
+
+/*
+ * sftp_index_remove
+ *
+ * Take the entry of a request id out of the index. The entries after it that
+ * had to go past its slot are moved back, so no search stops short of them.
+ */
+static void sftp_index_remove(struct sftp_index *index, uint32_t request_id)
+{
+    unsigned int mask = index->size - 1;
+    unsigned int i;
+    unsigned int j;
+
+    if(!index->count)
+        return;
+
+    for(i = request_id & mask; index->slots[i].entry; i = (i + 1) & mask) {
+        if(index->slots[i].request_id == request_id)
             break;
-        else
-            zombie = _libssh2_list_next(&zombie->node);
     }
+    if(!index->slots[i].entry)
+        return;
+
+    for(j = (i + 1) & mask; index->slots[j].entry; j = (j + 1) & mask) {
+        unsigned int home = index->slots[j].request_id & mask;
+
+        /* leave it if its home slot is after the free one */
+        if((i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j)))
+            continue;
+
+        index->slots[i] = index->slots[j];
+        i = j;
+    }
+    index->slots[i].entry = NULL;
+    index->count--;
+}
+
+/*
+ * sftp_index_free
+ */
+static void sftp_index_free(LIBSSH2_SESSION *session,
+                            struct sftp_index *index)
+{
+    if(index->slots)
+        LIBSSH2_FREE(session, index->slots);
+    memset(index, 0, sizeof(struct sftp_index));
+}
 
-    return zombie;
+/*
+ * Search list of zombied FXP_READ request IDs.
+ *
+ * Returns NULL if ID not in list.
+ */
+static struct sftp_zombie_requests *
+find_zombie_request(LIBSSH2_SFTP *sftp, uint32_t request_id)
+{
+    return sftp_index_find(&sftp->zombie_index, request_id);
 }
 
 static void
@@ -165,6 +289,7 @@ remove_zombie_request(LIBSSH2_SFTP *sftp, uint32_t request_id)
             "Removing request ID %ld from the list of zombie requests",
             request_id);
 
+        sftp_index_remove(&sftp->zombie_index, request_id);
         _libssh2_list_remove(&zombie->node);
         LIBSSH2_FREE(session, zombie);
     }
@@ -185,6 +310,11 @@ add_zombie_request(LIBSSH2_SFTP *sftp, uint32_t request_id)
     if (!zombie)
         return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
                               "malloc fail for zombie request  ID");
+    else if(sftp_index_add(session, &sftp->zombie_index, request_id,
+                           zombie)) {
+        LIBSSH2_FREE(session, zombie);
+        return LIBSSH2_ERROR_ALLOC;
+    }
     else {
         zombie->request_id = request_id;
         _libssh2_list_add(&sftp->zombie_requests, &zombie->node);
@@ -193,1847 +323,4305 @@ add_zombie_request(LIBSSH2_SFTP *sftp, uint32_t request_id)
 }
 
 /*
- * sftp_packet_add
+ * sftp_leftover_new
  *
- * Add a packet to the SFTP packet brigade
+ * Copy 'len' bytes of packet data to send later
  */
-static int
-sftp_packet_add(LIBSSH2_SFTP *sftp, unsigned char *data,
-                size_t data_len)
+static struct sftp_leftover *
+sftp_leftover_new(LIBSSH2_SFTP *sftp, const unsigned char *data, size_t len)
 {
     LIBSSH2_SESSION *session = sftp->channel->session;
-    LIBSSH2_SFTP_PACKET *packet;
-    uint32_t request_id;
-
-    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Received packet %d (len %d)",
-                   (int) data[0], data_len);
+    struct sftp_leftover *left;
 
-    /*
-     * Experience shows that if we mess up EAGAIN handling somewhere or
-     * otherwise get out of sync with the channel, this is where we first get
-     * a wrong byte and if so we need to bail out at once to aid tracking the
-     * problem better.
-     */
+    left = LIBSSH2_ALLOC(session, sizeof(struct sftp_leftover) + len);
+    if(!left) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for an SFTP packet");
+        return NULL;
+    }
+    memcpy(left->packet, data, len);
+    left->len = len;
+    left->sent = 0;
+    return left;
+}
 
-    switch(data[0]) {
-    case SSH_FXP_INIT:
-    case SSH_FXP_VERSION:
-    case SSH_FXP_OPEN:
-    case SSH_FXP_CLOSE:
-    case SSH_FXP_READ:
-    case SSH_FXP_WRITE:
-    case SSH_FXP_LSTAT:
-    case SSH_FXP_FSTAT:
-    case SSH_FXP_SETSTAT:
-    case SSH_FXP_FSETSTAT:
-    case SSH_FXP_OPENDIR:
-    case SSH_FXP_READDIR:
-    case SSH_FXP_REMOVE:
-    case SSH_FXP_MKDIR:
-    case SSH_FXP_RMDIR:
-    case SSH_FXP_REALPATH:
-    case SSH_FXP_STAT:
-    case SSH_FXP_RENAME:
-    case SSH_FXP_READLINK:
-    case SSH_FXP_SYMLINK:
-    case SSH_FXP_STATUS:
-    case SSH_FXP_HANDLE:
-    case SSH_FXP_DATA:
-    case SSH_FXP_NAME:
-    case SSH_FXP_ATTRS:
-    case SSH_FXP_EXTENDED:
-    case SSH_FXP_EXTENDED_REPLY:
-        break;
-    default:
-        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                              "Out of sync with the world");
+/*
+ * sftp_leftover_close
+ *
+ * Close a handle nobody holds any more, ignoring how that goes
+ */
+static void sftp_leftover_close(LIBSSH2_SFTP *sftp, const char *handle,
+                                size_t handle_len)
+{
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) */
+    unsigned char packet[SFTP_HANDLE_MAXLEN + 13];
+    unsigned char *s = packet;
+    struct sftp_leftover *left;
+    uint32_t request_id = sftp->request_id++;
+
+    _libssh2_store_u32(&s, (uint32_t)(handle_len + 9));
+    *(s++) = SSH_FXP_CLOSE;
+    _libssh2_store_u32(&s, request_id);
+    _libssh2_store_str(&s, handle, handle_len);
+
+    /* without memory the handle stays open until the channel closes */
+    if(add_zombie_request(sftp, request_id))
+        return;
+    left = sftp_leftover_new(sftp, packet, handle_len + 13);
+    if(!left) {
+        remove_zombie_request(sftp, request_id);
+        return;
     }
+    _libssh2_list_add(&sftp->leftovers, &left->node);
+}
 
-    request_id = _libssh2_ntohu32(&data[1]);
+/*
+ * sftp_leftover_sent
+ *
+ * 'sent' more bytes of the first leftover packet went out
+ */
+static void sftp_leftover_sent(LIBSSH2_SFTP *sftp, size_t sent)
+{
+    struct sftp_leftover *left = sftp->leftover_rest;
 
-    /* Don't add the packet if it answers a request we've given up on. */
-    if((data[0] == SSH_FXP_STATUS || data[0] == SSH_FXP_DATA)
-        && find_zombie_request(sftp, request_id)) {
+    if(!left)
+        left = _libssh2_list_first(&sftp->leftovers);
 
-        /* If we get here, the file ended before the response arrived. We
-        are no longer interested in the request so we discard it */
+    left->sent += sent;
+    if(left->sent < left->len)
+        return;
 
-        LIBSSH2_FREE(session, data);
+    if(left == sftp->leftover_rest)
+        sftp->leftover_rest = NULL;
+    else
+        _libssh2_list_remove(&left->node);
+    LIBSSH2_FREE(sftp->channel->session, left);
+}
 
-        remove_zombie_request(sftp, request_id);
-        return LIBSSH2_ERROR_NONE;
-    }
+/*
+ * sftp_leftover_free
+ *
+ * Drop the leftover packets, when the channel goes away
+ */
+static void sftp_leftover_free(LIBSSH2_SFTP *sftp)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct sftp_leftover *left;
 
-    packet = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_SFTP_PACKET));
-    if (!packet) {
-        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                              "Unable to allocate datablock for SFTP packet");
+    if(sftp->leftover_rest) {
+        LIBSSH2_FREE(session, sftp->leftover_rest);
+        sftp->leftover_rest = NULL;
+    }
+    while((left = _libssh2_list_first(&sftp->leftovers)) != NULL) {
+        _libssh2_list_remove(&left->node);
+        LIBSSH2_FREE(session, left);
     }
-
-    packet->data = data;
-    packet->data_len = data_len;
-    packet->request_id = request_id;
-
-    _libssh2_list_add(&sftp->packets, &packet->node);
-
-    return LIBSSH2_ERROR_NONE;
 }
 
 /*
- * sftp_packet_read
+ * sftp_channel_write2
  *
- * Frame an SFTP packet off the channel
+ * Send (part of) a request packet owned by 'owner', gathered from 'head'
+ * and 'buf' like _libssh2_channel_write2() does. They must hold all that is
+ * left of the packet, and a packet that is cut short has to be continued
+ * before any other is started, as the server reads them back-to-back.
+ *
+ * Every request goes through here, so the leftover packets are sent before
+ * a new one is started and never get in the middle of one.
  */
-static int
-sftp_packet_read(LIBSSH2_SFTP *sftp)
+static ssize_t sftp_channel_write2(LIBSSH2_SFTP *sftp, const void *owner,
+                                   const unsigned char *head, size_t headlen,
+                                   const unsigned char *buf, size_t buflen)
 {
     LIBSSH2_CHANNEL *channel = sftp->channel;
     LIBSSH2_SESSION *session = channel->session;
-    unsigned char *packet = NULL;
     ssize_t rc;
-    unsigned long recv_window;
-    int packet_type;
 
-    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "recv packet");
+    if(sftp->broken)
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "SFTP packet cut short, the server is out of "
+                              "sync");
+
+    if(!sftp->send_left) {
+        struct sftp_leftover *left;
+
+        while((left = sftp->leftover_rest ? sftp->leftover_rest :
+               _libssh2_list_first(&sftp->leftovers)) != NULL) {
+            rc = _libssh2_channel_write(channel, 0, &left->packet[left->sent],
+                                        left->len - left->sent);
+            sftp->leftover_busy = (rc == LIBSSH2_ERROR_EAGAIN);
+            if(rc < 0)
+                return rc;
+            else if(!rc) {
+                /* no window left, wait for the server to adjust it */
+                _libssh2_session_block(session,
+                                       LIBSSH2_SESSION_BLOCK_INBOUND);
+                return _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                                      "Would block sending SFTP packets "
+                                      "left behind");
+            }
+            sftp_leftover_sent(sftp, rc);
+        }
 
-    switch(sftp->packet_state) {
-    case libssh2_NB_state_sent: /* EAGAIN from window adjusting */
-        sftp->packet_state = libssh2_NB_state_idle;
+        sftp->send_owner = owner;
+        sftp->send_left = headlen + buflen;
+    }
 
-        packet = sftp->partial_packet;
-        goto window_adjust;
+    rc = _libssh2_channel_write2(channel, 0, head, headlen, buf, buflen);
+    if(rc > 0)
+        sftp->send_left -= MIN((size_t)rc, sftp->send_left);
+    return rc;
+}
 
-    case libssh2_NB_state_sent1: /* EAGAIN from channel read */
-        sftp->packet_state = libssh2_NB_state_idle;
+static ssize_t sftp_channel_write(LIBSSH2_SFTP *sftp, const void *owner,
+                                  const unsigned char *buf, size_t buflen)
+{
+    return sftp_channel_write2(sftp, owner, NULL, 0, buf, buflen);
+}
 
-        packet = sftp->partial_packet;
+/*
+ * sftp_packet_abandon
+ *
+ * The owner of a request packet gives up on it, with its last 'left' bytes
+ * at 'rest' if the owner has them. Returns non-zero if the packet was being
+ * sent, which means the server gets it all and replies to it.
+ *
+ * A packet cut short still has to get completed, or the server would take
+ * the next one as its rest. What the channel holds goes out anyway, the
+ * rest is sent before the next request. Without it the SFTP instance is of
+ * no further use.
+ */
+static int sftp_packet_abandon(LIBSSH2_SFTP *sftp, const void *owner,
+                               const unsigned char *rest, size_t left)
+{
+    size_t sent;
 
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "partial read cont, len: %lu", sftp->partial_len);
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "partial read cont, already recvd: %lu",
-                       sftp->partial_received);
-        /* fall-through */
-    default:
-        if(!packet) {
-            /* only do this if there's not already a packet buffer allocated
-               to use */
+    if(!sftp->send_left || (sftp->send_owner != owner))
+        return 0;
 
-            /* each packet starts with a 32 bit length field */
-            rc = _libssh2_channel_read(channel, 0,
-                                       (char *)&sftp->partial_size[
-                                           sftp->partial_size_len],
-                                       4 - sftp->partial_size_len);
-            if (rc == LIBSSH2_ERROR_EAGAIN)
-                return rc;
-            else if (rc < 0)
-                return _libssh2_error(session, rc, "channel read");
+    sent = _libssh2_channel_write_abandon(sftp->channel);
+    if(sent < left) {
+        if(rest)
+            sftp->leftover_rest = sftp_leftover_new(sftp, rest + sent,
+                                                    left - sent);
+        if(!sftp->leftover_rest) {
+            _libssh2_debug(sftp->channel->session, LIBSSH2_TRACE_SFTP,
+                           "SFTP packet cut short, giving up on the "
+                           "channel");
+            sftp->broken = 1;
+        }
+    }
+    sftp->send_owner = NULL;
+    sftp->send_left = 0;
+    return 1;
+}
 
-            sftp->partial_size_len += rc;
+/*
+ * sftp_packet_pooled
+ *
+ * Tells if a received packet of 'len' bytes is kept in a pool buffer. The
+ * replies to FXP_READ requests are, as they are both the largest and the
+ * most frequent packets.
+ */
+static int sftp_packet_pooled(LIBSSH2_SFTP *sftp, size_t len)
+{
+    return sftp->pool_size && (len * 2 > sftp->pool_size) &&
+        (len <= sftp->pool_size);
+}
 
-            if(4 != sftp->partial_size_len)
-                /* we got a short read for the length part */
-                return LIBSSH2_ERROR_EAGAIN;
+/*
+ * sftp_packet_alloc
+ *
+ * Get the buffer for a received packet of 'len' bytes. A pooled packet
+ * always gets a buffer of the full pool size, so that it can be recycled by
+ * sftp_packet_release() knowing only the length of the packet. The buffer
+ * may be freed with LIBSSH2_FREE() like any other all the same.
+ */
+static unsigned char *sftp_packet_alloc(LIBSSH2_SFTP *sftp, size_t len)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    unsigned char *buf;
 
-            sftp->partial_len = _libssh2_ntohu32(sftp->partial_size);
-            /* make sure we don't proceed if the packet size is unreasonably
-               large */
-            if (sftp->partial_len > LIBSSH2_SFTP_PACKET_MAXLEN)
-                return _libssh2_error(session,
-                                      LIBSSH2_ERROR_CHANNEL_PACKET_EXCEEDED,
-                                      "SFTP packet too large");
+    if(!sftp_packet_pooled(sftp, len))
+        return LIBSSH2_ALLOC(session, len);
 
-            _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                           "Data begin - Packet Length: %lu",
-                           sftp->partial_len);
-            packet = LIBSSH2_ALLOC(session, sftp->partial_len);
-            if (!packet)
-                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate SFTP packet");
-            sftp->partial_size_len = 0;
-            sftp->partial_received = 0; /* how much of the packet already
-                                           received */
-            sftp->partial_packet = packet;
+    if(sftp->pool) {
+        buf = sftp->pool;
+        memcpy(&sftp->pool, buf, sizeof(unsigned char *));
+        sftp->pool_count--;
+        return buf;
+    }
+    return LIBSSH2_ALLOC(session, sftp->pool_size);
+}
 
-    window_adjust:
-            recv_window = libssh2_channel_window_read_ex(channel, NULL, NULL);
+/*
+ * sftp_packet_release
+ *
+ * Done with the data of a received packet, keep its buffer for another one
+ * if it is a pool buffer and the pool is not full
+ */
+static void sftp_packet_release(LIBSSH2_SFTP *sftp, unsigned char *data,
+                                size_t data_len)
+{
+    if(sftp_packet_pooled(sftp, data_len) &&
+       (sftp->pool_count < SFTP_PACKET_POOL_BYTES / sftp->pool_size)) {
+        memcpy(data, &sftp->pool, sizeof(unsigned char *));
+        sftp->pool = data;
+        sftp->pool_count++;
+    }
+    else
+        LIBSSH2_FREE(sftp->channel->session, data);
+}
 
-            if(sftp->partial_len > recv_window) {
-                /* ask for twice the data amount we need at once */
-                rc = _libssh2_channel_receive_window_adjust(channel,
-                                                            sftp->partial_len*2,
-                                                            1, NULL);
-                /* store the state so that we continue with the correct
-                   operation at next invoke */
-                sftp->packet_state = (rc == LIBSSH2_ERROR_EAGAIN)?
-                    libssh2_NB_state_sent:
-                    libssh2_NB_state_idle;
-
-                if(rc == LIBSSH2_ERROR_EAGAIN)
-                    return rc;
-            }
-        }
-
-        /* Read as much of the packet as we can */
-        while (sftp->partial_len > sftp->partial_received) {
-            rc = _libssh2_channel_read(channel, 0,
-                                       (char *)&packet[sftp->partial_received],
-                                       sftp->partial_len -
-                                       sftp->partial_received);
+/*
+ * sftp_packet_node
+ *
+ * Get a node for the packets list
+ */
+static LIBSSH2_SFTP_PACKET *sftp_packet_node(LIBSSH2_SFTP *sftp)
+{
+    LIBSSH2_SFTP_PACKET *packet = _libssh2_list_first(&sftp->pool_nodes);
 
-            if (rc == LIBSSH2_ERROR_EAGAIN) {
-                /*
-                 * We received EAGAIN, save what we have and return EAGAIN to
-                 * the caller. Set 'partial_packet' so that this function
-                 * knows how to continue on the next invoke.
-                 */
-                sftp->packet_state = libssh2_NB_state_sent1;
-                return rc;
-            }
-            else if (rc < 0) {
-                LIBSSH2_FREE(session, packet);
-                sftp->partial_packet = NULL;
-                return _libssh2_error(session, rc,
-                                      "Error waiting for SFTP packet");
-            }
-            sftp->partial_received += rc;
-        }
+    if(!packet)
+        return LIBSSH2_ALLOC(sftp->channel->session,
+                             sizeof(LIBSSH2_SFTP_PACKET));
 
-        sftp->partial_packet = NULL;
+    _libssh2_list_remove(&packet->node);
+    sftp->pool_nodes_count--;
+    return packet;
+}
 
-        /* sftp_packet_add takes ownership of the packet and might free it
-           so we take a copy of the packet type before we call it. */
-        packet_type = packet[0];
-        rc = sftp_packet_add(sftp, packet, sftp->partial_len);
-        if (rc) {
-            LIBSSH2_FREE(session, packet);
-            return rc;
-        }
-        else {
-            return packet_type;
-        }
+/*
+ * sftp_packet_node_release
+ *
+ * Done with a node of the packets list, which is no longer in the list
+ */
+static void sftp_packet_node_release(LIBSSH2_SFTP *sftp,
+                                     LIBSSH2_SFTP_PACKET *packet)
+{
+    if(sftp->pool_nodes_count < SFTP_PACKET_NODES) {
+        _libssh2_list_add(&sftp->pool_nodes, &packet->node);
+        sftp->pool_nodes_count++;
     }
-    /* WON'T REACH */
+    else
+        LIBSSH2_FREE(sftp->channel->session, packet);
 }
+
 /*
- * sftp_packetlist_flush
+ * sftp_zombie_reply
  *
- * Remove all pending packets in the packet_list and the corresponding one(s)
- * in the SFTP packet brigade.
+ * Drop the reply to a request given up on. The handle an open brings is
+ * not wanted either, it gets closed.
  */
-static void sftp_packetlist_flush(LIBSSH2_SFTP_HANDLE *handle)
+static void sftp_zombie_reply(LIBSSH2_SFTP *sftp, unsigned char *data,
+                              size_t data_len)
 {
-    struct sftp_pipeline_chunk *chunk;
-    LIBSSH2_SFTP *sftp = handle->sftp;
-    LIBSSH2_SESSION *session = sftp->channel->session;
-
-    /* remove pending packets, if any */
-    chunk = _libssh2_list_first(&handle->packet_list);
-    while(chunk) {
-        unsigned char *data;
-        size_t data_len;
-        int rc;
-        struct sftp_pipeline_chunk *next = _libssh2_list_next(&chunk->node);
+    if((data[0] == SSH_FXP_HANDLE) && (data_len >= 9)) {
+        uint32_t handle_len = _libssh2_ntohu32(data + 5);
 
-        rc = sftp_packet_ask(sftp, SSH_FXP_STATUS,
-                             chunk->request_id, &data, &data_len);
-        if(rc)
-            rc = sftp_packet_ask(sftp, SSH_FXP_DATA,
-                                 chunk->request_id, &data, &data_len);
+        if(handle_len <= MIN(data_len - 9, SFTP_HANDLE_MAXLEN))
+            sftp_leftover_close(sftp, (char *)data + 9, handle_len);
+    }
+    sftp_packet_release(sftp, data, data_len);
+}
 
-        if(!rc)
-            /* we found a packet, free it */
-            LIBSSH2_FREE(session, data);
-        else if(chunk->sent)
-            /* there was no incoming packet for this request, mark this
-               request as a zombie if it ever sent the request */
-            add_zombie_request(sftp, chunk->request_id);
+/*
+ * sftp_request_drop
+ *
+ * Give up on a request that was sent. Its reply is dropped right away if
+ * it is in already, or else when it arrives.
+ */
+static void sftp_request_drop(LIBSSH2_SFTP *sftp, uint32_t request_id)
+{
+    LIBSSH2_SFTP_PACKET *packet = sftp_index_find(&sftp->packet_index,
+                                                  request_id);
 
-        _libssh2_list_remove(&chunk->node);
-        LIBSSH2_FREE(session, chunk);
-        chunk = next;
+    if(!packet) {
+        add_zombie_request(sftp, request_id);
+        return;
     }
-}
 
+    sftp_index_remove(&sftp->packet_index, request_id);
+    _libssh2_list_remove(&packet->node);
+    sftp_zombie_reply(sftp, packet->data, packet->data_len);
+    sftp_packet_node_release(sftp, packet);
+}
 
 /*
- * sftp_packet_ask()
+ * sftp_packet_pool_free
  *
- * Checks if there's a matching SFTP packet available.
+ * Free the spare buffers and nodes
  */
-static int
-sftp_packet_ask(LIBSSH2_SFTP *sftp, unsigned char packet_type,
-                uint32_t request_id, unsigned char **data,
-                size_t *data_len)
+static void sftp_packet_pool_free(LIBSSH2_SFTP *sftp)
 {
     LIBSSH2_SESSION *session = sftp->channel->session;
-    LIBSSH2_SFTP_PACKET *packet = _libssh2_list_first(&sftp->packets);
+    LIBSSH2_SFTP_PACKET *packet;
 
-    if(!packet)
-        return -1;
+    while(sftp->pool) {
+        unsigned char *buf = sftp->pool;
 
-    /* Special consideration when getting VERSION packet */
+        memcpy(&sftp->pool, buf, sizeof(unsigned char *));
+        LIBSSH2_FREE(session, buf);
+    }
+    sftp->pool_count = 0;
 
-    while (packet) {
-        if((packet->data[0] == packet_type) &&
-           ((packet_type == SSH_FXP_VERSION) ||
-            (packet->request_id == request_id))) {
+    while((packet = _libssh2_list_first(&sftp->pool_nodes)) != NULL) {
+        _libssh2_list_remove(&packet->node);
+        LIBSSH2_FREE(session, packet);
+    }
+    sftp->pool_nodes_count = 0;
+}
 
-            /* Match! Fetch the data */
-            *data = packet->data;
-            *data_len = packet->data_len;
+/* What sftp_cache_forget() drops besides the entries of the path itself */
+#define SFTP_CACHE_PARENT 1 /* the directory the path is in */
+#define SFTP_CACHE_TREE   2 /* everything below the path */
 
-            /* unlink and free this struct */
-            _libssh2_list_remove(&packet->node);
-            LIBSSH2_FREE(session, packet);
+/* All of these, as READDIR replies without some of them are not what STAT
+   and LSTAT would have returned */
+#define SFTP_CACHE_ATTRS (LIBSSH2_SFTP_ATTR_SIZE | LIBSSH2_SFTP_ATTR_UIDGID | \
+                          LIBSSH2_SFTP_ATTR_PERMISSIONS |               \
+                          LIBSSH2_SFTP_ATTR_ACMODTIME)
 
-            return 0;
-        }
-        /* check next struct in the list */
-        packet = _libssh2_list_next(&packet->node);
+/*
+ * sftp_cache_hash
+ *
+ * FNV-1a hash of a path. The STAT and LSTAT entries of a path end up in the
+ * same bucket.
+ */
+static unsigned int sftp_cache_hash(const char *path, size_t path_len)
+{
+    unsigned int hash = 2166136261U;
+    size_t i;
+
+    for(i = 0; i < path_len; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619U;
     }
-    return -1;
+    return hash;
 }
 
-/* sftp_packet_require
- * A la libssh2_packet_require
+/*
+ * sftp_cache_slot
+ *
+ * Find where the entry of a path is linked into its bucket. It points to
+ * NULL if there is no such entry.
  */
-static int
-sftp_packet_require(LIBSSH2_SFTP *sftp, unsigned char packet_type,
-                    uint32_t request_id, unsigned char **data,
-                    size_t *data_len)
+static struct sftp_cache_entry **
+sftp_cache_slot(struct sftp_cache *cache, const char *path, size_t path_len,
+                int lstat)
 {
-    LIBSSH2_SESSION *session = sftp->channel->session;
-    int rc;
+    unsigned int hash = sftp_cache_hash(path, path_len);
+    struct sftp_cache_entry **slot = &cache->buckets[hash & (cache->size - 1)];
 
-    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Requiring packet %d id %ld",
-                   (int) packet_type, request_id);
+    while(*slot) {
+        struct sftp_cache_entry *entry = *slot;
 
-    if (sftp_packet_ask(sftp, packet_type, request_id, data, data_len) == 0) {
-        /* The right packet was available in the packet brigade */
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Got %d",
-                       (int) packet_type);
-        return LIBSSH2_ERROR_NONE;
+        if((entry->hash == hash) && (entry->lstat == lstat) &&
+           (entry->path_len == path_len) &&
+           !memcmp(entry->path, path, path_len))
+            break;
+        slot = &entry->next;
     }
+    return slot;
+}
 
-    while (session->socket_state == LIBSSH2_SOCKET_CONNECTED) {
-        rc = sftp_packet_read(sftp);
-        if (rc < 0)
-            return rc;
-
-        /* data was read, check the queue again */
-        if (!sftp_packet_ask(sftp, packet_type, request_id, data, data_len)) {
-            /* The right packet was available in the packet brigade */
-            _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Got %d",
-                           (int) packet_type);
-            return LIBSSH2_ERROR_NONE;
-        }
-    }
+/*
+ * sftp_cache_drop
+ *
+ * Remove and free the entry linked in at 'slot'
+ */
+static void sftp_cache_drop(LIBSSH2_SFTP *sftp,
+                            struct sftp_cache_entry **slot)
+{
+    struct sftp_cache_entry *entry = *slot;
 
-    /* Only reached if the socket died */
-    return LIBSSH2_ERROR_SOCKET_DISCONNECT;
+    *slot = entry->next;
+    _libssh2_list_remove(&entry->node);
+    sftp->cache.count--;
+    LIBSSH2_FREE(sftp->channel->session, entry);
 }
 
-/* sftp_packet_requirev
- * Require one of N possible reponses
+/*
+ * sftp_cache_expire
+ *
+ * Drop the entries that were stored more than ttl ago, or with 'all' every
+ * entry
  */
-static int
-sftp_packet_requirev(LIBSSH2_SFTP *sftp, int num_valid_responses,
-                     const unsigned char *valid_responses,
-                     uint32_t request_id, unsigned char **data,
-                     size_t *data_len)
+static void sftp_cache_expire(LIBSSH2_SFTP *sftp, int all)
 {
-    int i;
-    int rc;
+    struct sftp_cache *cache = &sftp->cache;
+    struct sftp_cache_entry *entry;
+    libssh2_uint64_t now = all ? 0 : _libssh2_time_ms();
 
-    /* If no timeout is active, start a new one */
-    if (sftp->requirev_start == 0)
-        sftp->requirev_start = time(NULL);
+    while((entry = _libssh2_list_first(&cache->entries)) != NULL) {
+        if(!all && ((now - entry->stored) < cache->ttl))
+            break;
+        sftp_cache_drop(sftp, sftp_cache_slot(cache, entry->path,
+                                              entry->path_len,
+                                              entry->lstat));
+    }
+}
 
-    while (sftp->channel->session->socket_state == LIBSSH2_SOCKET_CONNECTED) {
-        for(i = 0; i < num_valid_responses; i++) {
-            if (sftp_packet_ask(sftp, valid_responses[i], request_id,
-                                data, data_len) == 0) {
-                /*
-                 * Set to zero before all returns to say
-                 * the timeout is not active
-                 */
-                sftp->requirev_start = 0;
-                return LIBSSH2_ERROR_NONE;
-            }
-        }
+/*
+ * sftp_cache_store
+ *
+ * Keep the attributes STAT, or LSTAT with 'lstat', found for 'name' in the
+ * directory 'dir'. Without a 'dir', 'name' is the whole path.
+ */
+static void sftp_cache_store(LIBSSH2_SFTP *sftp, const char *dir,
+                             size_t dir_len, const char *name,
+                             size_t name_len, int lstat,
+                             const LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    struct sftp_cache *cache = &sftp->cache;
+    struct sftp_cache_entry *entry, **slot;
+    unsigned int bucket;
+    size_t path_len = name_len;
+    char *s;
 
-        rc = sftp_packet_read(sftp);
-        if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN)) {
-            sftp->requirev_start = 0;
-            return rc;
-        } else if (rc <= 0) {
-            /* prevent busy-looping */
-            long left =
-                LIBSSH2_READ_TIMEOUT - (long)(time(NULL) - sftp->requirev_start);
+    if(!cache->ttl || !attrs->flags)
+        return;
 
-            if (left <= 0) {
-                sftp->requirev_start = 0;
-                return LIBSSH2_ERROR_TIMEOUT;
-            }
-            else if (rc == LIBSSH2_ERROR_EAGAIN) {
-                return rc;
-            }
-        }
+    if(dir_len)
+        path_len += dir_len + ((dir[dir_len - 1] != '/') ? 1 : 0);
+
+    sftp_cache_expire(sftp, 0);
+    if(cache->count >= cache->max_entries) {
+        /* make room by dropping the oldest */
+        entry = _libssh2_list_first(&cache->entries);
+        sftp_cache_drop(sftp, sftp_cache_slot(cache, entry->path,
+                                              entry->path_len,
+                                              entry->lstat));
     }
 
-    sftp->requirev_start = 0;
+    entry = LIBSSH2_ALLOC(sftp->channel->session,
+                          sizeof(struct sftp_cache_entry) + path_len);
+    if(!entry)
+        /* the cache is only a shortcut, go without */
+        return;
 
-    /* Only reached if the socket died */
-    return LIBSSH2_ERROR_SOCKET_DISCONNECT;
+    s = entry->path;
+    if(dir_len) {
+        memcpy(s, dir, dir_len);
+        s += dir_len;
+        if(dir[dir_len - 1] != '/')
+            *s++ = '/';
+    }
+    memcpy(s, name, name_len);
+    entry->path[path_len] = '\0';
+    entry->path_len = path_len;
+    entry->hash = sftp_cache_hash(entry->path, path_len);
+    entry->lstat = lstat;
+    entry->stored = _libssh2_time_ms();
+    entry->attrs = *attrs;
+
+    /* what is stored now replaces what was */
+    slot = sftp_cache_slot(cache, entry->path, path_len, lstat);
+    if(*slot)
+        sftp_cache_drop(sftp, slot);
+
+    bucket = entry->hash & (cache->size - 1);
+    entry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    _libssh2_list_add(&cache->entries, &entry->node);
+    cache->count++;
 }
 
-/* sftp_attr2bin
- * Populate attributes into an SFTP block
+/*
+ * sftp_cache_find
+ *
+ * Fill in 'attrs' from the cache. Returns 1 if the path was found, 0 if the
+ * server has to be asked.
  */
-static ssize_t
-sftp_attr2bin(unsigned char *p, const LIBSSH2_SFTP_ATTRIBUTES * attrs)
+static int sftp_cache_find(LIBSSH2_SFTP *sftp, const char *path,
+                           size_t path_len, int lstat,
+                           LIBSSH2_SFTP_ATTRIBUTES *attrs)
 {
-    unsigned char *s = p;
-    uint32_t flag_mask =
-        LIBSSH2_SFTP_ATTR_SIZE | LIBSSH2_SFTP_ATTR_UIDGID |
-        LIBSSH2_SFTP_ATTR_PERMISSIONS | LIBSSH2_SFTP_ATTR_ACMODTIME;
+    struct sftp_cache *cache = &sftp->cache;
+    struct sftp_cache_entry *entry;
 
-    /* TODO: When we add SFTP4+ functionality flag_mask can get additional
-       bits */
+    if(!cache->ttl)
+        return 0;
 
-    if (!attrs) {
-        _libssh2_htonu32(s, 0);
-        return 4;
+    sftp_cache_expire(sftp, 0);
+    entry = *sftp_cache_slot(cache, path, path_len, lstat);
+    if(!entry && !lstat) {
+        /* STAT finds the same as LSTAT for anything but a symbolic link */
+        entry = *sftp_cache_slot(cache, path, path_len, 1);
+        if(entry && (!(entry->attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) ||
+                     LIBSSH2_SFTP_S_ISLNK(entry->attrs.permissions)))
+            entry = NULL;
     }
+    if(!entry)
+        return 0;
 
-    _libssh2_store_u32(&s, attrs->flags & flag_mask);
+    *attrs = entry->attrs;
+    return 1;
+}
 
-    if (attrs->flags & LIBSSH2_SFTP_ATTR_SIZE) {
-        _libssh2_store_u64(&s, attrs->filesize);
+/*
+ * sftp_cache_forget
+ *
+ * Drop the entries of a path that is about to change, and with 'how' those
+ * of its directory or of everything below it as well
+ */
+static void sftp_cache_forget(LIBSSH2_SFTP *sftp, const char *path,
+                              size_t path_len, int how)
+{
+    struct sftp_cache *cache = &sftp->cache;
+    struct sftp_cache_entry *entry, *next, **slot;
+    size_t len = path_len;
+
+    if(!cache->ttl)
+        return;
+
+    if(!path) {
+        /* a handle without its path, no telling what changes */
+        sftp_cache_expire(sftp, 1);
+        return;
     }
 
-    if (attrs->flags & LIBSSH2_SFTP_ATTR_UIDGID) {
-        _libssh2_store_u32(&s, attrs->uid);
-        _libssh2_store_u32(&s, attrs->gid);
+    slot = sftp_cache_slot(cache, path, path_len, 0);
+    if(*slot)
+        sftp_cache_drop(sftp, slot);
+    slot = sftp_cache_slot(cache, path, path_len, 1);
+    if(*slot)
+        sftp_cache_drop(sftp, slot);
+
+    if(how & SFTP_CACHE_TREE) {
+        while(len && (path[len - 1] == '/'))
+            len--;
+        for(entry = _libssh2_list_first(&cache->entries); entry;
+            entry = next) {
+            next = _libssh2_list_next(&entry->node);
+            if((entry->path_len > len) && (entry->path[len] == '/') &&
+               !memcmp(entry->path, path, len))
+                sftp_cache_drop(sftp, sftp_cache_slot(cache, entry->path,
+                                                      entry->path_len,
+                                                      entry->lstat));
+        }
     }
 
-    if (attrs->flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) {
-        _libssh2_store_u32(&s, attrs->permissions);
+    if(how & SFTP_CACHE_PARENT) {
+        len = path_len;
+        while((len > 1) && (path[len - 1] == '/'))
+            len--;
+        while(len && (path[len - 1] != '/'))
+            len--;
+        if(!len)
+            sftp_cache_forget(sftp, ".", 1, 0);
+        else
+            /* keep the slash of the root directory */
+            sftp_cache_forget(sftp, path, (len > 1) ? len - 1 : 1, 0);
     }
+}
 
-    if (attrs->flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
-        _libssh2_store_u32(&s, attrs->atime);
-        _libssh2_store_u32(&s, attrs->mtime);
+/*
+ * sftp_cache_config
+ *
+ * Drop all entries and set the cache up anew, or turn it off with a ttl of 0
+ */
+static int sftp_cache_config(LIBSSH2_SFTP *sftp, unsigned long ttl,
+                             unsigned int max_entries)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct sftp_cache *cache = &sftp->cache;
+    unsigned int size = 16;
+
+    sftp_cache_expire(sftp, 1);
+    if(cache->buckets) {
+        LIBSSH2_FREE(session, cache->buckets);
+        cache->buckets = NULL;
     }
+    cache->ttl = 0;
 
-    return (s - p);
+    if(!ttl)
+        return 0;
+
+    if(!max_entries)
+        max_entries = SFTP_CACHE_ENTRIES;
+    while((size < max_entries) && (size < 0x10000000))
+        size *= 2;
+
+    cache->buckets = LIBSSH2_ALLOC(session,
+                                   size * sizeof(struct sftp_cache_entry *));
+    if(!cache->buckets)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for the SFTP "
+                              "attribute cache");
+    memset(cache->buckets, 0, size * sizeof(struct sftp_cache_entry *));
+    cache->size = size;
+    cache->max_entries = max_entries;
+    cache->ttl = ttl;
+    return 0;
 }
 
-/* sftp_bin2attr
+/*
+ * sftp_packet_add
+ *
+ * Add a packet to the SFTP packet brigade
  */
 static int
-sftp_bin2attr(LIBSSH2_SFTP_ATTRIBUTES * attrs, const unsigned char *p)
+sftp_packet_add(LIBSSH2_SFTP *sftp, unsigned char *data,
+                size_t data_len)
 {
-    const unsigned char *s = p;
-
-    memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
-    attrs->flags = _libssh2_ntohu32(s);
-    s += 4;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    LIBSSH2_SFTP_PACKET *packet;
+    uint32_t request_id;
 
-    if (attrs->flags & LIBSSH2_SFTP_ATTR_SIZE) {
-        attrs->filesize = _libssh2_ntohu64(s);
-        s += 8;
-    }
+    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Received packet %d (len %d)",
+                   (int) data[0], data_len);
 
-    if (attrs->flags & LIBSSH2_SFTP_ATTR_UIDGID) {
-        attrs->uid = _libssh2_ntohu32(s);
-        s += 4;
-        attrs->gid = _libssh2_ntohu32(s);
-        s += 4;
-    }
+    /*
+     * Experience shows that if we mess up EAGAIN handling somewhere or
+     * otherwise get out of sync with the channel, this is where we first get
+     * a wrong byte and if so we need to bail out at once to aid tracking the
+     * problem better.
+     */
 
-    if (attrs->flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) {
-        attrs->permissions = _libssh2_ntohu32(s);
-        s += 4;
+    switch(data[0]) {
+    case SSH_FXP_INIT:
+    case SSH_FXP_VERSION:
+    case SSH_FXP_OPEN:
+    case SSH_FXP_CLOSE:
+    case SSH_FXP_READ:
+    case SSH_FXP_WRITE:
+    case SSH_FXP_LSTAT:
+    case SSH_FXP_FSTAT:
+    case SSH_FXP_SETSTAT:
+    case SSH_FXP_FSETSTAT:
+    case SSH_FXP_OPENDIR:
+    case SSH_FXP_READDIR:
+    case SSH_FXP_REMOVE:
+    case SSH_FXP_MKDIR:
+    case SSH_FXP_RMDIR:
+    case SSH_FXP_REALPATH:
+    case SSH_FXP_STAT:
+    case SSH_FXP_RENAME:
+    case SSH_FXP_READLINK:
+    case SSH_FXP_SYMLINK:
+    case SSH_FXP_STATUS:
+    case SSH_FXP_HANDLE:
+    case SSH_FXP_DATA:
+    case SSH_FXP_NAME:
+    case SSH_FXP_ATTRS:
+    case SSH_FXP_EXTENDED:
+    case SSH_FXP_EXTENDED_REPLY:
+        break;
+    default:
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "Out of sync with the world");
     }
 
-    if (attrs->flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
-        attrs->atime = _libssh2_ntohu32(s);
-        s += 4;
-        attrs->mtime = _libssh2_ntohu32(s);
-        s += 4;
-    }
+    request_id = _libssh2_ntohu32(&data[1]);
 
-    return (s - p);
-}
+    /* Don't add the packet if it answers a request we've given up on. */
+    if((data[0] == SSH_FXP_STATUS || data[0] == SSH_FXP_DATA ||
+        data[0] == SSH_FXP_NAME || data[0] == SSH_FXP_HANDLE ||
+        data[0] == SSH_FXP_ATTRS || data[0] == SSH_FXP_EXTENDED_REPLY)
+        && find_zombie_request(sftp, request_id)) {
 
-/* ************
- * SFTP API *
- ************ */
+        /* If we get here, the file ended before the response arrived. We
+        are no longer interested in the request so we discard it */
+        sftp_zombie_reply(sftp, data, data_len);
 
-LIBSSH2_CHANNEL_CLOSE_FUNC(libssh2_sftp_dtor);
+        remove_zombie_request(sftp, request_id);
+        return LIBSSH2_ERROR_NONE;
+    }
 
-/* libssh2_sftp_dtor
- * Shutdown an SFTP stream when the channel closes
- */
-LIBSSH2_CHANNEL_CLOSE_FUNC(libssh2_sftp_dtor)
-{
-    LIBSSH2_SFTP *sftp = (LIBSSH2_SFTP *) (*channel_abstract);
+    packet = sftp_packet_node(sftp);
+    if (!packet) {
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate datablock for SFTP packet");
+    }
 
-    (void) session_abstract;
-    (void) channel;
+    packet->data = data;
+    packet->data_len = data_len;
+    packet->request_id = request_id;
 
-    /* Free the partial packet storage for sftp_packet_read */
-    if (sftp->partial_packet) {
-        LIBSSH2_FREE(session, sftp->partial_packet);
+    /* VERSION has no request id, it is looked for by type alone */
+    if(data[0] != SSH_FXP_VERSION) {
+        if(sftp_index_find(&sftp->packet_index, request_id)) {
+            sftp_packet_node_release(sftp, packet);
+            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                  "Second SFTP reply to the same request");
+        }
+        if(sftp_index_add(session, &sftp->packet_index, request_id,
+                          packet)) {
+            sftp_packet_node_release(sftp, packet);
+            return LIBSSH2_ERROR_ALLOC;
+        }
     }
 
-    /* Free the packet storage for _libssh2_sftp_packet_readdir */
-    if (sftp->readdir_packet) {
-        LIBSSH2_FREE(session, sftp->readdir_packet);
-    }
+    _libssh2_list_add(&sftp->packets, &packet->node);
 
-    LIBSSH2_FREE(session, sftp);
+    return LIBSSH2_ERROR_NONE;
 }
 
 /*
- * sftp_init
+ * sftp_packet_read
  *
- * Startup an SFTP session
+ * Frame an SFTP packet off the channel
  */
-static LIBSSH2_SFTP *sftp_init(LIBSSH2_SESSION *session)
+static int
+sftp_packet_read(LIBSSH2_SFTP *sftp)
 {
-    unsigned char *data, *s;
-    size_t data_len;
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    unsigned char *packet = NULL;
     ssize_t rc;
-    LIBSSH2_SFTP *sftp_handle;
+    unsigned long recv_window;
+    int packet_type;
 
-    if (session->sftpInit_state == libssh2_NB_state_idle) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "Initializing SFTP subsystem");
+    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "recv packet");
 
-        /*
-         * The 'sftpInit_sftp' and 'sftpInit_channel' struct fields within the
-         * session struct are only to be used during the setup phase. As soon
-         * as the SFTP session is created they are cleared and can thus be
-         * re-used again to allow any amount of SFTP handles per sessions.
-         *
-         * Note that you MUST NOT try to call libssh2_sftp_init() again to get
-         * another handle until the previous call has finished and either
-         * succesffully made a handle or failed and returned error (not
-         * including *EAGAIN).
-         */
+    switch(sftp->packet_state) {
+    case libssh2_NB_state_sent: /* EAGAIN from window adjusting */
+        sftp->packet_state = libssh2_NB_state_idle;
 
-        assert(session->sftpInit_sftp == NULL);
-        session->sftpInit_sftp = NULL;
-        session->sftpInit_state = libssh2_NB_state_created;
-    }
+        packet = sftp->partial_packet;
+        goto window_adjust;
 
-    sftp_handle = session->sftpInit_sftp;
+    case libssh2_NB_state_sent1: /* EAGAIN from channel read */
+        sftp->packet_state = libssh2_NB_state_idle;
 
-    if (session->sftpInit_state == libssh2_NB_state_created) {
-        session->sftpInit_channel =
-            _libssh2_channel_open(session, "session", sizeof("session") - 1,
-                                  LIBSSH2_CHANNEL_WINDOW_DEFAULT,
-                                  LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0);
-        if (!session->sftpInit_channel) {
-            if (libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN) {
-                _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
-                               "Would block starting up channel");
-            }
-            else {
-                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                               "Unable to startup channel");
-                session->sftpInit_state = libssh2_NB_state_idle;
-            }
-            return NULL;
-        }
+        packet = sftp->partial_packet;
 
-        session->sftpInit_state = libssh2_NB_state_sent;
-    }
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "partial read cont, len: %lu", sftp->partial_len);
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "partial read cont, already recvd: %lu",
+                       sftp->partial_received);
+        /* fall-through */
+    default:
+        if(!packet) {
+            /* only do this if there's not already a packet buffer allocated
+               to use */
 
-    if (session->sftpInit_state == libssh2_NB_state_sent) {
-        int ret = _libssh2_channel_process_startup(session->sftpInit_channel,
-                                                   "subsystem",
-                                                   sizeof("subsystem") - 1, "sftp",
-                                                   strlen("sftp"));
-        if (ret == LIBSSH2_ERROR_EAGAIN) {
-            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
-                           "Would block to request SFTP subsystem");
-            return NULL;
-        } else if (ret) {
-            _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
-                           "Unable to request SFTP subsystem");
-            goto sftp_init_error;
-        }
+            /* each packet starts with a 32 bit length field */
+            rc = _libssh2_channel_read(channel, 0,
+                                       (char *)&sftp->partial_size[
+                                           sftp->partial_size_len],
+                                       4 - sftp->partial_size_len);
+            if (rc == LIBSSH2_ERROR_EAGAIN)
+                return rc;
+            else if (rc < 0)
+                return _libssh2_error(session, rc, "channel read");
 
-        session->sftpInit_state = libssh2_NB_state_sent1;
-    }
+            sftp->partial_size_len += rc;
 
-    if (session->sftpInit_state == libssh2_NB_state_sent1) {
-        rc = _libssh2_channel_extended_data(session->sftpInit_channel,
-                                            LIBSSH2_CHANNEL_EXTENDED_DATA_IGNORE);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
-            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
-                           "Would block requesting handle extended data");
-            return NULL;
-        }
+            if(4 != sftp->partial_size_len)
+                /* we got a short read for the length part */
+                return LIBSSH2_ERROR_EAGAIN;
 
-        sftp_handle =
-            session->sftpInit_sftp =
-            LIBSSH2_ALLOC(session, sizeof(LIBSSH2_SFTP));
-        if (!sftp_handle) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Unable to allocate a new SFTP structure");
-            goto sftp_init_error;
-        }
-        memset(sftp_handle, 0, sizeof(LIBSSH2_SFTP));
-        sftp_handle->channel = session->sftpInit_channel;
-        sftp_handle->request_id = 0;
+            sftp->partial_len = _libssh2_ntohu32(sftp->partial_size);
+            /* make sure we don't proceed if the packet size is unreasonably
+               large */
+            if (sftp->partial_len > LIBSSH2_SFTP_PACKET_MAXLEN)
+                return _libssh2_error(session,
+                                      LIBSSH2_ERROR_CHANNEL_PACKET_EXCEEDED,
+                                      "SFTP packet too large");
 
-        _libssh2_htonu32(session->sftpInit_buffer, 5);
-        session->sftpInit_buffer[4] = SSH_FXP_INIT;
-        _libssh2_htonu32(session->sftpInit_buffer + 5, LIBSSH2_SFTP_VERSION);
-        session->sftpInit_sent = 0; /* nothing's sent yet */
+            _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                           "Data begin - Packet Length: %lu",
+                           sftp->partial_len);
+            packet = sftp_packet_alloc(sftp, sftp->partial_len);
+            if (!packet)
+                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate SFTP packet");
+            sftp->partial_size_len = 0;
+            sftp->partial_received = 0; /* how much of the packet already
+                                           received */
+            sftp->partial_packet = packet;
 
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "Sending FXP_INIT packet advertising version %d support",
-                       (int) LIBSSH2_SFTP_VERSION);
+    window_adjust:
+            recv_window = libssh2_channel_window_read_ex(channel, NULL, NULL);
 
-        session->sftpInit_state = libssh2_NB_state_sent2;
-    }
+            if(sftp->partial_len > recv_window) {
+                /* ask for twice the data amount we need at once */
+                rc = _libssh2_channel_receive_window_adjust(channel,
+                                                            sftp->partial_len*2,
+                                                            1, NULL);
+                /* store the state so that we continue with the correct
+                   operation at next invoke */
+                sftp->packet_state = (rc == LIBSSH2_ERROR_EAGAIN)?
+                    libssh2_NB_state_sent:
+                    libssh2_NB_state_idle;
 
-    if (session->sftpInit_state == libssh2_NB_state_sent2) {
-        /* sent off what's left of the init buffer to send */
-        rc = _libssh2_channel_write(session->sftpInit_channel, 0,
-                                    session->sftpInit_buffer +
-                                    session->sftpInit_sent,
-                                    9 - session->sftpInit_sent);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
-            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
-                           "Would block sending SSH_FXP_INIT");
-            return NULL;
-        }
-        else if(rc < 0) {
-            _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                           "Unable to send SSH_FXP_INIT");
-            goto sftp_init_error;
+                if(rc == LIBSSH2_ERROR_EAGAIN)
+                    return rc;
+            }
         }
-        else {
-            /* add up the number of bytes sent */
-            session->sftpInit_sent += rc;
 
-            if(session->sftpInit_sent == 9)
-                /* move on */
-                session->sftpInit_state = libssh2_NB_state_sent3;
+        /* Read as much of the packet as we can */
+        while (sftp->partial_len > sftp->partial_received) {
+            rc = _libssh2_channel_read(channel, 0,
+                                       (char *)&packet[sftp->partial_received],
+                                       sftp->partial_len -
+                                       sftp->partial_received);
 
-            /* if less than 9, we remain in this state to send more later on */
+            if (rc == LIBSSH2_ERROR_EAGAIN) {
+                /*
+                 * We received EAGAIN, save what we have and return EAGAIN to
+                 * the caller. Set 'partial_packet' so that this function
+                 * knows how to continue on the next invoke.
+                 */
+                sftp->packet_state = libssh2_NB_state_sent1;
+                return rc;
+            }
+            else if (rc < 0) {
+                LIBSSH2_FREE(session, packet);
+                sftp->partial_packet = NULL;
+                return _libssh2_error(session, rc,
+                                      "Error waiting for SFTP packet");
+            }
+            sftp->partial_received += rc;
         }
-    }
 
-    rc = sftp_packet_require(sftp_handle, SSH_FXP_VERSION,
-                             0, &data, &data_len);
-    if (rc == LIBSSH2_ERROR_EAGAIN)
-        return NULL;
-    else if (rc) {
-        _libssh2_error(session, rc,
-                       "Timeout waiting for response from SFTP subsystem");
-        goto sftp_init_error;
-    }
-    if (data_len < 5) {
-        _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                       "Invalid SSH_FXP_VERSION response");
-        goto sftp_init_error;
-    }
+        sftp->partial_packet = NULL;
 
-    s = data + 1;
-    sftp_handle->version = _libssh2_ntohu32(s);
-    s += 4;
-    if (sftp_handle->version > LIBSSH2_SFTP_VERSION) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "Truncating remote SFTP version from %lu",
-                       sftp_handle->version);
-        sftp_handle->version = LIBSSH2_SFTP_VERSION;
+        /* sftp_packet_add takes ownership of the packet and might free it
+           so we take a copy of the packet type before we call it. */
+        packet_type = packet[0];
+        rc = sftp_packet_add(sftp, packet, sftp->partial_len);
+        if (rc) {
+            LIBSSH2_FREE(session, packet);
+            return rc;
+        }
+        else {
+            return packet_type;
+        }
     }
-    _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                   "Enabling SFTP version %lu compatability",
-                   sftp_handle->version);
-    while (s < (data + data_len)) {
-        size_t extname_len, extdata_len;
+    /* WON'T REACH */
+}
+/*
+ * sftp_packetlist_flush
+ *
+ * Remove all pending packets in the packet_list and the corresponding one(s)
+ * in the SFTP packet brigade.
+ */
+static void sftp_packetlist_flush(LIBSSH2_SFTP_HANDLE *handle)
+{
+    struct sftp_pipeline_chunk *chunk;
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
 
-        extname_len = _libssh2_ntohu32(s);
-        s += 4;
-        /* the extension name starts here */
-        s += extname_len;
+    /* remove pending packets, if any */
+    chunk = _libssh2_list_first(&handle->packet_list);
+    while(chunk) {
+        unsigned char *data;
+        size_t data_len;
+        int rc;
+        struct sftp_pipeline_chunk *next = _libssh2_list_next(&chunk->node);
+        int sent = (chunk->sent != 0);
+
+        if(chunk->lefttosend) {
+            /* a libssh2_sftp_write() chunk lacks its data only if it could
+               not be copied, the buffer can't be counted on any more */
+            int header_only = (chunk->packet[4] == SSH_FXP_WRITE) &&
+                !chunk->copied;
+
+            if(sftp_packet_abandon(sftp, chunk, header_only ? NULL :
+                                   &chunk->packet[chunk->sent],
+                                   chunk->lefttosend))
+                sent = 1;
+        }
 
-        extdata_len = _libssh2_ntohu32(s);
-        s += 4;
+        rc = sftp_packet_ask(sftp, SSH_FXP_STATUS,
+                             chunk->request_id, &data, &data_len);
+        if(rc)
+            rc = sftp_packet_ask(sftp, SSH_FXP_DATA,
+                                 chunk->request_id, &data, &data_len);
+        if(rc)
+            rc = sftp_packet_ask(sftp, SSH_FXP_NAME,
+                                 chunk->request_id, &data, &data_len);
 
-        /* TODO: Actually process extensions */
-        s += extdata_len;
+        if(!rc)
+            /* we found a packet, free it */
+            LIBSSH2_FREE(session, data);
+        else if(sent)
+            /* there was no incoming packet for this request, mark this
+               request as a zombie if it ever sent the request */
+            add_zombie_request(sftp, chunk->request_id);
 
+        _libssh2_list_remove(&chunk->node);
+        LIBSSH2_FREE(session, chunk);
+        chunk = next;
     }
-    LIBSSH2_FREE(session, data);
+}
 
-    /* Make sure that when the channel gets closed, the SFTP service is shut
-       down too */
-    sftp_handle->channel->abstract = sftp_handle;
-    sftp_handle->channel->close_cb = libssh2_sftp_dtor;
 
-    session->sftpInit_state = libssh2_NB_state_idle;
+/*
+ * sftp_packet_ask()
+ *
+ * Checks if there's a matching SFTP packet available.
+ */
+static int
+sftp_packet_ask(LIBSSH2_SFTP *sftp, unsigned char packet_type,
+                uint32_t request_id, unsigned char **data,
+                size_t *data_len)
+{
+    LIBSSH2_SFTP_PACKET *packet;
 
-    /* clear the sftp and channel pointers in this session struct now */
-    session->sftpInit_sftp = NULL;
-    session->sftpInit_channel = NULL;
+    /* Special consideration when getting VERSION packet */
 
-    _libssh2_list_init(&sftp_handle->sftp_handles);
+    if(packet_type == SSH_FXP_VERSION) {
+        packet = _libssh2_list_first(&sftp->packets);
+        while(packet && (packet->data[0] != SSH_FXP_VERSION))
+            packet = _libssh2_list_next(&packet->node);
+    }
+    else {
+        packet = sftp_index_find(&sftp->packet_index, request_id);
+        if(packet && (packet->data[0] != packet_type))
+            packet = NULL;
+        if(packet)
+            sftp_index_remove(&sftp->packet_index, request_id);
+    }
 
-    return sftp_handle;
+    if(!packet)
+        return -1;
 
-  sftp_init_error:
-    while (_libssh2_channel_free(session->sftpInit_channel) ==
-           LIBSSH2_ERROR_EAGAIN);
-    session->sftpInit_channel = NULL;
-    if (session->sftpInit_sftp) {
-        LIBSSH2_FREE(session, session->sftpInit_sftp);
-        session->sftpInit_sftp = NULL;
-    }
-    session->sftpInit_state = libssh2_NB_state_idle;
-    return NULL;
+    /* Match! Fetch the data */
+    *data = packet->data;
+    *data_len = packet->data_len;
+
+    /* unlink and recycle this struct */
+    _libssh2_list_remove(&packet->node);
+    sftp_packet_node_release(sftp, packet);
+
+    return 0;
 }
 
-/*
- * libssh2_sftp_init
- *
- * Startup an SFTP session
+/* sftp_packet_require
+ * A la libssh2_packet_require
  */
-LIBSSH2_API LIBSSH2_SFTP *libssh2_sftp_init(LIBSSH2_SESSION *session)
+static int
+sftp_packet_require(LIBSSH2_SFTP *sftp, unsigned char packet_type,
+                    uint32_t request_id, unsigned char **data,
+                    size_t *data_len)
 {
-    LIBSSH2_SFTP *ptr;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    int rc;
 
-    if(!session)
-        return NULL;
+    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Requiring packet %d id %ld",
+                   (int) packet_type, request_id);
 
-    if(!(session->state & LIBSSH2_STATE_AUTHENTICATED)) {
-        _libssh2_error(session, LIBSSH2_ERROR_INVAL,
-                       "session not authenticated yet");
-        return NULL;
+    if (sftp_packet_ask(sftp, packet_type, request_id, data, data_len) == 0) {
+        /* The right packet was available in the packet brigade */
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Got %d",
+                       (int) packet_type);
+        return LIBSSH2_ERROR_NONE;
     }
 
-    BLOCK_ADJUST_ERRNO(ptr, session, sftp_init(session));
-    return ptr;
+    while (session->socket_state == LIBSSH2_SOCKET_CONNECTED) {
+        rc = sftp_packet_read(sftp);
+        if (rc < 0)
+            return rc;
+
+        /* data was read, check the queue again */
+        if (!sftp_packet_ask(sftp, packet_type, request_id, data, data_len)) {
+            /* The right packet was available in the packet brigade */
+            _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Got %d",
+                           (int) packet_type);
+            return LIBSSH2_ERROR_NONE;
+        }
+    }
+
+    /* Only reached if the socket died */
+    return LIBSSH2_ERROR_SOCKET_DISCONNECT;
 }
 
-/*
- * sftp_shutdown
- *
- * Shutsdown the SFTP subsystem
+/* sftp_packet_requirev
+ * Require one of N possible reponses
  */
 static int
-sftp_shutdown(LIBSSH2_SFTP *sftp)
+sftp_packet_requirev(LIBSSH2_SFTP *sftp, int num_valid_responses,
+                     const unsigned char *valid_responses,
+                     uint32_t request_id, unsigned char **data,
+                     size_t *data_len)
 {
+    int i;
     int rc;
-    LIBSSH2_SESSION *session = sftp->channel->session;
-    /*
-     * Make sure all memory used in the state variables are free
-     */
-    if (sftp->partial_packet) {
-        LIBSSH2_FREE(session, sftp->partial_packet);
-        sftp->partial_packet = NULL;
-    }
-    if (sftp->open_packet) {
-        LIBSSH2_FREE(session, sftp->open_packet);
-        sftp->open_packet = NULL;
-    }
-    if (sftp->readdir_packet) {
-        LIBSSH2_FREE(session, sftp->readdir_packet);
-        sftp->readdir_packet = NULL;
-    }
-    if (sftp->fstat_packet) {
-        LIBSSH2_FREE(session, sftp->fstat_packet);
-        sftp->fstat_packet = NULL;
-    }
-    if (sftp->unlink_packet) {
-        LIBSSH2_FREE(session, sftp->unlink_packet);
-        sftp->unlink_packet = NULL;
+
+    /* If no timeout is active, start a new one */
+    if (sftp->requirev_start == 0)
+        sftp->requirev_start = _libssh2_time_ms();
+
+    while (sftp->channel->session->socket_state == LIBSSH2_SOCKET_CONNECTED) {
+        for(i = 0; i < num_valid_responses; i++) {
+            if (sftp_packet_ask(sftp, valid_responses[i], request_id,
+                                data, data_len) == 0) {
+                /*
+                 * Set to zero before all returns to say
+                 * the timeout is not active
+                 */
+                sftp->requirev_start = 0;
+                return LIBSSH2_ERROR_NONE;
+            }
+        }
+
+        rc = sftp_packet_read(sftp);
+        if ((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN)) {
+            sftp->requirev_start = 0;
+            return rc;
+        } else if (rc <= 0) {
+            /* prevent busy-looping */
+            long left = LIBSSH2_READ_TIMEOUT * 1000 -
+                (long)(_libssh2_time_ms() - sftp->requirev_start);
+
+            if (left <= 0) {
+                sftp->requirev_start = 0;
+                return LIBSSH2_ERROR_TIMEOUT;
+            }
+            else if (rc == LIBSSH2_ERROR_EAGAIN) {
+                return rc;
+            }
+        }
     }
-    if (sftp->rename_packet) {
-        LIBSSH2_FREE(session, sftp->rename_packet);
-        sftp->rename_packet = NULL;
+
+    sftp->requirev_start = 0;
+
+    /* Only reached if the socket died */
+    return LIBSSH2_ERROR_SOCKET_DISCONNECT;
+}
+
+/* sftp_attr2bin
+ * Populate attributes into an SFTP block
+ */
+static ssize_t
+sftp_attr2bin(unsigned char *p, const LIBSSH2_SFTP_ATTRIBUTES * attrs)
+{
+    unsigned char *s = p;
+    uint32_t flag_mask =
+        LIBSSH2_SFTP_ATTR_SIZE | LIBSSH2_SFTP_ATTR_UIDGID |
+        LIBSSH2_SFTP_ATTR_PERMISSIONS | LIBSSH2_SFTP_ATTR_ACMODTIME;
+
+    /* TODO: When we add SFTP4+ functionality flag_mask can get additional
+       bits */
+
+    if (!attrs) {
+        _libssh2_htonu32(s, 0);
+        return 4;
     }
-    if (sftp->fstatvfs_packet) {
-        LIBSSH2_FREE(session, sftp->fstatvfs_packet);
-        sftp->fstatvfs_packet = NULL;
+
+    _libssh2_store_u32(&s, attrs->flags & flag_mask);
+
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_SIZE) {
+        _libssh2_store_u64(&s, attrs->filesize);
     }
-    if (sftp->statvfs_packet) {
-        LIBSSH2_FREE(session, sftp->statvfs_packet);
-        sftp->statvfs_packet = NULL;
+
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_UIDGID) {
+        _libssh2_store_u32(&s, attrs->uid);
+        _libssh2_store_u32(&s, attrs->gid);
     }
-    if (sftp->mkdir_packet) {
-        LIBSSH2_FREE(session, sftp->mkdir_packet);
-        sftp->mkdir_packet = NULL;
+
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) {
+        _libssh2_store_u32(&s, attrs->permissions);
     }
-    if (sftp->rmdir_packet) {
-        LIBSSH2_FREE(session, sftp->rmdir_packet);
-        sftp->rmdir_packet = NULL;
+
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
+        _libssh2_store_u32(&s, attrs->atime);
+        _libssh2_store_u32(&s, attrs->mtime);
     }
-    if (sftp->stat_packet) {
-        LIBSSH2_FREE(session, sftp->stat_packet);
-        sftp->stat_packet = NULL;
+
+    return (s - p);
+}
+
+/* sftp_bin2attr
+ */
+static int
+sftp_bin2attr(LIBSSH2_SFTP_ATTRIBUTES * attrs, const unsigned char *p)
+{
+    const unsigned char *s = p;
+
+    memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
+    attrs->flags = _libssh2_ntohu32(s);
+    s += 4;
+
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_SIZE) {
+        attrs->filesize = _libssh2_ntohu64(s);
+        s += 8;
     }
-    if (sftp->symlink_packet) {
-        LIBSSH2_FREE(session, sftp->symlink_packet);
-        sftp->symlink_packet = NULL;
+
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_UIDGID) {
+        attrs->uid = _libssh2_ntohu32(s);
+        s += 4;
+        attrs->gid = _libssh2_ntohu32(s);
+        s += 4;
     }
-    if (sftp->fsync_packet) {
-        LIBSSH2_FREE(session, sftp->fsync_packet);
-        sftp->fsync_packet = NULL;
+
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) {
+        attrs->permissions = _libssh2_ntohu32(s);
+        s += 4;
     }
 
-    sftp_packet_flush(sftp);
+    if (attrs->flags & LIBSSH2_SFTP_ATTR_ACMODTIME) {
+        attrs->atime = _libssh2_ntohu32(s);
+        s += 4;
+        attrs->mtime = _libssh2_ntohu32(s);
+        s += 4;
+    }
 
-    /* TODO: We should consider walking over the sftp_handles list and kill
-     * any remaining sftp handles ... */
+    return (s - p);
+}
 
-    rc = _libssh2_channel_free(sftp->channel);
+/* ************
+ * SFTP API *
+ ************ */
 
-    return rc;
-}
+LIBSSH2_CHANNEL_CLOSE_FUNC(libssh2_sftp_dtor);
 
-/* libssh2_sftp_shutdown
- * Shutsdown the SFTP subsystem
+/* libssh2_sftp_dtor
+ * Shutdown an SFTP stream when the channel closes
  */
-LIBSSH2_API int
-libssh2_sftp_shutdown(LIBSSH2_SFTP *sftp)
+LIBSSH2_CHANNEL_CLOSE_FUNC(libssh2_sftp_dtor)
 {
-    int rc;
-    if(!sftp)
-        return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, sftp->channel->session, sftp_shutdown(sftp));
-    return rc;
-}
+    LIBSSH2_SFTP *sftp = (LIBSSH2_SFTP *) (*channel_abstract);
 
-/* *******************************
- * SFTP File and Directory Ops *
- ******************************* */
+    (void) session_abstract;
+    (void) channel;
 
-/* sftp_open
+    /* Free the partial packet storage for sftp_packet_read */
+    if (sftp->partial_packet) {
+        LIBSSH2_FREE(session, sftp->partial_packet);
+    }
+
+    /* the channel may close without libssh2_sftp_shutdown(), as when the
+       session is freed */
+    if (sftp->walk) {
+        sftp_walk_free(sftp, sftp->walk, 0);
+        sftp->walk = NULL;
+    }
+    sftp_cache_config(sftp, 0, 0);
+
+    sftp_packet_flush(sftp);
+    sftp_leftover_free(sftp);
+
+    LIBSSH2_FREE(session, sftp);
+}
+
+/*
+ * sftp_version
+ *
+ * Take the version and the extensions from an FXP_VERSION packet, which is
+ * freed. Returns non-zero if the server supports limits@openssh.com.
  */
-static LIBSSH2_SFTP_HANDLE *
-sftp_open(LIBSSH2_SFTP *sftp, const char *filename,
-          size_t filename_len, uint32_t flags, long mode,
-          int open_type)
+static int sftp_version(LIBSSH2_SFTP *sftp, unsigned char *data,
+                        size_t data_len)
 {
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
-    LIBSSH2_SFTP_HANDLE *fp;
-    LIBSSH2_SFTP_ATTRIBUTES attrs = {
-        LIBSSH2_SFTP_ATTR_PERMISSIONS, 0, 0, 0, 0, 0, 0
-    };
-    unsigned char *s;
-    ssize_t rc;
-    int open_file = (open_type == LIBSSH2_SFTP_OPENFILE)?1:0;
-
-    if (sftp->open_state == libssh2_NB_state_idle) {
-        /* packet_len(4) + packet_type(1) + request_id(4) + filename_len(4) +
-           flags(4) */
-        sftp->open_packet_len = filename_len + 13 +
-            (open_file? (4 + sftp_attrsize(LIBSSH2_SFTP_ATTR_PERMISSIONS)) : 0);
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    unsigned char *s = data + 1;
+    unsigned char *end = data + data_len;
+    int limits = 0;
 
-        /* surprise! this starts out with nothing sent */
-        sftp->open_packet_sent = 0;
-        s = sftp->open_packet = LIBSSH2_ALLOC(session, sftp->open_packet_len);
-        if (!sftp->open_packet) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Unable to allocate memory for FXP_OPEN or "
-                           "FXP_OPENDIR packet");
-            return NULL;
-        }
-        /* Filetype in SFTP 3 and earlier */
-        attrs.permissions = mode |
-            (open_file ? LIBSSH2_SFTP_ATTR_PFILETYPE_FILE :
-             LIBSSH2_SFTP_ATTR_PFILETYPE_DIR);
+    sftp->version = _libssh2_ntohu32(s);
+    s += 4;
+    if (sftp->version > LIBSSH2_SFTP_VERSION) {
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "Truncating remote SFTP version from %lu",
+                       sftp->version);
+        sftp->version = LIBSSH2_SFTP_VERSION;
+    }
+    _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                   "Enabling SFTP version %lu compatability",
+                   sftp->version);
+    while ((end - s) >= 4) {
+        size_t extname_len, extdata_len;
+        unsigned char *extname;
 
-        _libssh2_store_u32(&s, sftp->open_packet_len - 4);
-        *(s++) = open_file? SSH_FXP_OPEN : SSH_FXP_OPENDIR;
-        sftp->open_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->open_request_id);
-        _libssh2_store_str(&s, filename, filename_len);
+        extname_len = _libssh2_ntohu32(s);
+        s += 4;
+        if ((size_t)(end - s) < extname_len + 4)
+            break;
+        /* the extension name starts here */
+        extname = s;
+        s += extname_len;
 
-        if (open_file) {
-            _libssh2_store_u32(&s, flags);
-            s += sftp_attr2bin(s, &attrs);
-        }
+        extdata_len = _libssh2_ntohu32(s);
+        s += 4;
+        if ((size_t)(end - s) < extdata_len)
+            break;
 
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Sending %s open request",
-                       open_file? "file" : "directory");
+        if ((extname_len == 18) && !memcmp(extname, "limits@openssh.com", 18))
+            limits = 1;
 
-        sftp->open_state = libssh2_NB_state_created;
+        s += extdata_len;
     }
+    LIBSSH2_FREE(session, data);
 
-    if (sftp->open_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, sftp->open_packet+
-                                    sftp->open_packet_sent,
-                                    sftp->open_packet_len -
-                                    sftp->open_packet_sent);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
-            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
-                           "Would block sending FXP_OPEN or FXP_OPENDIR command");
-            return NULL;
-        }
-        else if(rc < 0) {
-            _libssh2_error(session, rc, "Unable to send FXP_OPEN*");
-            LIBSSH2_FREE(session, sftp->open_packet);
-            sftp->open_packet = NULL;
-            sftp->open_state = libssh2_NB_state_idle;
-            return NULL;
-        }
+    return limits;
+}
 
-        /* bump the sent counter and remain in this state until the whole
-           data is off */
-        sftp->open_packet_sent += rc;
+/*
+ * sftp_init
+ *
+ * Startup an SFTP session
+ */
+static LIBSSH2_SFTP *sftp_init(LIBSSH2_SESSION *session)
+{
+    unsigned char *data, *s;
+    size_t data_len;
+    ssize_t rc;
+    LIBSSH2_SFTP *sftp_handle;
 
-        if(sftp->open_packet_len == sftp->open_packet_sent) {
-            LIBSSH2_FREE(session, sftp->open_packet);
-            sftp->open_packet = NULL;
+    if (session->sftpInit_state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "Initializing SFTP subsystem");
 
-            sftp->open_state = libssh2_NB_state_sent;
+        /*
+         * The 'sftpInit_sftp' and 'sftpInit_channel' struct fields within the
+         * session struct are only to be used during the setup phase. As soon
+         * as the SFTP session is created they are cleared and can thus be
+         * re-used again to allow any amount of SFTP handles per sessions.
+         *
+         * Note that you MUST NOT try to call libssh2_sftp_init() again to get
+         * another handle until the previous call has finished and either
+         * succesffully made a handle or failed and returned error (not
+         * including *EAGAIN).
+         */
+
+        assert(session->sftpInit_sftp == NULL);
+        session->sftpInit_sftp = NULL;
+        session->sftpInit_state = libssh2_NB_state_created;
+    }
+
+    sftp_handle = session->sftpInit_sftp;
+
+    if (session->sftpInit_state == libssh2_NB_state_created) {
+        session->sftpInit_channel =
+            _libssh2_channel_open(session, "session", sizeof("session") - 1,
+                                  LIBSSH2_CHANNEL_WINDOW_DEFAULT,
+                                  LIBSSH2_CHANNEL_PACKET_DEFAULT, NULL, 0);
+        if (!session->sftpInit_channel) {
+            if (libssh2_session_last_errno(session) == LIBSSH2_ERROR_EAGAIN) {
+                _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                               "Would block starting up channel");
+            }
+            else {
+                _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                               "Unable to startup channel");
+                session->sftpInit_state = libssh2_NB_state_idle;
+            }
+            return NULL;
         }
+
+        session->sftpInit_state = libssh2_NB_state_sent;
     }
 
-    if (sftp->open_state == libssh2_NB_state_sent) {
-        size_t data_len;
-        unsigned char *data;
-        static const unsigned char fopen_responses[2] =
-            { SSH_FXP_HANDLE, SSH_FXP_STATUS };
-        rc = sftp_packet_requirev(sftp, 2, fopen_responses,
-                                  sftp->open_request_id, &data,
-                                  &data_len);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
+    if (session->sftpInit_state == libssh2_NB_state_sent) {
+        int ret = _libssh2_channel_process_startup(session->sftpInit_channel,
+                                                   "subsystem",
+                                                   sizeof("subsystem") - 1, "sftp",
+                                                   strlen("sftp"));
+        if (ret == LIBSSH2_ERROR_EAGAIN) {
             _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
-                           "Would block waiting for status message");
+                           "Would block to request SFTP subsystem");
             return NULL;
+        } else if (ret) {
+            _libssh2_error(session, LIBSSH2_ERROR_CHANNEL_FAILURE,
+                           "Unable to request SFTP subsystem");
+            goto sftp_init_error;
         }
-        sftp->open_state = libssh2_NB_state_idle;
-        if (rc) {
-            _libssh2_error(session, rc, "Timeout waiting for status message");
+
+        session->sftpInit_state = libssh2_NB_state_sent1;
+    }
+
+    if (session->sftpInit_state == libssh2_NB_state_sent1) {
+        rc = _libssh2_channel_extended_data(session->sftpInit_channel,
+                                            LIBSSH2_CHANNEL_EXTENDED_DATA_IGNORE);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                           "Would block requesting handle extended data");
             return NULL;
         }
 
-        /* OPEN can basically get STATUS or HANDLE back, where HANDLE implies
-           a fine response while STATUS means error. It seems though that at
-           times we get an SSH_FX_OK back in a STATUS, followed the "real"
-           HANDLE so we need to properly deal with that. */
-        if (data[0] == SSH_FXP_STATUS) {
-            int badness = 1;
+        sftp_handle =
+            session->sftpInit_sftp =
+            LIBSSH2_ALLOC(session, sizeof(LIBSSH2_SFTP));
+        if (!sftp_handle) {
+            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                           "Unable to allocate a new SFTP structure");
+            goto sftp_init_error;
+        }
+        memset(sftp_handle, 0, sizeof(LIBSSH2_SFTP));
+        sftp_handle->channel = session->sftpInit_channel;
+        sftp_handle->request_id = 0;
+        sftp_handle->read_size = MAX_SFTP_READ_SIZE;
 
-            if(data_len < 9) {
-                _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                               "Too small FXP_STATUS");
-                LIBSSH2_FREE(session, data);
-                return NULL;
-            }
+        _libssh2_htonu32(session->sftpInit_buffer, 5);
+        session->sftpInit_buffer[4] = SSH_FXP_INIT;
+        _libssh2_htonu32(session->sftpInit_buffer + 5, LIBSSH2_SFTP_VERSION);
+        session->sftpInit_sent = 0; /* nothing's sent yet */
 
-            sftp->last_errno = _libssh2_ntohu32(data + 5);
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "Sending FXP_INIT packet advertising version %d support",
+                       (int) LIBSSH2_SFTP_VERSION);
 
-            if(LIBSSH2_FX_OK == sftp->last_errno) {
-                _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "got HANDLE FXOK!");
+        session->sftpInit_state = libssh2_NB_state_sent2;
+    }
 
-                LIBSSH2_FREE(session, data);
+    if (session->sftpInit_state == libssh2_NB_state_sent2) {
+        /* sent off what's left of the init buffer to send */
+        rc = _libssh2_channel_write(session->sftpInit_channel, 0,
+                                    session->sftpInit_buffer +
+                                    session->sftpInit_sent,
+                                    9 - session->sftpInit_sent);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                           "Would block sending SSH_FXP_INIT");
+            return NULL;
+        }
+        else if(rc < 0) {
+            _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                           "Unable to send SSH_FXP_INIT");
+            goto sftp_init_error;
+        }
+        else {
+            /* add up the number of bytes sent */
+            session->sftpInit_sent += rc;
 
-                /* silly situation, but check for a HANDLE */
-                rc = sftp_packet_require(sftp, SSH_FXP_HANDLE,
-                                         sftp->open_request_id, &data,
-                                         &data_len);
-                if(rc == LIBSSH2_ERROR_EAGAIN) {
-                    /* go back to sent state and wait for something else */
-                    sftp->open_state = libssh2_NB_state_sent;
-                    return NULL;
-                }
-                else if(!rc)
-                    /* we got the handle so this is not a bad situation */
-                    badness = 0;
-            }
+            if(session->sftpInit_sent == 9)
+                /* move on */
+                session->sftpInit_state = libssh2_NB_state_sent3;
 
-            if(badness) {
-                _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                               "Failed opening remote file");
-                _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "got FXP_STATUS %d",
-                               sftp->last_errno);
-                LIBSSH2_FREE(session, data);
-                return NULL;
-            }
+            /* if less than 9, we remain in this state to send more later on */
         }
+    }
 
-        if(data_len < 10) {
+    if (session->sftpInit_state == libssh2_NB_state_sent3) {
+        rc = sftp_packet_require(sftp_handle, SSH_FXP_VERSION,
+                                 0, &data, &data_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return NULL;
+        else if (rc) {
+            _libssh2_error(session, rc,
+                           "Timeout waiting for response from SFTP "
+                           "subsystem");
+            goto sftp_init_error;
+        }
+        if (data_len < 5) {
             _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                           "Too small FXP_HANDLE");
+                           "Invalid SSH_FXP_VERSION response");
             LIBSSH2_FREE(session, data);
-            return NULL;
+            goto sftp_init_error;
+        }
+        if (sftp_version(sftp_handle, data, data_len)) {
+            /* the server tells how large reads it serves */
+            s = session->sftpInit_buffer;
+
+            _libssh2_store_u32(&s, 27);
+            *(s++) = SSH_FXP_EXTENDED;
+            sftp_handle->limits_request_id = sftp_handle->request_id++;
+            _libssh2_store_u32(&s, sftp_handle->limits_request_id);
+            _libssh2_store_str(&s, "limits@openssh.com", 18);
+            session->sftpInit_sent = 0;
+
+            session->sftpInit_state = libssh2_NB_state_sent4;
         }
+        else
+            session->sftpInit_state = libssh2_NB_state_sent6;
+    }
 
-        fp = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_SFTP_HANDLE));
-        if (!fp) {
-            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                           "Unable to allocate new SFTP handle structure");
-            LIBSSH2_FREE(session, data);
+    if (session->sftpInit_state == libssh2_NB_state_sent4) {
+        rc = _libssh2_channel_write(session->sftpInit_channel, 0,
+                                    session->sftpInit_buffer +
+                                    session->sftpInit_sent,
+                                    31 - session->sftpInit_sent);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                           "Would block sending limits request");
             return NULL;
         }
-        memset(fp, 0, sizeof(LIBSSH2_SFTP_HANDLE));
-        fp->handle_type = open_file ? LIBSSH2_SFTP_HANDLE_FILE :
-            LIBSSH2_SFTP_HANDLE_DIR;
+        else if(rc < 0) {
+            _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                           "Unable to send limits request");
+            goto sftp_init_error;
+        }
+        session->sftpInit_sent += rc;
+        if(session->sftpInit_sent == 31)
+            session->sftpInit_state = libssh2_NB_state_sent5;
+    }
 
-        fp->handle_len = _libssh2_ntohu32(data + 5);
-        if (fp->handle_len > SFTP_HANDLE_MAXLEN)
-            /* SFTP doesn't allow handles longer than 256 characters */
-            fp->handle_len = SFTP_HANDLE_MAXLEN;
+    if (session->sftpInit_state == libssh2_NB_state_sent5) {
+        static const unsigned char limits_responses[2] =
+            { SSH_FXP_EXTENDED_REPLY, SSH_FXP_STATUS };
 
-        if(fp->handle_len > (data_len - 9))
-            /* do not reach beyond the end of the data we got */
-            fp->handle_len = data_len - 9;
+        rc = sftp_packet_requirev(sftp_handle, 2, limits_responses,
+                                  sftp_handle->limits_request_id,
+                                  &data, &data_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
+            return NULL;
+        else if (rc) {
+            _libssh2_error(session, rc,
+                           "Timeout waiting for limits response");
+            goto sftp_init_error;
+        }
 
-        memcpy(fp->handle, data + 9, fp->handle_len);
+        /* type(1) + request_id(4) + max-packet-length(8) +
+           max-read-length(8) + max-write-length(8) + max-open-handles(8) */
+        if ((data[0] == SSH_FXP_EXTENDED_REPLY) && (data_len >= 37)) {
+            libssh2_uint64_t max_read = _libssh2_ntohu64(data + 13);
 
+            /* zero means no limit is known, stay with the default */
+            if (max_read) {
+                if (max_read > MAX_SFTP_READ_SIZE_LIMIT)
+                    max_read = MAX_SFTP_READ_SIZE_LIMIT;
+                sftp_handle->read_size = (uint32_t)max_read;
+            }
+            _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                           "Server allows reads of %lu bytes, using %lu",
+                           (unsigned long)_libssh2_ntohu64(data + 13),
+                           (unsigned long)sftp_handle->read_size);
+        }
+        /* a STATUS reply only means the limits are unknown */
         LIBSSH2_FREE(session, data);
 
-        /* add this file handle to the list kept in the sftp session */
-        _libssh2_list_add(&sftp->sftp_handles, &fp->node);
+        session->sftpInit_state = libssh2_NB_state_sent6;
+    }
 
-        fp->sftp = sftp; /* point to the parent struct */
+    if (session->sftpInit_state != libssh2_NB_state_sent6) {
+        /* the FXP_INIT packet is not all sent yet */
+        _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                       "Would block sending SSH_FXP_INIT");
+        return NULL;
+    }
 
-        fp->u.file.offset = 0;
-        fp->u.file.offset_sent = 0;
+    /* Make sure that when the channel gets closed, the SFTP service is shut
+       down too */
+    sftp_handle->channel->abstract = sftp_handle;
+    sftp_handle->channel->close_cb = libssh2_sftp_dtor;
 
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Open command successful");
-        return fp;
+    session->sftpInit_state = libssh2_NB_state_idle;
+
+    /* clear the sftp and channel pointers in this session struct now */
+    session->sftpInit_sftp = NULL;
+    session->sftpInit_channel = NULL;
+
+    _libssh2_list_init(&sftp_handle->sftp_handles);
+    _libssh2_list_init(&sftp_handle->leftovers);
+    _libssh2_list_init(&sftp_handle->cache.entries);
+
+    /* the replies to FXP_READ requests are recycled from here on */
+    sftp_handle->pool_size = sftp_handle->read_size + 9;
+
+    return sftp_handle;
+
+  sftp_init_error:
+    while (_libssh2_channel_free(session->sftpInit_channel) ==
+           LIBSSH2_ERROR_EAGAIN);
+    session->sftpInit_channel = NULL;
+    if (session->sftpInit_sftp) {
+        LIBSSH2_FREE(session, session->sftpInit_sftp);
+        session->sftpInit_sftp = NULL;
     }
+    session->sftpInit_state = libssh2_NB_state_idle;
     return NULL;
 }
 
-/* libssh2_sftp_open_ex
- */
-LIBSSH2_API LIBSSH2_SFTP_HANDLE *
-libssh2_sftp_open_ex(LIBSSH2_SFTP *sftp, const char *filename,
-                     unsigned int filename_len, unsigned long flags, long mode,
-                     int open_type)
+/*
+ * libssh2_sftp_init
+ *
+ * Startup an SFTP session
+ */
+LIBSSH2_API LIBSSH2_SFTP *libssh2_sftp_init(LIBSSH2_SESSION *session)
 {
-    LIBSSH2_SFTP_HANDLE *hnd;
+    LIBSSH2_SFTP *ptr;
 
-    if(!sftp)
+    if(!session)
         return NULL;
 
-    BLOCK_ADJUST_ERRNO(hnd, sftp->channel->session,
-                       sftp_open(sftp, filename, filename_len, flags, mode,
-                                 open_type));
-    return hnd;
+    if(!(session->state & LIBSSH2_STATE_AUTHENTICATED)) {
+        _libssh2_error(session, LIBSSH2_ERROR_INVAL,
+                       "session not authenticated yet");
+        return NULL;
+    }
+
+    BLOCK_ADJUST_ERRNO(ptr, session, sftp_init(session));
+    return ptr;
 }
 
 /*
- * sftp_read
- *
- * Read from an SFTP file handle
+ * sftp_shutdown
  *
+ * Shutsdown the SFTP subsystem
  */
-static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
-                         size_t buffer_size)
+static int
+sftp_shutdown(LIBSSH2_SFTP *sftp)
 {
-    LIBSSH2_SFTP *sftp = handle->sftp;
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
-    size_t count = 0;
-    struct sftp_pipeline_chunk *chunk;
-    struct sftp_pipeline_chunk *next;
-    ssize_t rc;
-    struct _libssh2_sftp_handle_file_data *filep =
-        &handle->u.file;
+    int rc;
+    LIBSSH2_SESSION *session = sftp->channel->session;
 
-    /* This function can be interrupted in three different places where it
-       might need to wait for data from the network.  It returns EAGAIN to
-       allow non-blocking clients to do other work but these client are
-       expected to call this function again (possibly many times) to finish
-       the operation.
+    if (session->request_count)
+        _libssh2_request_cancel(session, sftp);
 
-       The tricky part is that if we previously aborted a sftp_read due to
-       EAGAIN, we must continue at the same spot to continue the previously
-       interrupted operation.  This is done using a state machine to record
-       what phase of execution we were at.  The state is stored in
-       sftp->read_state.
+    /*
+     * Make sure all memory used in the state variables are free
+     */
+    if (sftp->partial_packet) {
+        LIBSSH2_FREE(session, sftp->partial_packet);
+        sftp->partial_packet = NULL;
+    }
+    if (sftp->open_packet) {
+        LIBSSH2_FREE(session, sftp->open_packet);
+        sftp->open_packet = NULL;
+    }
+    if (sftp->fstat_packet) {
+        LIBSSH2_FREE(session, sftp->fstat_packet);
+        sftp->fstat_packet = NULL;
+    }
+    if (sftp->unlink_packet) {
+        LIBSSH2_FREE(session, sftp->unlink_packet);
+        sftp->unlink_packet = NULL;
+    }
+    if (sftp->rename_packet) {
+        LIBSSH2_FREE(session, sftp->rename_packet);
+        sftp->rename_packet = NULL;
+    }
+    if (sftp->fstatvfs_packet) {
+        LIBSSH2_FREE(session, sftp->fstatvfs_packet);
+        sftp->fstatvfs_packet = NULL;
+    }
+    if (sftp->statvfs_packet) {
+        LIBSSH2_FREE(session, sftp->statvfs_packet);
+        sftp->statvfs_packet = NULL;
+    }
+    if (sftp->mkdir_packet) {
+        LIBSSH2_FREE(session, sftp->mkdir_packet);
+        sftp->mkdir_packet = NULL;
+    }
+    if (sftp->rmdir_packet) {
+        LIBSSH2_FREE(session, sftp->rmdir_packet);
+        sftp->rmdir_packet = NULL;
+    }
+    if (sftp->stat_packet) {
+        LIBSSH2_FREE(session, sftp->stat_packet);
+        sftp->stat_packet = NULL;
+    }
+    if (sftp->symlink_packet) {
+        LIBSSH2_FREE(session, sftp->symlink_packet);
+        sftp->symlink_packet = NULL;
+    }
+    if (sftp->fsync_packet) {
+        LIBSSH2_FREE(session, sftp->fsync_packet);
+        sftp->fsync_packet = NULL;
+    }
 
-       libssh2_NB_state_idle: The first phase is where we prepare multiple
-       FXP_READ packets to do optimistic read-ahead.  We send off as many as
-       possible in the second phase without waiting for a response to each
-       one; this is the key to fast reads. But we may have to adjust the
-       channel window size to do this which may interrupt this function while
-       waiting.  The state machine saves the phase as libssh2_NB_state_idle so
-       it returns here on the next call.
+    if (sftp->walk) {
+        sftp_walk_free(sftp, sftp->walk, 0);
+        sftp->walk = NULL;
+    }
 
-       libssh2_NB_state_sent: The second phase is where we send the FXP_READ
-       packets.  Writing them to the channel can be interrupted with EAGAIN
-       but the state machine ensures we skip the first phase on the next call
-       and resume sending.
+    sftp_cache_config(sftp, 0, 0);
 
-       libssh2_NB_state_sent2: In the third phase (indicated by ) we read the
-       data from the responses that have arrived so far.  Reading can be
-       interrupted with EAGAIN but the state machine ensures we skip the first
-       and second phases on the next call and resume sending.
-    */
+    sftp_packet_flush(sftp);
+    sftp_leftover_free(sftp);
 
-    switch (sftp->read_state) {
-    case libssh2_NB_state_idle:
+    /* TODO: We should consider walking over the sftp_handles list and kill
+     * any remaining sftp handles ... */
 
-        /* Some data may already have been read from the server in the
-           previous call but didn't fit in the buffer at the time.  If so, we
-           return that now as we can't risk being interrupted later with data
-           partially written to the buffer. */
-        if(filep->data_left) {
-            size_t copy = MIN(buffer_size, filep->data_left);
+    rc = _libssh2_channel_free(sftp->channel);
 
-            memcpy(buffer, &filep->data[ filep->data_len - filep->data_left],
-                   copy);
+    return rc;
+}
 
-            filep->data_left -= copy;
-            filep->offset += copy;
+/* libssh2_sftp_shutdown
+ * Shutsdown the SFTP subsystem
+ */
+LIBSSH2_API int
+libssh2_sftp_shutdown(LIBSSH2_SFTP *sftp)
+{
+    LIBSSH2_SESSION *session;
+    int rc;
+    if(!sftp)
+        return LIBSSH2_ERROR_BAD_USE;
+    /* sftp is freed before BLOCK_ADJUST releases the session */
+    session = sftp->channel->session;
+    BLOCK_ADJUST(rc, session, sftp_shutdown(sftp));
+    return rc;
+}
 
-            if(!filep->data_left) {
-                LIBSSH2_FREE(session, filep->data);
-                filep->data = NULL;
-            }
+/* *******************************
+ * SFTP File and Directory Ops *
+ ******************************* */
 
-            return copy;
+/* sftp_open
+ */
+static LIBSSH2_SFTP_HANDLE *
+sftp_open(LIBSSH2_SFTP *sftp, const char *filename,
+          size_t filename_len, uint32_t flags, long mode,
+          int open_type)
+{
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    LIBSSH2_SFTP_HANDLE *fp;
+    LIBSSH2_SFTP_ATTRIBUTES attrs = {
+        LIBSSH2_SFTP_ATTR_PERMISSIONS, 0, 0, 0, 0, 0, 0
+    };
+    unsigned char *s;
+    ssize_t rc;
+    int open_file = (open_type == LIBSSH2_SFTP_OPENFILE)?1:0;
+
+    if (sftp->open_state == libssh2_NB_state_idle) {
+        /* packet_len(4) + packet_type(1) + request_id(4) + filename_len(4) +
+           flags(4) */
+        sftp->open_packet_len = filename_len + 13 +
+            (open_file? (4 + sftp_attrsize(LIBSSH2_SFTP_ATTR_PERMISSIONS)) : 0);
+
+        /* surprise! this starts out with nothing sent */
+        sftp->open_packet_sent = 0;
+        s = sftp->open_packet = LIBSSH2_ALLOC(session, sftp->open_packet_len);
+        if (!sftp->open_packet) {
+            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                           "Unable to allocate memory for FXP_OPEN or "
+                           "FXP_OPENDIR packet");
+            return NULL;
         }
+        /* Filetype in SFTP 3 and earlier */
+        attrs.permissions = mode |
+            (open_file ? LIBSSH2_SFTP_ATTR_PFILETYPE_FILE :
+             LIBSSH2_SFTP_ATTR_PFILETYPE_DIR);
 
-        /* We allow a number of bytes being requested at any given time
-           without having been acked - until we reach EOF. */
-        if(!filep->eof) {
-            /* Number of bytes asked for that haven't been acked yet */
-            size_t already = (filep->offset_sent - filep->offset);
+        _libssh2_store_u32(&s, sftp->open_packet_len - 4);
+        *(s++) = open_file? SSH_FXP_OPEN : SSH_FXP_OPENDIR;
+        sftp->open_request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, sftp->open_request_id);
+        _libssh2_store_str(&s, filename, filename_len);
 
-            size_t max_read_ahead = buffer_size*4;
-            unsigned long recv_window;
+        if (open_file) {
+            _libssh2_store_u32(&s, flags);
+            s += sftp_attr2bin(s, &attrs);
+        }
 
-            if(max_read_ahead > LIBSSH2_CHANNEL_WINDOW_DEFAULT*4)
-                max_read_ahead = LIBSSH2_CHANNEL_WINDOW_DEFAULT*4;
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Sending %s open request",
+                       open_file? "file" : "directory");
 
-            /* if the buffer_size passed in now is smaller than what has
-               already been sent, we risk getting count become a very large
-               number */
-            if(max_read_ahead > already)
-                count = max_read_ahead - already;
+        if (open_file && (flags & (LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC)))
+            sftp_cache_forget(sftp, filename, filename_len,
+                              (flags & LIBSSH2_FXF_CREAT) ?
+                              SFTP_CACHE_PARENT : 0);
 
-            /* 'count' is how much more data to ask for, and 'already' is how
-               much data that already has been asked for but not yet returned.
-               Specificly, 'count' means how much data that have or will be
-               asked for by the nodes that are already added to the linked
-               list. Some of those read requests may not actually have been
-               sent off successfully yet.
+        sftp->open_state = libssh2_NB_state_created;
+    }
 
-               If 'already' is very large it should be perfectly fine to have
-               count set to 0 as then we don't have to ask for more data
-               (right now).
+    if (sftp->open_state == libssh2_NB_state_created) {
+        rc = sftp_channel_write(sftp, sftp->open_packet, sftp->open_packet+
+                                sftp->open_packet_sent,
+                                sftp->open_packet_len -
+                                sftp->open_packet_sent);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                           "Would block sending FXP_OPEN or FXP_OPENDIR command");
+            return NULL;
+        }
+        else if(rc < 0) {
+            _libssh2_error(session, rc, "Unable to send FXP_OPEN*");
+            LIBSSH2_FREE(session, sftp->open_packet);
+            sftp->open_packet = NULL;
+            sftp->open_state = libssh2_NB_state_idle;
+            return NULL;
+        }
 
-               buffer_size*4 is just picked more or less out of the air. The
-               idea is that when reading SFTP from a remote server, we send
-               away multiple read requests guessing that the client will read
-               more than only this 'buffer_size' amount of memory. So we ask
-               for maximum buffer_size*4 amount of data so that we can return
-               them very fast in subsequent calls.
-            */
+        /* bump the sent counter and remain in this state until the whole
+           data is off */
+        sftp->open_packet_sent += rc;
 
-            recv_window = libssh2_channel_window_read_ex(sftp->channel,
-                                                         NULL, NULL);
-            if(max_read_ahead > recv_window) {
-                /* more data will be asked for than what the window currently
-                   allows, expand it! */
+        if(sftp->open_packet_len == sftp->open_packet_sent) {
+            LIBSSH2_FREE(session, sftp->open_packet);
+            sftp->open_packet = NULL;
 
-                rc = _libssh2_channel_receive_window_adjust(sftp->channel,
-                                                            max_read_ahead*8,
-                                                            1, NULL);
-                /* if this returns EAGAIN, we will get back to this function
-                   at next call */
-                assert(rc != LIBSSH2_ERROR_EAGAIN || !filep->data_left);
-                assert(rc != LIBSSH2_ERROR_EAGAIN || !filep->eof);
-                if (rc)
-                    return rc;
-            }
+            sftp->open_state = libssh2_NB_state_sent;
         }
+    }
 
-        while(count > 0) {
-            unsigned char *s;
-            uint32_t size = MIN(MAX_SFTP_READ_SIZE, count);
+    if (sftp->open_state == libssh2_NB_state_sent) {
+        size_t data_len;
+        unsigned char *data;
+        static const unsigned char fopen_responses[2] =
+            { SSH_FXP_HANDLE, SSH_FXP_STATUS };
+        rc = sftp_packet_requirev(sftp, 2, fopen_responses,
+                                  sftp->open_request_id, &data,
+                                  &data_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                           "Would block waiting for status message");
+            return NULL;
+        }
+        sftp->open_state = libssh2_NB_state_idle;
+        if (rc) {
+            _libssh2_error(session, rc, "Timeout waiting for status message");
+            return NULL;
+        }
 
-            /* 25 = packet_len(4) + packet_type(1) + request_id(4) +
-               handle_len(4) + offset(8) + count(4) */
-            uint32_t packet_len = (uint32_t)handle->handle_len + 25;
-            uint32_t request_id;
+        /* OPEN can basically get STATUS or HANDLE back, where HANDLE implies
+           a fine response while STATUS means error. It seems though that at
+           times we get an SSH_FX_OK back in a STATUS, followed the "real"
+           HANDLE so we need to properly deal with that. */
+        if (data[0] == SSH_FXP_STATUS) {
+            int badness = 1;
 
-            chunk = LIBSSH2_ALLOC(session, packet_len +
-                                  sizeof(struct sftp_pipeline_chunk));
-            if (!chunk)
-                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                      "malloc fail for FXP_WRITE");
+            if(data_len < 9) {
+                _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                               "Too small FXP_STATUS");
+                LIBSSH2_FREE(session, data);
+                return NULL;
+            }
 
-            chunk->len = size;
-            chunk->lefttosend = packet_len;
-            chunk->sent = 0;
+            sftp->last_errno = _libssh2_ntohu32(data + 5);
 
-            s = chunk->packet;
+            if(LIBSSH2_FX_OK == sftp->last_errno) {
+                _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "got HANDLE FXOK!");
 
-            _libssh2_store_u32(&s, packet_len - 4);
-            *s++ = SSH_FXP_READ;
-            request_id = sftp->request_id++;
-            chunk->request_id = request_id;
-            _libssh2_store_u32(&s, request_id);
-            _libssh2_store_str(&s, handle->handle, handle->handle_len);
-            _libssh2_store_u64(&s, filep->offset_sent);
-            filep->offset_sent += size; /* advance offset at once */
-            _libssh2_store_u32(&s, size);
+                LIBSSH2_FREE(session, data);
 
-            /* add this new entry LAST in the list */
-            _libssh2_list_add(&handle->packet_list, &chunk->node);
-            count -= size; /* deduct the size we used, as we might have
-                              to create more packets */
-        }
+                /* silly situation, but check for a HANDLE */
+                rc = sftp_packet_require(sftp, SSH_FXP_HANDLE,
+                                         sftp->open_request_id, &data,
+                                         &data_len);
+                if(rc == LIBSSH2_ERROR_EAGAIN) {
+                    /* go back to sent state and wait for something else */
+                    sftp->open_state = libssh2_NB_state_sent;
+                    return NULL;
+                }
+                else if(!rc)
+                    /* we got the handle so this is not a bad situation */
+                    badness = 0;
+            }
 
-    case libssh2_NB_state_sent:
+            if(badness) {
+                _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                               "Failed opening remote file");
+                _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "got FXP_STATUS %d",
+                               sftp->last_errno);
+                LIBSSH2_FREE(session, data);
+                return NULL;
+            }
+        }
 
-        sftp->read_state = libssh2_NB_state_idle;
+        if(data_len < 10) {
+            _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                           "Too small FXP_HANDLE");
+            LIBSSH2_FREE(session, data);
+            return NULL;
+        }
 
-        /* move through the READ packets that haven't been sent and send as
-           many as possible - remember that we don't block */
-        chunk = _libssh2_list_first(&handle->packet_list);
+        fp = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_SFTP_HANDLE));
+        if (!fp) {
+            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                           "Unable to allocate new SFTP handle structure");
+            LIBSSH2_FREE(session, data);
+            return NULL;
+        }
+        memset(fp, 0, sizeof(LIBSSH2_SFTP_HANDLE));
+        fp->handle_type = open_file ? LIBSSH2_SFTP_HANDLE_FILE :
+            LIBSSH2_SFTP_HANDLE_DIR;
 
-        while(chunk) {
-            if(chunk->lefttosend) {
+        fp->handle_len = _libssh2_ntohu32(data + 5);
+        if (fp->handle_len > SFTP_HANDLE_MAXLEN)
+            /* SFTP doesn't allow handles longer than 256 characters */
+            fp->handle_len = SFTP_HANDLE_MAXLEN;
 
-                rc = _libssh2_channel_write(channel, 0,
-                                            &chunk->packet[chunk->sent],
-                                            chunk->lefttosend);
-                if(rc < 0) {
-                    sftp->read_state = libssh2_NB_state_sent;
-                    return rc;
-                }
+        if(fp->handle_len > (data_len - 9))
+            /* do not reach beyond the end of the data we got */
+            fp->handle_len = data_len - 9;
 
-                /* remember where to continue sending the next time */
-                chunk->lefttosend -= rc;
-                chunk->sent += rc;
+        memcpy(fp->handle, data + 9, fp->handle_len);
 
-                if(chunk->lefttosend)
-                    /* data left to send, get out of loop */
-                    break;
-            }
+        LIBSSH2_FREE(session, data);
 
-            /* move on to the next chunk with data to send */
-            chunk = _libssh2_list_next(&chunk->node);
+        fp->path = LIBSSH2_ALLOC(session, filename_len + 1);
+        if (fp->path) {
+            memcpy(fp->path, filename, filename_len);
+            fp->path[filename_len] = '\0';
+            fp->path_len = filename_len;
         }
 
-    case libssh2_NB_state_sent2:
+        /* add this file handle to the list kept in the sftp session */
+        _libssh2_list_add(&sftp->sftp_handles, &fp->node);
 
-        sftp->read_state = libssh2_NB_state_idle;
+        fp->sftp = sftp; /* point to the parent struct */
 
-        /*
-         * Count all ACKed packets and act on the contents of them.
-         */
-        chunk = _libssh2_list_first(&handle->packet_list);
+        fp->u.file.offset = 0;
+        fp->u.file.offset_sent = 0;
 
-        while(chunk) {
-            unsigned char *data;
-            size_t data_len;
-            uint32_t rc32;
-            static const unsigned char read_responses[2] = {
-                SSH_FXP_DATA, SSH_FXP_STATUS
-            };
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Open command successful");
+        return fp;
+    }
+    return NULL;
+}
 
-            if(chunk->lefttosend)
-                /* if the chunk still has data left to send, we shouldn't wait
-                   for an ACK for it just yet */
-                break;
+/* libssh2_sftp_open_ex
+ */
+LIBSSH2_API LIBSSH2_SFTP_HANDLE *
+libssh2_sftp_open_ex(LIBSSH2_SFTP *sftp, const char *filename,
+                     unsigned int filename_len, unsigned long flags, long mode,
+                     int open_type)
+{
+    LIBSSH2_SFTP_HANDLE *hnd;
 
-            rc = sftp_packet_requirev(sftp, 2, read_responses,
-                                      chunk->request_id, &data, &data_len);
-            if (rc < 0) {
-                sftp->read_state = libssh2_NB_state_sent2;
-                return rc;
-            }
+    if(!sftp)
+        return NULL;
 
-            /*
-             * We get DATA or STATUS back. STATUS can be error, or it is
-             * FX_EOF when we reach the end of the file.
-             */
+    BLOCK_ADJUST_ERRNO(hnd, sftp->channel->session,
+                       sftp_open(sftp, filename, filename_len, flags, mode,
+                                 open_type));
+    return hnd;
+}
 
-            switch (data[0]) {
-            case SSH_FXP_STATUS:
-                /* remove the chunk we just processed */
+/* libssh2_sftp_send
+ * Open a remote file for an upload of 'filesize' bytes
+ */
+LIBSSH2_API LIBSSH2_SFTP_HANDLE *
+libssh2_sftp_send(LIBSSH2_SFTP *sftp, libssh2_uint64_t filesize,
+                  const char *remote_path, unsigned int remote_path_len,
+                  long mode)
+{
+    LIBSSH2_SFTP_HANDLE *hnd;
 
-                _libssh2_list_remove(&chunk->node);
-                LIBSSH2_FREE(session, chunk);
+    if(!sftp)
+        return NULL;
 
-                /* we must remove all outstanding READ requests, as either we
-                   got an error or we're at end of file */
-                sftp_packetlist_flush(handle);
+    BLOCK_ADJUST_ERRNO(hnd, sftp->channel->session,
+                       sftp_open(sftp, remote_path, remote_path_len,
+                                 LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT |
+                                 LIBSSH2_FXF_TRUNC, mode,
+                                 LIBSSH2_SFTP_OPENFILE));
+    if(hnd) {
+        hnd->u.file.transfer = LIBSSH2_SFTP_TRANSFER_SEND;
+        hnd->u.file.transfer_size = filesize;
+    }
+    return hnd;
+}
 
-                rc32 = _libssh2_ntohu32(data + 5);
-                LIBSSH2_FREE(session, data);
+/*
+ * sftp_recv
+ *
+ * Open a remote file for download and find out its size
+ */
+static LIBSSH2_SFTP_HANDLE *
+sftp_recv(LIBSSH2_SFTP *sftp, const char *remote_path,
+          unsigned int remote_path_len, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    LIBSSH2_SFTP_HANDLE *hnd;
+    int rc;
 
-                if (rc32 == LIBSSH2_FX_EOF) {
-                    filep->eof = TRUE;
-                    return 0;
-                }
-                else {
-                    sftp->last_errno = rc32;
-                    return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                          "SFTP READ error");
-                }
-                break;
+    if(sftp->recv_state == libssh2_NB_state_idle) {
+        hnd = sftp_open(sftp, remote_path, remote_path_len, LIBSSH2_FXF_READ,
+                        0, LIBSSH2_SFTP_OPENFILE);
+        if(!hnd)
+            return NULL;
 
-            case SSH_FXP_DATA:
-                rc32 = _libssh2_ntohu32(data + 5);
-                if (rc32 > (data_len - 9))
-                    return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                          "SFTP Protocol badness");
+        hnd->u.file.transfer = LIBSSH2_SFTP_TRANSFER_RECV;
+        sftp->recv_handle = hnd;
+        sftp->recv_state = libssh2_NB_state_created;
+    }
 
-                if(rc32 > chunk->len) {
-                    /* A chunk larger than we requested was returned to us.
-                       This is a protocol violation and we don't know how to
-                       deal with it. Bail out! */
-                    return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                          "FXP_READ response too big");
-                }
+    hnd = sftp->recv_handle;
+    memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
+    rc = sftp_fstat(hnd, attrs, 0);
+    if(rc == LIBSSH2_ERROR_EAGAIN)
+        return NULL;
 
-                if(rc32 != chunk->len) {
-                    /* a short read does not imply end of file, but we must
-                       adjust the offset_sent since it was advanced with a
-                       full chunk->len before */
-                    filep->offset_sent -= (chunk->len - rc32);
-                }
+    sftp->recv_state = libssh2_NB_state_idle;
+    sftp->recv_handle = NULL;
 
-                if(rc32 > buffer_size) {
-                    /* figure out the overlap amount */
-                    filep->data_left = rc32 - buffer_size;
+    /* without the size the transfer still works, only the read-ahead isn't
+       limited to the file */
+    if(!rc && (attrs->flags & LIBSSH2_SFTP_ATTR_SIZE))
+        hnd->u.file.transfer_size = attrs->filesize;
 
-                    /* getting the full packet would overflow the buffer, so
-                       only get the correct amount and keep the remainder */
-                    rc32 = (uint32_t)buffer_size;
+    return hnd;
+}
 
-                    /* store data to keep for next call */
-                    filep->data = data;
-                    filep->data_len = data_len;
+/* libssh2_sftp_recv
+ * Open a remote file for download of the whole file
+ */
+LIBSSH2_API LIBSSH2_SFTP_HANDLE *
+libssh2_sftp_recv(LIBSSH2_SFTP *sftp, const char *remote_path,
+                  unsigned int remote_path_len, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    LIBSSH2_SFTP_HANDLE *hnd;
+    LIBSSH2_SFTP_ATTRIBUTES attrs_local;
+
+    if(!sftp)
+        return NULL;
+
+    BLOCK_ADJUST_ERRNO(hnd, sftp->channel->session,
+                       sftp_recv(sftp, remote_path, remote_path_len,
+                                 attrs ? attrs : &attrs_local));
+    return hnd;
+}
+
+/*
+ * read_ahead_adapt
+ *
+ * Account for 'bytes' of data received for 'chunk' and adjust the read-ahead
+ * of the handle. With too little read-ahead the data trickles in at
+ * read_ahead per round trip, with enough it comes at the rate of the link
+ * while the round trip time only grows from the queueing. So every few round
+ * trips the read-ahead is aimed at twice the measured rate times the lowest
+ * round trip time seen, growing at most by doubling and shrinking slowly.
+ */
+static void read_ahead_adapt(LIBSSH2_SFTP *sftp,
+                             struct _libssh2_sftp_handle_file_data *filep,
+                             const struct sftp_pipeline_chunk *chunk,
+                             size_t bytes)
+{
+    libssh2_uint64_t now = _libssh2_time_ms();
+    unsigned long rtt = (unsigned long)(now - chunk->sent_time);
+    libssh2_uint64_t elapsed;
+    libssh2_uint64_t target;
+
+    if(!rtt)
+        rtt = 1; /* faster than the clock can tell */
+    if(!filep->rtt_min || (rtt < filep->rtt_min))
+        filep->rtt_min = rtt;
+
+    if(!filep->rate_start) {
+        filep->rate_start = chunk->sent_time;
+        filep->rate_bytes = 0;
+    }
+    filep->rate_bytes += bytes;
+
+    elapsed = now - filep->rate_start;
+    if(elapsed < 4 * (libssh2_uint64_t)filep->rtt_min)
+        return;
+
+    target = 2 * (libssh2_uint64_t)filep->rate_bytes * filep->rtt_min /
+        elapsed;
+
+    if(target > filep->read_ahead) {
+        if(target > 2 * (libssh2_uint64_t)filep->read_ahead)
+            target = 2 * (libssh2_uint64_t)filep->read_ahead;
+    }
+    else if(target < filep->read_ahead) {
+        libssh2_uint64_t slow = filep->read_ahead - filep->read_ahead / 4;
+        if(target < slow)
+            target = slow;
+    }
+
+    if(target > MAX_SFTP_READ_AHEAD)
+        target = MAX_SFTP_READ_AHEAD;
+    if(target < sftp->read_size)
+        target = sftp->read_size;
+
+    filep->read_ahead = (size_t)target;
+
+    /* start the next measurement */
+    filep->rate_start = now;
+    filep->rate_bytes = 0;
+}
+
+/*
+ * sftp_read
+ *
+ * Read from an SFTP file handle
+ *
+ */
+static ssize_t sftp_read(LIBSSH2_SFTP_HANDLE * handle, char *buffer,
+                         size_t buffer_size)
+{
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    size_t count = 0;
+    struct sftp_pipeline_chunk *chunk;
+    struct sftp_pipeline_chunk *next;
+    ssize_t rc;
+    struct _libssh2_sftp_handle_file_data *filep =
+        &handle->u.file;
+
+    /* This function can be interrupted in three different places where it
+       might need to wait for data from the network.  It returns EAGAIN to
+       allow non-blocking clients to do other work but these client are
+       expected to call this function again (possibly many times) to finish
+       the operation.
+
+       The tricky part is that if we previously aborted a sftp_read due to
+       EAGAIN, we must continue at the same spot to continue the previously
+       interrupted operation.  This is done using a state machine to record
+       what phase of execution we were at.  The state is stored in
+       sftp->read_state.
+
+       libssh2_NB_state_idle: The first phase is where we prepare multiple
+       FXP_READ packets to do optimistic read-ahead.  We send off as many as
+       possible in the second phase without waiting for a response to each
+       one; this is the key to fast reads. But we may have to adjust the
+       channel window size to do this which may interrupt this function while
+       waiting.  The state machine saves the phase as libssh2_NB_state_idle so
+       it returns here on the next call.
+
+       libssh2_NB_state_sent: The second phase is where we send the FXP_READ
+       packets.  Writing them to the channel can be interrupted with EAGAIN
+       but the state machine ensures we skip the first phase on the next call
+       and resume sending.
+
+       libssh2_NB_state_sent2: In the third phase (indicated by ) we read the
+       data from the responses that have arrived so far.  Reading can be
+       interrupted with EAGAIN but the state machine ensures we skip the first
+       and second phases on the next call and resume sending.
+    */
+
+    switch (sftp->read_state) {
+    case libssh2_NB_state_idle:
+
+        /* Some data may already have been read from the server in the
+           previous call but didn't fit in the buffer at the time.  If so, we
+           return that now as we can't risk being interrupted later with data
+           partially written to the buffer. */
+        if(filep->data_left) {
+            size_t copy = MIN(buffer_size, filep->data_left);
+
+            memcpy(buffer, &filep->data[ filep->data_len - filep->data_left],
+                   copy);
+
+            filep->data_left -= copy;
+            filep->offset += copy;
+
+            if(!filep->data_left) {
+                sftp_packet_release(sftp, filep->data, filep->data_len);
+                filep->data = NULL;
+            }
+
+            return copy;
+        }
+
+        /* We allow a number of bytes being requested at any given time
+           without having been acked - until we reach EOF. */
+        if(!filep->eof) {
+            /* Number of bytes asked for that haven't been acked yet */
+            size_t already = (filep->offset_sent - filep->offset);
+
+            size_t max_read_ahead;
+            unsigned long recv_window;
+
+            if(!filep->read_ahead) {
+                /* start out from the size of the reads, read_ahead_adapt()
+                   takes it from there. A whole file transfer goes for as
+                   much as the file holds right away. */
+                if(filep->transfer == LIBSSH2_SFTP_TRANSFER_RECV)
+                    filep->read_ahead = MAX_SFTP_READ_AHEAD;
+                else {
+                    filep->read_ahead = buffer_size*4;
+                    if(filep->read_ahead > LIBSSH2_CHANNEL_WINDOW_DEFAULT*4)
+                        filep->read_ahead = LIBSSH2_CHANNEL_WINDOW_DEFAULT*4;
                 }
-                else
-                    filep->data_len = 0;
+                if(filep->read_ahead < sftp->read_size)
+                    filep->read_ahead = sftp->read_size;
+            }
+            max_read_ahead = filep->read_ahead;
 
-                /* copy the received data from the received FXP_DATA packet to
-                   the buffer at the correct index */
-                memcpy(buffer, data + 9, rc32);
-                filep->offset += rc32;
+            /* if the buffer_size passed in now is smaller than what has
+               already been sent, we risk getting count become a very large
+               number */
+            if(max_read_ahead > already)
+                count = max_read_ahead - already;
 
-                if(filep->data_len == 0)
-                    /* free the allocated data if not stored to keep */
-                    LIBSSH2_FREE(session, data);
+            if(filep->transfer_size) {
+                /* don't ask for more than one read past the known end of
+                   the file, that one finds the EOF. Should the file have
+                   grown, the data received moves the end along. */
+                libssh2_uint64_t end = filep->transfer_size;
 
+                if(end < filep->offset)
+                    end = filep->offset;
+                end += sftp->read_size;
 
-                /* remove the chunk we just processed keeping track of the
-                 * next one in case we need it */
-                next = _libssh2_list_next(&chunk->node);
-                _libssh2_list_remove(&chunk->node);
-                LIBSSH2_FREE(session, chunk);
-                chunk = NULL;
+                if(filep->offset_sent >= end)
+                    count = 0;
+                else if(count > end - filep->offset_sent)
+                    count = (size_t)(end - filep->offset_sent);
+            }
 
-                if(rc32 > 0) {
-                    /* we must return as we wrote some data to the buffer */
-                    return rc32;
-                } else {
-                    /* A zero-byte read is not necessarily EOF so we must not
-                     * return 0 (that would signal EOF to the caller) so
-                     * instead we carry on to the next chunk */
-                    chunk = next;
+            /* 'count' is how much more data to ask for, and 'already' is how
+               much data that already has been asked for but not yet returned.
+               Specificly, 'count' means how much data that have or will be
+               asked for by the nodes that are already added to the linked
+               list. Some of those read requests may not actually have been
+               sent off successfully yet.
+
+               If 'already' is very large it should be perfectly fine to have
+               count set to 0 as then we don't have to ask for more data
+               (right now).
+
+               The idea is that when reading SFTP from a remote server, we
+               send away multiple read requests guessing that the client will
+               read more than only this 'buffer_size' amount of memory, so
+               that we can return them very fast in subsequent calls. How much
+               is asked for starts at buffer_size*4 and then follows what the
+               measured round trip time and throughput need.
+            */
+
+            recv_window = libssh2_channel_window_read_ex(sftp->channel,
+                                                         NULL, NULL);
+            if(max_read_ahead > recv_window) {
+                /* more data will be asked for than what the window currently
+                   allows, expand it! */
+
+                rc = _libssh2_channel_receive_window_adjust(sftp->channel,
+                                                            max_read_ahead*8,
+                                                            1, NULL);
+                /* if this returns EAGAIN, we will get back to this function
+                   at next call */
+                assert(rc != LIBSSH2_ERROR_EAGAIN || !filep->data_left);
+                assert(rc != LIBSSH2_ERROR_EAGAIN || !filep->eof);
+                if (rc)
+                    return rc;
+            }
+        }
+
+        while(count > 0) {
+            unsigned char *s;
+            uint32_t size = MIN(sftp->read_size, count);
+
+            /* 25 = packet_len(4) + packet_type(1) + request_id(4) +
+               handle_len(4) + offset(8) + count(4) */
+            uint32_t packet_len = (uint32_t)handle->handle_len + 25;
+            uint32_t request_id;
+
+            chunk = LIBSSH2_ALLOC(session, packet_len +
+                                  sizeof(struct sftp_pipeline_chunk));
+            if (!chunk)
+                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                      "malloc fail for FXP_WRITE");
+
+            chunk->len = size;
+            chunk->lefttosend = packet_len;
+            chunk->sent = 0;
+
+            s = chunk->packet;
+
+            _libssh2_store_u32(&s, packet_len - 4);
+            *s++ = SSH_FXP_READ;
+            request_id = sftp->request_id++;
+            chunk->request_id = request_id;
+            _libssh2_store_u32(&s, request_id);
+            _libssh2_store_str(&s, handle->handle, handle->handle_len);
+            _libssh2_store_u64(&s, filep->offset_sent);
+            filep->offset_sent += size; /* advance offset at once */
+            _libssh2_store_u32(&s, size);
+
+            /* add this new entry LAST in the list */
+            _libssh2_list_add(&handle->packet_list, &chunk->node);
+            count -= size; /* deduct the size we used, as we might have
+                              to create more packets */
+        }
+
+    case libssh2_NB_state_sent:
+
+        sftp->read_state = libssh2_NB_state_idle;
+
+        /* move through the READ packets that haven't been sent and send as
+           many as possible - remember that we don't block */
+        chunk = _libssh2_list_first(&handle->packet_list);
+
+        while(chunk) {
+            if(chunk->lefttosend) {
+
+                rc = sftp_channel_write(sftp, chunk,
+                                        &chunk->packet[chunk->sent],
+                                        chunk->lefttosend);
+                if(rc < 0) {
+                    sftp->read_state = libssh2_NB_state_sent;
+                    return rc;
                 }
 
-                break;
-            default:
-                return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                      "SFTP Protocol badness: unrecognised "
-                                      "read request response");
-            }
+                /* remember where to continue sending the next time */
+                chunk->lefttosend -= rc;
+                chunk->sent += rc;
+
+                if(chunk->lefttosend)
+                    /* data left to send, get out of loop */
+                    break;
+
+                chunk->sent_time = _libssh2_time_ms();
+            }
+
+            /* move on to the next chunk with data to send */
+            chunk = _libssh2_list_next(&chunk->node);
+        }
+
+    case libssh2_NB_state_sent2:
+
+        sftp->read_state = libssh2_NB_state_idle;
+
+        /*
+         * Count all ACKed packets and act on the contents of them.
+         */
+        chunk = _libssh2_list_first(&handle->packet_list);
+
+        while(chunk) {
+            unsigned char *data;
+            size_t data_len;
+            uint32_t rc32;
+            static const unsigned char read_responses[2] = {
+                SSH_FXP_DATA, SSH_FXP_STATUS
+            };
+
+            if(chunk->lefttosend)
+                /* if the chunk still has data left to send, we shouldn't wait
+                   for an ACK for it just yet */
+                break;
+
+            rc = sftp_packet_requirev(sftp, 2, read_responses,
+                                      chunk->request_id, &data, &data_len);
+            if (rc < 0) {
+                sftp->read_state = libssh2_NB_state_sent2;
+                return rc;
+            }
+
+            /*
+             * We get DATA or STATUS back. STATUS can be error, or it is
+             * FX_EOF when we reach the end of the file.
+             */
+
+            switch (data[0]) {
+            case SSH_FXP_STATUS:
+                /* remove the chunk we just processed */
+
+                _libssh2_list_remove(&chunk->node);
+                LIBSSH2_FREE(session, chunk);
+
+                /* we must remove all outstanding READ requests, as either we
+                   got an error or we're at end of file */
+                sftp_packetlist_flush(handle);
+
+                rc32 = _libssh2_ntohu32(data + 5);
+                LIBSSH2_FREE(session, data);
+
+                if (rc32 == LIBSSH2_FX_EOF) {
+                    filep->eof = TRUE;
+                    return 0;
+                }
+                else {
+                    sftp->last_errno = rc32;
+                    return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                          "SFTP READ error");
+                }
+                break;
+
+            case SSH_FXP_DATA:
+                rc32 = _libssh2_ntohu32(data + 5);
+                if (rc32 > (data_len - 9))
+                    return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                          "SFTP Protocol badness");
+
+                if(rc32 > chunk->len) {
+                    /* A chunk larger than we requested was returned to us.
+                       This is a protocol violation and we don't know how to
+                       deal with it. Bail out! */
+                    return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                          "FXP_READ response too big");
+                }
+
+                if(rc32 != chunk->len) {
+                    /* a short read does not imply end of file, but we must
+                       adjust the offset_sent since it was advanced with a
+                       full chunk->len before */
+                    filep->offset_sent -= (chunk->len - rc32);
+                }
+
+                read_ahead_adapt(sftp, filep, chunk, rc32);
+
+                if(rc32 > buffer_size) {
+                    /* figure out the overlap amount */
+                    filep->data_left = rc32 - buffer_size;
+
+                    /* getting the full packet would overflow the buffer, so
+                       only get the correct amount and keep the remainder */
+                    rc32 = (uint32_t)buffer_size;
+
+                    /* store data to keep for next call */
+                    filep->data = data;
+                    filep->data_len = data_len;
+                }
+                else
+                    filep->data_len = 0;
+
+                /* copy the received data from the received FXP_DATA packet to
+                   the buffer at the correct index */
+                memcpy(buffer, data + 9, rc32);
+                filep->offset += rc32;
+
+                if(filep->data_len == 0)
+                    /* free the allocated data if not stored to keep */
+                    sftp_packet_release(sftp, data, data_len);
+
+
+                /* remove the chunk we just processed keeping track of the
+                 * next one in case we need it */
+                next = _libssh2_list_next(&chunk->node);
+                _libssh2_list_remove(&chunk->node);
+                LIBSSH2_FREE(session, chunk);
+                chunk = NULL;
+
+                if(rc32 > 0) {
+                    /* we must return as we wrote some data to the buffer */
+                    return rc32;
+                } else {
+                    /* A zero-byte read is not necessarily EOF so we must not
+                     * return 0 (that would signal EOF to the caller) so
+                     * instead we carry on to the next chunk */
+                    chunk = next;
+                }
+
+                break;
+            default:
+                return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                      "SFTP Protocol badness: unrecognised "
+                                      "read request response");
+            }
+        }
+
+        break;
+
+    default:
+        assert(!"State machine error; unrecognised read state");
+    }
+
+    return 0;
+}
+
+/* libssh2_sftp_read
+ * Read from an SFTP file handle
+ */
+LIBSSH2_API ssize_t
+libssh2_sftp_read(LIBSSH2_SFTP_HANDLE *hnd, char *buffer,
+                  size_t buffer_maxlen)
+{
+    ssize_t rc;
+    if(!hnd)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
+                 sftp_read(hnd, buffer, buffer_maxlen));
+    return rc;
+}
+
+static ssize_t sftp_read_request(LIBSSH2_REQUEST *request)
+{
+    return sftp_read(request->handle, request->buffer, request->length);
+}
+
+/*
+ * sftp_request_abandon
+ *
+ * A cancelled read or write request may have left one of the handle's
+ * packets half written to the channel. The part already handed to the
+ * transport goes out regardless, so count it in the chunk.
+ */
+static void sftp_request_abandon(LIBSSH2_REQUEST *request)
+{
+    LIBSSH2_SFTP_HANDLE *handle = request->handle;
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    struct sftp_pipeline_chunk *chunk;
+    size_t sent;
+
+    if(channel->session->request_sending != request)
+        return;
+
+    sent = _libssh2_channel_write_abandon(channel);
+    if(!sent)
+        return;
+
+    if(sftp->leftover_busy) {
+        /* it was sending a leftover packet ahead of its own */
+        sftp->leftover_busy = 0;
+        sftp_leftover_sent(sftp, sent);
+        return;
+    }
+    sftp->send_left -= MIN(sent, sftp->send_left);
+
+    /* the chunks are sent in order, it is the first one not yet done */
+    for(chunk = _libssh2_list_first(&handle->packet_list);
+        chunk && !chunk->lefttosend;
+        chunk = _libssh2_list_next(&chunk->node))
+        ;
+    if(chunk) {
+        chunk->lefttosend -= sent;
+        chunk->sent += sent;
+    }
+}
+
+static void sftp_read_cancel(LIBSSH2_REQUEST *request)
+{
+    LIBSSH2_SFTP_HANDLE *handle = request->handle;
+
+    handle->sftp->read_state = libssh2_NB_state_idle;
+    sftp_request_abandon(request);
+}
+
+/* libssh2_sftp_read_async
+ * Queue a read from an SFTP file handle for libssh2_session_pump()
+ */
+LIBSSH2_API int
+libssh2_sftp_read_async(LIBSSH2_SFTP_HANDLE *hnd, char *buffer,
+                        size_t buffer_maxlen,
+                        LIBSSH2_COMPLETE_FUNC((*callback)), void *data)
+{
+    LIBSSH2_REQUEST request;
+    if(!hnd)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    memset(&request, 0, sizeof(request));
+    /* the read state is kept in the SFTP instance, not the handle */
+    request.object = hnd->sftp;
+    request.mark = &hnd->sftp->request_read_mark;
+    request.run = sftp_read_request;
+    request.cancel = sftp_read_cancel;
+    request.handle = hnd;
+    request.buffer = buffer;
+    request.length = buffer_maxlen;
+    request.callback = callback;
+    request.data = data;
+
+    return _libssh2_request_submit(hnd->sftp->channel->session, &request);
+}
+
+/*
+ * sftp_readdir_fetch
+ *
+ * Keep READDIR requests going on a directory handle and take the reply to
+ * the oldest one. Returns the number of names it holds, which are then in
+ * the handle's names_packet, 0 at the end of the directory or a negative
+ * error code.
+ */
+static int sftp_readdir_fetch(LIBSSH2_SFTP_HANDLE *handle)
+{
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) */
+    uint32_t packet_len = handle->handle_len + 13;
+    struct sftp_pipeline_chunk *chunk;
+    unsigned int requests = 0;
+    uint32_t num_names;
+    unsigned char *s, *data;
+    size_t data_len;
+    static const unsigned char read_responses[2] = {
+        SSH_FXP_NAME, SSH_FXP_STATUS };
+    ssize_t rc;
+
+    if(!handle->u.dir.depth)
+        handle->u.dir.depth = 1;
+
+    for(chunk = _libssh2_list_first(&handle->packet_list); chunk;
+        chunk = _libssh2_list_next(&chunk->node))
+        requests++;
+
+    /* Request more entries. The server answers the requests on a handle in
+       order, each with the names following those of the one before. */
+    while(!handle->u.dir.eof && (requests < handle->u.dir.depth)) {
+        chunk = LIBSSH2_ALLOC(session, sizeof(struct sftp_pipeline_chunk) +
+                              packet_len);
+        if (!chunk)
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for "
+                                  "FXP_READDIR packet");
+        memset(chunk, 0, sizeof(struct sftp_pipeline_chunk));
+
+        s = chunk->packet;
+        _libssh2_store_u32(&s, packet_len - 4);
+        *(s++) = SSH_FXP_READDIR;
+        chunk->request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, chunk->request_id);
+        _libssh2_store_str(&s, handle->handle, handle->handle_len);
+
+        chunk->lefttosend = packet_len;
+        _libssh2_list_add(&handle->packet_list, &chunk->node);
+        requests++;
+    }
+
+    /* send off what is not sent yet, in order */
+    for(chunk = _libssh2_list_first(&handle->packet_list); chunk;
+        chunk = _libssh2_list_next(&chunk->node)) {
+        if(!chunk->lefttosend)
+            continue;
+
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "Reading entries from directory handle");
+        rc = sftp_channel_write(sftp, chunk, &chunk->packet[chunk->sent],
+                                chunk->lefttosend);
+        if((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                                  "_libssh2_channel_write() failed");
+        else if(rc <= 0) {
+            if(!rc)
+                /* no window left, wait for the server to adjust it */
+                _libssh2_session_block(session,
+                                       LIBSSH2_SESSION_BLOCK_INBOUND);
+            break;
+        }
+
+        chunk->sent += rc;
+        chunk->lefttosend -= rc;
+        if(chunk->lefttosend)
+            break;
+    }
+
+    chunk = _libssh2_list_first(&handle->packet_list);
+    if(!chunk)
+        /* only after the end of the directory */
+        return 0;
+    else if(chunk->lefttosend)
+        return LIBSSH2_ERROR_EAGAIN;
+
+    rc = sftp_packet_requirev(sftp, 2, read_responses, chunk->request_id,
+                              &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return (int)rc;
+    else if (rc)
+        return _libssh2_error(session, (int)rc,
+                              "Timeout waiting for status message");
+
+    _libssh2_list_remove(&chunk->node);
+    LIBSSH2_FREE(session, chunk);
+
+    if (data_len < 9) {
+        LIBSSH2_FREE(session, data);
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "Invalid FXP_READDIR response");
+    }
+
+    if (data[0] == SSH_FXP_STATUS) {
+        uint32_t retcode = _libssh2_ntohu32(data + 5);
+        LIBSSH2_FREE(session, data);
+        if (retcode == LIBSSH2_FX_EOF) {
+            /* the requests still out can only say the same */
+            handle->u.dir.eof = 1;
+            sftp_packetlist_flush(handle);
+            return 0;
+        }
+        else {
+            sftp->last_errno = retcode;
+            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                  "SFTP Protocol Error");
+        }
+    }
+
+    num_names = _libssh2_ntohu32(data + 5);
+    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "%lu entries returned",
+                   num_names);
+    if (!num_names) {
+        LIBSSH2_FREE(session, data);
+        return 0;
+    }
+
+    if (handle->u.dir.depth < MAX_SFTP_READDIR_AHEAD)
+        handle->u.dir.depth *= 2;
+
+    handle->u.dir.names_left = num_names;
+    handle->u.dir.names_packet = data;
+    handle->u.dir.next_name = (char *) data + 9;
+    handle->u.dir.names_end = (char *) data + data_len;
+
+    return (int)num_names;
+}
+
+/*
+ * sftp_name_entry
+ *
+ * Find the name, long entry and attributes of the entry at 's' in a NAME
+ * packet that ends at 'end'. Returns where the entry after it starts, or
+ * NULL if the entry does not fit in the packet.
+ */
+static unsigned char *
+sftp_name_entry(unsigned char *s, unsigned char *end, unsigned char **name,
+                size_t *name_len, unsigned char **longentry,
+                size_t *longentry_len, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    if ((end - s) < 4)
+        return NULL;
+    *name_len = _libssh2_ntohu32(s);
+    s += 4;
+    if ((*name_len > (size_t)(end - s)) ||
+        ((size_t)(end - s) - *name_len < 4))
+        return NULL;
+    *name = s;
+    s += *name_len;
+
+    *longentry_len = _libssh2_ntohu32(s);
+    s += 4;
+    if ((*longentry_len > (size_t)(end - s)) ||
+        ((size_t)(end - s) - *longentry_len < 4))
+        return NULL;
+    *longentry = s;
+    s += *longentry_len;
+
+    if ((size_t)(end - s) < (size_t)sftp_attrsize(_libssh2_ntohu32(s)))
+        return NULL;
+    s += sftp_bin2attr(attrs, s);
+
+    return s;
+}
+
+/*
+ * sftp_readdir_entry
+ *
+ * Find the next entry in the NAME packet of a directory handle
+ */
+static unsigned char *
+sftp_readdir_entry(LIBSSH2_SFTP_HANDLE *handle, unsigned char **name,
+                   size_t *name_len, unsigned char **longentry,
+                   size_t *longentry_len, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    return sftp_name_entry((unsigned char *) handle->u.dir.next_name,
+                           (unsigned char *) handle->u.dir.names_end,
+                           name, name_len, longentry, longentry_len, attrs);
+}
+
+/*
+ * sftp_readdir_next
+ *
+ * Move on to the entry after the one sftp_readdir_entry() found
+ */
+static void sftp_readdir_next(LIBSSH2_SFTP_HANDLE *handle, unsigned char *s)
+{
+    handle->u.dir.next_name = (char *) s;
+
+    if ((--handle->u.dir.names_left) == 0)
+        LIBSSH2_FREE(handle->sftp->channel->session,
+                     handle->u.dir.names_packet);
+}
+
+/*
+ * sftp_readdir_cache
+ *
+ * Keep the attributes of a directory entry in the attribute cache. READDIR
+ * replies carry what LSTAT finds, as with OpenSSH.
+ */
+static void sftp_readdir_cache(LIBSSH2_SFTP_HANDLE *handle, const char *name,
+                               size_t name_len,
+                               const LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    if (!handle->path || ((attrs->flags & SFTP_CACHE_ATTRS) !=
+                          SFTP_CACHE_ATTRS))
+        return;
+    if (((name_len == 1) && (name[0] == '.')) ||
+        ((name_len == 2) && (name[0] == '.') && (name[1] == '.')))
+        return;
+
+    sftp_cache_store(handle->sftp, handle->path, handle->path_len, name,
+                     name_len, 1, attrs);
+}
+
+/* sftp_readdir
+ * Read from an SFTP directory handle
+ */
+static ssize_t sftp_readdir(LIBSSH2_SFTP_HANDLE *handle, char *buffer,
+                            size_t buffer_maxlen, char *longentry,
+                            size_t longentry_maxlen,
+                            LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    LIBSSH2_SESSION *session = handle->sftp->channel->session;
+    LIBSSH2_SFTP_ATTRIBUTES attrs_dummy;
+    unsigned char *name, *entry, *next;
+    size_t name_len, entry_len;
+    int rc;
+
+    if (!handle->u.dir.names_left) {
+        rc = sftp_readdir_fetch(handle);
+        if (rc <= 0)
+            return rc;
+    }
+
+    /*
+     * A request returned one or more directory entries, feed them back from
+     * the buffer
+     */
+    next = sftp_readdir_entry(handle, &name, &name_len, &entry, &entry_len,
+                              attrs ? attrs : &attrs_dummy);
+    if (!next)
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "Invalid FXP_NAME response");
+
+    if ((name_len >= buffer_maxlen) ||
+        (longentry && (longentry_maxlen>1) &&
+         (entry_len >= longentry_maxlen))) {
+        /* the entry is skipped, as it always was, so that callers moving
+           on to the next one do not get it back forever */
+        sftp_readdir_next(handle, next);
+        return LIBSSH2_ERROR_BUFFER_TOO_SMALL;
+    }
+
+    memcpy(buffer, name, name_len);
+    buffer[name_len] = '\0';           /* zero terminate */
+
+    sftp_readdir_cache(handle, buffer, name_len,
+                       attrs ? attrs : &attrs_dummy);
+
+    if (longentry && (longentry_maxlen>1)) {
+        memcpy(longentry, entry, entry_len);
+        longentry[entry_len] = '\0'; /* zero terminate */
+    }
+
+    sftp_readdir_next(handle, next);
+
+    _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                   "libssh2_sftp_readdir_ex() return %d", name_len);
+    return (ssize_t)name_len;
+}
+
+/* libssh2_sftp_readdir_ex
+ * Read from an SFTP directory handle
+ */
+LIBSSH2_API int
+libssh2_sftp_readdir_ex(LIBSSH2_SFTP_HANDLE *hnd, char *buffer,
+                        size_t buffer_maxlen, char *longentry,
+                        size_t longentry_maxlen,
+                        LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    int rc;
+    if(!hnd)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
+                 sftp_readdir(hnd, buffer, buffer_maxlen, longentry,
+                              longentry_maxlen, attrs));
+    return rc;
+}
+
+/*
+ * sftp_readdir_ready
+ *
+ * Tells if the reply to the oldest READDIR request of a directory handle is
+ * in, after taking in what has arrived on the channel
+ */
+static int sftp_readdir_ready(LIBSSH2_SFTP_HANDLE *handle)
+{
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    struct sftp_pipeline_chunk *chunk;
+
+    while(sftp_packet_read(sftp) > 0)
+        ;
+
+    chunk = _libssh2_list_first(&handle->packet_list);
+    return chunk && !chunk->lefttosend &&
+        sftp_index_find(&sftp->packet_index, chunk->request_id);
+}
+
+/* sftp_readdir_batch
+ * Read many entries from an SFTP directory handle at once
+ */
+static int sftp_readdir_batch(LIBSSH2_SFTP_HANDLE *handle,
+                              LIBSSH2_SFTP_DIRENT *entries,
+                              size_t max_entries, char *buffer,
+                              size_t buffer_len)
+{
+    LIBSSH2_SESSION *session = handle->sftp->channel->session;
+    unsigned char *name, *entry, *next;
+    size_t name_len, entry_len;
+    size_t count = 0;
+    size_t used = 0;
+    int rc;
+
+    while (count < max_entries) {
+        LIBSSH2_SFTP_DIRENT *dirent = &entries[count];
+
+        if (!handle->u.dir.names_left) {
+            /* only wait for more when there is nothing to hand out */
+            if (count && !sftp_readdir_ready(handle))
+                break;
+
+            rc = sftp_readdir_fetch(handle);
+            if (rc < 0)
+                return count ? (int)count : rc;
+            else if (!rc)
+                break;
+        }
+
+        next = sftp_readdir_entry(handle, &name, &name_len, &entry,
+                                  &entry_len, &dirent->attrs);
+        if (!next)
+            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                  "Invalid FXP_NAME response");
+
+        if ((name_len + entry_len + 2) > (buffer_len - used)) {
+            if (!count)
+                return LIBSSH2_ERROR_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        dirent->name = &buffer[used];
+        dirent->name_len = name_len;
+        memcpy(dirent->name, name, name_len);
+        dirent->name[name_len] = '\0';
+        used += name_len + 1;
+
+        sftp_readdir_cache(handle, dirent->name, name_len, &dirent->attrs);
+
+        dirent->longentry = &buffer[used];
+        dirent->longentry_len = entry_len;
+        memcpy(dirent->longentry, entry, entry_len);
+        dirent->longentry[entry_len] = '\0';
+        used += entry_len + 1;
+
+        sftp_readdir_next(handle, next);
+        count++;
+    }
+
+    return (int)count;
+}
+
+/* libssh2_sftp_readdir_batch
+ * Read many entries from an SFTP directory handle at once
+ */
+LIBSSH2_API int
+libssh2_sftp_readdir_batch(LIBSSH2_SFTP_HANDLE *hnd,
+                           LIBSSH2_SFTP_DIRENT *entries, size_t max_entries,
+                           char *buffer, size_t buffer_len)
+{
+    int rc;
+    if(!hnd || !entries || !buffer)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
+                 sftp_readdir_batch(hnd, entries, max_entries, buffer,
+                                    buffer_len));
+    return rc;
+}
+
+/*
+ * sftp_send_queue
+ *
+ * Complete the header of the chunk a libssh2_sftp_send() handle is filling
+ * and put it in line to get sent off.
+ */
+static void sftp_send_queue(LIBSSH2_SFTP_HANDLE *handle)
+{
+    struct sftp_pipeline_chunk *chunk = handle->u.file.merge;
+    uint32_t packet_len = (uint32_t)(handle->handle_len + 25 + chunk->len);
+    unsigned char *s = chunk->packet;
+
+    _libssh2_store_u32(&s, packet_len - 4);
+    /* the data length follows the request id, handle and offset */
+    s = &chunk->packet[handle->handle_len + 21];
+    _libssh2_store_u32(&s, (uint32_t)chunk->len);
+
+    chunk->lefttosend = packet_len;
+    _libssh2_list_add(&handle->packet_list, &chunk->node);
+    handle->u.file.merge = NULL;
+}
+
+/*
+ * sftp_send_pipe
+ *
+ * Send off the queued FXP_WRITE packets of a libssh2_sftp_send() handle as
+ * far as possible and take care of their acks.
+ *
+ * Returns 0 when all queued data is written, EAGAIN when some is left or a
+ * negative error code. The data not yet written is dropped on errors.
+ */
+static int sftp_send_pipe(LIBSSH2_SFTP_HANDLE *handle)
+{
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    struct _libssh2_sftp_handle_file_data *filep = &handle->u.file;
+    struct sftp_pipeline_chunk *chunk;
+    unsigned char *data;
+    size_t data_len;
+    uint32_t retcode;
+    ssize_t rc;
+
+    chunk = _libssh2_list_first(&handle->packet_list);
+    while(chunk) {
+        if(chunk->lefttosend) {
+            rc = sftp_channel_write(sftp, chunk, &chunk->packet[chunk->sent],
+                                    chunk->lefttosend);
+            if(rc == LIBSSH2_ERROR_EAGAIN)
+                /* see if any acks came in meanwhile */
+                break;
+            else if(rc < 0)
+                return (int)rc;
+            else if(!rc) {
+                /* no window left, wait for the server to adjust it */
+                _libssh2_session_block(session,
+                                       LIBSSH2_SESSION_BLOCK_INBOUND);
+                break;
+            }
+
+            /* the channel may have sent only a part, go on with the rest */
+            chunk->lefttosend -= rc;
+            chunk->sent += rc;
+            continue;
+        }
+        chunk = _libssh2_list_next(&chunk->node);
+    }
+
+    while((chunk = _libssh2_list_first(&handle->packet_list)) != NULL) {
+        if(chunk->lefttosend)
+            return LIBSSH2_ERROR_EAGAIN;
+
+        rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
+                                 chunk->request_id, &data, &data_len);
+        if(rc < 0)
+            return (int)rc;
+
+        retcode = _libssh2_ntohu32(data + 5);
+        LIBSSH2_FREE(session, data);
+
+        if(retcode != LIBSSH2_FX_OK) {
+            sftp->last_errno = retcode;
+            sftp_packetlist_flush(handle);
+            if(filep->merge) {
+                LIBSSH2_FREE(session, filep->merge);
+                filep->merge = NULL;
+            }
+            filep->offset_sent = filep->offset;
+            filep->acked = 0;
+            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                  "FXP write failed");
+        }
+
+        filep->offset += chunk->len;
+        _libssh2_list_remove(&chunk->node);
+        LIBSSH2_FREE(session, chunk);
+    }
+
+    return 0;
+}
+
+/*
+ * sftp_send_write
+ *
+ * sftp_write() for handles from libssh2_sftp_send(). The data is copied into
+ * FXP_WRITE packets of the full size and reported as written as soon as it
+ * is copied, while up to MAX_SFTP_WRITE_BEHIND bytes are on their way to the
+ * server. Errors the server reports for them are returned by a later write,
+ * or by fsync or close, which wait for all of them.
+ *
+ * As with sftp_write(), data that was copied but not returned as written
+ * (because of EAGAIN) is expected to get passed in again.
+ */
+static ssize_t sftp_send_write(LIBSSH2_SFTP_HANDLE *handle,
+                               const char *buffer, size_t count)
+{
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct _libssh2_sftp_handle_file_data *filep = &handle->u.file;
+    /* 25 = packet_len(4) + packet_type(1) + request_id(4) +
+       handle_len(4) + offset(8) + count(4) */
+    size_t header_len = handle->handle_len + 25;
+    size_t org_count = count;
+    size_t ret;
+    int rc;
+
+    /* skip the data copied in a previous call */
+    if(count > filep->acked) {
+        buffer += filep->acked;
+        count -= filep->acked;
+    }
+    else
+        count = 0;
+
+    while(count &&
+          ((filep->offset_sent - filep->offset) < MAX_SFTP_WRITE_BEHIND)) {
+        struct sftp_pipeline_chunk *chunk = filep->merge;
+        size_t size;
+
+        if(!chunk) {
+            unsigned char *s;
+
+            chunk = LIBSSH2_ALLOC(session, header_len +
+                                  MAX_SFTP_OUTGOING_SIZE +
+                                  sizeof(struct sftp_pipeline_chunk));
+            if(!chunk)
+                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                      "malloc fail for FXP_WRITE");
+
+            chunk->len = 0;
+            chunk->sent = 0;
+            chunk->lefttosend = 0;
+            chunk->offset = filep->offset_sent;
+            chunk->copied = 1;
+
+            /* the lengths are filled in by sftp_send_queue() */
+            s = &chunk->packet[4];
+            *(s++) = SSH_FXP_WRITE;
+            chunk->request_id = sftp->request_id++;
+            _libssh2_store_u32(&s, chunk->request_id);
+            _libssh2_store_str(&s, handle->handle, handle->handle_len);
+            _libssh2_store_u64(&s, filep->offset_sent);
+            filep->merge = chunk;
+        }
+
+        size = MIN(count, MAX_SFTP_OUTGOING_SIZE - chunk->len);
+        /* stop at the declared size so that the last packet goes out with
+           the write that reaches it, the size is only a hint though and
+           more data just keeps the pipeline going */
+        if(filep->offset_sent < filep->transfer_size)
+            size = (size_t)MIN(size, filep->transfer_size -
+                               filep->offset_sent);
+        memcpy(&chunk->packet[header_len + chunk->len], buffer, size);
+        chunk->len += size;
+        filep->offset_sent += size;
+        filep->acked += size;
+        buffer += size;
+        count -= size;
+
+        if((chunk->len == MAX_SFTP_OUTGOING_SIZE) ||
+           (filep->offset_sent == filep->transfer_size))
+            sftp_send_queue(handle);
+    }
+
+    rc = sftp_send_pipe(handle);
+    if(rc && (rc != LIBSSH2_ERROR_EAGAIN))
+        return rc;
+
+    if(rc && !filep->acked)
+        /* no room for more data until acks arrive */
+        return rc;
+
+    ret = MIN(filep->acked, org_count);
+    filep->acked -= ret;
+    return ret;
+}
+
+/*
+ * sftp_write_keep
+ *
+ * The chunk of sftp_write() that is not all sent when the call returns gets
+ * a copy of its data from 'payload', as the application may pass in less
+ * of the buffer the next time or give up on the write. The chunk is the
+ * last one, it gets replaced by one with the data after the header.
+ */
+static int sftp_write_keep(LIBSSH2_SFTP_HANDLE *handle,
+                           struct sftp_pipeline_chunk *chunk,
+                           const unsigned char *payload)
+{
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    size_t header_len = handle->handle_len + 25;
+    struct sftp_pipeline_chunk *kept;
+
+    if(chunk->copied)
+        return 0;
+
+    kept = LIBSSH2_ALLOC(session, sizeof(struct sftp_pipeline_chunk) +
+                         header_len + chunk->len);
+    if(!kept)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for FXP_WRITE "
+                              "data");
+
+    memcpy(kept, chunk, sizeof(struct sftp_pipeline_chunk) + header_len);
+    memcpy(&kept->packet[header_len], payload, chunk->len);
+    kept->copied = 1;
+
+    _libssh2_list_remove(&chunk->node);
+    _libssh2_list_add(&handle->packet_list, &kept->node);
+    if(sftp->send_owner == chunk)
+        sftp->send_owner = kept;
+    LIBSSH2_FREE(session, chunk);
+    return 0;
+}
+
+/*
+ * sftp_write
+ *
+ * Write data to an SFTP handle. Returns the number of bytes written, or
+ * a negative error code.
+ *
+ * We recommend sending very large data buffers to this function!
+ *
+ * Concept:
+ *
+ * - Detect how much of the given buffer that was already sent in a previous
+ *   call by inspecting the linked list of outgoing chunks. Make sure to skip
+ *   passed the data that has already been taken care of.
+ *
+ * - Finish sending the chunk a previous call left unsent, if any.
+ *
+ * - Split the (new) outgoing data in chunks no larger than N, one at a time
+ *   and send each as soon as it is created, as many as possible until
+ *   EAGAIN.
+ *
+ * - Each N bytes chunk is a separate SFTP packet. Only the packet header is
+ *   stored in the chunk, the data is sent straight from the buffer the
+ *   application passes in. The chunk that is not all sent when the call
+ *   returns gets a copy of its data, so the next call may pass in less.
+ *
+ * - Add all created outgoing packets to the linked list.
+ *
+ * - For all the chunks in the list that have been completely sent off, check
+ *   for ACKs. If a chunk has been ACKed, it is removed from the linked
+ *   list and the "acked" counter gets increased with that data amount.
+ *
+ * - Return TOTAL bytes acked so far.
+ *
+ * Caveats:
+ * -  be careful: we must not return a higher number than what was given!
+ *
+ * TODO:
+ *   Introduce an option that disables this sort of "speculative" ahead writing
+ *   as there's a risk that it will do harm to some app.
+ */
+
+static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
+                          size_t count)
+{
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    size_t data_len;
+    uint32_t retcode;
+    uint32_t packet_len;
+    unsigned char *s, *data;
+    ssize_t rc;
+    struct sftp_pipeline_chunk *chunk;
+    struct sftp_pipeline_chunk *next;
+    size_t acked = 0;
+    const unsigned char *org_buffer = (const unsigned char *)buffer;
+    size_t org_count = count;
+    size_t already;
+    libssh2_uint64_t base;
+    /* 25 = packet_len(4) + packet_type(1) + request_id(4) +
+       handle_len(4) + offset(8) + count(4) */
+    size_t header_len = handle->handle_len + 25;
+
+    /* the size and times of the file change as the data arrives */
+    handle->u.file.written = 1;
+    sftp_cache_forget(sftp, handle->path, handle->path_len, 0);
+
+    if(handle->u.file.transfer == LIBSSH2_SFTP_TRANSFER_SEND)
+        return sftp_send_write(handle, buffer, count);
+
+    switch(sftp->write_state) {
+    default:
+    case libssh2_NB_state_idle:
+
+        /* the file offset the first byte of the buffer is meant for */
+        base = handle->u.file.offset - handle->u.file.acked;
+
+        /* Number of bytes sent off that haven't been acked and therefor we
+           will get passed in here again.
+
+           Also, add up the number of bytes that actually already have been
+           acked but we haven't been able to return as such yet, so we will
+           get that data as well passed in here again.
+        */
+        already = (handle->u.file.offset_sent - handle->u.file.offset)+
+            handle->u.file.acked;
+
+        if(count >= already) {
+            /* skip the part already made into packets */
+            buffer += already;
+            count -= already;
+        }
+        else
+            /* there is more data already fine than what we got in this call */
+            count = 0;
+
+        sftp->write_state = libssh2_NB_state_idle;
+
+        /* finish the chunk left unsent by the previous call, then make the
+           rest of the buffer into chunks one at a time as they go out */
+        chunk = (struct sftp_pipeline_chunk *)handle->packet_list.last;
+        if(chunk && !chunk->lefttosend)
+            chunk = NULL;
+
+        while(chunk || count) {
+            const unsigned char *payload = NULL;
+
+            if(!chunk) {
+                /* TODO: Possibly this should have some logic to prevent a
+                   very very small fraction to be left but lets ignore that
+                   for now */
+                uint32_t size = MIN(MAX_SFTP_OUTGOING_SIZE, count);
+                uint32_t request_id;
+
+                packet_len = header_len + size;
+
+                chunk = LIBSSH2_ALLOC(session, header_len +
+                                      sizeof(struct sftp_pipeline_chunk));
+                if (!chunk)
+                    return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                          "malloc fail for FXP_WRITE");
+
+                chunk->len = size;
+                chunk->sent = 0;
+                chunk->lefttosend = packet_len;
+                chunk->offset = handle->u.file.offset_sent;
+                chunk->copied = 0;
+
+                s = chunk->packet;
+                _libssh2_store_u32(&s, packet_len - 4);
+
+                *(s++) = SSH_FXP_WRITE;
+                request_id = sftp->request_id++;
+                chunk->request_id = request_id;
+                _libssh2_store_u32(&s, request_id);
+                _libssh2_store_str(&s, handle->handle, handle->handle_len);
+                _libssh2_store_u64(&s, handle->u.file.offset_sent);
+                handle->u.file.offset_sent += size; /* advance offset at
+                                                       once */
+                _libssh2_store_u32(&s, size); /* the data follows from
+                                                 'buffer' */
+
+                /* add this new entry LAST in the list */
+                _libssh2_list_add(&handle->packet_list, &chunk->node);
+
+                buffer += size;
+                count -= size; /* deduct the size we used, as we might have
+                                  to create more packets */
+            }
+
+            if(chunk->copied)
+                rc = sftp_channel_write(sftp, chunk,
+                                        &chunk->packet[chunk->sent],
+                                        chunk->lefttosend);
+            else if(chunk->offset + chunk->len > base + org_count)
+                /* its data could not be copied and isn't passed in again */
+                return _libssh2_error(session, LIBSSH2_ERROR_BAD_USE,
+                                      "Data of a pending FXP_WRITE not "
+                                      "passed in again");
+            else {
+                payload = org_buffer + (chunk->offset - base);
+
+                if(chunk->sent < header_len)
+                    rc = sftp_channel_write2(sftp, chunk,
+                                             &chunk->packet[chunk->sent],
+                                             header_len - chunk->sent,
+                                             payload, chunk->len);
+                else
+                    rc = sftp_channel_write(sftp, chunk, payload +
+                                            (chunk->sent - header_len),
+                                            chunk->lefttosend);
+            }
+            if(rc > 0) {
+                /* remember where to continue sending the next time */
+                chunk->lefttosend -= rc;
+                chunk->sent += rc;
+            }
+
+            if(chunk->lefttosend) {
+                /* data left to send, the next call may pass in less of the
+                   buffer or none at all */
+                int keep = sftp_write_keep(handle, chunk, payload);
+                if((rc < 0) && (rc != LIBSSH2_ERROR_EAGAIN))
+                    return rc;
+                else if(keep)
+                    return keep;
+                else if(rc < 0)
+                    /* remain in idle state */
+                    return rc;
+                break;
+            }
+            chunk = NULL;
+        }
+
+        /* fall-through */
+    case libssh2_NB_state_sent:
+
+        sftp->write_state = libssh2_NB_state_idle;
+        /*
+         * Count all ACKed packets
+         */
+        chunk = _libssh2_list_first(&handle->packet_list);
+
+        while(chunk) {
+            if(chunk->lefttosend)
+                /* if the chunk still has data left to send, we shouldn't wait
+                   for an ACK for it just yet */
+                break;
+
+            else if(acked)
+                /* if we have sent data that is acked, we must return that
+                   info before we call a function that might return EAGAIN */
+                break;
+
+            /* we check the packets in order */
+            rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
+                                     chunk->request_id, &data, &data_len);
+            if (rc < 0) {
+                if (rc == LIBSSH2_ERROR_EAGAIN)
+                    sftp->write_state = libssh2_NB_state_sent;
+                return rc;
+            }
+
+            retcode = _libssh2_ntohu32(data + 5);
+            LIBSSH2_FREE(session, data);
+
+            sftp->last_errno = retcode;
+            if (retcode == LIBSSH2_FX_OK) {
+                acked += chunk->len; /* number of payload data that was acked
+                                        here */
+
+                /* we increase the offset value for all acks */
+                handle->u.file.offset += chunk->len;
+
+                next = _libssh2_list_next(&chunk->node);
+
+                _libssh2_list_remove(&chunk->node); /* remove from list */
+                LIBSSH2_FREE(session, chunk); /* free memory */
+
+                chunk = next;
+            }
+            else {
+                /* flush all pending packets from the outgoing list */
+                sftp_packetlist_flush(handle);
+
+                /* since we return error now, the applicaton will not get any
+                   outstanding data acked, so we need to rewind the offset to
+                   where the application knows it has reached with acked data */
+                handle->u.file.offset -= handle->u.file.acked;
+
+                /* then reset the offset_sent to be the same as the offset */
+                handle->u.file.offset_sent = handle->u.file.offset;
+
+                /* clear the acked counter since we can have no pending data to
+                   ack after an error */
+                handle->u.file.acked = 0;
+
+                /* the server returned an error for that written chunk, propagate
+                   this back to our parent function */
+                return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                      "FXP write failed");
+            }
+        }
+        break;
+    }
+
+    /* if there were acked data in a previous call that wasn't returned then,
+       add that up and try to return it all now. This can happen if the app
+       first sends a huge buffer of data, and then in a second call it sends a
+       smaller one. */
+    acked += handle->u.file.acked;
+
+    if(acked) {
+        ssize_t ret = MIN(acked, org_count);
+        /* we got data acked so return that amount, but no more than what
+           was asked to get sent! */
+
+        /* store the remainder. 'ret' is always equal to or less than 'acked'
+           here */
+        handle->u.file.acked = acked - ret;
+
+        return ret;
+    }
+
+    else
+        return 0; /* nothing was acked, and no EAGAIN was received! */
+}
+
+/* libssh2_sftp_write
+ * Write data to a file handle
+ */
+LIBSSH2_API ssize_t
+libssh2_sftp_write(LIBSSH2_SFTP_HANDLE *hnd, const char *buffer,
+                   size_t count)
+{
+    ssize_t rc;
+    if(!hnd)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
+                 sftp_write(hnd, buffer, count));
+    return rc;
+
+}
+
+static ssize_t sftp_write_request(LIBSSH2_REQUEST *request)
+{
+    return sftp_write(request->handle, request->buffer, request->length);
+}
+
+static void sftp_write_cancel(LIBSSH2_REQUEST *request)
+{
+    LIBSSH2_SFTP_HANDLE *handle = request->handle;
+
+    handle->sftp->write_state = libssh2_NB_state_idle;
+    sftp_request_abandon(request);
+}
+
+/* libssh2_sftp_write_async
+ * Queue a write to a file handle for libssh2_session_pump()
+ */
+LIBSSH2_API int
+libssh2_sftp_write_async(LIBSSH2_SFTP_HANDLE *hnd, const char *buffer,
+                         size_t count,
+                         LIBSSH2_COMPLETE_FUNC((*callback)), void *data)
+{
+    LIBSSH2_REQUEST request;
+    if(!hnd)
+        return LIBSSH2_ERROR_BAD_USE;
+
+    memset(&request, 0, sizeof(request));
+    /* the write state is kept in the SFTP instance, not the handle */
+    request.object = hnd->sftp;
+    request.mark = &hnd->sftp->request_write_mark;
+    request.run = sftp_write_request;
+    request.cancel = sftp_write_cancel;
+    request.handle = hnd;
+    request.buffer = (char *)buffer;
+    request.length = count;
+    request.callback = callback;
+    request.data = data;
+
+    return _libssh2_request_submit(hnd->sftp->channel->session, &request);
+}
+
+static int sftp_fsync(LIBSSH2_SFTP_HANDLE *handle)
+{
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    /* 34 = packet_len(4) + packet_type(1) + request_id(4) +
+       string_len(4) + strlen("fsync@openssh.com")(17) + handle_len(4) */
+    uint32_t packet_len = handle->handle_len + 34;
+    size_t data_len;
+    unsigned char *packet, *s, *data;
+    ssize_t rc;
+    uint32_t retcode;
+
+    if (sftp->fsync_state == libssh2_NB_state_idle) {
+        if((handle->handle_type == LIBSSH2_SFTP_HANDLE_FILE) &&
+           (handle->u.file.transfer == LIBSSH2_SFTP_TRANSFER_SEND)) {
+            /* the data reported written has to reach the file first */
+            if(handle->u.file.merge)
+                sftp_send_queue(handle);
+            rc = sftp_send_pipe(handle);
+            if(rc)
+                return (int)rc;
+        }
+
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "Issuing fsync command");
+        s = packet = LIBSSH2_ALLOC(session, packet_len);
+        if (!packet) {
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for FXP_EXTENDED "
+                                  "packet");
+        }
+
+        _libssh2_store_u32(&s, packet_len - 4);
+        *(s++) = SSH_FXP_EXTENDED;
+        sftp->fsync_request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, sftp->fsync_request_id);
+        _libssh2_store_str(&s, "fsync@openssh.com", 17);
+        _libssh2_store_str(&s, handle->handle, handle->handle_len);
+
+        sftp->fsync_state = libssh2_NB_state_created;
+    } else {
+        packet = sftp->fsync_packet;
+    }
+
+    if (sftp->fsync_state == libssh2_NB_state_created) {
+        rc = sftp_channel_write(sftp, packet, packet, packet_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN ||
+            (0 <= rc && rc < (ssize_t)packet_len)) {
+            sftp->fsync_packet = packet;
+            return LIBSSH2_ERROR_EAGAIN;
+        }
+
+        LIBSSH2_FREE(session, packet);
+        sftp->fsync_packet = NULL;
+
+        if (rc < 0) {
+            sftp->fsync_state = libssh2_NB_state_idle;
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                                  "_libssh2_channel_write() failed");
+        }
+        sftp->fsync_state = libssh2_NB_state_sent;
+    }
+
+    rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
+                             sftp->fsync_request_id, &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
+        return rc;
+    } else if (rc) {
+        sftp->fsync_state = libssh2_NB_state_idle;
+        return _libssh2_error(session, rc,
+                              "Error waiting for FXP EXTENDED REPLY");
+    }
+
+    sftp->fsync_state = libssh2_NB_state_idle;
+
+    retcode = _libssh2_ntohu32(data + 5);
+    LIBSSH2_FREE(session, data);
+
+    if (retcode != LIBSSH2_FX_OK) {
+        sftp->last_errno = retcode;
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "fsync failed");
+    }
+
+    return 0;
+}
+
+/* libssh2_sftp_fsync
+ * Commit data on the handle to disk.
+ */
+LIBSSH2_API int
+libssh2_sftp_fsync(LIBSSH2_SFTP_HANDLE *hnd)
+{
+    int rc;
+    if(!hnd)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
+                 sftp_fsync(hnd));
+    return rc;
+}
+
+
+/*
+ * sftp_fstat
+ *
+ * Get or Set stat on a file
+ */
+static int sftp_fstat(LIBSSH2_SFTP_HANDLE *handle,
+                      LIBSSH2_SFTP_ATTRIBUTES *attrs, int setstat)
+{
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    size_t data_len;
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) */
+    uint32_t packet_len =
+        handle->handle_len + 13 + (setstat ? sftp_attrsize(attrs->flags) : 0);
+    unsigned char *s, *data;
+    static const unsigned char fstat_responses[2] =
+        { SSH_FXP_ATTRS, SSH_FXP_STATUS };
+    ssize_t rc;
+
+    if (sftp->fstat_state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Issuing %s command",
+                       setstat ? "set-stat" : "stat");
+        if (setstat)
+            sftp_cache_forget(sftp, handle->path, handle->path_len, 0);
+        s = sftp->fstat_packet = LIBSSH2_ALLOC(session, packet_len);
+        if (!sftp->fstat_packet) {
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for "
+                                  "FSTAT/FSETSTAT packet");
+        }
+
+        _libssh2_store_u32(&s, packet_len - 4);
+        *(s++) = setstat ? SSH_FXP_FSETSTAT : SSH_FXP_FSTAT;
+        sftp->fstat_request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, sftp->fstat_request_id);
+        _libssh2_store_str(&s, handle->handle, handle->handle_len);
+
+        if (setstat) {
+            s += sftp_attr2bin(s, attrs);
+        }
+
+        sftp->fstat_state = libssh2_NB_state_created;
+    }
+
+    if (sftp->fstat_state == libssh2_NB_state_created) {
+        rc = sftp_channel_write(sftp, sftp->fstat_packet, sftp->fstat_packet,
+                                packet_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        }
+        else if ((ssize_t)packet_len != rc) {
+            LIBSSH2_FREE(session, sftp->fstat_packet);
+            sftp->fstat_packet = NULL;
+            sftp->fstat_state = libssh2_NB_state_idle;
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                                  (setstat ? "Unable to send FXP_FSETSTAT"
+                                   : "Unable to send FXP_FSTAT command"));
+        }
+        LIBSSH2_FREE(session, sftp->fstat_packet);
+        sftp->fstat_packet = NULL;
+
+        sftp->fstat_state = libssh2_NB_state_sent;
+    }
+
+    rc = sftp_packet_requirev(sftp, 2, fstat_responses,
+                              sftp->fstat_request_id, &data,
+                              &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+    else if (rc) {
+        sftp->fstat_state = libssh2_NB_state_idle;
+        return _libssh2_error(session, rc,
+                              "Timeout waiting for status message");
+    }
+
+    sftp->fstat_state = libssh2_NB_state_idle;
+
+    if (data[0] == SSH_FXP_STATUS) {
+        uint32_t retcode;
+
+        retcode = _libssh2_ntohu32(data + 5);
+        LIBSSH2_FREE(session, data);
+        if (retcode == LIBSSH2_FX_OK) {
+            return 0;
+        } else {
+            sftp->last_errno = retcode;
+            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                  "SFTP Protocol Error");
+        }
+    }
+
+    sftp_bin2attr(attrs, data + 5);
+    LIBSSH2_FREE(session, data);
+
+    if (!setstat && handle->path)
+        sftp_cache_store(sftp, NULL, 0, handle->path, handle->path_len, 0,
+                         attrs);
+
+    return 0;
+}
+
+/* libssh2_sftp_fstat_ex
+ * Get or Set stat on a file
+ */
+LIBSSH2_API int
+libssh2_sftp_fstat_ex(LIBSSH2_SFTP_HANDLE *hnd,
+                      LIBSSH2_SFTP_ATTRIBUTES *attrs, int setstat)
+{
+    int rc;
+    if(!hnd || !attrs)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
+                 sftp_fstat(hnd, attrs, setstat));
+    return rc;
+}
+
+
+/* libssh2_sftp_seek64
+ * Set the read/write pointer to an arbitrary position within the file
+ */
+LIBSSH2_API void
+libssh2_sftp_seek64(LIBSSH2_SFTP_HANDLE *handle, libssh2_uint64_t offset)
+{
+    if(!handle)
+        return;
+    if(handle->u.file.offset == offset && handle->u.file.offset_sent == offset)
+        return;
+
+    handle->u.file.offset = handle->u.file.offset_sent = offset;
+    /* discard all pending requests and currently read data */
+    sftp_packetlist_flush(handle);
+
+    if(handle->u.file.merge) {
+        LIBSSH2_FREE(handle->sftp->channel->session, handle->u.file.merge);
+        handle->u.file.merge = NULL;
+    }
+    handle->u.file.acked = 0;
+
+    /* free the left received buffered data */
+    if (handle->u.file.data_left) {
+        LIBSSH2_FREE(handle->sftp->channel->session, handle->u.file.data);
+        handle->u.file.data_left = handle->u.file.data_len = 0;
+        handle->u.file.data = NULL;
+    }
+
+    /* reset EOF to False */
+    handle->u.file.eof = FALSE;
+
+    /* the requests in flight were dropped, measure anew */
+    handle->u.file.rate_start = 0;
+}
+
+/* libssh2_sftp_seek
+ * Set the read/write pointer to an arbitrary position within the file
+ */
+LIBSSH2_API void
+libssh2_sftp_seek(LIBSSH2_SFTP_HANDLE *handle, size_t offset)
+{
+    libssh2_sftp_seek64(handle, (libssh2_uint64_t)offset);
+}
+
+/* libssh2_sftp_tell
+ * Return the current read/write pointer's offset
+ */
+LIBSSH2_API size_t
+libssh2_sftp_tell(LIBSSH2_SFTP_HANDLE *handle)
+{
+    if(!handle)
+        return 0; /* no handle, no size */
+
+    /* NOTE: this may very well truncate the size if it is larger than what
+       size_t can hold, so libssh2_sftp_tell64() is really the function you
+       should use */
+    return (size_t)(handle->u.file.offset);
+}
+
+/* libssh2_sftp_tell64
+ * Return the current read/write pointer's offset
+ */
+LIBSSH2_API libssh2_uint64_t
+libssh2_sftp_tell64(LIBSSH2_SFTP_HANDLE *handle)
+{
+    if(!handle)
+        return 0; /* no handle, no size */
+
+    return handle->u.file.offset;
+}
+
+/*
+ * Flush all remaining incoming SFTP packets and zombies.
+ */
+static void sftp_packet_flush(LIBSSH2_SFTP *sftp)
+{
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    LIBSSH2_SFTP_PACKET *packet = _libssh2_list_first(&sftp->packets);
+    struct sftp_zombie_requests *zombie =
+        _libssh2_list_first(&sftp->zombie_requests);
+
+    while(packet) {
+        LIBSSH2_SFTP_PACKET *next;
+
+        /* check next struct in the list */
+        next =  _libssh2_list_next(&packet->node);
+        _libssh2_list_remove(&packet->node);
+        LIBSSH2_FREE(session, packet->data);
+        LIBSSH2_FREE(session, packet);
+
+        packet = next;
+    }
+
+    while(zombie) {
+        /* figure out the next node */
+        struct sftp_zombie_requests *next = _libssh2_list_next(&zombie->node);
+        /* unlink the current one */
+        _libssh2_list_remove(&zombie->node);
+        /* free the memory */
+        LIBSSH2_FREE(session, zombie);
+        zombie = next;
+    }
+
+    sftp_index_free(session, &sftp->packet_index);
+    sftp_index_free(session, &sftp->zombie_index);
+    sftp_packet_pool_free(sftp);
+}
+
+/*
+ * sftp_handle_free
+ *
+ * Unlink a handle from the SFTP instance and free it with all it holds.
+ */
+static void sftp_handle_free(LIBSSH2_SFTP_HANDLE *handle)
+{
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+
+    /* remove this handle from the parent's list */
+    _libssh2_list_remove(&handle->node);
+
+    if (handle->handle_type == LIBSSH2_SFTP_HANDLE_DIR) {
+        if(handle->u.dir.names_left)
+            LIBSSH2_FREE(session, handle->u.dir.names_packet);
+    }
+    else {
+        if(handle->u.file.data)
+            LIBSSH2_FREE(session, handle->u.file.data);
+        if(handle->u.file.merge)
+            LIBSSH2_FREE(session, handle->u.file.merge);
+        if(handle->u.file.written)
+            sftp_cache_forget(sftp, handle->path, handle->path_len, 0);
+    }
+    if(handle->path)
+        LIBSSH2_FREE(session, handle->path);
+    if(handle->close_packet)
+        LIBSSH2_FREE(session, handle->close_packet);
+
+    sftp_packetlist_flush(handle);
+    sftp->read_state = libssh2_NB_state_idle;
+
+    LIBSSH2_FREE(session, handle);
+}
+
+/* sftp_close_handle
+ *
+ * Close a file or directory handle
+ * Also frees handle resource and unlinks it from the SFTP structure
+ */
+static int
+sftp_close_handle(LIBSSH2_SFTP_HANDLE *handle)
+{
+    LIBSSH2_SFTP *sftp = handle->sftp;
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    size_t data_len;
+    int retcode;
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) */
+    uint32_t packet_len = handle->handle_len + 13;
+    unsigned char *s, *data = NULL;
+    int rc;
+
+    if (handle->close_state == libssh2_NB_state_idle) {
+        if((handle->handle_type == LIBSSH2_SFTP_HANDLE_FILE) &&
+           (handle->u.file.transfer == LIBSSH2_SFTP_TRANSFER_SEND)) {
+            /* write out what a transfer cut short has left behind */
+            if(handle->u.file.merge)
+                sftp_send_queue(handle);
+            rc = sftp_send_pipe(handle);
+            if(rc == LIBSSH2_ERROR_EAGAIN)
+                return rc;
+            else if(rc == LIBSSH2_ERROR_SFTP_PROTOCOL)
+                /* the server refused a write, the file is still open and
+                   gets closed before the error is returned */
+                handle->u.file.send_error = rc;
+            else if(rc) {
+                /* the channel failed, there is no closing the file */
+                sftp_handle_free(handle);
+                return rc;
+            }
+        }
+
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Closing handle");
+        if (session->request_count)
+            _libssh2_request_cancel(session, handle);
+        /* a request cut short has to be completed before FXP_CLOSE */
+        sftp_packetlist_flush(handle);
+        s = handle->close_packet = LIBSSH2_ALLOC(session, packet_len);
+        if (!handle->close_packet) {
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for FXP_CLOSE "
+                                  "packet");
+        }
+
+        _libssh2_store_u32(&s, packet_len - 4);
+        *(s++) = SSH_FXP_CLOSE;
+        handle->close_request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, handle->close_request_id);
+        _libssh2_store_str(&s, handle->handle, handle->handle_len);
+        handle->close_state = libssh2_NB_state_created;
+    }
+
+    if (handle->close_state == libssh2_NB_state_created) {
+        rc = sftp_channel_write(sftp, handle->close_packet,
+                                handle->close_packet, packet_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if ((ssize_t)packet_len != rc) {
+            /* the channel failed, there is no closing the file */
+            sftp_handle_free(handle);
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                                  "Unable to send FXP_CLOSE command");
+        }
+        LIBSSH2_FREE(session, handle->close_packet);
+        handle->close_packet = NULL;
+
+        handle->close_state = libssh2_NB_state_sent;
+    }
+
+    if (handle->close_state == libssh2_NB_state_sent) {
+        rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
+                                 handle->close_request_id, &data,
+                                 &data_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if (rc) {
+            sftp_handle_free(handle);
+            return _libssh2_error(session, rc,
+                                  "Error waiting for status message");
         }
 
-        break;
+        handle->close_state = libssh2_NB_state_sent1;
+    }
 
-    default:
-        assert(!"State machine error; unrecognised read state");
+    if(!data)
+        /* if it reaches this point with data unset, something unwanted
+           happened (like this function is called again when in
+           libssh2_NB_state_sent1 state) and we just bail out */
+        return LIBSSH2_ERROR_INVAL;
+
+    retcode = _libssh2_ntohu32(data + 5);
+    LIBSSH2_FREE(session, data);
+
+    if (retcode != LIBSSH2_FX_OK) {
+        sftp->last_errno = retcode;
+        handle->close_state = libssh2_NB_state_idle;
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "SFTP Protocol Error");
     }
 
+    rc = (handle->handle_type == LIBSSH2_SFTP_HANDLE_FILE) ?
+        handle->u.file.send_error : 0;
+    sftp_handle_free(handle);
+
+    if(rc)
+        return _libssh2_error(session, rc, "FXP write failed");
     return 0;
 }
 
-/* libssh2_sftp_read
- * Read from an SFTP file handle
+/* libssh2_sftp_close_handle
+ *
+ * Close a file or directory handle
+ * Also frees handle resource and unlinks it from the SFTP structure
  */
-LIBSSH2_API ssize_t
-libssh2_sftp_read(LIBSSH2_SFTP_HANDLE *hnd, char *buffer,
-                  size_t buffer_maxlen)
+LIBSSH2_API int
+libssh2_sftp_close_handle(LIBSSH2_SFTP_HANDLE *hnd)
 {
-    ssize_t rc;
+    LIBSSH2_SESSION *session;
+    int rc;
     if(!hnd)
         return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
-                 sftp_read(hnd, buffer, buffer_maxlen));
+    /* hnd is freed before BLOCK_ADJUST releases the session */
+    session = hnd->sftp->channel->session;
+    BLOCK_ADJUST(rc, session, sftp_close_handle(hnd));
     return rc;
 }
 
-/* sftp_readdir
- * Read from an SFTP directory handle
+/* sftp_unlink
+ * Delete a file from the remote server
  */
-static ssize_t sftp_readdir(LIBSSH2_SFTP_HANDLE *handle, char *buffer,
-                            size_t buffer_maxlen, char *longentry,
-                            size_t longentry_maxlen,
-                            LIBSSH2_SFTP_ATTRIBUTES *attrs)
+static int sftp_unlink(LIBSSH2_SFTP *sftp, const char *filename,
+                       size_t filename_len)
 {
-    LIBSSH2_SFTP *sftp = handle->sftp;
     LIBSSH2_CHANNEL *channel = sftp->channel;
     LIBSSH2_SESSION *session = channel->session;
     size_t data_len;
-    uint32_t num_names;
-    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) */
-    uint32_t packet_len = handle->handle_len + 13;
+    int retcode;
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + filename_len(4) */
+    uint32_t packet_len = filename_len + 13;
     unsigned char *s, *data;
-    static const unsigned char read_responses[2] = {
-        SSH_FXP_NAME, SSH_FXP_STATUS };
-    ssize_t retcode;
-
-    if (sftp->readdir_state == libssh2_NB_state_idle) {
-        if (handle->u.dir.names_left) {
-            /*
-             * A prior request returned more than one directory entry,
-             * feed it back from the buffer
-             */
-            LIBSSH2_SFTP_ATTRIBUTES attrs_dummy;
-            size_t real_longentry_len;
-            size_t real_filename_len;
-            size_t filename_len;
-            size_t longentry_len;
-
-            s = (unsigned char *) handle->u.dir.next_name;
-            real_filename_len = _libssh2_ntohu32(s);
+    int rc;
 
-            s += 4;
+    if (sftp->unlink_state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Unlinking %s", filename);
+        sftp_cache_forget(sftp, filename, filename_len, SFTP_CACHE_PARENT);
+        s = sftp->unlink_packet = LIBSSH2_ALLOC(session, packet_len);
+        if (!sftp->unlink_packet) {
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for FXP_REMOVE "
+                                  "packet");
+        }
 
-            filename_len = real_filename_len;
-            if (filename_len >= buffer_maxlen) {
-                filename_len = LIBSSH2_ERROR_BUFFER_TOO_SMALL;
-                goto end;
-            }
+        _libssh2_store_u32(&s, packet_len - 4);
+        *(s++) = SSH_FXP_REMOVE;
+        sftp->unlink_request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, sftp->unlink_request_id);
+        _libssh2_store_str(&s, filename, filename_len);
+        sftp->unlink_state = libssh2_NB_state_created;
+    }
 
-            memcpy(buffer, s, filename_len);
-            buffer[filename_len] = '\0';           /* zero terminate */
-            s += real_filename_len;
+    if (sftp->unlink_state == libssh2_NB_state_created) {
+        rc = sftp_channel_write(sftp, sftp->unlink_packet, sftp->unlink_packet,
+                                packet_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if ((ssize_t)packet_len != rc) {
+            LIBSSH2_FREE(session, sftp->unlink_packet);
+            sftp->unlink_packet = NULL;
+            sftp->unlink_state = libssh2_NB_state_idle;
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                                  "Unable to send FXP_REMOVE command");
+        }
+        LIBSSH2_FREE(session, sftp->unlink_packet);
+        sftp->unlink_packet = NULL;
 
-            real_longentry_len = _libssh2_ntohu32(s);
-            s += 4;
+        sftp->unlink_state = libssh2_NB_state_sent;
+    }
 
-            if (longentry && (longentry_maxlen>1)) {
-                longentry_len = real_longentry_len;
+    rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
+                             sftp->unlink_request_id, &data,
+                             &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
+        return rc;
+    }
+    else if (rc) {
+        sftp->unlink_state = libssh2_NB_state_idle;
+        return _libssh2_error(session, rc,
+                              "Error waiting for FXP STATUS");
+    }
 
-                if (longentry_len >= longentry_maxlen) {
-                    filename_len = LIBSSH2_ERROR_BUFFER_TOO_SMALL;
-                    goto end;
-                }
+    sftp->unlink_state = libssh2_NB_state_idle;
 
-                memcpy(longentry, s, longentry_len);
-                longentry[longentry_len] = '\0'; /* zero terminate */
-            }
-            s += real_longentry_len;
+    retcode = _libssh2_ntohu32(data + 5);
+    LIBSSH2_FREE(session, data);
 
-            if (attrs)
-                memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
+    if (retcode == LIBSSH2_FX_OK) {
+        return 0;
+    } else {
+        sftp->last_errno = retcode;
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "SFTP Protocol Error");
+    }
+}
 
-            s += sftp_bin2attr(attrs ? attrs : &attrs_dummy, s);
+/* libssh2_sftp_unlink_ex
+ * Delete a file from the remote server
+ */
+LIBSSH2_API int
+libssh2_sftp_unlink_ex(LIBSSH2_SFTP *sftp, const char *filename,
+                       unsigned int filename_len)
+{
+    int rc;
+    if(!sftp)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, sftp->channel->session,
+                 sftp_unlink(sftp, filename, filename_len));
+    return rc;
+}
 
-            handle->u.dir.next_name = (char *) s;
-          end:
+/*
+ * sftp_rename
+ *
+ * Rename a file on the remote server
+ */
+static int sftp_rename(LIBSSH2_SFTP *sftp, const char *source_filename,
+                       unsigned int source_filename_len,
+                       const char *dest_filename,
+                       unsigned int dest_filename_len, long flags)
+{
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    size_t data_len;
+    int retcode;
+    uint32_t packet_len =
+        source_filename_len + dest_filename_len + 17 + (sftp->version >=
+                                                        5 ? 4 : 0);
+    /* packet_len(4) + packet_type(1) + request_id(4) +
+       source_filename_len(4) + dest_filename_len(4) + flags(4){SFTP5+) */
+    unsigned char *data;
+    ssize_t rc;
 
-            if ((--handle->u.dir.names_left) == 0)
-                LIBSSH2_FREE(session, handle->u.dir.names_packet);
+    if (sftp->version < 2) {
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "Server does not support RENAME");
+    }
 
-            _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                           "libssh2_sftp_readdir_ex() return %d",
-                           filename_len);
-            return (ssize_t)filename_len;
+    if (sftp->rename_state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Renaming %s to %s",
+                       source_filename, dest_filename);
+        sftp_cache_forget(sftp, source_filename, source_filename_len,
+                          SFTP_CACHE_PARENT | SFTP_CACHE_TREE);
+        sftp_cache_forget(sftp, dest_filename, dest_filename_len,
+                          SFTP_CACHE_PARENT | SFTP_CACHE_TREE);
+        sftp->rename_s = sftp->rename_packet =
+            LIBSSH2_ALLOC(session, packet_len);
+        if (!sftp->rename_packet) {
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for FXP_RENAME "
+                                  "packet");
         }
 
-        /* Request another entry(entries?) */
-
-        s = sftp->readdir_packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!sftp->readdir_packet)
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for "
-                                  "FXP_READDIR packet");
+        _libssh2_store_u32(&sftp->rename_s, packet_len - 4);
+        *(sftp->rename_s++) = SSH_FXP_RENAME;
+        sftp->rename_request_id = sftp->request_id++;
+        _libssh2_store_u32(&sftp->rename_s, sftp->rename_request_id);
+        _libssh2_store_str(&sftp->rename_s, source_filename,
+                           source_filename_len);
+        _libssh2_store_str(&sftp->rename_s, dest_filename, dest_filename_len);
 
-        _libssh2_store_u32(&s, packet_len - 4);
-        *(s++) = SSH_FXP_READDIR;
-        sftp->readdir_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->readdir_request_id);
-        _libssh2_store_str(&s, handle->handle, handle->handle_len);
+        if (sftp->version >= 5)
+            _libssh2_store_u32(&sftp->rename_s, flags);
 
-        sftp->readdir_state = libssh2_NB_state_created;
+        sftp->rename_state = libssh2_NB_state_created;
     }
 
-    if (sftp->readdir_state == libssh2_NB_state_created) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "Reading entries from directory handle");
-        retcode = _libssh2_channel_write(channel, 0, sftp->readdir_packet,
-                                         packet_len);
-        if (retcode == LIBSSH2_ERROR_EAGAIN) {
-            return retcode;
-        }
-        else if ((ssize_t)packet_len != retcode) {
-            LIBSSH2_FREE(session, sftp->readdir_packet);
-            sftp->readdir_packet = NULL;
-            sftp->readdir_state = libssh2_NB_state_idle;
+    if (sftp->rename_state == libssh2_NB_state_created) {
+        rc = sftp_channel_write(sftp, sftp->rename_packet,
+                                sftp->rename_packet,
+                                sftp->rename_s - sftp->rename_packet);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            return rc;
+        } else if ((ssize_t)packet_len != rc) {
+            LIBSSH2_FREE(session, sftp->rename_packet);
+            sftp->rename_packet = NULL;
+            sftp->rename_state = libssh2_NB_state_idle;
             return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "_libssh2_channel_write() failed");
+                                  "Unable to send FXP_RENAME command");
         }
+        LIBSSH2_FREE(session, sftp->rename_packet);
+        sftp->rename_packet = NULL;
 
-        LIBSSH2_FREE(session, sftp->readdir_packet);
-        sftp->readdir_packet = NULL;
-
-        sftp->readdir_state = libssh2_NB_state_sent;
+        sftp->rename_state = libssh2_NB_state_sent;
     }
 
-    retcode = sftp_packet_requirev(sftp, 2, read_responses,
-                                   sftp->readdir_request_id, &data,
-                                   &data_len);
-    if (retcode == LIBSSH2_ERROR_EAGAIN)
-        return retcode;
-    else if (retcode) {
-        sftp->readdir_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, retcode,
-                              "Timeout waiting for status message");
+    rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
+                             sftp->rename_request_id, &data,
+                             &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
+        return rc;
+    } else if (rc) {
+        sftp->rename_state = libssh2_NB_state_idle;
+        return _libssh2_error(session, rc,
+                              "Error waiting for FXP STATUS");
     }
 
-    if (data[0] == SSH_FXP_STATUS) {
-        retcode = _libssh2_ntohu32(data + 5);
-        LIBSSH2_FREE(session, data);
-        if (retcode == LIBSSH2_FX_EOF) {
-            sftp->readdir_state = libssh2_NB_state_idle;
-            return 0;
-        }
-        else {
-            sftp->last_errno = retcode;
-            sftp->readdir_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                  "SFTP Protocol Error");
-        }
-    }
+    sftp->rename_state = libssh2_NB_state_idle;
+
+    retcode = _libssh2_ntohu32(data + 5);
+    LIBSSH2_FREE(session, data);
+
+    sftp->last_errno = retcode;
+
+    /* now convert the SFTP error code to libssh2 return code or error
+       message */
+    switch (retcode) {
+    case LIBSSH2_FX_OK:
+        retcode = LIBSSH2_ERROR_NONE;
+        break;
+
+    case LIBSSH2_FX_FILE_ALREADY_EXISTS:
+        retcode = _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                 "File already exists and "
+                                 "SSH_FXP_RENAME_OVERWRITE not specified");
+        break;
 
-    sftp->readdir_state = libssh2_NB_state_idle;
+    case LIBSSH2_FX_OP_UNSUPPORTED:
+        retcode = _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                 "Operation Not Supported");
+        break;
 
-    num_names = _libssh2_ntohu32(data + 5);
-    _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "%lu entries returned",
-                   num_names);
-    if (!num_names) {
-        LIBSSH2_FREE(session, data);
-        return 0;
+    default:
+        retcode = _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                 "SFTP Protocol Error");
+        break;
     }
 
-    handle->u.dir.names_left = num_names;
-    handle->u.dir.names_packet = data;
-    handle->u.dir.next_name = (char *) data + 9;
-
-    /* use the name popping mechanism from the start of the function */
-    return sftp_readdir(handle, buffer, buffer_maxlen, longentry,
-                        longentry_maxlen, attrs);
+    return retcode;
 }
 
-/* libssh2_sftp_readdir_ex
- * Read from an SFTP directory handle
+/* libssh2_sftp_rename_ex
+ * Rename a file on the remote server
  */
 LIBSSH2_API int
-libssh2_sftp_readdir_ex(LIBSSH2_SFTP_HANDLE *hnd, char *buffer,
-                        size_t buffer_maxlen, char *longentry,
-                        size_t longentry_maxlen,
-                        LIBSSH2_SFTP_ATTRIBUTES *attrs)
+libssh2_sftp_rename_ex(LIBSSH2_SFTP *sftp, const char *source_filename,
+                       unsigned int source_filename_len,
+                       const char *dest_filename,
+                       unsigned int dest_filename_len, long flags)
 {
     int rc;
-    if(!hnd)
+    if(!sftp)
         return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
-                 sftp_readdir(hnd, buffer, buffer_maxlen, longentry,
-                              longentry_maxlen, attrs));
+    BLOCK_ADJUST(rc, sftp->channel->session,
+                 sftp_rename(sftp, source_filename, source_filename_len,
+                             dest_filename, dest_filename_len, flags));
     return rc;
 }
 
 /*
- * sftp_write
- *
- * Write data to an SFTP handle. Returns the number of bytes written, or
- * a negative error code.
- *
- * We recommend sending very large data buffers to this function!
- *
- * Concept:
- *
- * - Detect how much of the given buffer that was already sent in a previous
- *   call by inspecting the linked list of outgoing chunks. Make sure to skip
- *   passed the data that has already been taken care of.
- *
- * - Split all (new) outgoing data in chunks no larger than N.
- *
- * - Each N bytes chunk gets created as a separate SFTP packet.
- *
- * - Add all created outgoing packets to the linked list.
- *
- * - Walk through the list and send the chunks that haven't been sent,
- *   as many as possible until EAGAIN. Some of the chunks may have been put
- *   in the list in a previous invoke.
- *
- * - For all the chunks in the list that have been completely sent off, check
- *   for ACKs. If a chunk has been ACKed, it is removed from the linked
- *   list and the "acked" counter gets increased with that data amount.
- *
- * - Return TOTAL bytes acked so far.
- *
- * Caveats:
- * -  be careful: we must not return a higher number than what was given!
+ * sftp_fstatvfs
  *
- * TODO:
- *   Introduce an option that disables this sort of "speculative" ahead writing
- *   as there's a risk that it will do harm to some app.
+ * Get file system statistics
  */
-
-static ssize_t sftp_write(LIBSSH2_SFTP_HANDLE *handle, const char *buffer,
-                          size_t count)
+static int sftp_fstatvfs(LIBSSH2_SFTP_HANDLE *handle, LIBSSH2_SFTP_STATVFS *st)
 {
     LIBSSH2_SFTP *sftp = handle->sftp;
     LIBSSH2_CHANNEL *channel = sftp->channel;
     LIBSSH2_SESSION *session = channel->session;
     size_t data_len;
-    uint32_t retcode;
-    uint32_t packet_len;
-    unsigned char *s, *data;
+    /* 17 = packet_len(4) + packet_type(1) + request_id(4) + ext_len(4)
+          + handle_len (4) */
+    /* 20 = strlen ("fstatvfs@openssh.com") */
+    uint32_t packet_len = handle->handle_len + 20 + 17;
+    unsigned char *packet, *s, *data;
     ssize_t rc;
-    struct sftp_pipeline_chunk *chunk;
-    struct sftp_pipeline_chunk *next;
-    size_t acked = 0;
-    size_t org_count = count;
-    size_t already;
-
-    switch(sftp->write_state) {
-    default:
-    case libssh2_NB_state_idle:
-
-        /* Number of bytes sent off that haven't been acked and therefor we
-           will get passed in here again.
-
-           Also, add up the number of bytes that actually already have been
-           acked but we haven't been able to return as such yet, so we will
-           get that data as well passed in here again.
-        */
-        already = (handle->u.file.offset_sent - handle->u.file.offset)+
-            handle->u.file.acked;
-
-        if(count >= already) {
-            /* skip the part already made into packets */
-            buffer += already;
-            count -= already;
-        }
-        else
-            /* there is more data already fine than what we got in this call */
-            count = 0;
-
-        sftp->write_state = libssh2_NB_state_idle;
-        while(count) {
-            /* TODO: Possibly this should have some logic to prevent a very
-               very small fraction to be left but lets ignore that for now */
-            uint32_t size = MIN(MAX_SFTP_OUTGOING_SIZE, count);
-            uint32_t request_id;
-
-            /* 25 = packet_len(4) + packet_type(1) + request_id(4) +
-               handle_len(4) + offset(8) + count(4) */
-            packet_len = handle->handle_len + size + 25;
-
-            chunk = LIBSSH2_ALLOC(session, packet_len +
-                                  sizeof(struct sftp_pipeline_chunk));
-            if (!chunk)
-                return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                      "malloc fail for FXP_WRITE");
-
-            chunk->len = size;
-            chunk->sent = 0;
-            chunk->lefttosend = packet_len;
-
-            s = chunk->packet;
-            _libssh2_store_u32(&s, packet_len - 4);
-
-            *(s++) = SSH_FXP_WRITE;
-            request_id = sftp->request_id++;
-            chunk->request_id = request_id;
-            _libssh2_store_u32(&s, request_id);
-            _libssh2_store_str(&s, handle->handle, handle->handle_len);
-            _libssh2_store_u64(&s, handle->u.file.offset_sent);
-            handle->u.file.offset_sent += size; /* advance offset at once */
-            _libssh2_store_str(&s, buffer, size);
-
-            /* add this new entry LAST in the list */
-            _libssh2_list_add(&handle->packet_list, &chunk->node);
+    unsigned int flag;
 
-            buffer += size;
-            count -= size; /* deduct the size we used, as we might have
-                              to create more packets */
+    if (sftp->fstatvfs_state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "Getting file system statistics");
+        s = packet = LIBSSH2_ALLOC(session, packet_len);
+        if (!packet) {
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for FXP_EXTENDED "
+                                  "packet");
         }
 
-        /* move through the WRITE packets that haven't been sent and send as many
-           as possible - remember that we don't block */
-        chunk = _libssh2_list_first(&handle->packet_list);
-
-        while(chunk) {
-            if(chunk->lefttosend) {
-                rc = _libssh2_channel_write(channel, 0,
-                                            &chunk->packet[chunk->sent],
-                                            chunk->lefttosend);
-                if(rc < 0)
-                    /* remain in idle state */
-                    return rc;
-
-                /* remember where to continue sending the next time */
-                chunk->lefttosend -= rc;
-                chunk->sent += rc;
+        _libssh2_store_u32(&s, packet_len - 4);
+        *(s++) = SSH_FXP_EXTENDED;
+        sftp->fstatvfs_request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, sftp->fstatvfs_request_id);
+        _libssh2_store_str(&s, "fstatvfs@openssh.com", 20);
+        _libssh2_store_str(&s, handle->handle, handle->handle_len);
 
-                if(chunk->lefttosend)
-                    /* data left to send, get out of loop */
-                    break;
-            }
+        sftp->fstatvfs_state = libssh2_NB_state_created;
+    }
+    else {
+        packet = sftp->fstatvfs_packet;
+    }
 
-            /* move on to the next chunk with data to send */
-            chunk = _libssh2_list_next(&chunk->node);
+    if (sftp->fstatvfs_state == libssh2_NB_state_created) {
+        rc = sftp_channel_write(sftp, packet, packet, packet_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN ||
+            (0 <= rc && rc < (ssize_t)packet_len)) {
+            sftp->fstatvfs_packet = packet;
+            return LIBSSH2_ERROR_EAGAIN;
         }
 
-        /* fall-through */
-    case libssh2_NB_state_sent:
-
-        sftp->write_state = libssh2_NB_state_idle;
-        /*
-         * Count all ACKed packets
-         */
-        chunk = _libssh2_list_first(&handle->packet_list);
-
-        while(chunk) {
-            if(chunk->lefttosend)
-                /* if the chunk still has data left to send, we shouldn't wait
-                   for an ACK for it just yet */
-                break;
-
-            else if(acked)
-                /* if we have sent data that is acked, we must return that
-                   info before we call a function that might return EAGAIN */
-                break;
-
-            /* we check the packets in order */
-            rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
-                                     chunk->request_id, &data, &data_len);
-            if (rc < 0) {
-                if (rc == LIBSSH2_ERROR_EAGAIN)
-                    sftp->write_state = libssh2_NB_state_sent;
-                return rc;
-            }
-
-            retcode = _libssh2_ntohu32(data + 5);
-            LIBSSH2_FREE(session, data);
-
-            sftp->last_errno = retcode;
-            if (retcode == LIBSSH2_FX_OK) {
-                acked += chunk->len; /* number of payload data that was acked
-                                        here */
-
-                /* we increase the offset value for all acks */
-                handle->u.file.offset += chunk->len;
-
-                next = _libssh2_list_next(&chunk->node);
-
-                _libssh2_list_remove(&chunk->node); /* remove from list */
-                LIBSSH2_FREE(session, chunk); /* free memory */
-
-                chunk = next;
-            }
-            else {
-                /* flush all pending packets from the outgoing list */
-                sftp_packetlist_flush(handle);
-
-                /* since we return error now, the applicaton will not get any
-                   outstanding data acked, so we need to rewind the offset to
-                   where the application knows it has reached with acked data */
-                handle->u.file.offset -= handle->u.file.acked;
-
-                /* then reset the offset_sent to be the same as the offset */
-                handle->u.file.offset_sent = handle->u.file.offset;
-
-                /* clear the acked counter since we can have no pending data to
-                   ack after an error */
-                handle->u.file.acked = 0;
+        LIBSSH2_FREE(session, packet);
+        sftp->fstatvfs_packet = NULL;
 
-                /* the server returned an error for that written chunk, propagate
-                   this back to our parent function */
-                return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                      "FXP write failed");
-            }
+        if (rc < 0) {
+            sftp->fstatvfs_state = libssh2_NB_state_idle;
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                                  "_libssh2_channel_write() failed");
         }
-        break;
+        sftp->fstatvfs_state = libssh2_NB_state_sent;
     }
 
-    /* if there were acked data in a previous call that wasn't returned then,
-       add that up and try to return it all now. This can happen if the app
-       first sends a huge buffer of data, and then in a second call it sends a
-       smaller one. */
-    acked += handle->u.file.acked;
+    rc = sftp_packet_require(sftp, SSH_FXP_EXTENDED_REPLY,
+                             sftp->fstatvfs_request_id, &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
+        return rc;
+    } else if (rc) {
+        sftp->fstatvfs_state = libssh2_NB_state_idle;
+        return _libssh2_error(session, rc,
+                              "Error waiting for FXP EXTENDED REPLY");
+    } else if (data_len < 93) {
+        LIBSSH2_FREE(session, data);
+        sftp->fstatvfs_state = libssh2_NB_state_idle;
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "SFTP Protocol Error: short response");
+    }
 
-    if(acked) {
-        ssize_t ret = MIN(acked, org_count);
-        /* we got data acked so return that amount, but no more than what
-           was asked to get sent! */
+    sftp->fstatvfs_state = libssh2_NB_state_idle;
 
-        /* store the remainder. 'ret' is always equal to or less than 'acked'
-           here */
-        handle->u.file.acked = acked - ret;
+    st->f_bsize = _libssh2_ntohu64(data + 5);
+    st->f_frsize = _libssh2_ntohu64(data + 13);
+    st->f_blocks = _libssh2_ntohu64(data + 21);
+    st->f_bfree = _libssh2_ntohu64(data + 29);
+    st->f_bavail = _libssh2_ntohu64(data + 37);
+    st->f_files = _libssh2_ntohu64(data + 45);
+    st->f_ffree = _libssh2_ntohu64(data + 53);
+    st->f_favail = _libssh2_ntohu64(data + 61);
+    st->f_fsid = _libssh2_ntohu64(data + 69);
+    flag = _libssh2_ntohu64(data + 77);
+    st->f_namemax = _libssh2_ntohu64(data + 85);
 
-        return ret;
-    }
+    st->f_flag = (flag & SSH_FXE_STATVFS_ST_RDONLY)
+                  ? LIBSSH2_SFTP_ST_RDONLY : 0;
+    st->f_flag |= (flag & SSH_FXE_STATVFS_ST_NOSUID)
+                  ? LIBSSH2_SFTP_ST_NOSUID : 0;
 
-    else
-        return 0; /* nothing was acked, and no EAGAIN was received! */
+    LIBSSH2_FREE(session, data);
+    return 0;
 }
 
-/* libssh2_sftp_write
- * Write data to a file handle
+/* libssh2_sftp_fstatvfs
+ * Get filesystem space and inode utilization (requires fstatvfs@openssh.com
+ * support on the server)
  */
-LIBSSH2_API ssize_t
-libssh2_sftp_write(LIBSSH2_SFTP_HANDLE *hnd, const char *buffer,
-                   size_t count)
+LIBSSH2_API int
+libssh2_sftp_fstatvfs(LIBSSH2_SFTP_HANDLE *handle, LIBSSH2_SFTP_STATVFS *st)
 {
-    ssize_t rc;
-    if(!hnd)
+    int rc;
+    if(!handle || !st)
         return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
-                 sftp_write(hnd, buffer, count));
+    BLOCK_ADJUST(rc, handle->sftp->channel->session, sftp_fstatvfs(handle, st));
     return rc;
-
 }
 
-static int sftp_fsync(LIBSSH2_SFTP_HANDLE *handle)
+/*
+ * sftp_statvfs
+ *
+ * Get file system statistics
+ */
+static int sftp_statvfs(LIBSSH2_SFTP *sftp, const char *path,
+                        unsigned int path_len, LIBSSH2_SFTP_STATVFS *st)
 {
-    LIBSSH2_SFTP *sftp = handle->sftp;
     LIBSSH2_CHANNEL *channel = sftp->channel;
     LIBSSH2_SESSION *session = channel->session;
-    /* 34 = packet_len(4) + packet_type(1) + request_id(4) +
-       string_len(4) + strlen("fsync@openssh.com")(17) + handle_len(4) */
-    uint32_t packet_len = handle->handle_len + 34;
     size_t data_len;
+    /* 17 = packet_len(4) + packet_type(1) + request_id(4) + ext_len(4)
+          + path_len (4) */
+    /* 19 = strlen ("statvfs@openssh.com") */
+    uint32_t packet_len = path_len + 19 + 17;
     unsigned char *packet, *s, *data;
     ssize_t rc;
-    uint32_t retcode;
+    unsigned int flag;
 
-    if (sftp->fsync_state == libssh2_NB_state_idle) {
+    if (sftp->statvfs_state == libssh2_NB_state_idle) {
         _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "Issuing fsync command");
+                       "Getting file system statistics of %s", path);
         s = packet = LIBSSH2_ALLOC(session, packet_len);
         if (!packet) {
             return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
@@ -2043,1343 +4631,1965 @@ static int sftp_fsync(LIBSSH2_SFTP_HANDLE *handle)
 
         _libssh2_store_u32(&s, packet_len - 4);
         *(s++) = SSH_FXP_EXTENDED;
-        sftp->fsync_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->fsync_request_id);
-        _libssh2_store_str(&s, "fsync@openssh.com", 17);
-        _libssh2_store_str(&s, handle->handle, handle->handle_len);
+        sftp->statvfs_request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, sftp->statvfs_request_id);
+        _libssh2_store_str(&s, "statvfs@openssh.com", 19);
+        _libssh2_store_str(&s, path, path_len);
 
-        sftp->fsync_state = libssh2_NB_state_created;
-    } else {
-        packet = sftp->fsync_packet;
+        sftp->statvfs_state = libssh2_NB_state_created;
+    }
+    else {
+        packet = sftp->statvfs_packet;
     }
 
-    if (sftp->fsync_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, packet, packet_len);
+    if (sftp->statvfs_state == libssh2_NB_state_created) {
+        rc = sftp_channel_write(sftp, packet, packet, packet_len);
         if (rc == LIBSSH2_ERROR_EAGAIN ||
             (0 <= rc && rc < (ssize_t)packet_len)) {
-            sftp->fsync_packet = packet;
+            sftp->statvfs_packet = packet;
             return LIBSSH2_ERROR_EAGAIN;
         }
 
         LIBSSH2_FREE(session, packet);
-        sftp->fsync_packet = NULL;
+        sftp->statvfs_packet = NULL;
 
         if (rc < 0) {
-            sftp->fsync_state = libssh2_NB_state_idle;
+            sftp->statvfs_state = libssh2_NB_state_idle;
             return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
                                   "_libssh2_channel_write() failed");
         }
-        sftp->fsync_state = libssh2_NB_state_sent;
+        sftp->statvfs_state = libssh2_NB_state_sent;
     }
 
-    rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
-                             sftp->fsync_request_id, &data, &data_len);
+    rc = sftp_packet_require(sftp, SSH_FXP_EXTENDED_REPLY,
+                             sftp->statvfs_request_id, &data, &data_len);
     if (rc == LIBSSH2_ERROR_EAGAIN) {
         return rc;
     } else if (rc) {
-        sftp->fsync_state = libssh2_NB_state_idle;
+        sftp->statvfs_state = libssh2_NB_state_idle;
         return _libssh2_error(session, rc,
                               "Error waiting for FXP EXTENDED REPLY");
+    } else if (data_len < 93) {
+        LIBSSH2_FREE(session, data);
+        sftp->statvfs_state = libssh2_NB_state_idle;
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "SFTP Protocol Error: short response");
     }
 
-    sftp->fsync_state = libssh2_NB_state_idle;
+    sftp->statvfs_state = libssh2_NB_state_idle;
+
+    st->f_bsize = _libssh2_ntohu64(data + 5);
+    st->f_frsize = _libssh2_ntohu64(data + 13);
+    st->f_blocks = _libssh2_ntohu64(data + 21);
+    st->f_bfree = _libssh2_ntohu64(data + 29);
+    st->f_bavail = _libssh2_ntohu64(data + 37);
+    st->f_files = _libssh2_ntohu64(data + 45);
+    st->f_ffree = _libssh2_ntohu64(data + 53);
+    st->f_favail = _libssh2_ntohu64(data + 61);
+    st->f_fsid = _libssh2_ntohu64(data + 69);
+    flag = _libssh2_ntohu64(data + 77);
+    st->f_namemax = _libssh2_ntohu64(data + 85);
+
+    st->f_flag = (flag & SSH_FXE_STATVFS_ST_RDONLY)
+                  ? LIBSSH2_SFTP_ST_RDONLY : 0;
+    st->f_flag |= (flag & SSH_FXE_STATVFS_ST_NOSUID)
+                  ? LIBSSH2_SFTP_ST_NOSUID : 0;
+
+    LIBSSH2_FREE(session, data);
+    return 0;
+}
+
+/* libssh2_sftp_statvfs_ex
+ * Get filesystem space and inode utilization (requires statvfs@openssh.com
+ * support on the server)
+ */
+LIBSSH2_API int
+libssh2_sftp_statvfs(LIBSSH2_SFTP *sftp, const char *path,
+                     size_t path_len, LIBSSH2_SFTP_STATVFS *st)
+{
+    int rc;
+    if(!sftp || !st)
+        return LIBSSH2_ERROR_BAD_USE;
+    BLOCK_ADJUST(rc, sftp->channel->session, sftp_statvfs(sftp, path, path_len,
+                                                          st));
+    return rc;
+}
+
+
+/*
+ * sftp_mkdir
+ *
+ * Create an SFTP directory
+ */
+static int sftp_mkdir(LIBSSH2_SFTP *sftp, const char *path,
+                      unsigned int path_len, long mode)
+{
+    LIBSSH2_CHANNEL *channel = sftp->channel;
+    LIBSSH2_SESSION *session = channel->session;
+    LIBSSH2_SFTP_ATTRIBUTES attrs = {
+        LIBSSH2_SFTP_ATTR_PERMISSIONS, 0, 0, 0, 0, 0, 0
+    };
+    size_t data_len;
+    int retcode;
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + path_len(4) */
+    ssize_t packet_len = path_len + 13 +
+        sftp_attrsize(LIBSSH2_SFTP_ATTR_PERMISSIONS);
+    unsigned char *packet, *s, *data;
+    int rc;
+
+    if (sftp->mkdir_state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                       "Creating directory %s with mode 0%lo", path, mode);
+        sftp_cache_forget(sftp, path, path_len, SFTP_CACHE_PARENT);
+        s = packet = LIBSSH2_ALLOC(session, packet_len);
+        if (!packet) {
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for FXP_MKDIR "
+                                  "packet");
+        }
+        /* Filetype in SFTP 3 and earlier */
+        attrs.permissions = mode | LIBSSH2_SFTP_ATTR_PFILETYPE_DIR;
+
+        _libssh2_store_u32(&s, packet_len - 4);
+        *(s++) = SSH_FXP_MKDIR;
+        sftp->mkdir_request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, sftp->mkdir_request_id);
+        _libssh2_store_str(&s, path, path_len);
+
+        s += sftp_attr2bin(s, &attrs);
+
+        sftp->mkdir_state = libssh2_NB_state_created;
+    }
+    else {
+        packet = sftp->mkdir_packet;
+    }
+
+    if (sftp->mkdir_state == libssh2_NB_state_created) {
+        rc = sftp_channel_write(sftp, packet, packet, packet_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN) {
+            sftp->mkdir_packet = packet;
+            return rc;
+        }
+        if (packet_len != rc) {
+            LIBSSH2_FREE(session, packet);
+            sftp->mkdir_state = libssh2_NB_state_idle;
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                                  "_libssh2_channel_write() failed");
+        }
+        LIBSSH2_FREE(session, packet);
+        sftp->mkdir_state = libssh2_NB_state_sent;
+        sftp->mkdir_packet = NULL;
+    }
+
+    rc = sftp_packet_require(sftp, SSH_FXP_STATUS, sftp->mkdir_request_id,
+                             &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
+        return rc;
+    } else if (rc) {
+        sftp->mkdir_state = libssh2_NB_state_idle;
+        return _libssh2_error(session, rc,
+                              "Error waiting for FXP STATUS");
+    }
+
+    sftp->mkdir_state = libssh2_NB_state_idle;
 
     retcode = _libssh2_ntohu32(data + 5);
     LIBSSH2_FREE(session, data);
 
-    if (retcode != LIBSSH2_FX_OK) {
+    if (retcode == LIBSSH2_FX_OK) {
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "OK!");
+        return 0;
+    } else {
         sftp->last_errno = retcode;
         return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                              "fsync failed");
+                              "SFTP Protocol Error");
     }
-
-    return 0;
 }
 
-/* libssh2_sftp_fsync
- * Commit data on the handle to disk.
+/*
+ * libssh2_sftp_mkdir_ex
+ *
+ * Create an SFTP directory
  */
 LIBSSH2_API int
-libssh2_sftp_fsync(LIBSSH2_SFTP_HANDLE *hnd)
+libssh2_sftp_mkdir_ex(LIBSSH2_SFTP *sftp, const char *path,
+                      unsigned int path_len, long mode)
 {
     int rc;
-    if(!hnd)
+    if(!sftp)
         return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
-                 sftp_fsync(hnd));
+    BLOCK_ADJUST(rc, sftp->channel->session,
+                 sftp_mkdir(sftp, path, path_len, mode));
     return rc;
 }
 
-
-/*
- * sftp_fstat
- *
- * Get or Set stat on a file
+/* sftp_rmdir
+ * Remove a directory
  */
-static int sftp_fstat(LIBSSH2_SFTP_HANDLE *handle,
-                      LIBSSH2_SFTP_ATTRIBUTES *attrs, int setstat)
+static int sftp_rmdir(LIBSSH2_SFTP *sftp, const char *path,
+                      unsigned int path_len)
 {
-    LIBSSH2_SFTP *sftp = handle->sftp;
     LIBSSH2_CHANNEL *channel = sftp->channel;
     LIBSSH2_SESSION *session = channel->session;
     size_t data_len;
-    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) */
-    uint32_t packet_len =
-        handle->handle_len + 13 + (setstat ? sftp_attrsize(attrs->flags) : 0);
+    int retcode;
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + path_len(4) */
+    ssize_t packet_len = path_len + 13;
     unsigned char *s, *data;
-    static const unsigned char fstat_responses[2] =
-        { SSH_FXP_ATTRS, SSH_FXP_STATUS };
-    ssize_t rc;
+    int rc;
 
-    if (sftp->fstat_state == libssh2_NB_state_idle) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Issuing %s command",
-                       setstat ? "set-stat" : "stat");
-        s = sftp->fstat_packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!sftp->fstat_packet) {
+    if (sftp->rmdir_state == libssh2_NB_state_idle) {
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Removing directory: %s",
+                       path);
+        sftp_cache_forget(sftp, path, path_len,
+                          SFTP_CACHE_PARENT | SFTP_CACHE_TREE);
+        s = sftp->rmdir_packet = LIBSSH2_ALLOC(session, packet_len);
+        if (!sftp->rmdir_packet) {
             return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for "
-                                  "FSTAT/FSETSTAT packet");
+                                  "Unable to allocate memory for FXP_RMDIR "
+                                  "packet");
         }
 
         _libssh2_store_u32(&s, packet_len - 4);
-        *(s++) = setstat ? SSH_FXP_FSETSTAT : SSH_FXP_FSTAT;
-        sftp->fstat_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->fstat_request_id);
-        _libssh2_store_str(&s, handle->handle, handle->handle_len);
-
-        if (setstat) {
-            s += sftp_attr2bin(s, attrs);
-        }
+        *(s++) = SSH_FXP_RMDIR;
+        sftp->rmdir_request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, sftp->rmdir_request_id);
+        _libssh2_store_str(&s, path, path_len);
 
-        sftp->fstat_state = libssh2_NB_state_created;
+        sftp->rmdir_state = libssh2_NB_state_created;
     }
 
-    if (sftp->fstat_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, sftp->fstat_packet,
-                                    packet_len);
+    if (sftp->rmdir_state == libssh2_NB_state_created) {
+        rc = sftp_channel_write(sftp, sftp->rmdir_packet, sftp->rmdir_packet,
+                                packet_len);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             return rc;
-        }
-        else if ((ssize_t)packet_len != rc) {
-            LIBSSH2_FREE(session, sftp->fstat_packet);
-            sftp->fstat_packet = NULL;
-            sftp->fstat_state = libssh2_NB_state_idle;
+        } else if (packet_len != rc) {
+            LIBSSH2_FREE(session, sftp->rmdir_packet);
+            sftp->rmdir_packet = NULL;
+            sftp->rmdir_state = libssh2_NB_state_idle;
             return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  (setstat ? "Unable to send FXP_FSETSTAT"
-                                   : "Unable to send FXP_FSTAT command"));
+                                  "Unable to send FXP_RMDIR command");
         }
-        LIBSSH2_FREE(session, sftp->fstat_packet);
-        sftp->fstat_packet = NULL;
+        LIBSSH2_FREE(session, sftp->rmdir_packet);
+        sftp->rmdir_packet = NULL;
 
-        sftp->fstat_state = libssh2_NB_state_sent;
+        sftp->rmdir_state = libssh2_NB_state_sent;
     }
 
-    rc = sftp_packet_requirev(sftp, 2, fstat_responses,
-                              sftp->fstat_request_id, &data,
-                              &data_len);
-    if (rc == LIBSSH2_ERROR_EAGAIN)
+    rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
+                             sftp->rmdir_request_id, &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN) {
         return rc;
-    else if (rc) {
-        sftp->fstat_state = libssh2_NB_state_idle;
+    } else if (rc) {
+        sftp->rmdir_state = libssh2_NB_state_idle;
         return _libssh2_error(session, rc,
-                              "Timeout waiting for status message");
+                              "Error waiting for FXP STATUS");
     }
 
-    sftp->fstat_state = libssh2_NB_state_idle;
-
-    if (data[0] == SSH_FXP_STATUS) {
-        uint32_t retcode;
-
-        retcode = _libssh2_ntohu32(data + 5);
-        LIBSSH2_FREE(session, data);
-        if (retcode == LIBSSH2_FX_OK) {
-            return 0;
-        } else {
-            sftp->last_errno = retcode;
-            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                  "SFTP Protocol Error");
-        }
-    }
+    sftp->rmdir_state = libssh2_NB_state_idle;
 
-    sftp_bin2attr(attrs, data + 5);
+    retcode = _libssh2_ntohu32(data + 5);
     LIBSSH2_FREE(session, data);
 
-    return 0;
+    if (retcode == LIBSSH2_FX_OK) {
+        return 0;
+    } else {
+        sftp->last_errno = retcode;
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "SFTP Protocol Error");
+    }
 }
 
-/* libssh2_sftp_fstat_ex
- * Get or Set stat on a file
+/* libssh2_sftp_rmdir_ex
+ * Remove a directory
  */
 LIBSSH2_API int
-libssh2_sftp_fstat_ex(LIBSSH2_SFTP_HANDLE *hnd,
-                      LIBSSH2_SFTP_ATTRIBUTES *attrs, int setstat)
+libssh2_sftp_rmdir_ex(LIBSSH2_SFTP *sftp, const char *path,
+                      unsigned int path_len)
 {
     int rc;
-    if(!hnd || !attrs)
+    if(!sftp)
         return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, hnd->sftp->channel->session,
-                 sftp_fstat(hnd, attrs, setstat));
+    BLOCK_ADJUST(rc, sftp->channel->session,
+                 sftp_rmdir(sftp, path, path_len));
     return rc;
 }
 
-
-/* libssh2_sftp_seek64
- * Set the read/write pointer to an arbitrary position within the file
- */
-LIBSSH2_API void
-libssh2_sftp_seek64(LIBSSH2_SFTP_HANDLE *handle, libssh2_uint64_t offset)
-{
-    if(!handle)
-        return;
-    if(handle->u.file.offset == offset && handle->u.file.offset_sent == offset)
-        return;
-
-    handle->u.file.offset = handle->u.file.offset_sent = offset;
-    /* discard all pending requests and currently read data */
-    sftp_packetlist_flush(handle);
-
-    /* free the left received buffered data */
-    if (handle->u.file.data_left) {
-        LIBSSH2_FREE(handle->sftp->channel->session, handle->u.file.data);
-        handle->u.file.data_left = handle->u.file.data_len = 0;
-        handle->u.file.data = NULL;
-    }
-
-    /* reset EOF to False */
-    handle->u.file.eof = FALSE;
-}
-
-/* libssh2_sftp_seek
- * Set the read/write pointer to an arbitrary position within the file
- */
-LIBSSH2_API void
-libssh2_sftp_seek(LIBSSH2_SFTP_HANDLE *handle, size_t offset)
-{
-    libssh2_sftp_seek64(handle, (libssh2_uint64_t)offset);
-}
-
-/* libssh2_sftp_tell
- * Return the current read/write pointer's offset
- */
-LIBSSH2_API size_t
-libssh2_sftp_tell(LIBSSH2_SFTP_HANDLE *handle)
-{
-    if(!handle)
-        return 0; /* no handle, no size */
-
-    /* NOTE: this may very well truncate the size if it is larger than what
-       size_t can hold, so libssh2_sftp_tell64() is really the function you
-       should use */
-    return (size_t)(handle->u.file.offset);
-}
-
-/* libssh2_sftp_tell64
- * Return the current read/write pointer's offset
- */
-LIBSSH2_API libssh2_uint64_t
-libssh2_sftp_tell64(LIBSSH2_SFTP_HANDLE *handle)
-{
-    if(!handle)
-        return 0; /* no handle, no size */
-
-    return handle->u.file.offset;
-}
-
-/*
- * Flush all remaining incoming SFTP packets and zombies.
- */
-static void sftp_packet_flush(LIBSSH2_SFTP *sftp)
-{
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
-    LIBSSH2_SFTP_PACKET *packet = _libssh2_list_first(&sftp->packets);
-    struct sftp_zombie_requests *zombie =
-        _libssh2_list_first(&sftp->zombie_requests);
-
-    while(packet) {
-        LIBSSH2_SFTP_PACKET *next;
-
-        /* check next struct in the list */
-        next =  _libssh2_list_next(&packet->node);
-        _libssh2_list_remove(&packet->node);
-        LIBSSH2_FREE(session, packet->data);
-        LIBSSH2_FREE(session, packet);
-
-        packet = next;
-    }
-
-    while(zombie) {
-        /* figure out the next node */
-        struct sftp_zombie_requests *next = _libssh2_list_next(&zombie->node);
-        /* unlink the current one */
-        _libssh2_list_remove(&zombie->node);
-        /* free the memory */
-        LIBSSH2_FREE(session, zombie);
-        zombie = next;
-    }
-
-}
-
-/* sftp_close_handle
- *
- * Close a file or directory handle
- * Also frees handle resource and unlinks it from the SFTP structure
+/* sftp_stat
+ * Stat a file or symbolic link
  */
-static int
-sftp_close_handle(LIBSSH2_SFTP_HANDLE *handle)
+static int sftp_stat(LIBSSH2_SFTP *sftp, const char *path,
+                     unsigned int path_len, int stat_type,
+                     LIBSSH2_SFTP_ATTRIBUTES * attrs)
 {
-    LIBSSH2_SFTP *sftp = handle->sftp;
     LIBSSH2_CHANNEL *channel = sftp->channel;
     LIBSSH2_SESSION *session = channel->session;
     size_t data_len;
-    int retcode;
-    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) */
-    uint32_t packet_len = handle->handle_len + 13;
-    unsigned char *s, *data = NULL;
+    ssize_t packet_len;
+    unsigned char *s, *data;
+    static const unsigned char stat_responses[2] =
+        { SSH_FXP_ATTRS, SSH_FXP_STATUS };
+    int fresh = stat_type & LIBSSH2_SFTP_FRESH;
     int rc;
 
-    if (handle->close_state == libssh2_NB_state_idle) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Closing handle");
-        s = handle->close_packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!handle->close_packet) {
+    stat_type &= ~LIBSSH2_SFTP_FRESH;
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + path_len(4) */
+    packet_len = path_len + 13 +
+        ((stat_type ==
+          LIBSSH2_SFTP_SETSTAT) ? sftp_attrsize(attrs->flags) : 0);
+
+    if (sftp->stat_state == libssh2_NB_state_idle) {
+        if (stat_type == LIBSSH2_SFTP_SETSTAT)
+            sftp_cache_forget(sftp, path, path_len, 0);
+        else if (!fresh &&
+                 sftp_cache_find(sftp, path, path_len,
+                                 stat_type == LIBSSH2_SFTP_LSTAT, attrs)) {
+            _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
+                           "Attributes of %s found in the cache", path);
+            return 0;
+        }
+
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "%s %s",
+                       (stat_type == LIBSSH2_SFTP_SETSTAT) ? "Set-statting" :
+                       (stat_type ==
+                        LIBSSH2_SFTP_LSTAT ? "LStatting" : "Statting"), path);
+        s = sftp->stat_packet = LIBSSH2_ALLOC(session, packet_len);
+        if (!sftp->stat_packet) {
             return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for FXP_CLOSE "
+                                  "Unable to allocate memory for FXP_*STAT "
                                   "packet");
         }
 
         _libssh2_store_u32(&s, packet_len - 4);
-        *(s++) = SSH_FXP_CLOSE;
-        handle->close_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, handle->close_request_id);
-        _libssh2_store_str(&s, handle->handle, handle->handle_len);
-        handle->close_state = libssh2_NB_state_created;
-    }
 
-    if (handle->close_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, handle->close_packet,
-                                    packet_len);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
-            return rc;
-        } else if ((ssize_t)packet_len != rc) {
-            LIBSSH2_FREE(session, handle->close_packet);
-            handle->close_packet = NULL;
-            handle->close_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "Unable to send FXP_CLOSE command");
+        switch (stat_type) {
+        case LIBSSH2_SFTP_SETSTAT:
+            *(s++) = SSH_FXP_SETSTAT;
+            break;
+
+        case LIBSSH2_SFTP_LSTAT:
+            *(s++) = SSH_FXP_LSTAT;
+            break;
+
+        case LIBSSH2_SFTP_STAT:
+        default:
+            *(s++) = SSH_FXP_STAT;
         }
-        LIBSSH2_FREE(session, handle->close_packet);
-        handle->close_packet = NULL;
+        sftp->stat_request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, sftp->stat_request_id);
+        _libssh2_store_str(&s, path, path_len);
 
-        handle->close_state = libssh2_NB_state_sent;
+        if (stat_type == LIBSSH2_SFTP_SETSTAT)
+            s += sftp_attr2bin(s, attrs);
+
+        sftp->stat_state = libssh2_NB_state_created;
     }
 
-    if (handle->close_state == libssh2_NB_state_sent) {
-        rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
-                                 handle->close_request_id, &data,
-                                 &data_len);
+    if (sftp->stat_state == libssh2_NB_state_created) {
+        rc = sftp_channel_write(sftp, sftp->stat_packet,
+                                sftp->stat_packet, packet_len);
         if (rc == LIBSSH2_ERROR_EAGAIN) {
             return rc;
-        } else if (rc) {
-            handle->close_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, rc,
-                                  "Error waiting for status message");
+        } else if (packet_len != rc) {
+            LIBSSH2_FREE(session, sftp->stat_packet);
+            sftp->stat_packet = NULL;
+            sftp->stat_state = libssh2_NB_state_idle;
+            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
+                                  "Unable to send STAT/LSTAT/SETSTAT command");
         }
+        LIBSSH2_FREE(session, sftp->stat_packet);
+        sftp->stat_packet = NULL;
 
-        handle->close_state = libssh2_NB_state_sent1;
+        sftp->stat_state = libssh2_NB_state_sent;
     }
 
-    if(!data)
-        /* if it reaches this point with data unset, something unwanted
-           happened (like this function is called again when in
-           libssh2_NB_state_sent1 state) and we just bail out */
-        return LIBSSH2_ERROR_INVAL;
-
-    retcode = _libssh2_ntohu32(data + 5);
-    LIBSSH2_FREE(session, data);
-
-    if (retcode != LIBSSH2_FX_OK) {
-        sftp->last_errno = retcode;
-        handle->close_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                              "SFTP Protocol Error");
+    rc = sftp_packet_requirev(sftp, 2, stat_responses,
+                              sftp->stat_request_id, &data, &data_len);
+    if (rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
+    else if (rc) {
+        sftp->stat_state = libssh2_NB_state_idle;
+        return _libssh2_error(session, rc,
+                              "Timeout waiting for status message");
     }
 
-    /* remove this handle from the parent's list */
-    _libssh2_list_remove(&handle->node);
+    sftp->stat_state = libssh2_NB_state_idle;
 
-    if ((handle->handle_type == LIBSSH2_SFTP_HANDLE_DIR)
-        && handle->u.dir.names_left) {
-        LIBSSH2_FREE(session, handle->u.dir.names_packet);
-    }
-    else {
-        if(handle->u.file.data)
-            LIBSSH2_FREE(session, handle->u.file.data);
-    }
+    if (data[0] == SSH_FXP_STATUS) {
+        int retcode;
 
-    sftp_packetlist_flush(handle);
-    sftp->read_state = libssh2_NB_state_idle;
+        retcode = _libssh2_ntohu32(data + 5);
+        LIBSSH2_FREE(session, data);
+        if (retcode == LIBSSH2_FX_OK) {
+            return 0;
+        } else {
+            sftp->last_errno = retcode;
+            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                  "SFTP Protocol Error");
+        }
+    }
 
-    handle->close_state = libssh2_NB_state_idle;
+    memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
+    sftp_bin2attr(attrs, data + 5);
+    LIBSSH2_FREE(session, data);
 
-    LIBSSH2_FREE(session, handle);
+    if (stat_type != LIBSSH2_SFTP_SETSTAT)
+        sftp_cache_store(sftp, NULL, 0, path, path_len,
+                         stat_type == LIBSSH2_SFTP_LSTAT, attrs);
 
     return 0;
 }
 
-/* libssh2_sftp_close_handle
- *
- * Close a file or directory handle
- * Also frees handle resource and unlinks it from the SFTP structure
+/* libssh2_sftp_stat_ex
+ * Stat a file or symbolic link
  */
 LIBSSH2_API int
-libssh2_sftp_close_handle(LIBSSH2_SFTP_HANDLE *hnd)
+libssh2_sftp_stat_ex(LIBSSH2_SFTP *sftp, const char *path,
+                     unsigned int path_len, int stat_type,
+                     LIBSSH2_SFTP_ATTRIBUTES *attrs)
 {
     int rc;
-    if(!hnd)
+    if(!sftp)
         return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, hnd->sftp->channel->session, sftp_close_handle(hnd));
+    BLOCK_ADJUST(rc, sftp->channel->session,
+                 sftp_stat(sftp, path, path_len, stat_type, attrs));
     return rc;
 }
 
-/* sftp_unlink
- * Delete a file from the remote server
+/* sftp_symlink
+ * Read or set a symlink
  */
-static int sftp_unlink(LIBSSH2_SFTP *sftp, const char *filename,
-                       size_t filename_len)
+static int sftp_symlink(LIBSSH2_SFTP *sftp, const char *path,
+                        unsigned int path_len, char *target,
+                        unsigned int target_len, int link_type)
 {
     LIBSSH2_CHANNEL *channel = sftp->channel;
     LIBSSH2_SESSION *session = channel->session;
-    size_t data_len;
-    int retcode;
-    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + filename_len(4) */
-    uint32_t packet_len = filename_len + 13;
+    size_t data_len, link_len;
+    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + path_len(4) */
+    ssize_t packet_len =
+        path_len + 13 +
+        ((link_type == LIBSSH2_SFTP_SYMLINK) ? (4 + target_len) : 0);
     unsigned char *s, *data;
-    int rc;
+    static const unsigned char link_responses[2] =
+        { SSH_FXP_NAME, SSH_FXP_STATUS };
+    int retcode;
 
-    if (sftp->unlink_state == libssh2_NB_state_idle) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Unlinking %s", filename);
-        s = sftp->unlink_packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!sftp->unlink_packet) {
+    if ((sftp->version < 3) && (link_type != LIBSSH2_SFTP_REALPATH)) {
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "Server does not support SYMLINK or READLINK");
+    }
+
+    if (sftp->symlink_state == libssh2_NB_state_idle) {
+        s = sftp->symlink_packet = LIBSSH2_ALLOC(session, packet_len);
+        if (!sftp->symlink_packet) {
             return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for FXP_REMOVE "
-                                  "packet");
+                                  "Unable to allocate memory for "
+                                  "SYMLINK/READLINK/REALPATH packet");
+        }
+
+        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "%s %s on %s",
+                       (link_type ==
+                        LIBSSH2_SFTP_SYMLINK) ? "Creating" : "Reading",
+                       (link_type ==
+                        LIBSSH2_SFTP_REALPATH) ? "realpath" : "symlink", path);
+
+        if (link_type == LIBSSH2_SFTP_SYMLINK) {
+            /* servers disagree on which of the two is the new link */
+            sftp_cache_forget(sftp, path, path_len, SFTP_CACHE_PARENT);
+            sftp_cache_forget(sftp, target, target_len, SFTP_CACHE_PARENT);
         }
 
         _libssh2_store_u32(&s, packet_len - 4);
-        *(s++) = SSH_FXP_REMOVE;
-        sftp->unlink_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->unlink_request_id);
-        _libssh2_store_str(&s, filename, filename_len);
-        sftp->unlink_state = libssh2_NB_state_created;
+
+        switch (link_type) {
+        case LIBSSH2_SFTP_REALPATH:
+            *(s++) = SSH_FXP_REALPATH;
+            break;
+
+        case LIBSSH2_SFTP_SYMLINK:
+            *(s++) = SSH_FXP_SYMLINK;
+            break;
+
+        case LIBSSH2_SFTP_READLINK:
+        default:
+            *(s++) = SSH_FXP_READLINK;
+        }
+        sftp->symlink_request_id = sftp->request_id++;
+        _libssh2_store_u32(&s, sftp->symlink_request_id);
+        _libssh2_store_str(&s, path, path_len);
+
+        if (link_type == LIBSSH2_SFTP_SYMLINK)
+            _libssh2_store_str(&s, target, target_len);
+
+        sftp->symlink_state = libssh2_NB_state_created;
     }
 
-    if (sftp->unlink_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, sftp->unlink_packet,
-                                    packet_len);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
+    if (sftp->symlink_state == libssh2_NB_state_created) {
+        ssize_t rc = sftp_channel_write(sftp, sftp->symlink_packet,
+                                        sftp->symlink_packet, packet_len);
+        if (rc == LIBSSH2_ERROR_EAGAIN)
             return rc;
-        } else if ((ssize_t)packet_len != rc) {
-            LIBSSH2_FREE(session, sftp->unlink_packet);
-            sftp->unlink_packet = NULL;
-            sftp->unlink_state = libssh2_NB_state_idle;
+        else if (packet_len != rc) {
+            LIBSSH2_FREE(session, sftp->symlink_packet);
+            sftp->symlink_packet = NULL;
+            sftp->symlink_state = libssh2_NB_state_idle;
             return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "Unable to send FXP_REMOVE command");
+                                  "Unable to send SYMLINK/READLINK command");
         }
-        LIBSSH2_FREE(session, sftp->unlink_packet);
-        sftp->unlink_packet = NULL;
+        LIBSSH2_FREE(session, sftp->symlink_packet);
+        sftp->symlink_packet = NULL;
 
-        sftp->unlink_state = libssh2_NB_state_sent;
+        sftp->symlink_state = libssh2_NB_state_sent;
     }
 
-    rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
-                             sftp->unlink_request_id, &data,
-                             &data_len);
-    if (rc == LIBSSH2_ERROR_EAGAIN) {
-        return rc;
+    retcode = sftp_packet_requirev(sftp, 2, link_responses,
+                                   sftp->symlink_request_id, &data,
+                                   &data_len);
+    if (retcode == LIBSSH2_ERROR_EAGAIN)
+        return retcode;
+    else if (retcode) {
+        sftp->symlink_state = libssh2_NB_state_idle;
+        return _libssh2_error(session, retcode,
+                              "Error waiting for status message");
     }
-    else if (rc) {
-        sftp->unlink_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, rc,
-                              "Error waiting for FXP STATUS");
+
+    sftp->symlink_state = libssh2_NB_state_idle;
+
+    if (data[0] == SSH_FXP_STATUS) {
+        int retcode;
+
+        retcode = _libssh2_ntohu32(data + 5);
+        LIBSSH2_FREE(session, data);
+        if (retcode == LIBSSH2_FX_OK)
+            return LIBSSH2_ERROR_NONE;
+        else {
+            sftp->last_errno = retcode;
+            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                  "SFTP Protocol Error");
+        }
     }
 
-    sftp->unlink_state = libssh2_NB_state_idle;
+    if (_libssh2_ntohu32(data + 5) < 1) {
+        LIBSSH2_FREE(session, data);
+        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
+                              "Invalid READLINK/REALPATH response, "
+                              "no name entries");
+    }
 
-    retcode = _libssh2_ntohu32(data + 5);
+    /* this reads a u32 and stores it into a signed 32bit value */
+    link_len = _libssh2_ntohu32(data + 9);
+    if (link_len < target_len) {
+        memcpy(target, data + 13, link_len);
+        target[link_len] = 0;
+        retcode = (int)link_len;
+    }
+    else
+        retcode = LIBSSH2_ERROR_BUFFER_TOO_SMALL;
     LIBSSH2_FREE(session, data);
 
-    if (retcode == LIBSSH2_FX_OK) {
-        return 0;
-    } else {
-        sftp->last_errno = retcode;
-        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                              "SFTP Protocol Error");
-    }
+    return retcode;
 }
 
-/* libssh2_sftp_unlink_ex
- * Delete a file from the remote server
+/* libssh2_sftp_symlink_ex
+ * Read or set a symlink
  */
 LIBSSH2_API int
-libssh2_sftp_unlink_ex(LIBSSH2_SFTP *sftp, const char *filename,
-                       unsigned int filename_len)
+libssh2_sftp_symlink_ex(LIBSSH2_SFTP *sftp, const char *path,
+                        unsigned int path_len, char *target,
+                        unsigned int target_len, int link_type)
 {
     int rc;
     if(!sftp)
         return LIBSSH2_ERROR_BAD_USE;
     BLOCK_ADJUST(rc, sftp->channel->session,
-                 sftp_unlink(sftp, filename, filename_len));
+                 sftp_symlink(sftp, path, path_len, target, target_len,
+                              link_type));
     return rc;
 }
 
-/*
- * sftp_rename
- *
- * Rename a file on the remote server
+/* libssh2_sftp_last_error
+ * Returns the last error code reported by SFTP
  */
-static int sftp_rename(LIBSSH2_SFTP *sftp, const char *source_filename,
-                       unsigned int source_filename_len,
-                       const char *dest_filename,
-                       unsigned int dest_filename_len, long flags)
+LIBSSH2_API unsigned long
+libssh2_sftp_last_error(LIBSSH2_SFTP *sftp)
 {
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
-    size_t data_len;
-    int retcode;
-    uint32_t packet_len =
-        source_filename_len + dest_filename_len + 17 + (sftp->version >=
-                                                        5 ? 4 : 0);
-    /* packet_len(4) + packet_type(1) + request_id(4) +
-       source_filename_len(4) + dest_filename_len(4) + flags(4){SFTP5+) */
-    unsigned char *data;
-    ssize_t rc;
+    if(!sftp)
+       return 0;
 
-    if (sftp->version < 2) {
-        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                              "Server does not support RENAME");
-    }
+    return sftp->last_errno;
+}
 
-    if (sftp->rename_state == libssh2_NB_state_idle) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Renaming %s to %s",
-                       source_filename, dest_filename);
-        sftp->rename_s = sftp->rename_packet =
-            LIBSSH2_ALLOC(session, packet_len);
-        if (!sftp->rename_packet) {
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for FXP_RENAME "
-                                  "packet");
-        }
+/* libssh2_sftp_cache_config
+ * Turn the attribute cache on or off and drop what it has
+ */
+LIBSSH2_API int
+libssh2_sftp_cache_config(LIBSSH2_SFTP *sftp, unsigned long ttl,
+                          unsigned int max_entries)
+{
+    if(!sftp)
+        return LIBSSH2_ERROR_BAD_USE;
+    return sftp_cache_config(sftp, ttl, max_entries);
+}
 
-        _libssh2_store_u32(&sftp->rename_s, packet_len - 4);
-        *(sftp->rename_s++) = SSH_FXP_RENAME;
-        sftp->rename_request_id = sftp->request_id++;
-        _libssh2_store_u32(&sftp->rename_s, sftp->rename_request_id);
-        _libssh2_store_str(&sftp->rename_s, source_filename,
-                           source_filename_len);
-        _libssh2_store_str(&sftp->rename_s, dest_filename, dest_filename_len);
+/* libssh2_sftp_get_channel
+ * Return the channel of sftp, then caller can control the channel's behavior.
+ */
+LIBSSH2_API LIBSSH2_CHANNEL *
+libssh2_sftp_get_channel(LIBSSH2_SFTP *sftp)
+{
+    if (!sftp)
+        return NULL;
 
-        if (sftp->version >= 5)
-            _libssh2_store_u32(&sftp->rename_s, flags);
+    return sftp->channel;
+}
 
-        sftp->rename_state = libssh2_NB_state_created;
-    }
+/*
+ * Batch transfers
+ *
+ * A batch moves many whole files over one SFTP instance. Rather than
+ * opening, moving and closing one file after the other, with round trips in
+ * every step, up to 'max_files' files are open at once and the OPEN, READ,
+ * WRITE and CLOSE requests of all of them are sent back-to-back. Replies are
+ * matched by request id as they arrive, so lots of small files move at the
+ * speed of the link instead of one round trip after the other, while no more
+ * than 'max_bytes' of data is asked for or sent without being answered.
+ */
 
-    if (sftp->rename_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, sftp->rename_packet,
-                                    sftp->rename_s - sftp->rename_packet);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
-            return rc;
-        } else if ((ssize_t)packet_len != rc) {
-            LIBSSH2_FREE(session, sftp->rename_packet);
-            sftp->rename_packet = NULL;
-            sftp->rename_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "Unable to send FXP_RENAME command");
-        }
-        LIBSSH2_FREE(session, sftp->rename_packet);
-        sftp->rename_packet = NULL;
+#define SFTP_BATCH_FILES 64 /* default 'max_files' */
 
-        sftp->rename_state = libssh2_NB_state_sent;
-    }
+/*
+ * sftp_batch_request
+ *
+ * Allocate a request of 'type' with room for a packet of 'packet_len' bytes
+ * and fill in the start of the packet. The rest is up to the caller.
+ */
+static struct sftp_batch_request *
+sftp_batch_request(LIBSSH2_SFTP_BATCH *batch, struct sftp_batch_file *file,
+                   unsigned char type, size_t packet_len)
+{
+    LIBSSH2_SFTP *sftp = batch->sftp;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct sftp_batch_request *req;
+    unsigned char *s;
 
-    rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
-                             sftp->rename_request_id, &data,
-                             &data_len);
-    if (rc == LIBSSH2_ERROR_EAGAIN) {
-        return rc;
-    } else if (rc) {
-        sftp->rename_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, rc,
-                              "Error waiting for FXP STATUS");
+    req = LIBSSH2_ALLOC(session, sizeof(struct sftp_batch_request) +
+                        packet_len);
+    if(!req) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for an SFTP batch request");
+        return NULL;
     }
 
-    sftp->rename_state = libssh2_NB_state_idle;
-
-    retcode = _libssh2_ntohu32(data + 5);
-    LIBSSH2_FREE(session, data);
-
-    sftp->last_errno = retcode;
+    req->file = file;
+    req->type = type;
+    req->request_id = sftp->request_id++;
+    req->offset = 0;
+    req->len = 0;
+    req->packet_len = packet_len;
+    req->sent = 0;
 
-    /* now convert the SFTP error code to libssh2 return code or error
-       message */
-    switch (retcode) {
-    case LIBSSH2_FX_OK:
-        retcode = LIBSSH2_ERROR_NONE;
-        break;
+    s = req->packet;
+    _libssh2_store_u32(&s, (uint32_t)(packet_len - 4));
+    *(s++) = type;
+    _libssh2_store_u32(&s, req->request_id);
 
-    case LIBSSH2_FX_FILE_ALREADY_EXISTS:
-        retcode = _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                 "File already exists and "
-                                 "SSH_FXP_RENAME_OVERWRITE not specified");
-        break;
+    return req;
+}
 
-    case LIBSSH2_FX_OP_UNSUPPORTED:
-        retcode = _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                 "Operation Not Supported");
-        break;
+/*
+ * sftp_batch_queue
+ *
+ * Put a request in line to get sent off
+ */
+static void sftp_batch_queue(LIBSSH2_SFTP_BATCH *batch,
+                             struct sftp_batch_request *req)
+{
+    req->file->requests++;
+    batch->outstanding += req->len;
+    _libssh2_list_add(&batch->outgoing, &req->node);
+}
 
-    default:
-        retcode = _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                 "SFTP Protocol Error");
-        break;
+/*
+ * sftp_batch_open
+ *
+ * Queue the FXP_OPEN of a file
+ */
+static int sftp_batch_open(LIBSSH2_SFTP_BATCH *batch,
+                           struct sftp_batch_file *file)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs = {
+        LIBSSH2_SFTP_ATTR_PERMISSIONS, 0, 0, 0, 0, 0, 0
+    };
+    struct sftp_batch_request *req;
+    unsigned char *s;
+    /* packet_len(4) + packet_type(1) + request_id(4) + filename_len(4) +
+       flags(4) + attrs */
+    size_t packet_len = file->path_len + 17 +
+        (file->put ? sftp_attrsize(LIBSSH2_SFTP_ATTR_PERMISSIONS) : 4);
+
+    req = sftp_batch_request(batch, file, SSH_FXP_OPEN, packet_len);
+    if(!req)
+        return LIBSSH2_ERROR_ALLOC;
+
+    s = &req->packet[9];
+    _libssh2_store_str(&s, file->path, file->path_len);
+    if(file->put) {
+        sftp_cache_forget(batch->sftp, file->path, file->path_len,
+                          SFTP_CACHE_PARENT);
+        /* the parts of a striped upload must not truncate each other */
+        _libssh2_store_u32(&s, LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT |
+                           (file->range ? 0 : LIBSSH2_FXF_TRUNC));
+        attrs.permissions = file->mode | LIBSSH2_SFTP_ATTR_PFILETYPE_FILE;
+        sftp_attr2bin(s, &attrs);
+    }
+    else {
+        _libssh2_store_u32(&s, LIBSSH2_FXF_READ);
+        sftp_attr2bin(s, NULL);
     }
 
-    return retcode;
+    sftp_batch_queue(batch, req);
+    file->state = LIBSSH2_SFTP_BATCH_OPENING;
+    return 0;
 }
 
-/* libssh2_sftp_rename_ex
- * Rename a file on the remote server
+/*
+ * sftp_batch_read
+ *
+ * Queue an FXP_READ of 'len' bytes at 'offset' of a file
  */
-LIBSSH2_API int
-libssh2_sftp_rename_ex(LIBSSH2_SFTP *sftp, const char *source_filename,
-                       unsigned int source_filename_len,
-                       const char *dest_filename,
-                       unsigned int dest_filename_len, long flags)
+static int sftp_batch_read(LIBSSH2_SFTP_BATCH *batch,
+                           struct sftp_batch_file *file,
+                           libssh2_uint64_t offset, size_t len)
 {
-    int rc;
-    if(!sftp)
-        return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, sftp->channel->session,
-                 sftp_rename(sftp, source_filename, source_filename_len,
-                             dest_filename, dest_filename_len, flags));
-    return rc;
+    struct sftp_batch_request *req;
+    unsigned char *s;
+    /* 25 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) +
+       offset(8) + count(4) */
+    req = sftp_batch_request(batch, file, SSH_FXP_READ,
+                             file->handle_len + 25);
+    if(!req)
+        return LIBSSH2_ERROR_ALLOC;
+
+    s = &req->packet[9];
+    _libssh2_store_str(&s, file->handle, file->handle_len);
+    _libssh2_store_u64(&s, offset);
+    _libssh2_store_u32(&s, (uint32_t)len);
+    req->offset = offset;
+    req->len = len;
+
+    sftp_batch_queue(batch, req);
+    return 0;
 }
 
 /*
- * sftp_fstatvfs
+ * sftp_batch_write
  *
- * Get file system statistics
+ * Queue an FXP_WRITE of the next piece of a file, taking the data from the
+ * application. Returns 1 if a request was queued, 0 if there is no more data
+ * or a negative error code.
  */
-static int sftp_fstatvfs(LIBSSH2_SFTP_HANDLE *handle, LIBSSH2_SFTP_STATVFS *st)
+static int sftp_batch_write(LIBSSH2_SFTP_BATCH *batch,
+                            struct sftp_batch_file *file)
 {
-    LIBSSH2_SFTP *sftp = handle->sftp;
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
-    size_t data_len;
-    /* 17 = packet_len(4) + packet_type(1) + request_id(4) + ext_len(4)
-          + handle_len (4) */
-    /* 20 = strlen ("fstatvfs@openssh.com") */
-    uint32_t packet_len = handle->handle_len + 20 + 17;
-    unsigned char *packet, *s, *data;
-    ssize_t rc;
-    unsigned int flag;
-
-    if (sftp->fstatvfs_state == libssh2_NB_state_idle) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "Getting file system statistics");
-        s = packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!packet) {
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for FXP_EXTENDED "
-                                  "packet");
-        }
-
-        _libssh2_store_u32(&s, packet_len - 4);
-        *(s++) = SSH_FXP_EXTENDED;
-        sftp->fstatvfs_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->fstatvfs_request_id);
-        _libssh2_store_str(&s, "fstatvfs@openssh.com", 20);
-        _libssh2_store_str(&s, handle->handle, handle->handle_len);
-
-        sftp->fstatvfs_state = libssh2_NB_state_created;
+    LIBSSH2_SESSION *session = batch->sftp->channel->session;
+    struct sftp_batch_request *req;
+    unsigned char *s;
+    /* 25 = packet_len(4) + packet_type(1) + request_id(4) + handle_len(4) +
+       offset(8) + count(4) */
+    size_t header_len = file->handle_len + 25;
+    size_t size = MAX_SFTP_OUTGOING_SIZE;
+    ssize_t got;
+
+    if(file->size - file->offset < size)
+        size = (size_t)(file->size - file->offset);
+
+    req = sftp_batch_request(batch, file, SSH_FXP_WRITE, header_len + size);
+    if(!req)
+        return LIBSSH2_ERROR_ALLOC;
+
+    got = file->data(batch, file->offset, (char *)&req->packet[header_len],
+                     size, file->abstract);
+    if((got <= 0) || ((size_t)got > size)) {
+        LIBSSH2_FREE(session, req);
+        if(got)
+            file->rc = (got < 0) ? (int)got : LIBSSH2_ERROR_BAD_USE;
+        else
+            /* the file ended before the size given, stop here */
+            file->size = file->offset;
+        return 0;
     }
-    else {
-        packet = sftp->fstatvfs_packet;
+
+    if((size_t)got < size) {
+        /* less than asked for, the next piece continues after it */
+        size = got;
+        req->packet_len = header_len + size;
+        s = req->packet;
+        _libssh2_store_u32(&s, (uint32_t)(req->packet_len - 4));
     }
 
-    if (sftp->fstatvfs_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, packet, packet_len);
-        if (rc == LIBSSH2_ERROR_EAGAIN ||
-            (0 <= rc && rc < (ssize_t)packet_len)) {
-            sftp->fstatvfs_packet = packet;
-            return LIBSSH2_ERROR_EAGAIN;
-        }
+    s = &req->packet[9];
+    _libssh2_store_str(&s, file->handle, file->handle_len);
+    _libssh2_store_u64(&s, file->offset);
+    _libssh2_store_u32(&s, (uint32_t)size);
+    req->offset = file->offset;
+    req->len = size;
+    file->offset += size;
 
-        LIBSSH2_FREE(session, packet);
-        sftp->fstatvfs_packet = NULL;
+    sftp_batch_queue(batch, req);
+    return 1;
+}
+
+/*
+ * sftp_batch_issue
+ *
+ * Queue the next piece of data to move for a file. Returns 1 if a request
+ * was queued, 0 if the file has nothing to move now or a negative error code.
+ */
+static int sftp_batch_issue(LIBSSH2_SFTP_BATCH *batch,
+                            struct sftp_batch_file *file)
+{
+    size_t size = batch->sftp->read_size;
+    int rc;
 
-        if (rc < 0) {
-            sftp->fstatvfs_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "_libssh2_channel_write() failed");
-        }
-        sftp->fstatvfs_state = libssh2_NB_state_sent;
-    }
+    if((file->state != LIBSSH2_SFTP_BATCH_OPEN) || file->rc)
+        return 0;
 
-    rc = sftp_packet_require(sftp, SSH_FXP_EXTENDED_REPLY,
-                             sftp->fstatvfs_request_id, &data, &data_len);
-    if (rc == LIBSSH2_ERROR_EAGAIN) {
-        return rc;
-    } else if (rc) {
-        sftp->fstatvfs_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, rc,
-                              "Error waiting for FXP EXTENDED REPLY");
-    } else if (data_len < 93) {
-        LIBSSH2_FREE(session, data);
-        sftp->fstatvfs_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                              "SFTP Protocol Error: short response");
+    if(file->put) {
+        if(file->offset >= file->size)
+            return 0;
+        return sftp_batch_write(batch, file);
     }
 
-    sftp->fstatvfs_state = libssh2_NB_state_idle;
-
-    st->f_bsize = _libssh2_ntohu64(data + 5);
-    st->f_frsize = _libssh2_ntohu64(data + 13);
-    st->f_blocks = _libssh2_ntohu64(data + 21);
-    st->f_bfree = _libssh2_ntohu64(data + 29);
-    st->f_bavail = _libssh2_ntohu64(data + 37);
-    st->f_files = _libssh2_ntohu64(data + 45);
-    st->f_ffree = _libssh2_ntohu64(data + 53);
-    st->f_favail = _libssh2_ntohu64(data + 61);
-    st->f_fsid = _libssh2_ntohu64(data + 69);
-    flag = _libssh2_ntohu64(data + 77);
-    st->f_namemax = _libssh2_ntohu64(data + 85);
+    if(file->eof || (file->requests >= file->depth))
+        return 0;
 
-    st->f_flag = (flag & SSH_FXE_STATVFS_ST_RDONLY)
-                  ? LIBSSH2_SFTP_ST_RDONLY : 0;
-    st->f_flag |= (flag & SSH_FXE_STATVFS_ST_NOSUID)
-                  ? LIBSSH2_SFTP_ST_NOSUID : 0;
+    if(file->range) {
+        if(file->offset >= file->size)
+            return 0;
+        if(file->size - file->offset < size)
+            size = (size_t)(file->size - file->offset);
+    }
 
-    LIBSSH2_FREE(session, data);
-    return 0;
+    rc = sftp_batch_read(batch, file, file->offset, size);
+    if(rc)
+        return rc;
+    file->offset += size;
+    return 1;
 }
 
-/* libssh2_sftp_fstatvfs
- * Get filesystem space and inode utilization (requires fstatvfs@openssh.com
- * support on the server)
+/*
+ * sftp_batch_done
+ *
+ * Tell the application how a file went and forget about it
  */
-LIBSSH2_API int
-libssh2_sftp_fstatvfs(LIBSSH2_SFTP_HANDLE *handle, LIBSSH2_SFTP_STATVFS *st)
+static void sftp_batch_done(LIBSSH2_SFTP_BATCH *batch,
+                            struct sftp_batch_file *file, int rc)
 {
-    int rc;
-    if(!handle || !st)
-        return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, handle->sftp->channel->session, sftp_fstatvfs(handle, st));
-    return rc;
+    LIBSSH2_SESSION *session = batch->sftp->channel->session;
+
+    if(file->state != LIBSSH2_SFTP_BATCH_QUEUED)
+        batch->active_count--;
+    _libssh2_list_remove(&file->node);
+
+    if(file->status)
+        batch->sftp->last_errno = file->status;
+    if(file->put)
+        /* what was stat'ed while the data went out is stale */
+        sftp_cache_forget(batch->sftp, file->path, file->path_len, 0);
+    if(file->done)
+        file->done(batch, rc, file->abstract);
+
+    LIBSSH2_FREE(session, file->path);
+    LIBSSH2_FREE(session, file);
 }
 
 /*
- * sftp_statvfs
+ * sftp_batch_check
  *
- * Get file system statistics
+ * Close a file that is complete or failed, once it has no requests left
  */
-static int sftp_statvfs(LIBSSH2_SFTP *sftp, const char *path,
-                        unsigned int path_len, LIBSSH2_SFTP_STATVFS *st)
+static int sftp_batch_check(LIBSSH2_SFTP_BATCH *batch,
+                            struct sftp_batch_file *file)
 {
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
-    size_t data_len;
-    /* 17 = packet_len(4) + packet_type(1) + request_id(4) + ext_len(4)
-          + path_len (4) */
-    /* 19 = strlen ("statvfs@openssh.com") */
-    uint32_t packet_len = path_len + 19 + 17;
-    unsigned char *packet, *s, *data;
-    ssize_t rc;
-    unsigned int flag;
+    struct sftp_batch_request *req;
+    unsigned char *s;
 
-    if (sftp->statvfs_state == libssh2_NB_state_idle) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "Getting file system statistics of %s", path);
-        s = packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!packet) {
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for FXP_EXTENDED "
-                                  "packet");
-        }
+    if(file->requests)
+        return 0;
 
-        _libssh2_store_u32(&s, packet_len - 4);
-        *(s++) = SSH_FXP_EXTENDED;
-        sftp->statvfs_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->statvfs_request_id);
-        _libssh2_store_str(&s, "statvfs@openssh.com", 19);
-        _libssh2_store_str(&s, path, path_len);
+    switch(file->state) {
+    case LIBSSH2_SFTP_BATCH_OPENING:
+        /* the open failed, there is nothing to close */
+        sftp_batch_done(batch, file, file->rc);
+        return 0;
 
-        sftp->statvfs_state = libssh2_NB_state_created;
+    case LIBSSH2_SFTP_BATCH_OPEN:
+        if(!file->rc && !file->eof &&
+           (!(file->put || file->range) || (file->offset < file->size)))
+            /* there is more to move */
+            return 0;
+
+        /* 13 = packet_len(4) + packet_type(1) + request_id(4) +
+           handle_len(4) */
+        req = sftp_batch_request(batch, file, SSH_FXP_CLOSE,
+                                 file->handle_len + 13);
+        if(!req)
+            return LIBSSH2_ERROR_ALLOC;
+
+        s = &req->packet[9];
+        _libssh2_store_str(&s, file->handle, file->handle_len);
+        sftp_batch_queue(batch, req);
+        file->state = LIBSSH2_SFTP_BATCH_CLOSING;
+        return 0;
+
+    default:
+        return 0;
     }
+}
+
+/*
+ * sftp_batch_fail
+ *
+ * Note the first error of a file
+ */
+static void sftp_batch_fail(struct sftp_batch_file *file, int rc,
+                            uint32_t status)
+{
+    if(!file->rc) {
+        file->rc = rc;
+        file->status = status;
+    }
+}
+
+/*
+ * sftp_batch_reply
+ *
+ * Act on the reply 'data' to the request 'req'. Both are freed here.
+ */
+static int sftp_batch_reply(LIBSSH2_SFTP_BATCH *batch,
+                            struct sftp_batch_request *req,
+                            unsigned char *data, size_t data_len)
+{
+    LIBSSH2_SESSION *session = batch->sftp->channel->session;
+    struct sftp_batch_file *file = req->file;
+    unsigned char type = data[0];
+    uint32_t status = LIBSSH2_FX_OK;
+    size_t len = 0;
+    ssize_t got;
+    int rc = 0;
+
+    sftp_index_remove(&batch->inflight_index, req->request_id);
+    _libssh2_list_remove(&req->node);
+    file->requests--;
+    batch->outstanding -= req->len;
+
+    /* a malformed reply gets type 0, which is no valid reply to anything */
+    if(data_len < 9)
+        type = 0;
+    else if(type == SSH_FXP_STATUS)
+        status = _libssh2_ntohu32(data + 5);
     else {
-        packet = sftp->statvfs_packet;
+        len = _libssh2_ntohu32(data + 5);
+        if(len > data_len - 9)
+            type = 0;
     }
 
-    if (sftp->statvfs_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, packet, packet_len);
-        if (rc == LIBSSH2_ERROR_EAGAIN ||
-            (0 <= rc && rc < (ssize_t)packet_len)) {
-            sftp->statvfs_packet = packet;
-            return LIBSSH2_ERROR_EAGAIN;
+    switch(req->type) {
+    case SSH_FXP_OPEN:
+        if((type == SSH_FXP_HANDLE) && (len <= SFTP_HANDLE_MAXLEN)) {
+            memcpy(file->handle, data + 9, len);
+            file->handle_len = len;
+            file->state = LIBSSH2_SFTP_BATCH_OPEN;
+            /* the size of a range is known, no need to feel the way */
+            if(file->range)
+                file->depth = (unsigned int)
+                    (batch->max_bytes / batch->sftp->read_size) + 1;
+            else
+                file->depth = 2;
         }
+        else
+            sftp_batch_fail(file, LIBSSH2_ERROR_SFTP_PROTOCOL, status);
+        break;
 
-        LIBSSH2_FREE(session, packet);
-        sftp->statvfs_packet = NULL;
-
-        if (rc < 0) {
-            sftp->statvfs_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "_libssh2_channel_write() failed");
+    case SSH_FXP_READ:
+        if((type == SSH_FXP_DATA) && (len <= req->len)) {
+            if(file->rc)
+                break;
+            if(!len) {
+                /* nothing more to get, take it as EOF */
+                file->eof = 1;
+                break;
+            }
+            got = file->data(batch, req->offset, (char *)data + 9, len,
+                             file->abstract);
+            if(got < 0)
+                sftp_batch_fail(file, (int)got, 0);
+            else if(len < req->len)
+                /* a short read does not mean the end of the file, ask for
+                   the rest again */
+                rc = sftp_batch_read(batch, file, req->offset + len,
+                                     req->len - len);
+            else if(file->depth < batch->max_bytes / req->len)
+                file->depth *= 2;
         }
-        sftp->statvfs_state = libssh2_NB_state_sent;
-    }
-
-    rc = sftp_packet_require(sftp, SSH_FXP_EXTENDED_REPLY,
-                             sftp->statvfs_request_id, &data, &data_len);
-    if (rc == LIBSSH2_ERROR_EAGAIN) {
-        return rc;
-    } else if (rc) {
-        sftp->statvfs_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, rc,
-                              "Error waiting for FXP EXTENDED REPLY");
-    } else if (data_len < 93) {
-        LIBSSH2_FREE(session, data);
-        sftp->statvfs_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                              "SFTP Protocol Error: short response");
-    }
+        else if((type == SSH_FXP_STATUS) && (status == LIBSSH2_FX_EOF))
+            file->eof = 1;
+        else
+            sftp_batch_fail(file, LIBSSH2_ERROR_SFTP_PROTOCOL, status);
+        break;
 
-    sftp->statvfs_state = libssh2_NB_state_idle;
+    case SSH_FXP_WRITE:
+        if((type != SSH_FXP_STATUS) || (status != LIBSSH2_FX_OK))
+            sftp_batch_fail(file, LIBSSH2_ERROR_SFTP_PROTOCOL, status);
+        break;
 
-    st->f_bsize = _libssh2_ntohu64(data + 5);
-    st->f_frsize = _libssh2_ntohu64(data + 13);
-    st->f_blocks = _libssh2_ntohu64(data + 21);
-    st->f_bfree = _libssh2_ntohu64(data + 29);
-    st->f_bavail = _libssh2_ntohu64(data + 37);
-    st->f_files = _libssh2_ntohu64(data + 45);
-    st->f_ffree = _libssh2_ntohu64(data + 53);
-    st->f_favail = _libssh2_ntohu64(data + 61);
-    st->f_fsid = _libssh2_ntohu64(data + 69);
-    flag = _libssh2_ntohu64(data + 77);
-    st->f_namemax = _libssh2_ntohu64(data + 85);
+    case SSH_FXP_CLOSE:
+        if((type != SSH_FXP_STATUS) || (status != LIBSSH2_FX_OK))
+            sftp_batch_fail(file, LIBSSH2_ERROR_SFTP_PROTOCOL, status);
+        LIBSSH2_FREE(session, req);
+        sftp_packet_release(batch->sftp, data, data_len);
+        sftp_batch_done(batch, file, file->rc);
+        return 0;
+    }
 
-    st->f_flag = (flag & SSH_FXE_STATVFS_ST_RDONLY)
-                  ? LIBSSH2_SFTP_ST_RDONLY : 0;
-    st->f_flag |= (flag & SSH_FXE_STATVFS_ST_NOSUID)
-                  ? LIBSSH2_SFTP_ST_NOSUID : 0;
+    LIBSSH2_FREE(session, req);
+    sftp_packet_release(batch->sftp, data, data_len);
 
-    LIBSSH2_FREE(session, data);
-    return 0;
+    if(rc)
+        return rc;
+    return sftp_batch_check(batch, file);
 }
 
-/* libssh2_sftp_statvfs_ex
- * Get filesystem space and inode utilization (requires statvfs@openssh.com
- * support on the server)
+/*
+ * sftp_batch_dispatch
+ *
+ * Take the replies to the batch's requests out of the packets received
  */
-LIBSSH2_API int
-libssh2_sftp_statvfs(LIBSSH2_SFTP *sftp, const char *path,
-                     size_t path_len, LIBSSH2_SFTP_STATVFS *st)
+static int sftp_batch_dispatch(LIBSSH2_SFTP_BATCH *batch)
 {
+    LIBSSH2_SFTP *sftp = batch->sftp;
+    LIBSSH2_SFTP_PACKET *packet = _libssh2_list_first(&sftp->packets);
     int rc;
-    if(!sftp || !st)
-        return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, sftp->channel->session, sftp_statvfs(sftp, path, path_len,
-                                                          st));
-    return rc;
-}
 
+    while(packet) {
+        LIBSSH2_SFTP_PACKET *next = _libssh2_list_next(&packet->node);
+        struct sftp_batch_request *req = NULL;
+
+        if(packet->data[0] != SSH_FXP_VERSION)
+            req = sftp_index_find(&batch->inflight_index, packet->request_id);
+
+        if(req) {
+            unsigned char *data = packet->data;
+            size_t data_len = packet->data_len;
+
+            sftp_index_remove(&sftp->packet_index, packet->request_id);
+            _libssh2_list_remove(&packet->node);
+            sftp_packet_node_release(sftp, packet);
+
+            rc = sftp_batch_reply(batch, req, data, data_len);
+            if(rc)
+                return rc;
+        }
+        packet = next;
+    }
+    return 0;
+}
 
 /*
- * sftp_mkdir
+ * sftp_batch_run
  *
- * Create an SFTP directory
+ * Move the files of a batch as far as possible without blocking
  */
-static int sftp_mkdir(LIBSSH2_SFTP *sftp, const char *path,
-                      unsigned int path_len, long mode)
+static int sftp_batch_run(LIBSSH2_SFTP_BATCH *batch)
 {
+    LIBSSH2_SFTP *sftp = batch->sftp;
     LIBSSH2_CHANNEL *channel = sftp->channel;
     LIBSSH2_SESSION *session = channel->session;
-    LIBSSH2_SFTP_ATTRIBUTES attrs = {
-        LIBSSH2_SFTP_ATTR_PERMISSIONS, 0, 0, 0, 0, 0, 0
-    };
-    size_t data_len;
-    int retcode;
-    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + path_len(4) */
-    ssize_t packet_len = path_len + 13 +
-        sftp_attrsize(LIBSSH2_SFTP_ATTR_PERMISSIONS);
-    unsigned char *packet, *s, *data;
+    struct sftp_batch_file *file;
+    struct sftp_batch_request *req;
+    int progress;
+    int issued;
     int rc;
 
-    if (sftp->mkdir_state == libssh2_NB_state_idle) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP,
-                       "Creating directory %s with mode 0%lo", path, mode);
-        s = packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!packet) {
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for FXP_MKDIR "
-                                  "packet");
+    do {
+        progress = 0;
+
+        /* start on more files */
+        while((batch->active_count < batch->max_files) &&
+              (file = _libssh2_list_first(&batch->queued)) != NULL) {
+            rc = sftp_batch_open(batch, file);
+            if(rc)
+                return rc;
+            _libssh2_list_remove(&file->node);
+            _libssh2_list_add(&batch->active, &file->node);
+            batch->active_count++;
         }
-        /* Filetype in SFTP 3 and earlier */
-        attrs.permissions = mode | LIBSSH2_SFTP_ATTR_PFILETYPE_DIR;
 
-        _libssh2_store_u32(&s, packet_len - 4);
-        *(s++) = SSH_FXP_MKDIR;
-        sftp->mkdir_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->mkdir_request_id);
-        _libssh2_store_str(&s, path, path_len);
+        /* a piece of every file in turn, as long as the budget lasts */
+        do {
+            issued = 0;
+            file = _libssh2_list_first(&batch->active);
+            while(file && (batch->outstanding < batch->max_bytes)) {
+                struct sftp_batch_file *next = _libssh2_list_next(&file->node);
 
-        s += sftp_attr2bin(s, &attrs);
+                rc = sftp_batch_issue(batch, file);
+                if(rc < 0)
+                    return rc;
+                else if(rc)
+                    issued = 1;
+                else {
+                    /* the application may have ended or failed the file */
+                    rc = sftp_batch_check(batch, file);
+                    if(rc)
+                        return rc;
+                }
+                file = next;
+            }
+        } while(issued && (batch->outstanding < batch->max_bytes));
+
+        /* make room for all the data asked for */
+        if(libssh2_channel_window_read_ex(channel, NULL, NULL) <
+           batch->max_bytes) {
+            rc = _libssh2_channel_receive_window_adjust(channel,
+                                                        (uint32_t)
+                                                        batch->max_bytes * 2,
+                                                        1, NULL);
+            if(rc)
+                return rc;
+        }
 
-        sftp->mkdir_state = libssh2_NB_state_created;
-    }
-    else {
-        packet = sftp->mkdir_packet;
-    }
+        while((req = _libssh2_list_first(&batch->outgoing)) != NULL) {
+            ssize_t nwritten = sftp_channel_write(sftp, req,
+                                                  &req->packet[req->sent],
+                                                  req->packet_len -
+                                                  req->sent);
+            if(nwritten == LIBSSH2_ERROR_EAGAIN)
+                break;
+            else if(nwritten < 0)
+                return (int)nwritten;
+            else if(!nwritten) {
+                /* no window left, wait for the server to adjust it */
+                _libssh2_session_block(session,
+                                       LIBSSH2_SESSION_BLOCK_INBOUND);
+                break;
+            }
 
-    if (sftp->mkdir_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, packet, packet_len);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
-            sftp->mkdir_packet = packet;
-            return rc;
+            progress = 1;
+            req->sent += nwritten;
+            if(req->sent == req->packet_len) {
+                _libssh2_list_remove(&req->node);
+                _libssh2_list_add(&batch->inflight, &req->node);
+                rc = sftp_index_add(session, &batch->inflight_index,
+                                    req->request_id, req);
+                if(rc)
+                    return rc;
+            }
         }
-        if (packet_len != rc) {
-            LIBSSH2_FREE(session, packet);
-            sftp->mkdir_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "_libssh2_channel_write() failed");
+
+        while((rc = sftp_packet_read(sftp)) != LIBSSH2_ERROR_EAGAIN) {
+            if(rc < 0)
+                return rc;
+            progress = 1;
         }
-        LIBSSH2_FREE(session, packet);
-        sftp->mkdir_state = libssh2_NB_state_sent;
-        sftp->mkdir_packet = NULL;
-    }
 
-    rc = sftp_packet_require(sftp, SSH_FXP_STATUS, sftp->mkdir_request_id,
-                             &data, &data_len);
-    if (rc == LIBSSH2_ERROR_EAGAIN) {
-        return rc;
-    } else if (rc) {
-        sftp->mkdir_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, rc,
-                              "Error waiting for FXP STATUS");
-    }
+        rc = sftp_batch_dispatch(batch);
+        if(rc)
+            return rc;
 
-    sftp->mkdir_state = libssh2_NB_state_idle;
+        if(!_libssh2_list_first(&batch->active) &&
+           !_libssh2_list_first(&batch->queued))
+            return 0;
 
-    retcode = _libssh2_ntohu32(data + 5);
-    LIBSSH2_FREE(session, data);
+    } while(progress);
 
-    if (retcode == LIBSSH2_FX_OK) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "OK!");
-        return 0;
-    } else {
-        sftp->last_errno = retcode;
-        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                              "SFTP Protocol Error");
+    return _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                          "Would block running the SFTP batch");
+}
+
+/* libssh2_sftp_batch_init
+ * Start a batch of file transfers
+ */
+LIBSSH2_API LIBSSH2_SFTP_BATCH *
+libssh2_sftp_batch_init(LIBSSH2_SFTP *sftp, unsigned int max_files,
+                        size_t max_bytes)
+{
+    LIBSSH2_SESSION *session;
+    LIBSSH2_SFTP_BATCH *batch;
+
+    if(!sftp)
+        return NULL;
+
+    session = sftp->channel->session;
+    batch = LIBSSH2_ALLOC(session, sizeof(LIBSSH2_SFTP_BATCH));
+    if(!batch) {
+        _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                       "Unable to allocate memory for an SFTP batch");
+        return NULL;
     }
+    memset(batch, 0, sizeof(LIBSSH2_SFTP_BATCH));
+    batch->sftp = sftp;
+    batch->max_files = max_files ? max_files : SFTP_BATCH_FILES;
+    batch->max_bytes = max_bytes ? max_bytes : MAX_SFTP_READ_AHEAD;
+    _libssh2_list_init(&batch->queued);
+    _libssh2_list_init(&batch->active);
+    _libssh2_list_init(&batch->outgoing);
+    _libssh2_list_init(&batch->inflight);
+
+    return batch;
 }
 
 /*
- * libssh2_sftp_mkdir_ex
+ * sftp_batch_add
  *
- * Create an SFTP directory
+ * Add a file to the queue of a batch
  */
-LIBSSH2_API int
-libssh2_sftp_mkdir_ex(LIBSSH2_SFTP *sftp, const char *path,
-                      unsigned int path_len, long mode)
+static int sftp_batch_add(LIBSSH2_SFTP_BATCH *batch, int put, int range,
+                          const char *remote_path,
+                          unsigned int remote_path_len, long mode,
+                          libssh2_uint64_t offset, libssh2_uint64_t length,
+                          LIBSSH2_SFTP_BATCH_DATA_FUNC((*data)),
+                          LIBSSH2_SFTP_BATCH_DONE_FUNC((*done)),
+                          void *file_abstract)
 {
-    int rc;
-    if(!sftp)
+    LIBSSH2_SESSION *session;
+    struct sftp_batch_file *file;
+
+    if(!batch || !remote_path || !data)
         return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, sftp->channel->session,
-                 sftp_mkdir(sftp, path, path_len, mode));
-    return rc;
+
+    session = batch->sftp->channel->session;
+    file = LIBSSH2_ALLOC(session, sizeof(struct sftp_batch_file));
+    if(!file)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for an SFTP batch "
+                              "file");
+    memset(file, 0, sizeof(struct sftp_batch_file));
+
+    file->path = LIBSSH2_ALLOC(session, remote_path_len ? remote_path_len : 1);
+    if(!file->path) {
+        LIBSSH2_FREE(session, file);
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for an SFTP batch "
+                              "file");
+    }
+    memcpy(file->path, remote_path, remote_path_len);
+    file->path_len = remote_path_len;
+    file->put = put;
+    file->range = range;
+    file->mode = mode;
+    file->offset = offset;
+    file->size = offset + length;
+    file->state = LIBSSH2_SFTP_BATCH_QUEUED;
+    file->data = data;
+    file->done = done;
+    file->abstract = file_abstract;
+
+    _libssh2_list_add(&batch->queued, &file->node);
+    return 0;
 }
 
-/* sftp_rmdir
- * Remove a directory
+/* libssh2_sftp_batch_get
+ * Add a download to a batch
  */
-static int sftp_rmdir(LIBSSH2_SFTP *sftp, const char *path,
-                      unsigned int path_len)
+LIBSSH2_API int
+libssh2_sftp_batch_get(LIBSSH2_SFTP_BATCH *batch, const char *remote_path,
+                       unsigned int remote_path_len,
+                       LIBSSH2_SFTP_BATCH_DATA_FUNC((*data)),
+                       LIBSSH2_SFTP_BATCH_DONE_FUNC((*done)),
+                       void *file_abstract)
+{
+    return sftp_batch_add(batch, 0, 0, remote_path, remote_path_len, 0, 0, 0,
+                          data, done, file_abstract);
+}
+
+/* libssh2_sftp_batch_get_range
+ * Add a download of a part of a file to a batch
+ */
+LIBSSH2_API int
+libssh2_sftp_batch_get_range(LIBSSH2_SFTP_BATCH *batch,
+                             const char *remote_path,
+                             unsigned int remote_path_len,
+                             libssh2_uint64_t offset,
+                             libssh2_uint64_t length,
+                             LIBSSH2_SFTP_BATCH_DATA_FUNC((*data)),
+                             LIBSSH2_SFTP_BATCH_DONE_FUNC((*done)),
+                             void *file_abstract)
+{
+    return sftp_batch_add(batch, 0, 1, remote_path, remote_path_len, 0,
+                          offset, length, data, done, file_abstract);
+}
+
+/* libssh2_sftp_batch_put
+ * Add an upload to a batch
+ */
+LIBSSH2_API int
+libssh2_sftp_batch_put(LIBSSH2_SFTP_BATCH *batch, const char *remote_path,
+                       unsigned int remote_path_len, long mode,
+                       libssh2_uint64_t filesize,
+                       LIBSSH2_SFTP_BATCH_DATA_FUNC((*data)),
+                       LIBSSH2_SFTP_BATCH_DONE_FUNC((*done)),
+                       void *file_abstract)
+{
+    return sftp_batch_add(batch, 1, 0, remote_path, remote_path_len, mode,
+                          0, filesize, data, done, file_abstract);
+}
+
+/* libssh2_sftp_batch_put_range
+ * Add an upload of a part of a file to a batch
+ */
+LIBSSH2_API int
+libssh2_sftp_batch_put_range(LIBSSH2_SFTP_BATCH *batch,
+                             const char *remote_path,
+                             unsigned int remote_path_len, long mode,
+                             libssh2_uint64_t offset,
+                             libssh2_uint64_t length,
+                             LIBSSH2_SFTP_BATCH_DATA_FUNC((*data)),
+                             LIBSSH2_SFTP_BATCH_DONE_FUNC((*done)),
+                             void *file_abstract)
+{
+    return sftp_batch_add(batch, 1, 1, remote_path, remote_path_len, mode,
+                          offset, length, data, done, file_abstract);
+}
+
+/* libssh2_sftp_batch_run
+ * Move the files of a batch
+ */
+LIBSSH2_API int
+libssh2_sftp_batch_run(LIBSSH2_SFTP_BATCH *batch)
 {
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
-    size_t data_len;
-    int retcode;
-    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + path_len(4) */
-    ssize_t packet_len = path_len + 13;
-    unsigned char *s, *data;
     int rc;
 
-    if (sftp->rmdir_state == libssh2_NB_state_idle) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "Removing directory: %s",
-                       path);
-        s = sftp->rmdir_packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!sftp->rmdir_packet) {
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for FXP_RMDIR "
-                                  "packet");
-        }
+    if(!batch)
+        return LIBSSH2_ERROR_BAD_USE;
 
-        _libssh2_store_u32(&s, packet_len - 4);
-        *(s++) = SSH_FXP_RMDIR;
-        sftp->rmdir_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->rmdir_request_id);
-        _libssh2_store_str(&s, path, path_len);
+    BLOCK_ADJUST(rc, batch->sftp->channel->session, sftp_batch_run(batch));
+    return rc;
+}
 
-        sftp->rmdir_state = libssh2_NB_state_created;
-    }
+/* libssh2_sftp_batch_free
+ * Cancel what is left of a batch and free it
+ */
+LIBSSH2_API void
+libssh2_sftp_batch_free(LIBSSH2_SFTP_BATCH *batch)
+{
+    LIBSSH2_SFTP *sftp;
+    LIBSSH2_SESSION *session;
+    struct sftp_batch_request *req;
+    struct sftp_batch_file *file;
 
-    if (sftp->rmdir_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, sftp->rmdir_packet,
-                                    packet_len);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
-            return rc;
-        } else if (packet_len != rc) {
-            LIBSSH2_FREE(session, sftp->rmdir_packet);
-            sftp->rmdir_packet = NULL;
-            sftp->rmdir_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "Unable to send FXP_RMDIR command");
-        }
-        LIBSSH2_FREE(session, sftp->rmdir_packet);
-        sftp->rmdir_packet = NULL;
+    if(!batch)
+        return;
 
-        sftp->rmdir_state = libssh2_NB_state_sent;
+    sftp = batch->sftp;
+    session = sftp->channel->session;
+
+    while((req = _libssh2_list_first(&batch->outgoing)) != NULL) {
+        if(sftp_packet_abandon(sftp, req, &req->packet[req->sent],
+                               req->packet_len - req->sent))
+            /* it gets completed, drop the reply */
+            add_zombie_request(sftp, req->request_id);
+        else if(req->type == SSH_FXP_CLOSE) {
+            /* the file is open, close it even so */
+            sftp_leftover_close(sftp, req->file->handle,
+                                req->file->handle_len);
+        }
+        _libssh2_list_remove(&req->node);
+        LIBSSH2_FREE(session, req);
+    }
+    while((req = _libssh2_list_first(&batch->inflight)) != NULL) {
+        /* drop the replies, the handles an open brings get closed */
+        sftp_request_drop(sftp, req->request_id);
+        _libssh2_list_remove(&req->node);
+        LIBSSH2_FREE(session, req);
     }
+    sftp_index_free(session, &batch->inflight_index);
 
-    rc = sftp_packet_require(sftp, SSH_FXP_STATUS,
-                             sftp->rmdir_request_id, &data, &data_len);
-    if (rc == LIBSSH2_ERROR_EAGAIN) {
-        return rc;
-    } else if (rc) {
-        sftp->rmdir_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, rc,
-                              "Error waiting for FXP STATUS");
+    while((file = _libssh2_list_first(&batch->active)) != NULL) {
+        if(file->state == LIBSSH2_SFTP_BATCH_OPEN)
+            sftp_leftover_close(sftp, file->handle, file->handle_len);
+        file->status = 0;
+        sftp_batch_done(batch, file, LIBSSH2_ERROR_CANCELLED);
     }
+    while((file = _libssh2_list_first(&batch->queued)) != NULL)
+        sftp_batch_done(batch, file, LIBSSH2_ERROR_CANCELLED);
 
-    sftp->rmdir_state = libssh2_NB_state_idle;
+    LIBSSH2_FREE(session, batch);
+}
 
-    retcode = _libssh2_ntohu32(data + 5);
-    LIBSSH2_FREE(session, data);
+/* Directories a tree walk has open at once unless told otherwise, and the
+   READDIR requests it keeps outstanding on each */
+#define SFTP_WALK_DIRS 64
+#define SFTP_WALK_READDIRS 2
 
-    if (retcode == LIBSSH2_FX_OK) {
-        return 0;
-    } else {
-        sftp->last_errno = retcode;
-        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                              "SFTP Protocol Error");
-    }
+/*
+ * sftp_walk_queue
+ *
+ * Queue a request of 'type' that takes one string, a path or a handle
+ */
+static int sftp_walk_queue(LIBSSH2_SFTP *sftp, struct sftp_walk *walk,
+                           struct sftp_walk_dir *dir, unsigned char type,
+                           const char *str, size_t str_len)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct sftp_walk_request *req;
+    /* packet_len(4) + packet_type(1) + request_id(4) + str_len(4) */
+    size_t packet_len = str_len + 13;
+    unsigned char *s;
+
+    req = LIBSSH2_ALLOC(session, sizeof(struct sftp_walk_request) +
+                        packet_len);
+    if(!req)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for an SFTP walk "
+                              "request");
+
+    req->dir = dir;
+    req->type = type;
+    req->request_id = sftp->request_id++;
+    req->packet_len = packet_len;
+    req->sent = 0;
+
+    s = req->packet;
+    _libssh2_store_u32(&s, (uint32_t)(packet_len - 4));
+    *(s++) = type;
+    _libssh2_store_u32(&s, req->request_id);
+    _libssh2_store_str(&s, str, str_len);
+    /* the spare byte of the struct makes the string zero terminated */
+    *s = '\0';
+
+    dir->requests++;
+    _libssh2_list_add(&walk->outgoing, &req->node);
+    return 0;
 }
 
-/* libssh2_sftp_rmdir_ex
- * Remove a directory
+/*
+ * sftp_walk_add
+ *
+ * Queue a directory to be read
  */
-LIBSSH2_API int
-libssh2_sftp_rmdir_ex(LIBSSH2_SFTP *sftp, const char *path,
-                      unsigned int path_len)
+static int sftp_walk_add(LIBSSH2_SFTP *sftp, struct sftp_walk *walk,
+                         const char *path, size_t path_len,
+                         unsigned int depth)
 {
-    int rc;
-    if(!sftp)
-        return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, sftp->channel->session,
-                 sftp_rmdir(sftp, path, path_len));
-    return rc;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct sftp_walk_dir *dir;
+
+    dir = LIBSSH2_ALLOC(session, sizeof(struct sftp_walk_dir) + path_len);
+    if(!dir)
+        return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                              "Unable to allocate memory for an SFTP walk "
+                              "directory");
+    memset(dir, 0, sizeof(struct sftp_walk_dir));
+
+    memcpy(dir->path, path, path_len);
+    dir->path[path_len] = '\0';
+    dir->path_len = path_len;
+    dir->depth = depth;
+    dir->state = LIBSSH2_SFTP_WALK_QUEUED;
+
+    _libssh2_list_add(&walk->queued, &dir->node);
+    return 0;
 }
 
-/* sftp_stat
- * Stat a file or symbolic link
+/*
+ * sftp_walk_path
+ *
+ * Put together the path of an entry of a directory in the walk's buffer
  */
-static int sftp_stat(LIBSSH2_SFTP *sftp, const char *path,
-                     unsigned int path_len, int stat_type,
-                     LIBSSH2_SFTP_ATTRIBUTES * attrs)
+static char *sftp_walk_path(LIBSSH2_SFTP *sftp, struct sftp_walk *walk,
+                            struct sftp_walk_dir *dir,
+                            const unsigned char *name, size_t name_len,
+                            size_t *path_len)
 {
-    LIBSSH2_CHANNEL *channel = sftp->channel;
-    LIBSSH2_SESSION *session = channel->session;
-    size_t data_len;
-    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + path_len(4) */
-    ssize_t packet_len =
-        path_len + 13 +
-        ((stat_type ==
-          LIBSSH2_SFTP_SETSTAT) ? sftp_attrsize(attrs->flags) : 0);
-    unsigned char *s, *data;
-    static const unsigned char stat_responses[2] =
-        { SSH_FXP_ATTRS, SSH_FXP_STATUS };
-    int rc;
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    size_t dir_len = dir->path_len;
+    size_t len;
 
-    if (sftp->stat_state == libssh2_NB_state_idle) {
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "%s %s",
-                       (stat_type == LIBSSH2_SFTP_SETSTAT) ? "Set-statting" :
-                       (stat_type ==
-                        LIBSSH2_SFTP_LSTAT ? "LStatting" : "Statting"), path);
-        s = sftp->stat_packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!sftp->stat_packet) {
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for FXP_*STAT "
-                                  "packet");
+    /* don't double the slash of "/" or "dir/" */
+    if(dir_len && (dir->path[dir_len - 1] == '/'))
+        dir_len--;
+    len = dir_len + 1 + name_len;
+
+    if(len >= walk->path_size) {
+        char *path = LIBSSH2_REALLOC(session, walk->path, len + 1);
+        if(!path) {
+            _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                           "Unable to allocate memory for an SFTP walk "
+                           "path");
+            return NULL;
         }
+        walk->path = path;
+        walk->path_size = len + 1;
+    }
 
-        _libssh2_store_u32(&s, packet_len - 4);
+    memcpy(walk->path, dir->path, dir_len);
+    walk->path[dir_len] = '/';
+    memcpy(&walk->path[dir_len + 1], name, name_len);
+    walk->path[len] = '\0';
 
-        switch (stat_type) {
-        case LIBSSH2_SFTP_SETSTAT:
-            *(s++) = SSH_FXP_SETSTAT;
-            break;
+    *path_len = len;
+    return walk->path;
+}
 
-        case LIBSSH2_SFTP_LSTAT:
-            *(s++) = SSH_FXP_LSTAT;
-            break;
+/*
+ * sftp_walk_stop
+ *
+ * Wind the walk down after the callback asked for it: drop the directories
+ * not opened yet and read no further in the open ones
+ */
+static void sftp_walk_stop(LIBSSH2_SFTP *sftp, struct sftp_walk *walk,
+                           int rc)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct sftp_walk_dir *dir;
 
-        case LIBSSH2_SFTP_STAT:
-        default:
-            *(s++) = SSH_FXP_STAT;
-        }
-        sftp->stat_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->stat_request_id);
-        _libssh2_store_str(&s, path, path_len);
+    walk->rc = rc;
 
-        if (stat_type == LIBSSH2_SFTP_SETSTAT)
-            s += sftp_attr2bin(s, attrs);
+    while((dir = _libssh2_list_first(&walk->queued)) != NULL) {
+        _libssh2_list_remove(&dir->node);
+        LIBSSH2_FREE(session, dir);
+    }
+    for(dir = _libssh2_list_first(&walk->active); dir;
+        dir = _libssh2_list_next(&dir->node))
+        dir->eof = 1;
+}
 
-        sftp->stat_state = libssh2_NB_state_created;
+/*
+ * sftp_walk_entry
+ *
+ * Hand an entry to the callback and queue it for reading if it is a
+ * directory to descend into
+ */
+static int sftp_walk_entry(LIBSSH2_SFTP *sftp, struct sftp_walk *walk,
+                           struct sftp_walk_dir *dir, const char *path,
+                           size_t path_len, LIBSSH2_SFTP_ATTRIBUTES *attrs)
+{
+    unsigned int depth = dir->depth + 1;
+    int rc;
+
+    rc = walk->callback(sftp, path, path_len, attrs, depth, walk->abstract);
+    if(rc < 0) {
+        sftp_walk_stop(sftp, walk, rc);
+        return 0;
     }
+    else if(rc == LIBSSH2_SFTP_WALK_PRUNE)
+        return 0;
 
-    if (sftp->stat_state == libssh2_NB_state_created) {
-        rc = _libssh2_channel_write(channel, 0, sftp->stat_packet, packet_len);
-        if (rc == LIBSSH2_ERROR_EAGAIN) {
-            return rc;
-        } else if (packet_len != rc) {
-            LIBSSH2_FREE(session, sftp->stat_packet);
-            sftp->stat_packet = NULL;
-            sftp->stat_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "Unable to send STAT/LSTAT/SETSTAT command");
+    if((attrs->flags & LIBSSH2_SFTP_ATTR_PERMISSIONS) &&
+       LIBSSH2_SFTP_S_ISDIR(attrs->permissions) &&
+       (!walk->max_depth || (depth < walk->max_depth)))
+        return sftp_walk_add(sftp, walk, path, path_len, depth);
+
+    return 0;
+}
+
+/*
+ * sftp_walk_names
+ *
+ * Go through the entries of a NAME reply to a READDIR. The ones without
+ * file type in their attributes get an LSTAT first.
+ */
+static int sftp_walk_names(LIBSSH2_SFTP *sftp, struct sftp_walk *walk,
+                           struct sftp_walk_dir *dir, unsigned char *data,
+                           size_t data_len)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    unsigned char *s = data + 9;
+    unsigned char *end = data + data_len;
+    unsigned char *name, *longentry;
+    size_t name_len, longentry_len;
+    uint32_t count = _libssh2_ntohu32(data + 5);
+    char *path;
+    size_t path_len;
+    int rc;
+
+    if(!count)
+        /* nothing more to get, take it as EOF */
+        dir->eof = 1;
+
+    while(count-- && !walk->rc) {
+        s = sftp_name_entry(s, end, &name, &name_len, &longentry,
+                            &longentry_len, &attrs);
+        if(!s) {
+            /* a broken reply, read no further in this directory */
+            dir->eof = 1;
+            break;
         }
-        LIBSSH2_FREE(session, sftp->stat_packet);
-        sftp->stat_packet = NULL;
 
-        sftp->stat_state = libssh2_NB_state_sent;
-    }
+        if(((name_len == 1) && (name[0] == '.')) ||
+           ((name_len == 2) && (name[0] == '.') && (name[1] == '.')))
+            continue;
 
-    rc = sftp_packet_requirev(sftp, 2, stat_responses,
-                              sftp->stat_request_id, &data, &data_len);
-    if (rc == LIBSSH2_ERROR_EAGAIN)
-        return rc;
-    else if (rc) {
-        sftp->stat_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, rc,
-                              "Timeout waiting for status message");
+        path = sftp_walk_path(sftp, walk, dir, name, name_len, &path_len);
+        if(!path)
+            return LIBSSH2_ERROR_ALLOC;
+
+        if((attrs.flags & SFTP_CACHE_ATTRS) == SFTP_CACHE_ATTRS)
+            sftp_cache_store(sftp, NULL, 0, path, path_len, 1, &attrs);
+
+        if(attrs.flags & LIBSSH2_SFTP_ATTR_PERMISSIONS)
+            rc = sftp_walk_entry(sftp, walk, dir, path, path_len, &attrs);
+        else
+            rc = sftp_walk_queue(sftp, walk, dir, SSH_FXP_LSTAT, path,
+                                 path_len);
+        if(rc)
+            return rc;
     }
+    return 0;
+}
 
-    sftp->stat_state = libssh2_NB_state_idle;
+/*
+ * sftp_walk_reply
+ *
+ * Act on the reply 'data' to the request 'req'. Both are freed here.
+ */
+static int sftp_walk_reply(LIBSSH2_SFTP *sftp, struct sftp_walk *walk,
+                           struct sftp_walk_request *req,
+                           unsigned char *data, size_t data_len)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct sftp_walk_dir *dir = req->dir;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    /* a malformed reply gets type 0, which is no valid reply to anything */
+    unsigned char type = (data_len < 9) ? 0 : data[0];
+    uint32_t len;
+    int rc = 0;
+
+    sftp_index_remove(&walk->inflight_index, req->request_id);
+    _libssh2_list_remove(&req->node);
+    dir->requests--;
+
+    switch(req->type) {
+    case SSH_FXP_OPENDIR:
+        len = (type == SSH_FXP_HANDLE) ? _libssh2_ntohu32(data + 5) : 0;
+        if(len && (len <= data_len - 9) && (len <= SFTP_HANDLE_MAXLEN)) {
+            memcpy(dir->handle, data + 9, len);
+            dir->handle_len = len;
+            dir->state = LIBSSH2_SFTP_WALK_OPEN;
+        }
+        else {
+            /* a directory below that can't be read is left out, but the
+               walk can't do without the one it starts at */
+            if(!dir->depth && !walk->rc) {
+                if(type == SSH_FXP_STATUS)
+                    sftp->last_errno = _libssh2_ntohu32(data + 5);
+                walk->rc = _libssh2_error(session,
+                                          LIBSSH2_ERROR_SFTP_PROTOCOL,
+                                          "Unable to open the directory to "
+                                          "walk");
+            }
+            dir->eof = 1;
+        }
+        break;
 
-    if (data[0] == SSH_FXP_STATUS) {
-        int retcode;
+    case SSH_FXP_READDIR:
+        if(type == SSH_FXP_NAME)
+            rc = sftp_walk_names(sftp, walk, dir, data, data_len);
+        else
+            /* the end of the directory, or an error that ends it */
+            dir->eof = 1;
+        break;
 
-        retcode = _libssh2_ntohu32(data + 5);
-        LIBSSH2_FREE(session, data);
-        if (retcode == LIBSSH2_FX_OK) {
-            return 0;
-        } else {
-            sftp->last_errno = retcode;
-            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                  "SFTP Protocol Error");
+    case SSH_FXP_LSTAT:
+        /* an entry that is gone by now is left out */
+        if((type == SSH_FXP_ATTRS) && !walk->rc &&
+           ((size_t)sftp_attrsize(_libssh2_ntohu32(data + 5)) <=
+            data_len - 5)) {
+            sftp_bin2attr(&attrs, data + 5);
+            sftp_cache_store(sftp, NULL, 0, (char *)&req->packet[13],
+                             req->packet_len - 13, 1, &attrs);
+            rc = sftp_walk_entry(sftp, walk, dir, (char *)&req->packet[13],
+                                 req->packet_len - 13, &attrs);
         }
+        break;
+
+    case SSH_FXP_CLOSE:
+        _libssh2_list_remove(&dir->node);
+        walk->active_count--;
+        LIBSSH2_FREE(session, dir);
+        LIBSSH2_FREE(session, req);
+        LIBSSH2_FREE(session, data);
+        return 0;
     }
 
-    memset(attrs, 0, sizeof(LIBSSH2_SFTP_ATTRIBUTES));
-    sftp_bin2attr(attrs, data + 5);
+    LIBSSH2_FREE(session, req);
     LIBSSH2_FREE(session, data);
+    if(rc)
+        return rc;
 
+    /* close the directory once it is read and nothing is left in flight */
+    if(!dir->requests && dir->eof) {
+        if(dir->state == LIBSSH2_SFTP_WALK_OPEN) {
+            /* it stays open if the close can't be queued, so that freeing
+               the walk closes it */
+            rc = sftp_walk_queue(sftp, walk, dir, SSH_FXP_CLOSE,
+                                 dir->handle, dir->handle_len);
+            if(!rc)
+                dir->state = LIBSSH2_SFTP_WALK_CLOSING;
+            return rc;
+        }
+        else if(dir->state == LIBSSH2_SFTP_WALK_OPENING) {
+            _libssh2_list_remove(&dir->node);
+            walk->active_count--;
+            LIBSSH2_FREE(session, dir);
+        }
+    }
     return 0;
 }
 
-/* libssh2_sftp_stat_ex
- * Stat a file or symbolic link
+/*
+ * sftp_walk_dispatch
+ *
+ * Hand the replies to requests of the walk that have arrived to
+ * sftp_walk_reply()
  */
-LIBSSH2_API int
-libssh2_sftp_stat_ex(LIBSSH2_SFTP *sftp, const char *path,
-                     unsigned int path_len, int stat_type,
-                     LIBSSH2_SFTP_ATTRIBUTES *attrs)
+static int sftp_walk_dispatch(LIBSSH2_SFTP *sftp, struct sftp_walk *walk)
 {
+    LIBSSH2_SFTP_PACKET *packet = _libssh2_list_first(&sftp->packets);
     int rc;
-    if(!sftp)
-        return LIBSSH2_ERROR_BAD_USE;
-    BLOCK_ADJUST(rc, sftp->channel->session,
-                 sftp_stat(sftp, path, path_len, stat_type, attrs));
-    return rc;
+
+    while(packet) {
+        LIBSSH2_SFTP_PACKET *next = _libssh2_list_next(&packet->node);
+        struct sftp_walk_request *req = NULL;
+
+        if(packet->data[0] != SSH_FXP_VERSION)
+            req = sftp_index_find(&walk->inflight_index, packet->request_id);
+
+        if(req) {
+            unsigned char *data = packet->data;
+            size_t data_len = packet->data_len;
+
+            sftp_index_remove(&sftp->packet_index, packet->request_id);
+            _libssh2_list_remove(&packet->node);
+            sftp_packet_node_release(sftp, packet);
+
+            rc = sftp_walk_reply(sftp, walk, req, data, data_len);
+            if(rc)
+                return rc;
+        }
+        packet = next;
+    }
+    return 0;
 }
 
-/* sftp_symlink
- * Read or set a symlink
+/*
+ * sftp_walk_run
+ *
+ * Walk as far as possible without blocking
  */
-static int sftp_symlink(LIBSSH2_SFTP *sftp, const char *path,
-                        unsigned int path_len, char *target,
-                        unsigned int target_len, int link_type)
+static int sftp_walk_run(LIBSSH2_SFTP *sftp, struct sftp_walk *walk)
 {
     LIBSSH2_CHANNEL *channel = sftp->channel;
     LIBSSH2_SESSION *session = channel->session;
-    size_t data_len, link_len;
-    /* 13 = packet_len(4) + packet_type(1) + request_id(4) + path_len(4) */
-    ssize_t packet_len =
-        path_len + 13 +
-        ((link_type == LIBSSH2_SFTP_SYMLINK) ? (4 + target_len) : 0);
-    unsigned char *s, *data;
-    static const unsigned char link_responses[2] =
-        { SSH_FXP_NAME, SSH_FXP_STATUS };
-    int retcode;
+    struct sftp_walk_dir *dir;
+    struct sftp_walk_request *req;
+    int progress;
+    int rc;
 
-    if ((sftp->version < 3) && (link_type != LIBSSH2_SFTP_REALPATH)) {
-        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                              "Server does not support SYMLINK or READLINK");
-    }
+    do {
+        progress = 0;
 
-    if (sftp->symlink_state == libssh2_NB_state_idle) {
-        s = sftp->symlink_packet = LIBSSH2_ALLOC(session, packet_len);
-        if (!sftp->symlink_packet) {
-            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
-                                  "Unable to allocate memory for "
-                                  "SYMLINK/READLINK/REALPATH packet");
+        /* open more directories, the ones found last first so that the
+           queue stays short */
+        while((walk->active_count < walk->max_dirs) &&
+              ((dir = (struct sftp_walk_dir *)walk->queued.last) != NULL)) {
+            rc = sftp_walk_queue(sftp, walk, dir, SSH_FXP_OPENDIR,
+                                 dir->path, dir->path_len);
+            if(rc)
+                return rc;
+            _libssh2_list_remove(&dir->node);
+            _libssh2_list_add(&walk->active, &dir->node);
+            walk->active_count++;
+            dir->state = LIBSSH2_SFTP_WALK_OPENING;
         }
 
-        _libssh2_debug(session, LIBSSH2_TRACE_SFTP, "%s %s on %s",
-                       (link_type ==
-                        LIBSSH2_SFTP_SYMLINK) ? "Creating" : "Reading",
-                       (link_type ==
-                        LIBSSH2_SFTP_REALPATH) ? "realpath" : "symlink", path);
-
-        _libssh2_store_u32(&s, packet_len - 4);
+        /* keep reading the open ones */
+        for(dir = _libssh2_list_first(&walk->active); dir;
+            dir = _libssh2_list_next(&dir->node)) {
+            while((dir->state == LIBSSH2_SFTP_WALK_OPEN) && !dir->eof &&
+                  (dir->requests < SFTP_WALK_READDIRS)) {
+                rc = sftp_walk_queue(sftp, walk, dir, SSH_FXP_READDIR,
+                                     dir->handle, dir->handle_len);
+                if(rc)
+                    return rc;
+            }
+        }
 
-        switch (link_type) {
-        case LIBSSH2_SFTP_REALPATH:
-            *(s++) = SSH_FXP_REALPATH;
-            break;
+        while((req = _libssh2_list_first(&walk->outgoing)) != NULL) {
+            ssize_t nwritten = sftp_channel_write(sftp, req,
+                                                  &req->packet[req->sent],
+                                                  req->packet_len -
+                                                  req->sent);
+            if(nwritten == LIBSSH2_ERROR_EAGAIN)
+                break;
+            else if(nwritten < 0)
+                return (int)nwritten;
+            else if(!nwritten) {
+                /* no window left, wait for the server to adjust it */
+                _libssh2_session_block(session,
+                                       LIBSSH2_SESSION_BLOCK_INBOUND);
+                break;
+            }
 
-        case LIBSSH2_SFTP_SYMLINK:
-            *(s++) = SSH_FXP_SYMLINK;
-            break;
+            progress = 1;
+            req->sent += nwritten;
+            if(req->sent == req->packet_len) {
+                _libssh2_list_remove(&req->node);
+                _libssh2_list_add(&walk->inflight, &req->node);
+                rc = sftp_index_add(session, &walk->inflight_index,
+                                    req->request_id, req);
+                if(rc)
+                    return rc;
+            }
+        }
 
-        case LIBSSH2_SFTP_READLINK:
-        default:
-            *(s++) = SSH_FXP_READLINK;
+        while((rc = sftp_packet_read(sftp)) != LIBSSH2_ERROR_EAGAIN) {
+            if(rc < 0)
+                return rc;
+            progress = 1;
         }
-        sftp->symlink_request_id = sftp->request_id++;
-        _libssh2_store_u32(&s, sftp->symlink_request_id);
-        _libssh2_store_str(&s, path, path_len);
 
-        if (link_type == LIBSSH2_SFTP_SYMLINK)
-            _libssh2_store_str(&s, target, target_len);
+        rc = sftp_walk_dispatch(sftp, walk);
+        if(rc)
+            return rc;
 
-        sftp->symlink_state = libssh2_NB_state_created;
-    }
+        if(!_libssh2_list_first(&walk->active) &&
+           !_libssh2_list_first(&walk->queued))
+            return 0;
 
-    if (sftp->symlink_state == libssh2_NB_state_created) {
-        ssize_t rc = _libssh2_channel_write(channel, 0, sftp->symlink_packet,
-                                            packet_len);
-        if (rc == LIBSSH2_ERROR_EAGAIN)
-            return rc;
-        else if (packet_len != rc) {
-            LIBSSH2_FREE(session, sftp->symlink_packet);
-            sftp->symlink_packet = NULL;
-            sftp->symlink_state = libssh2_NB_state_idle;
-            return _libssh2_error(session, LIBSSH2_ERROR_SOCKET_SEND,
-                                  "Unable to send SYMLINK/READLINK command");
-        }
-        LIBSSH2_FREE(session, sftp->symlink_packet);
-        sftp->symlink_packet = NULL;
+    } while(progress);
 
-        sftp->symlink_state = libssh2_NB_state_sent;
+    return _libssh2_error(session, LIBSSH2_ERROR_EAGAIN,
+                          "Would block walking the SFTP tree");
+}
+
+/*
+ * sftp_walk_free
+ *
+ * Free a walk and all that is left of it. If 'zombies' is set the channel
+ * is kept: replies still to come are dropped, half-sent requests get
+ * completed and the directories left open are closed.
+ */
+static void sftp_walk_free(LIBSSH2_SFTP *sftp, struct sftp_walk *walk,
+                           int zombies)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct sftp_walk_request *req;
+    struct sftp_walk_dir *dir;
+
+    while((req = _libssh2_list_first(&walk->outgoing)) != NULL) {
+        if(zombies) {
+            if(sftp_packet_abandon(sftp, req, &req->packet[req->sent],
+                                   req->packet_len - req->sent))
+                /* it gets completed, drop the reply */
+                add_zombie_request(sftp, req->request_id);
+            else if(req->type == SSH_FXP_CLOSE)
+                /* the directory is open, close it even so */
+                sftp_leftover_close(sftp, req->dir->handle,
+                                    req->dir->handle_len);
+        }
+        _libssh2_list_remove(&req->node);
+        LIBSSH2_FREE(session, req);
+    }
+    while((req = _libssh2_list_first(&walk->inflight)) != NULL) {
+        /* drop the replies, the handles an open brings get closed */
+        if(zombies)
+            sftp_request_drop(sftp, req->request_id);
+        _libssh2_list_remove(&req->node);
+        LIBSSH2_FREE(session, req);
     }
+    sftp_index_free(session, &walk->inflight_index);
 
-    retcode = sftp_packet_requirev(sftp, 2, link_responses,
-                                   sftp->symlink_request_id, &data,
-                                   &data_len);
-    if (retcode == LIBSSH2_ERROR_EAGAIN)
-        return retcode;
-    else if (retcode) {
-        sftp->symlink_state = libssh2_NB_state_idle;
-        return _libssh2_error(session, retcode,
-                              "Error waiting for status message");
+    while((dir = _libssh2_list_first(&walk->active)) != NULL) {
+        if(zombies && (dir->state == LIBSSH2_SFTP_WALK_OPEN))
+            sftp_leftover_close(sftp, dir->handle, dir->handle_len);
+        _libssh2_list_remove(&dir->node);
+        LIBSSH2_FREE(session, dir);
+    }
+    while((dir = _libssh2_list_first(&walk->queued)) != NULL) {
+        _libssh2_list_remove(&dir->node);
+        LIBSSH2_FREE(session, dir);
     }
 
-    sftp->symlink_state = libssh2_NB_state_idle;
+    if(walk->path)
+        LIBSSH2_FREE(session, walk->path);
+    LIBSSH2_FREE(session, walk);
+}
 
-    if (data[0] == SSH_FXP_STATUS) {
-        int retcode;
+/*
+ * sftp_walk
+ *
+ * Walk the tree below a remote directory, keeping the state in the SFTP
+ * instance while it would block
+ */
+static int sftp_walk(LIBSSH2_SFTP *sftp, const char *path,
+                     unsigned int path_len, unsigned int max_dirs,
+                     unsigned int max_depth,
+                     LIBSSH2_SFTP_WALK_FUNC((*callback)), void *abstract)
+{
+    LIBSSH2_SESSION *session = sftp->channel->session;
+    struct sftp_walk *walk = sftp->walk;
+    int rc;
 
-        retcode = _libssh2_ntohu32(data + 5);
-        LIBSSH2_FREE(session, data);
-        if (retcode == LIBSSH2_FX_OK)
-            return LIBSSH2_ERROR_NONE;
-        else {
-            sftp->last_errno = retcode;
-            return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                                  "SFTP Protocol Error");
+    if(!walk) {
+        walk = LIBSSH2_ALLOC(session, sizeof(struct sftp_walk));
+        if(!walk)
+            return _libssh2_error(session, LIBSSH2_ERROR_ALLOC,
+                                  "Unable to allocate memory for an SFTP "
+                                  "walk");
+        memset(walk, 0, sizeof(struct sftp_walk));
+
+        walk->callback = callback;
+        walk->abstract = abstract;
+        walk->max_dirs = max_dirs ? max_dirs : SFTP_WALK_DIRS;
+        walk->max_depth = max_depth;
+        _libssh2_list_init(&walk->queued);
+        _libssh2_list_init(&walk->active);
+        _libssh2_list_init(&walk->outgoing);
+        _libssh2_list_init(&walk->inflight);
+
+        rc = sftp_walk_add(sftp, walk, path, path_len, 0);
+        if(rc) {
+            LIBSSH2_FREE(session, walk);
+            return rc;
         }
+        sftp->walk = walk;
     }
 
-    if (_libssh2_ntohu32(data + 5) < 1) {
-        LIBSSH2_FREE(session, data);
-        return _libssh2_error(session, LIBSSH2_ERROR_SFTP_PROTOCOL,
-                              "Invalid READLINK/REALPATH response, "
-                              "no name entries");
-    }
+    rc = sftp_walk_run(sftp, walk);
+    if(rc == LIBSSH2_ERROR_EAGAIN)
+        return rc;
 
-    /* this reads a u32 and stores it into a signed 32bit value */
-    link_len = _libssh2_ntohu32(data + 9);
-    if (link_len < target_len) {
-        memcpy(target, data + 13, link_len);
-        target[link_len] = 0;
-        retcode = (int)link_len;
+    sftp->walk = NULL;
+    if(!rc) {
+        /* all done, or stopped by the callback */
+        rc = walk->rc;
+        sftp_walk_free(sftp, walk, 0);
     }
     else
-        retcode = LIBSSH2_ERROR_BUFFER_TOO_SMALL;
-    LIBSSH2_FREE(session, data);
-
-    return retcode;
+        /* requests may still be out after an error */
+        sftp_walk_free(sftp, walk, 1);
+    return rc;
 }
 
-/* libssh2_sftp_symlink_ex
- * Read or set a symlink
+/* libssh2_sftp_walk
+ * Walk the tree below a remote directory
  */
 LIBSSH2_API int
-libssh2_sftp_symlink_ex(LIBSSH2_SFTP *sftp, const char *path,
-                        unsigned int path_len, char *target,
-                        unsigned int target_len, int link_type)
+libssh2_sftp_walk(LIBSSH2_SFTP *sftp, const char *path,
+                  unsigned int path_len, unsigned int max_dirs,
+                  unsigned int max_depth,
+                  LIBSSH2_SFTP_WALK_FUNC((*callback)), void *abstract)
 {
     int rc;
-    if(!sftp)
+
+    if(!sftp || !path || !callback)
         return LIBSSH2_ERROR_BAD_USE;
+
     BLOCK_ADJUST(rc, sftp->channel->session,
-                 sftp_symlink(sftp, path, path_len, target, target_len,
-                              link_type));
+                 sftp_walk(sftp, path, path_len, max_dirs, max_depth,
+                           callback, abstract));
     return rc;
 }
-
-/* libssh2_sftp_last_error
- * Returns the last error code reported by SFTP
- */
-LIBSSH2_API unsigned long
-libssh2_sftp_last_error(LIBSSH2_SFTP *sftp)
-{
-    if(!sftp)
-       return 0;
-
-    return sftp->last_errno;
-}
-
-/* libssh2_sftp_get_channel
- * Return the channel of sftp, then caller can control the channel's behavior.
- */
-LIBSSH2_API LIBSSH2_CHANNEL *
-libssh2_sftp_get_channel(LIBSSH2_SFTP *sftp)
-{
-    if (!sftp)
-        return NULL;
-
-    return sftp->channel;
-}
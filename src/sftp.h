@@ -46,9 +46,39 @@
 #define MAX_SFTP_OUTGOING_SIZE 30000
 
 /* MAX_SFTP_READ_SIZE is how much data is asked for at max in each FXP_READ
- * packets.
+ * packets, unless the server tells it serves larger reads. Servers must not
+ * return less than asked for other than at end of file, and they all handle
+ * this much.
  */
-#define MAX_SFTP_READ_SIZE 2000
+#define MAX_SFTP_READ_SIZE 30000
+
+/* MAX_SFTP_READ_SIZE_LIMIT is the largest FXP_READ size used even when the
+ * server allows more, the FXP_DATA reply has to fit within
+ * LIBSSH2_SFTP_PACKET_MAXLEN
+ */
+#define MAX_SFTP_READ_SIZE_LIMIT (255*1024)
+
+/* MAX_SFTP_READ_AHEAD is the most data sftp_read() asks for ahead of what
+ * the application has read
+ */
+#define MAX_SFTP_READ_AHEAD (8*1024*1024)
+
+/* MAX_SFTP_WRITE_BEHIND is the most data a handle from libssh2_sftp_send()
+ * keeps sent off but not acknowledged by the server
+ */
+#define MAX_SFTP_WRITE_BEHIND (8*1024*1024)
+
+/* MAX_SFTP_READDIR_AHEAD is the most FXP_READDIR requests a directory handle
+ * keeps outstanding
+ */
+#define MAX_SFTP_READDIR_AHEAD 16
+
+/* SFTP_PACKET_POOL_BYTES is how much memory the spare buffers for replies to
+ * FXP_READ requests kept by an SFTP instance may take, and SFTP_PACKET_NODES
+ * how many spare packet list nodes it keeps
+ */
+#define SFTP_PACKET_POOL_BYTES (1024*1024)
+#define SFTP_PACKET_NODES 64
 
 struct sftp_pipeline_chunk {
     struct list_node node;
@@ -57,7 +87,28 @@ struct sftp_pipeline_chunk {
     size_t sent;
     ssize_t lefttosend; /* if 0, the entire packet has been sent off */
     uint32_t request_id;
-    unsigned char packet[1]; /* data */
+    libssh2_uint64_t sent_time; /* READ: _libssh2_time_ms() when the request
+                                   was sent off */
+    libssh2_uint64_t offset; /* WRITE: file offset of the data, which is
+                                taken from the buffer passed to
+                                libssh2_sftp_write() unless 'copied' */
+    char copied; /* WRITE: the data follows the header in 'packet' */
+    unsigned char packet[1]; /* data, for WRITE the header and if 'copied'
+                                the data */
+};
+
+/* An open addressing table that finds an entry by request id, so matching a
+   reply does not cost a walk over everything in flight. It grows with the
+   number of entries and is empty when size is 0. */
+struct sftp_index_slot {
+    uint32_t request_id;
+    void *entry; /* NULL in a free slot */
+};
+
+struct sftp_index {
+    struct sftp_index_slot *slots;
+    unsigned int size; /* a power of two */
+    unsigned int count;
 };
 
 struct sftp_zombie_requests {
@@ -65,6 +116,45 @@ struct sftp_zombie_requests {
     uint32_t request_id;
 };
 
+/* A packet whose owner went away before it was sent, which goes out ahead
+   of the next request. See sftp_channel_write(). */
+struct sftp_leftover {
+    struct list_node node;
+    size_t len;
+    size_t sent;
+    unsigned char packet[1];
+};
+
+/* SFTP_CACHE_ENTRIES is how many paths the attribute cache keeps at most
+ * unless told otherwise
+ */
+#define SFTP_CACHE_ENTRIES 4096
+
+/* An entry of the attribute cache, in a bucket of the hash table and in the
+   list of entries in the order they were stored */
+struct sftp_cache_entry {
+    struct list_node node;
+    struct sftp_cache_entry *next; /* in the same bucket */
+    unsigned int hash; /* of the path */
+    int lstat; /* what LSTAT rather than STAT found */
+    libssh2_uint64_t stored; /* _libssh2_time_ms() */
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    size_t path_len;
+    char path[1]; /* zero terminated */
+};
+
+/* The attribute cache of an SFTP instance, see libssh2_sftp_cache_config().
+   As all entries live equally long, the oldest one in the list is the first
+   to expire. */
+struct sftp_cache {
+    unsigned long ttl; /* ms, 0 when the cache is off */
+    unsigned int max_entries;
+    unsigned int count;
+    struct list_head entries; /* the oldest first */
+    struct sftp_cache_entry **buckets;
+    unsigned int size; /* number of buckets, a power of two */
+};
+
 #ifndef MIN
 #define MIN(x,y) ((x)<(y)?(x):(y))
 #endif
@@ -90,6 +180,11 @@ struct _LIBSSH2_SFTP_HANDLE
     char handle[SFTP_HANDLE_MAXLEN];
     size_t handle_len;
 
+    /* the path it was opened with, for the attribute cache. NULL if there
+       was no memory for it. */
+    char *path;
+    size_t path_len;
+
     enum {
         LIBSSH2_SFTP_HANDLE_FILE,
         LIBSSH2_SFTP_HANDLE_DIR
@@ -114,12 +209,47 @@ struct _LIBSSH2_SFTP_HANDLE
             size_t data_left;
 
             char eof; /* we have read to the end */
+
+            /* sftp_read() keeps 'read_ahead' bytes asked for ahead of the
+               application. It is adapted towards twice the delivery rate
+               times the lowest round trip time seen, which is enough to
+               keep the link busy. */
+            size_t read_ahead;
+            unsigned long rtt_min; /* ms, 0 until measured */
+            libssh2_uint64_t rate_start; /* _libssh2_time_ms() */
+            size_t rate_bytes; /* data received since 'rate_start' */
+
+            /* Handles from libssh2_sftp_send() and libssh2_sftp_recv() know
+               the size of the whole transfer up front. A send handle copies
+               the data into 'merge' until a full FXP_WRITE worth is collected
+               or the declared size is reached, and reports it written once
+               copied. A recv handle reads ahead as deep as the file allows
+               from the start. */
+            enum {
+                LIBSSH2_SFTP_TRANSFER_NONE,
+                LIBSSH2_SFTP_TRANSFER_SEND,
+                LIBSSH2_SFTP_TRANSFER_RECV
+            } transfer;
+            libssh2_uint64_t transfer_size; /* 0 if unknown */
+            struct sftp_pipeline_chunk *merge;
+            int send_error; /* a write refused while closing, returned once
+                               the handle is closed */
+
+            char written; /* data was written, which may still be on its way
+                             to the file when the handle is closed */
         } file;
         struct _libssh2_sftp_handle_dir_data
         {
             uint32_t names_left;
             void *names_packet;
             char *next_name;
+            char *names_end; /* end of names_packet */
+
+            /* The READDIR requests in packet_list are kept 'depth' deep,
+               which starts at one and doubles with every NAME reply up to
+               MAX_SFTP_READDIR_AHEAD. None are sent after 'eof'. */
+            unsigned int depth;
+            char eof;
         } dir;
     } u;
 
@@ -133,16 +263,157 @@ struct _LIBSSH2_SFTP_HANDLE
 
 };
 
+/* A request of a batch transfer, with its packet until it is sent off */
+struct sftp_batch_request {
+    struct list_node node; /* in the outgoing or the inflight list */
+    struct sftp_batch_file *file;
+    uint32_t request_id;
+    unsigned char type; /* SSH_FXP_OPEN, READ, WRITE or CLOSE */
+    libssh2_uint64_t offset; /* READ/WRITE: where the data goes */
+    size_t len; /* READ/WRITE: size of the data */
+    size_t packet_len;
+    size_t sent;
+    unsigned char packet[1];
+};
+
+/* A file of a batch transfer */
+struct sftp_batch_file {
+    struct list_node node; /* in the queued or the active list */
+    int put; /* upload rather than download */
+    int range; /* only the part up to 'size' from where 'offset' started */
+    enum {
+        LIBSSH2_SFTP_BATCH_QUEUED,
+        LIBSSH2_SFTP_BATCH_OPENING,
+        LIBSSH2_SFTP_BATCH_OPEN,
+        LIBSSH2_SFTP_BATCH_CLOSING
+    } state;
+    char *path;
+    unsigned int path_len;
+    long mode;
+    libssh2_uint64_t size; /* put, or a range: where the data ends */
+    libssh2_uint64_t offset; /* next data to ask for or send */
+    char eof; /* get: the server said EOF, there is no more to ask for */
+    unsigned int depth; /* get: FXP_READs to keep in flight, doubled with
+                           every full one answered so that small files don't
+                           get lots of reads past their end */
+    int rc; /* the first error, which ends the transfer of this file */
+    uint32_t status; /* SFTP status code that came with 'rc' */
+    unsigned int requests; /* outgoing and in flight */
+    char handle[SFTP_HANDLE_MAXLEN];
+    size_t handle_len;
+    LIBSSH2_SFTP_BATCH_DATA_FUNC((*data));
+    LIBSSH2_SFTP_BATCH_DONE_FUNC((*done));
+    void *abstract;
+};
+
+struct _LIBSSH2_SFTP_BATCH
+{
+    LIBSSH2_SFTP *sftp;
+
+    unsigned int max_files; /* files open at once */
+    size_t max_bytes; /* data asked for or sent but not answered */
+
+    struct list_head queued; /* files not started yet */
+    struct list_head active; /* files being opened, moved or closed */
+    unsigned int active_count;
+
+    struct list_head outgoing; /* requests to send, in order */
+    struct list_head inflight; /* requests sent, waiting for a reply */
+    struct sftp_index inflight_index; /* the inflight list by request id */
+    size_t outstanding; /* data of the READ and WRITE requests */
+};
+
+/* A request of a tree walk, with its packet */
+struct sftp_walk_request {
+    struct list_node node; /* in the outgoing or the inflight list */
+    struct sftp_walk_dir *dir;
+    uint32_t request_id;
+    unsigned char type; /* SSH_FXP_OPENDIR, READDIR, LSTAT or CLOSE */
+    size_t packet_len;
+    size_t sent;
+    unsigned char packet[1]; /* LSTAT: the path of the entry is kept here */
+};
+
+/* A directory of a tree walk */
+struct sftp_walk_dir {
+    struct list_node node; /* in the walk's queued or active list */
+    enum {
+        LIBSSH2_SFTP_WALK_QUEUED,
+        LIBSSH2_SFTP_WALK_OPENING,
+        LIBSSH2_SFTP_WALK_OPEN,
+        LIBSSH2_SFTP_WALK_CLOSING
+    } state;
+    unsigned int depth; /* 0 where the walk starts */
+    unsigned int requests; /* queued or sent, not answered */
+    char eof; /* no more READDIR requests to send */
+    char handle[SFTP_HANDLE_MAXLEN];
+    size_t handle_len;
+    size_t path_len;
+    char path[1]; /* zero terminated */
+};
+
+/* State of libssh2_sftp_walk() */
+struct sftp_walk
+{
+    LIBSSH2_SFTP_WALK_FUNC((*callback));
+    void *abstract;
+    unsigned int max_dirs; /* directories open at once */
+    unsigned int max_depth; /* 0 for no limit */
+
+    struct list_head queued; /* directories found, the newest last */
+    struct list_head active; /* directories being opened, read or closed */
+    unsigned int active_count;
+
+    struct list_head outgoing; /* requests to send, in order */
+    struct list_head inflight; /* requests sent, waiting for a reply */
+    struct sftp_index inflight_index; /* the inflight list by request id */
+
+    char *path; /* where the path of an entry is put together */
+    size_t path_size;
+
+    int rc; /* what the callback stopped the walk with */
+};
+
 struct _LIBSSH2_SFTP
 {
     LIBSSH2_CHANNEL *channel;
 
     uint32_t request_id, version;
 
+    /* Size of the FXP_READ requests, raised if the server tells it handles
+       more than MAX_SFTP_READ_SIZE */
+    uint32_t read_size;
+    uint32_t limits_request_id;
+
     struct list_head packets;
+    struct sftp_index packet_index; /* the packets list by request id */
+
+    /* Spare buffers for received packets of more than half of pool_size,
+       chained through their first bytes, and spare packet list nodes. See
+       sftp_packet_alloc(). pool_size stays 0 until the instance is set up. */
+    size_t pool_size;
+    unsigned char *pool;
+    unsigned int pool_count;
+    struct list_head pool_nodes;
+    unsigned int pool_nodes_count;
 
     /* List of FXP_READ responses to ignore because EOF already received. */
     struct list_head zombie_requests;
+    struct sftp_index zombie_index;
+
+    /* The packet being sent, which nothing may come in the middle of: who
+       it belongs to and how much of it is left, 0 between two packets */
+    const void *send_owner;
+    size_t send_left;
+
+    /* Packets to send before the next request: the rest of one its owner
+       gave up on half way through, and the FXP_CLOSE of handles nobody
+       holds any more. 'leftover_busy' is set while the channel holds a
+       write of the first one. */
+    struct sftp_leftover *leftover_rest;
+    struct list_head leftovers;
+    char leftover_busy;
+    char broken; /* a packet was cut short, the server is out of sync */
 
     /* a list of _LIBSSH2_SFTP_HANDLE structs */
     struct list_head sftp_handles;
@@ -156,8 +427,18 @@ struct _LIBSSH2_SFTP
     uint32_t partial_len;               /* Desired number of bytes */
     size_t partial_received;            /* Bytes received so far   */
 
-    /* Time that libssh2_sftp_packet_requirev() started reading */
-    time_t requirev_start;
+    /* Time that libssh2_sftp_packet_requirev() started reading, in
+       _libssh2_time_ms() */
+    libssh2_uint64_t requirev_start;
+
+    /* State of libssh2_sftp_walk() */
+    struct sftp_walk *walk;
+
+    struct sftp_cache cache;
+
+    /* State variables used in libssh2_sftp_recv() */
+    libssh2_nonblocking_states recv_state;
+    LIBSSH2_SFTP_HANDLE *recv_handle;
 
     /* State variables used in libssh2_sftp_open_ex() */
     libssh2_nonblocking_states open_state;
@@ -175,16 +456,16 @@ struct _LIBSSH2_SFTP
     /* State variable used in sftp_write() */
     libssh2_nonblocking_states write_state;
 
+    /* Last pump pass a read and a write request on this SFTP instance had
+       to wait in */
+    unsigned long request_read_mark;
+    unsigned long request_write_mark;
+
     /* State variables used in sftp_fsync() */
     libssh2_nonblocking_states fsync_state;
     unsigned char *fsync_packet;
     uint32_t fsync_request_id;
 
-    /* State variables used in libssh2_sftp_readdir() */
-    libssh2_nonblocking_states readdir_state;
-    unsigned char *readdir_packet;
-    uint32_t readdir_request_id;
-
     /* State variables used in libssh2_sftp_fstat_ex() */
     libssh2_nonblocking_states fstat_state;
     unsigned char *fstat_packet;
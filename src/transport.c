@@ -49,6 +49,7 @@
 #include <assert.h>
 
 #include "transport.h"
+#include "session.h"
 #include "mac.h"
 
 #define MAX_BLOCKSIZE 32    /* MUST fit biggest crypto block size we use/get */
@@ -138,22 +139,19 @@ decrypt(LIBSSH2_SESSION * session, unsigned char *source,
        we risk losing those extra bytes */
     assert((len % blocksize) == 0);
 
-    while (len >= blocksize) {
-        if (session->remote.crypt->crypt(session, source, blocksize,
-                                         &session->remote.crypt_abstract)) {
-            LIBSSH2_FREE(session, p->payload);
-            return LIBSSH2_ERROR_DECRYPT;
-        }
+    /* all complete blocks in one go, the cipher call overhead is paid once
+       per read instead of once per block */
+    if (session->remote.crypt->crypt(session, source, len,
+                                     &session->remote.crypt_abstract)) {
+        LIBSSH2_FREE(session, p->payload);
+        return LIBSSH2_ERROR_DECRYPT;
+    }
 
-        /* if the crypt() function would write to a given address it
-           wouldn't have to memcpy() and we could avoid this memcpy()
-           too */
-        memcpy(dest, source, blocksize);
+    /* if the crypt() function would write to a given address it
+       wouldn't have to memcpy() and we could avoid this memcpy()
+       too */
+    memcpy(dest, source, len);
 
-        len -= blocksize;       /* less bytes left */
-        dest += blocksize;      /* advance write pointer */
-        source += blocksize;    /* advance read pointer */
-    }
     return LIBSSH2_ERROR_NONE;         /* all is fine */
 }
 
@@ -282,6 +280,10 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
     /* default clear the bit */
     session->socket_block_directions &= ~LIBSSH2_SESSION_BLOCK_INBOUND;
 
+    /* queued zerocopy notices keep the socket flagged with an error, which
+       wakes up the application until they are read */
+    _libssh2_transport_zerocopy_reap(session);
+
     /*
      * All channels, systems, subsystems, etc eventually make it down here
      * when looking for more incoming data. If a key exchange is going on
@@ -363,24 +365,24 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
             /* now read a big chunk from the network into the temp buffer */
             nread =
                 LIBSSH2_RECV(session, &p->buf[remainbuf],
-                              PACKETBUFSIZE - remainbuf,
+                              p->bufsize - remainbuf,
                               LIBSSH2_SOCKET_RECV_FLAGS(session));
             if (nread <= 0) {
                 /* check if this is due to EAGAIN and return the special
                    return code if so, error out normally otherwise */
                 if ((nread < 0) && (nread == -EAGAIN)) {
-                    session->socket_block_directions |=
-                        LIBSSH2_SESSION_BLOCK_INBOUND;
+                    _libssh2_session_block(session,
+                                           LIBSSH2_SESSION_BLOCK_INBOUND);
                     return LIBSSH2_ERROR_EAGAIN;
                 }
                 _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
                                "Error recving %d bytes (got %d)",
-                               PACKETBUFSIZE - remainbuf, -nread);
+                               (int)(p->bufsize - remainbuf), -nread);
                 return LIBSSH2_ERROR_SOCKET_RECV;
             }
             _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
                            "Recved %d/%d bytes to %p+%d", nread,
-                           PACKETBUFSIZE - remainbuf, p->buf, remainbuf);
+                           (int)(p->bufsize - remainbuf), p->buf, remainbuf);
 
             debugdump(session, "libssh2_transport_read() raw",
                       &p->buf[remainbuf], nread);
@@ -404,8 +406,8 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
                    check is only done for the initial block since once we have
                    got the start of a block we can in fact deal with fractions
                 */
-                session->socket_block_directions |=
-                    LIBSSH2_SESSION_BLOCK_INBOUND;
+                _libssh2_session_block(session,
+                                       LIBSSH2_SESSION_BLOCK_INBOUND);
                 return LIBSSH2_ERROR_EAGAIN;
             }
 
@@ -587,6 +589,251 @@ int _libssh2_transport_read(LIBSSH2_SESSION * session)
     return LIBSSH2_ERROR_SOCKET_RECV; /* we never reach this point */
 }
 
+#ifdef LIBSSH2_ZEROCOPY
+/*
+ * zerocopy_buffer
+ *
+ * Return a ring buffer to build a packet with 'len' bytes of payload in, or
+ * NULL if the packet should rather be built in outbuf and copied by send.
+ */
+static unsigned char *
+zerocopy_buffer(LIBSSH2_SESSION *session, size_t len)
+{
+    struct transportpacket *p = &session->packet;
+    struct zerocopy_buffer *zc;
+
+    /* only the default send callback is known to pass the flag on */
+    if(!session->flag.zerocopy || (len < ZEROCOPY_MIN) || session->io ||
+       (session->send != _libssh2_send))
+        return NULL;
+
+    if(!p->zerocopy) {
+        int on = 1;
+
+        p->zerocopy = setsockopt(session->socket_fd, SOL_SOCKET, SO_ZEROCOPY,
+                                 (void *)&on, sizeof(on)) ? -1 : 1;
+        _libssh2_debug(session, LIBSSH2_TRACE_SOCKET, "Zerocopy send %s",
+                       (p->zerocopy > 0) ? "enabled" : "not available");
+    }
+    if(p->zerocopy < 0)
+        return NULL;
+
+    if(p->zc_pending)
+        _libssh2_transport_zerocopy_reap(session);
+
+    zc = &p->zc[p->zc_next];
+    if(zc->pending)
+        /* the kernel isn't done with it, rather copy than wait */
+        return NULL;
+
+    if(!zc->data) {
+        zc->data = LIBSSH2_ALLOC(session, MAX_SSH_PACKET_LEN);
+        if(!zc->data)
+            return NULL;
+    }
+    zc->sends = 0;
+
+    return zc->data;
+}
+
+/*
+ * zerocopy_complete
+ *
+ * The kernel has completed the sends with ids 'lo' to 'hi', release the
+ * buffers they were made from.
+ */
+static void
+zerocopy_complete(struct transportpacket *p, uint32_t lo, uint32_t hi)
+{
+    unsigned int i;
+
+    for(i = 0; i < ZEROCOPY_BUFFERS; i++) {
+        struct zerocopy_buffer *zc = &p->zc[i];
+        /* positions relative to the buffer's first id, ids wrap around */
+        int32_t from = (int32_t)(lo - zc->first);
+        int32_t to = (int32_t)(hi - zc->first);
+
+        if(!zc->pending)
+            continue;
+
+        if(from < 0)
+            from = 0;
+        if(to > (int32_t)zc->sends - 1)
+            to = (int32_t)zc->sends - 1;
+        if(to < from)
+            continue;
+
+        zc->pending -= (uint32_t)(to - from + 1);
+        if(!zc->pending)
+            p->zc_pending--;
+    }
+}
+
+/*
+ * zerocopy_reap
+ *
+ * Read the completion notices queued on the socket. Returns the number of
+ * notices read, or -1 if the error queue can't be read at all, as when the
+ * socket has been closed already.
+ */
+static int
+zerocopy_reap(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+    int reaped = 0;
+
+    while(p->zc_pending) {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cm;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        /* reading the error queue never blocks */
+        if(recvmsg(session->socket_fd, &msg, MSG_ERRQUEUE) < 0) {
+            if((errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+               (errno != EINTR) && !reaped)
+                return -1;
+            break;
+        }
+
+        for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr;
+
+            if(!((cm->cmsg_level == IPPROTO_IP &&
+                  cm->cmsg_type == IP_RECVERR) ||
+                 (cm->cmsg_level == IPPROTO_IPV6 &&
+                  cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if(serr->ee_errno || (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY))
+                continue;
+
+            zerocopy_complete(p, serr->ee_info, serr->ee_data);
+            reaped++;
+
+            /* when the kernel keeps falling back to copying, as it does on
+               loopback, the notices only add cost */
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                if(++p->zc_copied == ZEROCOPY_BUFFERS) {
+                    _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
+                                   "Zerocopy sends get copied, disabled");
+                    p->zerocopy = -1;
+                }
+            }
+            else
+                p->zc_copied = 0;
+        }
+    }
+
+    return reaped;
+}
+
+int
+_libssh2_transport_zerocopy_reap(LIBSSH2_SESSION *session)
+{
+    return zerocopy_reap(session) > 0;
+}
+
+int
+_libssh2_transport_zerocopy_free(LIBSSH2_SESSION *session)
+{
+    struct transportpacket *p = &session->packet;
+    unsigned int i;
+
+    /* the kernel may still be sending the last packets from these buffers,
+       reusing the memory before it completes them would change the data on
+       the wire */
+    if(p->zc_pending && (zerocopy_reap(session) >= 0) && p->zc_pending)
+        return LIBSSH2_ERROR_EAGAIN;
+
+    for(i = 0; i < ZEROCOPY_BUFFERS; i++) {
+        struct zerocopy_buffer *zc = &p->zc[i];
+
+        if(!zc->data)
+            continue;
+        if(zc->pending) {
+            /* the socket is gone and with it any word on when the kernel
+               is done, so the buffer is left to it for good */
+            _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
+                           "Zerocopy buffer %u left with %u sends pending",
+                           i, zc->pending);
+        }
+        else
+            LIBSSH2_FREE(session, zc->data);
+        zc->data = NULL;
+    }
+
+    return 0;
+}
+#else
+int
+_libssh2_transport_zerocopy_reap(LIBSSH2_SESSION *session)
+{
+    (void)session;
+    return 0;
+}
+
+int
+_libssh2_transport_zerocopy_free(LIBSSH2_SESSION *session)
+{
+    (void)session;
+    return 0;
+}
+#endif /* LIBSSH2_ZEROCOPY */
+
+/*
+ * send_packet
+ *
+ * Send (part of) the packet being built in p->obuf.
+ */
+static ssize_t
+send_packet(LIBSSH2_SESSION *session, const unsigned char *buf, size_t len)
+{
+#ifdef LIBSSH2_ZEROCOPY
+    struct transportpacket *p = &session->packet;
+
+    if(p->obuf != p->outbuf) {
+        struct zerocopy_buffer *zc = &p->zc[p->zc_next];
+        ssize_t rc = _libssh2_send(session->socket_fd, buf, len,
+                                   LIBSSH2_SOCKET_SEND_FLAGS(session) |
+                                   MSG_ZEROCOPY, &session->abstract);
+        if(rc >= 0) {
+            /* every successful send gets the next id */
+            if(!zc->sends++)
+                zc->first = p->zc_next_id;
+            if(!zc->pending++)
+                p->zc_pending++;
+            p->zc_next_id++;
+            return rc;
+        }
+        if(rc != -ENOBUFS)
+            return rc;
+        /* out of memory to pin pages with, this part gets copied */
+    }
+#endif
+    return LIBSSH2_SEND(session, buf, len, LIBSSH2_SOCKET_SEND_FLAGS(session));
+}
+
+/*
+ * packet_sent
+ *
+ * The packet in p->obuf has been sent completely.
+ */
+static void
+packet_sent(struct transportpacket *p)
+{
+#ifdef LIBSSH2_ZEROCOPY
+    if(p->obuf != p->outbuf)
+        /* the buffer stays held until the kernel completes the sends */
+        p->zc_next = (p->zc_next + 1) % ZEROCOPY_BUFFERS;
+#endif
+    p->obuf = p->outbuf;
+}
+
 static int
 send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
               size_t data_len, ssize_t *ret)
@@ -594,6 +841,8 @@ send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
     ssize_t rc;
     ssize_t length;
     struct transportpacket *p = &session->packet;
+    /* the call that made the packet was abandoned, anyone completes it */
+    int orphan = !p->odata;
 
     if (!p->olen) {
         *ret = 0;
@@ -601,7 +850,14 @@ send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
     }
 
     /* send as much as possible of the existing packet */
-    if ((data != p->odata) || (data_len != p->olen)) {
+    if (!orphan && ((data != p->odata) || (data_len != p->olen))) {
+        if (session->lock_waiters) {
+            /* a thread waiting for the socket left this packet, which has
+               to go out before this one */
+            _libssh2_session_block(session, LIBSSH2_SESSION_BLOCK_OUTBOUND);
+            return LIBSSH2_ERROR_EAGAIN;
+        }
+
         /* When we are about to complete the sending of a packet, it is vital
            that the caller doesn't try to send a new/different packet since
            we don't add this one up until the previous one has been sent. To
@@ -610,28 +866,30 @@ send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
         return LIBSSH2_ERROR_BAD_USE;
     }
 
-    *ret = 1;                   /* set to make our parent return */
+    /* set to make our parent return, unless the packet is an orphan and
+       the caller's own packet goes out after it */
+    *ret = !orphan;
 
     /* number of bytes left to send */
     length = p->ototal_num - p->osent;
 
-    rc = LIBSSH2_SEND(session, &p->outbuf[p->osent], length,
-                       LIBSSH2_SOCKET_SEND_FLAGS(session));
+    rc = send_packet(session, &p->obuf[p->osent], length);
     if (rc < 0)
         _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
                        "Error sending %d bytes: %d", length, -rc);
     else {
         _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
-                       "Sent %d/%d bytes at %p+%d", rc, length, p->outbuf,
+                       "Sent %d/%d bytes at %p+%d", rc, length, p->obuf,
                        p->osent);
         debugdump(session, "libssh2_transport_write send()",
-                  &p->outbuf[p->osent], rc);
+                  &p->obuf[p->osent], rc);
     }
 
     if (rc == length) {
         /* the remainder of the package was sent */
         p->ototal_num = 0;
         p->olen = 0;
+        packet_sent(p);
         /* we leave *ret set so that the parent returns as we MUST return back
            a send success now, so that we don't risk sending EAGAIN later
            which then would confuse the parent function */
@@ -644,7 +902,7 @@ send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
             /* send failure! */
             return LIBSSH2_ERROR_SOCKET_SEND;
 
-        session->socket_block_directions |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
+        _libssh2_session_block(session, LIBSSH2_SESSION_BLOCK_OUTBOUND);
         return LIBSSH2_ERROR_EAGAIN;
     }
 
@@ -653,6 +911,20 @@ send_existing(LIBSSH2_SESSION *session, const unsigned char *data,
     return rc < length ? LIBSSH2_ERROR_EAGAIN : LIBSSH2_ERROR_NONE;
 }
 
+/*
+ * _libssh2_transport_orphan
+ *
+ * The call that got EAGAIN from _libssh2_transport_send() will not call it
+ * again. The rest of its packet is sent before the next packet, whoever
+ * sends that.
+ */
+void
+_libssh2_transport_orphan(LIBSSH2_SESSION *session)
+{
+    if(session->packet.olen)
+        session->packet.odata = NULL;
+}
+
 /*
  * libssh2_transport_send
  *
@@ -690,6 +962,7 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
     int compressed;
     ssize_t ret;
     int rc;
+    unsigned char *buf;
     const unsigned char *orgdata = data;
     size_t orgdata_len = data_len;
 
@@ -729,6 +1002,14 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
 
     encrypted = (session->state & LIBSSH2_STATE_NEWKEYS) ? 1 : 0;
 
+    /* build the packet right where it is going to be sent from */
+#ifdef LIBSSH2_ZEROCOPY
+    buf = zerocopy_buffer(session, data_len + data2_len);
+    if(!buf)
+#endif
+        buf = p->outbuf;
+    p->obuf = buf;
+
     compressed =
         session->local.comp != NULL &&
         session->local.comp->compress &&
@@ -744,7 +1025,7 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
 
         /* compress directly to the target buffer */
         rc = session->local.comp->comp(session,
-                                       &p->outbuf[5], &dest_len,
+                                       &buf[5], &dest_len,
                                        data, data_len,
                                        &session->local.comp_abstract);
         if(rc)
@@ -756,7 +1037,7 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
             dest2_len -= dest_len;
 
             rc = session->local.comp->comp(session,
-                                           &p->outbuf[5+dest_len], &dest2_len,
+                                           &buf[5+dest_len], &dest2_len,
                                            data2, data2_len,
                                            &session->local.comp_abstract);
         }
@@ -774,9 +1055,9 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
             return LIBSSH2_ERROR_INVAL;
 
         /* copy the payload data */
-        memcpy(&p->outbuf[5], data, data_len);
+        memcpy(&buf[5], data, data_len);
         if(data2 && data2_len)
-            memcpy(&p->outbuf[5+data_len], data2, data2_len);
+            memcpy(&buf[5+data_len], data2, data2_len);
         data_len += data2_len; /* use the combined length */
     }
 
@@ -822,53 +1103,47 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
 
     /* store packet_length, which is the size of the whole packet except
        the MAC and the packet_length field itself */
-    _libssh2_htonu32(p->outbuf, packet_length - 4);
+    _libssh2_htonu32(buf, packet_length - 4);
     /* store padding_length */
-    p->outbuf[4] = padding_length;
+    buf[4] = padding_length;
 
     /* fill the padding area with random junk */
-    _libssh2_random(p->outbuf + 5 + data_len, padding_length);
+    _libssh2_random(buf + 5 + data_len, padding_length);
 
     if (encrypted) {
-        size_t i;
-
         /* Calculate MAC hash. Put the output at index packet_length,
            since that size includes the whole packet. The MAC is
            calculated on the entire unencrypted packet, including all
            fields except the MAC field itself. */
-        session->local.mac->hash(session, p->outbuf + packet_length,
-                                 session->local.seqno, p->outbuf,
+        session->local.mac->hash(session, buf + packet_length,
+                                 session->local.seqno, buf,
                                  packet_length, NULL, 0,
                                  &session->local.mac_abstract);
 
-        /* Encrypt the whole packet data, one block size at a time.
-           The MAC field is not encrypted. */
-        for(i = 0; i < packet_length; i += session->local.crypt->blocksize) {
-            unsigned char *ptr = &p->outbuf[i];
-            if (session->local.crypt->crypt(session, ptr,
-                                            session->local.crypt->blocksize,
-                                            &session->local.crypt_abstract))
-                return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
-        }
+        /* Encrypt the whole packet data in a single call, packet_length
+           is a multiple of the block size. The MAC field is not
+           encrypted. */
+        if (session->local.crypt->crypt(session, buf, packet_length,
+                                        &session->local.crypt_abstract))
+            return LIBSSH2_ERROR_ENCRYPT;     /* encryption failure */
     }
 
     session->local.seqno++;
 
-    ret = LIBSSH2_SEND(session, p->outbuf, total_length,
-                        LIBSSH2_SOCKET_SEND_FLAGS(session));
+    ret = send_packet(session, buf, total_length);
     if (ret < 0)
         _libssh2_debug(session, LIBSSH2_TRACE_SOCKET,
                        "Error sending %d bytes: %d", total_length, -ret);
     else {
         _libssh2_debug(session, LIBSSH2_TRACE_SOCKET, "Sent %d/%d bytes at %p",
-                       ret, total_length, p->outbuf);
-        debugdump(session, "libssh2_transport_write send()", p->outbuf, ret);
+                       ret, total_length, buf);
+        debugdump(session, "libssh2_transport_write send()", buf, ret);
     }
 
     if (ret != total_length) {
         if (ret >= 0 || ret == -EAGAIN) {
             /* the whole packet could not be sent, save the rest */
-            session->socket_block_directions |= LIBSSH2_SESSION_BLOCK_OUTBOUND;
+            _libssh2_session_block(session, LIBSSH2_SESSION_BLOCK_OUTBOUND);
             p->odata = orgdata;
             p->olen = orgdata_len;
             p->osent = ret <= 0 ? 0 : ret;
@@ -881,6 +1156,7 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
     /* the whole thing got sent away */
     p->odata = NULL;
     p->olen = 0;
+    packet_sent(p);
 
     return LIBSSH2_ERROR_NONE;         /* all is good */
 }
@@ -67,6 +67,14 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
                             const unsigned char *data, size_t data_len,
                             const unsigned char *data2, size_t data2_len);
 
+/*
+ * _libssh2_transport_orphan
+ *
+ * Let the next packet sent complete the partly sent one, whose caller gave
+ * up on it.
+ */
+void _libssh2_transport_orphan(LIBSSH2_SESSION *session);
+
 /*
  * _libssh2_transport_read
  *
@@ -84,4 +92,21 @@ int _libssh2_transport_send(LIBSSH2_SESSION *session,
  */
 int _libssh2_transport_read(LIBSSH2_SESSION * session);
 
+/*
+ * _libssh2_transport_zerocopy_reap
+ *
+ * Collect the kernel's completion notices for zerocopy sends, releasing the
+ * buffers it is done with. Returns non-zero if any notice was read.
+ */
+int _libssh2_transport_zerocopy_reap(LIBSSH2_SESSION *session);
+
+/*
+ * _libssh2_transport_zerocopy_free
+ *
+ * Free the zerocopy buffers. Returns LIBSSH2_ERROR_EAGAIN while the kernel
+ * still has sends from them to complete; the notice that it has completed
+ * them flags the socket with an error, which poll() always reports.
+ */
+int _libssh2_transport_zerocopy_free(LIBSSH2_SESSION *session);
+
 #endif /* __LIBSSH2_TRANSPORT_H */
@@ -0,0 +1,255 @@
+/* Copyright (c) 2026 The libssh2 project and its contributors.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* Checks of requests cancelled from the completion callbacks run by
+   libssh2_session_pump(). The requests run stand-in calls on dummy
+   objects, so no connection is needed. */
+#include "libssh2_priv.h"
+
+#include <stdio.h>
+
+#define CHECK(cond)                                                 \
+    do {                                                            \
+        if(!(cond)) {                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",            \
+                    __FILE__, __LINE__, #cond);                     \
+            return 1;                                               \
+        }                                                           \
+    } while(0)
+
+/* a stand-in for a channel or SFTP instance */
+struct object {
+    unsigned long mark;
+    int eagain;         /* times its calls return EAGAIN before they finish */
+    int cancelled;      /* times the cancel hook ran */
+};
+
+/* what a request did */
+struct result {
+    int runs;
+    int calls;          /* of the callback */
+    ssize_t rc;
+    struct object *cancel;  /* cancel the requests of this one when done */
+    struct result *submit;  /* queue a request with this when done */
+};
+
+static struct object objects[3];
+
+static ssize_t run(LIBSSH2_REQUEST *request)
+{
+    struct object *object = request->object;
+    struct result *result = request->data;
+
+    result->runs++;
+    if(object->eagain) {
+        object->eagain--;
+        return LIBSSH2_ERROR_EAGAIN;
+    }
+    return (ssize_t)request->length;
+}
+
+static void cancel(LIBSSH2_REQUEST *request)
+{
+    struct object *object = request->object;
+
+    object->cancelled++;
+}
+
+static int submit(LIBSSH2_SESSION *session, struct object *object,
+                  size_t length, struct result *result);
+
+static LIBSSH2_COMPLETE_FUNC(done)
+{
+    struct result *result = data;
+
+    result->calls++;
+    result->rc = rc;
+    if(result->cancel)
+        _libssh2_request_cancel(session, result->cancel);
+    if(result->submit)
+        submit(session, &objects[2], 7, result->submit);
+
+    /* pumping from a callback run by a pump is refused */
+    if(session->request_pumping &&
+       (libssh2_session_pump(session) != LIBSSH2_ERROR_BAD_USE))
+        result->rc = -1000;
+}
+
+static int submit(LIBSSH2_SESSION *session, struct object *object,
+                  size_t length, struct result *result)
+{
+    LIBSSH2_REQUEST request;
+
+    memset(&request, 0, sizeof(request));
+    request.object = object;
+    request.mark = &object->mark;
+    request.run = run;
+    request.cancel = cancel;
+    request.length = length;
+    request.callback = done;
+    request.data = result;
+    return _libssh2_request_submit(session, &request);
+}
+
+static int test_cancel_later(LIBSSH2_SESSION *session)
+{
+    struct result r[5];
+
+    memset(objects, 0, sizeof(objects));
+    memset(r, 0, sizeof(r));
+
+    /* the first request cancels those on another object queued behind it,
+       which must not run */
+    r[0].cancel = &objects[1];
+    CHECK(!submit(session, &objects[0], 10, &r[0]));
+    CHECK(!submit(session, &objects[1], 11, &r[1]));
+    CHECK(!submit(session, &objects[1], 12, &r[2]));
+    CHECK(!submit(session, &objects[2], 13, &r[3]));
+    CHECK(!submit(session, &objects[1], 14, &r[4]));
+
+    CHECK(libssh2_session_pump(session) == 0);
+    CHECK((r[0].runs == 1) && (r[0].calls == 1) && (r[0].rc == 10));
+    CHECK((r[1].runs == 0) && (r[1].calls == 1) &&
+          (r[1].rc == LIBSSH2_ERROR_CANCELLED));
+    CHECK((r[2].runs == 0) && (r[2].calls == 1) &&
+          (r[2].rc == LIBSSH2_ERROR_CANCELLED));
+    CHECK((r[3].runs == 1) && (r[3].calls == 1) && (r[3].rc == 13));
+    CHECK((r[4].runs == 0) && (r[4].calls == 1) &&
+          (r[4].rc == LIBSSH2_ERROR_CANCELLED));
+    CHECK(!objects[1].cancelled);
+    CHECK(!session->request_count);
+    return 0;
+}
+
+static int test_cancel_waiting(LIBSSH2_SESSION *session)
+{
+    struct result r[4];
+
+    memset(objects, 0, sizeof(objects));
+    memset(r, 0, sizeof(r));
+
+    /* a request that has to wait is cancelled by one that finishes after
+       it in the same pump, its object gets put back */
+    objects[0].eagain = 1;
+    r[1].cancel = &objects[0];
+    CHECK(!submit(session, &objects[0], 20, &r[0]));
+    CHECK(!submit(session, &objects[1], 21, &r[1]));
+    CHECK(!submit(session, &objects[0], 22, &r[2]));
+
+    CHECK(libssh2_session_pump(session) == 0);
+    CHECK((r[0].runs == 1) && (r[0].calls == 1) &&
+          (r[0].rc == LIBSSH2_ERROR_CANCELLED));
+    CHECK((r[1].runs == 1) && (r[1].rc == 21));
+    CHECK((r[2].runs == 0) && (r[2].rc == LIBSSH2_ERROR_CANCELLED));
+    CHECK(objects[0].cancelled == 1);
+
+    /* a request that cancels its own object and queues a new request: the
+       new one waits for the next pump */
+    memset(r, 0, sizeof(r));
+    r[0].cancel = &objects[0];
+    r[0].submit = &r[3];
+    CHECK(!submit(session, &objects[0], 30, &r[0]));
+    CHECK(!submit(session, &objects[0], 31, &r[1]));
+    CHECK(!submit(session, &objects[2], 32, &r[2]));
+
+    CHECK(libssh2_session_pump(session) == 1);
+    CHECK((r[0].runs == 1) && (r[0].rc == 30));
+    CHECK((r[1].runs == 0) && (r[1].rc == LIBSSH2_ERROR_CANCELLED));
+    CHECK((r[2].runs == 1) && (r[2].rc == 32));
+    CHECK((r[3].runs == 0) && (r[3].calls == 0));
+
+    CHECK(libssh2_session_pump(session) == 0);
+    CHECK((r[3].runs == 1) && (r[3].calls == 1) && (r[3].rc == 7));
+    return 0;
+}
+
+static int test_cancel_all(LIBSSH2_SESSION *session)
+{
+    struct result r[3];
+
+    memset(objects, 0, sizeof(objects));
+    memset(r, 0, sizeof(r));
+
+    /* requests left waiting by a pump are cancelled when the session goes,
+       see libssh2_session_free() */
+    objects[1].eagain = 5;
+    CHECK(!submit(session, &objects[1], 40, &r[0]));
+    CHECK(!submit(session, &objects[1], 41, &r[1]));
+    CHECK(!submit(session, &objects[2], 42, &r[2]));
+    CHECK(libssh2_session_pump(session) == 2);
+    CHECK((r[0].runs == 1) && !r[0].calls);
+    CHECK((r[1].runs == 0) && !r[1].calls);
+    CHECK((r[2].runs == 1) && (r[2].rc == 42));
+
+    _libssh2_request_cancel(session, NULL);
+    CHECK((r[0].calls == 1) && (r[0].rc == LIBSSH2_ERROR_CANCELLED));
+    CHECK((r[1].calls == 1) && (r[1].rc == LIBSSH2_ERROR_CANCELLED));
+    CHECK(objects[1].cancelled == 1);
+    CHECK(!session->request_count);
+    CHECK(!_libssh2_list_first(&session->requests));
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    LIBSSH2_SESSION *session;
+    int rc;
+    (void)argv;
+    (void)argc;
+
+    rc = libssh2_init(LIBSSH2_INIT_NO_CRYPTO);
+    if(rc != 0) {
+        fprintf(stderr, "libssh2_init() failed: %d\n", rc);
+        return 1;
+    }
+
+    session = libssh2_session_init();
+    if(!session) {
+        fprintf(stderr, "libssh2_session_init() failed\n");
+        return 1;
+    }
+
+    rc = test_cancel_later(session);
+    if(!rc)
+        rc = test_cancel_waiting(session);
+    if(!rc)
+        rc = test_cancel_all(session);
+
+    libssh2_session_free(session);
+    libssh2_exit();
+
+    return rc;
+}
@@ -0,0 +1,255 @@
+/* Copyright (c) 2026 The libssh2 project and its contributors.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* Checks of the ready and rearm lists of the poller, which are internal,
+   so the source is built into the test. */
+#include "poller.c"
+
+#include <stdio.h>
+
+#ifndef WIN32
+#include <sys/socket.h>
+
+#define CHECK(cond)                                                 \
+    do {                                                            \
+        if(!(cond)) {                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",            \
+                    __FILE__, __LINE__, #cond);                     \
+            return 1;                                               \
+        }                                                           \
+    } while(0)
+
+#define SOCKETS 40
+
+/*
+ * Every socket on a list knows its place in it, and only those do.
+ */
+static int check_lists(LIBSSH2_POLLER *poller)
+{
+    unsigned int which;
+    unsigned int i;
+
+    for(which = 0; which < 2; which++) {
+        unsigned int on = 0;
+
+        CHECK(poller->list_len[which] <= poller->num_sockets);
+        for(i = 0; i < poller->list_len[which]; i++) {
+            unsigned int index = poller->list[which][i];
+
+            CHECK(index < poller->num_sockets);
+            CHECK(poller->sockets[index].pos[which] == i + 1);
+        }
+        for(i = 0; i < poller->num_sockets; i++) {
+            if(poller->sockets[i].pos[which])
+                on++;
+        }
+        CHECK(on == poller->list_len[which]);
+    }
+    return 0;
+}
+
+static int test_ready_list(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_POLLER *poller = libssh2_poller_init(session);
+    LIBSSH2_POLLFD entry;
+    LIBSSH2_POLLFD fds[SOCKETS];
+    int sv[SOCKETS][2];
+    int seen[SOCKETS];
+    char c;
+    int rc;
+    int n;
+    int i;
+
+    CHECK(poller);
+    memset(&entry, 0, sizeof(entry));
+    entry.type = LIBSSH2_POLLFD_SOCKET;
+    entry.events = LIBSSH2_POLLFD_POLLIN;
+    for(i = 0; i < SOCKETS; i++) {
+        CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]));
+        entry.fd.socket = sv[i][0];
+        CHECK(!libssh2_poller_add(poller, &entry));
+    }
+    CHECK(poller->num_sockets == SOCKETS);
+    CHECK(!check_lists(poller));
+
+    /* nothing to read */
+    CHECK(libssh2_poller_wait(poller, fds, SOCKETS, 0) == 0);
+    CHECK(!poller->list_len[POLLER_READY]);
+
+    /* every other socket gets data, and is reported a few at a time: the
+       sockets not reported yet stay on the ready list */
+    for(i = 0; i < SOCKETS; i += 2)
+        CHECK(send(sv[i][1], "x", 1, 0) == 1);
+    memset(seen, 0, sizeof(seen));
+    for(n = 0; n < SOCKETS / 2; n += rc) {
+        rc = libssh2_poller_wait(poller, fds, 3, 1000);
+        CHECK((rc > 0) && (rc <= 3));
+        CHECK(!check_lists(poller));
+        CHECK(poller->list_len[POLLER_READY] + n + rc <= SOCKETS / 2);
+        for(i = 0; i < rc; i++) {
+            int k;
+
+            CHECK(fds[i].type == LIBSSH2_POLLFD_SOCKET);
+            CHECK(fds[i].revents == LIBSSH2_POLLFD_POLLIN);
+            for(k = 0; (k < SOCKETS) && (sv[k][0] != fds[i].fd.socket); k++)
+                ;
+            CHECK((k < SOCKETS) && !(k % 2) && !seen[k]);
+            seen[k] = 1;
+            CHECK(recv(sv[k][0], &c, 1, 0) == 1);
+        }
+    }
+    CHECK(!poller->list_len[POLLER_READY]);
+
+    /* removing sockets that are on the ready list keeps it in order */
+    for(i = 0; i < SOCKETS; i++)
+        poller_list_add(poller, POLLER_READY, (unsigned int)i);
+    CHECK(poller->list_len[POLLER_READY] == SOCKETS);
+    for(i = 0; i < SOCKETS; i += 3) {
+        entry.fd.socket = sv[i][0];
+        CHECK(!libssh2_poller_remove(poller, &entry));
+        CHECK(!check_lists(poller));
+    }
+    CHECK(poller->num_sockets == SOCKETS - (SOCKETS + 2) / 3);
+    CHECK(poller->list_len[POLLER_READY] == poller->num_sockets);
+
+    /* sockets on the ready list without events report nothing */
+    CHECK(libssh2_poller_wait(poller, fds, SOCKETS, 0) == 0);
+    CHECK(!poller->list_len[POLLER_READY]);
+    CHECK(!check_lists(poller));
+
+    libssh2_poller_free(poller);
+    for(i = 0; i < SOCKETS; i++) {
+        close(sv[i][0]);
+        close(sv[i][1]);
+    }
+    return 0;
+}
+
+static int test_rearm_list(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_POLLER *poller = libssh2_poller_init(session);
+    LIBSSH2_SESSION *watched = libssh2_session_init();
+    LIBSSH2_POLLFD entry;
+    LIBSSH2_POLLFD fds[2];
+    int sv[2];
+    int index;
+
+    CHECK(poller && watched);
+    CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    watched->socket_fd = sv[0];
+
+    memset(&entry, 0, sizeof(entry));
+    entry.type = LIBSSH2_POLLFD_SESSION;
+    entry.fd.session = watched;
+    CHECK(!libssh2_poller_add(poller, &entry));
+    index = poller_socket_find(poller, sv[0]);
+    CHECK(index >= 0);
+
+    /* not blocked, nothing is asked for */
+    CHECK(!poller->sockets[index].watched);
+    CHECK(libssh2_poller_wait(poller, fds, 2, 0) == 0);
+
+    /* blocked on writing: the socket is rearmed by the next wait, which
+       reports the session as it can write */
+    _libssh2_session_block(watched, LIBSSH2_SESSION_BLOCK_OUTBOUND);
+    CHECK(poller->list_len[POLLER_REARM] == 1);
+    CHECK(!check_lists(poller));
+    CHECK(libssh2_poller_wait(poller, fds, 2, 1000) == 1);
+    CHECK(!poller->list_len[POLLER_REARM]);
+    CHECK(poller->sockets[index].watched == LIBSSH2_POLLFD_POLLOUT);
+    CHECK(fds[0].type == LIBSSH2_POLLFD_SESSION);
+    CHECK(fds[0].fd.session == watched);
+    CHECK(fds[0].revents == LIBSSH2_POLLFD_POLLOUT);
+
+    /* blocked on reading instead, being rearmed twice puts it on the list
+       once */
+    watched->socket_block_directions = 0;
+    _libssh2_session_block(watched, LIBSSH2_SESSION_BLOCK_INBOUND);
+    _libssh2_session_block(watched, LIBSSH2_SESSION_BLOCK_INBOUND);
+    CHECK(poller->list_len[POLLER_REARM] == 1);
+    CHECK(libssh2_poller_wait(poller, fds, 2, 0) == 0);
+    CHECK(poller->sockets[index].watched == LIBSSH2_POLLFD_POLLIN);
+    CHECK(send(sv[1], "x", 1, 0) == 1);
+    CHECK(libssh2_poller_wait(poller, fds, 2, 1000) == 1);
+    CHECK(fds[0].revents == LIBSSH2_POLLFD_POLLIN);
+
+    /* a session removed while on the rearm list leaves it */
+    _libssh2_session_block(watched, LIBSSH2_SESSION_BLOCK_OUTBOUND);
+    CHECK(poller->list_len[POLLER_REARM] == 1);
+    CHECK(!libssh2_poller_remove(poller, &entry));
+    CHECK(!poller->num_sockets);
+    CHECK(!poller->list_len[POLLER_REARM]);
+    CHECK(!poller->list_len[POLLER_READY]);
+    CHECK(!watched->watcher);
+
+    libssh2_poller_free(poller);
+    libssh2_session_free(watched);
+    close(sv[0]);
+    close(sv[1]);
+    return 0;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    LIBSSH2_SESSION *session;
+    int rc = 0;
+    (void)argv;
+    (void)argc;
+
+    rc = libssh2_init(LIBSSH2_INIT_NO_CRYPTO);
+    if(rc != 0) {
+        fprintf(stderr, "libssh2_init() failed: %d\n", rc);
+        return 1;
+    }
+
+    session = libssh2_session_init();
+    if(!session) {
+        fprintf(stderr, "libssh2_session_init() failed\n");
+        return 1;
+    }
+
+#ifndef WIN32
+    rc = test_ready_list(session);
+    if(!rc)
+        rc = test_rearm_list(session);
+#endif
+
+    libssh2_session_free(session);
+    libssh2_exit();
+
+    return rc;
+}
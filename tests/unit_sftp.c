@@ -0,0 +1,269 @@
+/* Copyright (c) 2026 The libssh2 project and its contributors.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above
+ *   copyright notice, this list of conditions and the
+ *   following disclaimer.
+ *
+ *   Redistributions in binary form must reproduce the above
+ *   copyright notice, this list of conditions and the following
+ *   disclaimer in the documentation and/or other materials
+ *   provided with the distribution.
+ *
+ *   Neither the name of the copyright holder nor the names
+ *   of any other contributors may be used to endorse or
+ *   promote products derived from this software without
+ *   specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ */
+
+/* Checks of the request index and the attribute cache of the SFTP
+   subsystem. Both are internal, so the source is built into the test. */
+#include "sftp.c"
+
+#include <stdio.h>
+
+#define CHECK(cond)                                                 \
+    do {                                                            \
+        if(!(cond)) {                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n",            \
+                    __FILE__, __LINE__, #cond);                     \
+            return 1;                                               \
+        }                                                           \
+    } while(0)
+
+#define INDEX_ENTRIES 300
+
+static int test_sftp_index(LIBSSH2_SESSION *session)
+{
+    struct sftp_index index;
+    int entries[INDEX_ENTRIES];
+    uint32_t i;
+
+    memset(&index, 0, sizeof(index));
+    CHECK(!sftp_index_find(&index, 1));
+    sftp_index_remove(&index, 1);
+
+    /* ids in sequence, growing the table several times */
+    for(i = 0; i < INDEX_ENTRIES; i++) {
+        CHECK(!sftp_index_add(session, &index, i, &entries[i]));
+        CHECK((index.count + 0U) * 2 <= index.size);
+    }
+    CHECK(index.count == INDEX_ENTRIES);
+    CHECK(index.size == 1024);
+    for(i = 0; i < INDEX_ENTRIES; i++)
+        CHECK(sftp_index_find(&index, i) == &entries[i]);
+    CHECK(!sftp_index_find(&index, INDEX_ENTRIES));
+
+    /* removing ids that aren't there changes nothing */
+    sftp_index_remove(&index, INDEX_ENTRIES);
+    sftp_index_remove(&index, 0x80000000U);
+    CHECK(index.count == INDEX_ENTRIES);
+
+    /* gaps left behind must not hide the entries after them */
+    for(i = 0; i < INDEX_ENTRIES; i += 3)
+        sftp_index_remove(&index, i);
+    for(i = 0; i < INDEX_ENTRIES; i++)
+        CHECK(sftp_index_find(&index, i) == ((i % 3) ? &entries[i] : NULL));
+    for(i = 1; i < INDEX_ENTRIES; i++)
+        sftp_index_remove(&index, i);
+    CHECK(!index.count);
+    sftp_index_free(session, &index);
+
+    /* ids with the same home slot, the last ones wrapping around the end
+       of the table */
+    for(i = 0; i < 8; i++)
+        CHECK(!sftp_index_add(session, &index, 29 + i * 32, &entries[i]));
+    CHECK(index.size == 32);
+    for(i = 0; i < 8; i++)
+        CHECK(sftp_index_find(&index, 29 + i * 32) == &entries[i]);
+    sftp_index_remove(&index, 29);
+    sftp_index_remove(&index, 29 + 4 * 32);
+    for(i = 0; i < 8; i++)
+        CHECK(sftp_index_find(&index, 29 + i * 32) ==
+              (((i == 0) || (i == 4)) ? NULL : &entries[i]));
+    CHECK(index.count == 6);
+
+    /* growing keeps every entry of a cluster */
+    for(i = 8; i < 40; i++)
+        CHECK(!sftp_index_add(session, &index, 1000 + i, &entries[i]));
+    CHECK(index.size == 128);
+    for(i = 1; i < 8; i++)
+        CHECK(sftp_index_find(&index, 29 + i * 32) ==
+              ((i == 4) ? NULL : &entries[i]));
+    for(i = 8; i < 40; i++)
+        CHECK(sftp_index_find(&index, 1000 + i) == &entries[i]);
+
+    sftp_index_free(session, &index);
+    CHECK(!index.slots && !index.size && !index.count);
+    return 0;
+}
+
+static int cache_has(LIBSSH2_SFTP *sftp, const char *path)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+    return sftp_cache_find(sftp, path, strlen(path), 0, &attrs);
+}
+
+static void cache_put(LIBSSH2_SFTP *sftp, const char *path)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+    memset(&attrs, 0, sizeof(attrs));
+    attrs.flags = SFTP_CACHE_ATTRS;
+    attrs.permissions = LIBSSH2_SFTP_S_IFREG | 0644;
+    attrs.filesize = strlen(path);
+    sftp_cache_store(sftp, NULL, 0, path, strlen(path), 0, &attrs);
+}
+
+static int test_sftp_cache(LIBSSH2_SESSION *session)
+{
+    LIBSSH2_CHANNEL channel;
+    LIBSSH2_SFTP sftp;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    struct sftp_cache_entry *entry;
+
+    memset(&channel, 0, sizeof(channel));
+    memset(&sftp, 0, sizeof(sftp));
+    channel.session = session;
+    sftp.channel = &channel;
+    _libssh2_list_init(&sftp.cache.entries);
+
+    /* off, nothing is kept */
+    cache_put(&sftp, "/a");
+    CHECK(!cache_has(&sftp, "/a"));
+
+    CHECK(!sftp_cache_config(&sftp, 60000, 4));
+
+    /* STAT finds an LSTAT entry unless it is a link */
+    cache_put(&sftp, "/a");
+    CHECK(cache_has(&sftp, "/a"));
+    CHECK(!sftp_cache_find(&sftp, "/a", 2, 1, &attrs));
+    memset(&attrs, 0, sizeof(attrs));
+    attrs.flags = SFTP_CACHE_ATTRS;
+    attrs.permissions = LIBSSH2_SFTP_S_IFLNK | 0777;
+    sftp_cache_store(&sftp, NULL, 0, "/l", 2, 1, &attrs);
+    CHECK(sftp_cache_find(&sftp, "/l", 2, 1, &attrs));
+    CHECK(!cache_has(&sftp, "/l"));
+
+    /* a directory and a name make one path */
+    attrs.permissions = LIBSSH2_SFTP_S_IFREG | 0644;
+    sftp_cache_store(&sftp, "/d/", 3, "x", 1, 0, &attrs);
+    sftp_cache_store(&sftp, "/d", 2, "y", 1, 0, &attrs);
+    CHECK(cache_has(&sftp, "/d/x"));
+    CHECK(cache_has(&sftp, "/d/y"));
+    CHECK(sftp.cache.count == 4);
+
+    /* full, the oldest goes */
+    cache_put(&sftp, "/b");
+    CHECK(sftp.cache.count == 4);
+    CHECK(!cache_has(&sftp, "/a"));
+    CHECK(cache_has(&sftp, "/b"));
+
+    /* entries older than the ttl are gone, the others stay */
+    entry = _libssh2_list_first(&sftp.cache.entries);
+    entry->stored -= 60000;
+    entry = _libssh2_list_next(&entry->node);
+    entry->stored -= 60000;
+    CHECK(!sftp_cache_find(&sftp, "/l", 2, 1, &attrs));
+    CHECK(!cache_has(&sftp, "/d/x"));
+    CHECK(cache_has(&sftp, "/d/y"));
+    CHECK(cache_has(&sftp, "/b"));
+    CHECK(sftp.cache.count == 2);
+
+    /* everything below a directory, but not its namesakes */
+    CHECK(!sftp_cache_config(&sftp, 60000, 16));
+    cache_put(&sftp, "/d");
+    cache_put(&sftp, "/d/a");
+    cache_put(&sftp, "/d/sub/c");
+    cache_put(&sftp, "/dx");
+    cache_put(&sftp, "/dx/a");
+    sftp_cache_forget(&sftp, "/d/", 3, SFTP_CACHE_TREE);
+    CHECK(cache_has(&sftp, "/d"));
+    CHECK(!cache_has(&sftp, "/d/a"));
+    CHECK(!cache_has(&sftp, "/d/sub/c"));
+    CHECK(cache_has(&sftp, "/dx"));
+    CHECK(cache_has(&sftp, "/dx/a"));
+    sftp_cache_forget(&sftp, "/d", 2, SFTP_CACHE_TREE);
+    CHECK(!cache_has(&sftp, "/d"));
+    CHECK(sftp.cache.count == 2);
+
+    /* the directory a path is in, and nothing else */
+    cache_put(&sftp, "/d");
+    cache_put(&sftp, "/d/a");
+    cache_put(&sftp, "/d/b");
+    cache_put(&sftp, "/");
+    cache_put(&sftp, "/top");
+    cache_put(&sftp, ".");
+    cache_put(&sftp, "rel");
+    sftp_cache_forget(&sftp, "/d/a", 4, SFTP_CACHE_PARENT);
+    CHECK(!cache_has(&sftp, "/d/a"));
+    CHECK(!cache_has(&sftp, "/d"));
+    CHECK(cache_has(&sftp, "/d/b"));
+    CHECK(cache_has(&sftp, "/"));
+    sftp_cache_forget(&sftp, "/top", 4, SFTP_CACHE_PARENT);
+    CHECK(!cache_has(&sftp, "/top"));
+    CHECK(!cache_has(&sftp, "/"));
+    CHECK(cache_has(&sftp, "/dx"));
+    sftp_cache_forget(&sftp, "rel", 3, SFTP_CACHE_PARENT);
+    CHECK(!cache_has(&sftp, "rel"));
+    CHECK(!cache_has(&sftp, "."));
+    CHECK(cache_has(&sftp, "/d/b"));
+
+    /* a handle without a path drops everything */
+    sftp_cache_forget(&sftp, NULL, 0, 0);
+    CHECK(!sftp.cache.count);
+    CHECK(!_libssh2_list_first(&sftp.cache.entries));
+
+    cache_put(&sftp, "/a");
+    CHECK(!sftp_cache_config(&sftp, 0, 0));
+    CHECK(!sftp.cache.count && !sftp.cache.buckets);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    LIBSSH2_SESSION *session;
+    int rc;
+    (void)argv;
+    (void)argc;
+
+    rc = libssh2_init(LIBSSH2_INIT_NO_CRYPTO);
+    if(rc != 0) {
+        fprintf(stderr, "libssh2_init() failed: %d\n", rc);
+        return 1;
+    }
+
+    session = libssh2_session_init();
+    if(!session) {
+        fprintf(stderr, "libssh2_session_init() failed\n");
+        return 1;
+    }
+
+    rc = test_sftp_index(session);
+    if(!rc)
+        rc = test_sftp_cache(session);
+
+    libssh2_session_free(session);
+    libssh2_exit();
+
+    return rc;
+}